@@ -0,0 +1,713 @@
+/*
+ * Multi-queue block layer
+ *
+ * A multi-queue device has no elevator, request freelist or queue_lock
+ * on the submission path. Bios are turned into requests in a software
+ * context private to the submitting CPU, and the hardware queue that
+ * CPU maps to pulls them from there and hands them to the driver.
+ * Requests are preallocated, one per tag of each hardware queue.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+
+/*
+ * Per-CPU software submission context
+ */
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;	/* not yet dispatched */
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+
+	unsigned long		rq_dispatched[2];
+	unsigned long		rq_merged;
+
+	request_queue_t		*queue;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Requests completed on another CPU than the one they were submitted
+ * on, waiting for kblockd on the submitting CPU to finish them off.
+ */
+struct blk_mq_done {
+	spinlock_t		lock;
+	struct list_head	list;
+	struct work_struct	work;
+};
+
+static DEFINE_PER_CPU(struct blk_mq_done, blk_mq_done);
+
+/* how far back in a software queue we look for a merge */
+#define BLK_MQ_MERGE_DEPTH	8
+
+static inline int blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(hctx->nr_ctx); i++)
+		if (hctx->ctx_map[i])
+			return 1;
+
+	return !list_empty(&hctx->dispatch);
+}
+
+/*
+ * Tag allocation: the tag is the index of the preallocated request
+ */
+static struct request *__blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int tag;
+
+	do {
+		tag = find_first_zero_bit(hctx->tag_map, hctx->queue_depth);
+		if (tag >= hctx->queue_depth)
+			return NULL;
+	} while (test_and_set_bit(tag, hctx->tag_map));
+
+	return hctx->rqs[tag];
+}
+
+static struct request *blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					    int can_wait)
+{
+	struct request *rq;
+	DEFINE_WAIT(wait);
+
+	rq = __blk_mq_alloc_request(hctx);
+	while (!rq && can_wait) {
+		prepare_to_wait_exclusive(&hctx->tag_wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		rq = __blk_mq_alloc_request(hctx);
+		if (!rq)
+			io_schedule();
+		finish_wait(&hctx->tag_wait, &wait);
+	}
+
+	return rq;
+}
+
+static void blk_mq_free_request(struct blk_mq_hw_ctx *hctx,
+				struct request *rq)
+{
+	rq->rq_status = RQ_INACTIVE;
+
+	clear_bit(rq->tag, hctx->tag_map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&hctx->tag_wait))
+		wake_up(&hctx->tag_wait);
+}
+
+static void blk_mq_rq_init(struct blk_mq_ctx *ctx, struct request *rq,
+			   struct bio *bio)
+{
+	request_queue_t *q = ctx->queue;
+	int tag = rq->tag;
+
+	memset(rq, 0, sizeof(*rq));
+	INIT_LIST_HEAD(&rq->queuelist);
+	rq->tag = tag;
+	rq->q = q;
+	rq->mq_ctx = ctx;
+	rq->rq_status = RQ_ACTIVE;
+	rq->ref_count = 1;
+
+	rq->flags = bio_data_dir(bio) | REQ_CMD;
+	if (bio_rw_ahead(bio) || bio_failfast(bio))
+		rq->flags |= REQ_FAILFAST;
+
+	rq->hard_sector = rq->sector = bio->bi_sector;
+	rq->hard_nr_sectors = rq->nr_sectors = bio_sectors(bio);
+	rq->current_nr_sectors = rq->hard_cur_sectors = bio_cur_sectors(bio);
+	rq->nr_phys_segments = bio_phys_segments(q, bio);
+	rq->nr_hw_segments = bio_hw_segments(q, bio);
+	rq->buffer = bio_data(bio);
+	rq->bio = rq->biotail = bio;
+	rq->rq_disk = bio->bi_bdev->bd_disk;
+	rq->start_time = jiffies;
+}
+
+/*
+ * Disk statistics. The in-flight count and the time based statistics
+ * derived from it need a lock around the whole queue, so they are not
+ * kept for multi-queue devices.
+ */
+static void blk_mq_account_sectors(struct request *rq, int nr_sectors,
+				   int merge)
+{
+	struct gendisk *disk = rq->rq_disk;
+
+	if (!disk)
+		return;
+
+	preempt_disable();
+	if (rq_data_dir(rq) == READ) {
+		__disk_stat_add(disk, read_sectors, nr_sectors);
+		if (merge)
+			__disk_stat_inc(disk, read_merges);
+	} else {
+		__disk_stat_add(disk, write_sectors, nr_sectors);
+		if (merge)
+			__disk_stat_inc(disk, write_merges);
+	}
+	preempt_enable();
+}
+
+static void blk_mq_account_done(struct request *rq)
+{
+	struct gendisk *disk = rq->rq_disk;
+	unsigned long duration = jiffies - rq->start_time;
+
+	if (!disk)
+		return;
+
+	preempt_disable();
+	if (rq_data_dir(rq) == READ) {
+		__disk_stat_inc(disk, reads);
+		__disk_stat_add(disk, read_ticks, duration);
+	} else {
+		__disk_stat_inc(disk, writes);
+		__disk_stat_add(disk, write_ticks, duration);
+	}
+	preempt_enable();
+}
+
+/*
+ * Try to add the bio to one of the last requests of the software
+ * queue. Called with ctx->lock held.
+ */
+static int blk_mq_attempt_merge(request_queue_t *q, struct blk_mq_ctx *ctx,
+				struct bio *bio)
+{
+	struct request *rq;
+	int nr_sectors = bio_sectors(bio);
+	int checked = BLK_MQ_MERGE_DEPTH;
+
+	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
+		if (!checked--)
+			break;
+		if (!elv_rq_merge_ok(rq, bio))
+			continue;
+
+		if (rq->sector + rq->nr_sectors == bio->bi_sector) {
+			if (!ll_back_merge_fn(q, rq, bio))
+				return 0;
+
+			rq->biotail->bi_next = bio;
+			rq->biotail = bio;
+			rq->nr_sectors = rq->hard_nr_sectors += nr_sectors;
+			goto merged;
+		}
+
+		if (rq->sector - nr_sectors == bio->bi_sector) {
+			if (!ll_front_merge_fn(q, rq, bio))
+				return 0;
+
+			bio->bi_next = rq->bio;
+			rq->bio = bio;
+			rq->buffer = bio_data(bio);
+			rq->current_nr_sectors = bio_cur_sectors(bio);
+			rq->hard_cur_sectors = rq->current_nr_sectors;
+			rq->sector = rq->hard_sector = bio->bi_sector;
+			rq->nr_sectors = rq->hard_nr_sectors += nr_sectors;
+			goto merged;
+		}
+	}
+
+	return 0;
+
+merged:
+	ctx->rq_merged++;
+	blk_mq_account_sectors(rq, nr_sectors, 1);
+	return 1;
+}
+
+/*
+ * Pull everything off the software queues mapped to this hardware
+ * queue, and hand it to the driver until it says it is busy. What it
+ * could not take waits on hctx->dispatch for the next run.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	request_queue_t *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	unsigned int i;
+	int ret;
+	LIST_HEAD(rq_list);
+
+	if (test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		return;
+
+	hctx->run++;
+
+	/*
+	 * requests a busy driver bounced last time go first
+	 */
+	if (!list_empty(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	for (i = 0; i < hctx->nr_ctx; i++) {
+		if (!test_bit(i, hctx->ctx_map))
+			continue;
+		clear_bit(i, hctx->ctx_map);
+
+		ctx = hctx->ctxs[i];
+		spin_lock(&ctx->lock);
+		list_splice_init(&ctx->rq_list, rq_list.prev);
+		spin_unlock(&ctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_entry_rq(rq_list.next);
+		list_del_init(&rq->queuelist);
+
+		rq->flags |= REQ_STARTED;
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		switch (ret) {
+		case BLK_MQ_RQ_QUEUE_OK:
+			rq->mq_ctx->rq_dispatched[rq_data_dir(rq)]++;
+			continue;
+		case BLK_MQ_RQ_QUEUE_BUSY:
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		default:
+			printk(KERN_ERR "blk-mq: bad return on queue: %d\n", ret);
+			/* fall through */
+		case BLK_MQ_RQ_QUEUE_ERROR:
+			blk_mq_end_io(rq, -EIO);
+			continue;
+		}
+		break;
+	}
+
+	if (!list_empty(&rq_list)) {
+		spin_lock(&hctx->lock);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+	}
+}
+
+static void blk_mq_run_work_fn(void *data)
+{
+	__blk_mq_run_hw_queue(data);
+}
+
+/**
+ * blk_mq_run_hw_queue - dispatch pending requests of a hardware queue
+ * @hctx:	The hardware queue
+ * @async:	Leave the work to kblockd, e.g. when called from interrupt
+ *		context
+ **/
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, int async)
+{
+	if (test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		return;
+
+	if (async || in_interrupt())
+		kblockd_schedule_work(&hctx->run_work);
+	else
+		__blk_mq_run_hw_queue(hctx);
+}
+
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(request_queue_t *q, int async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(request_queue_t *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, 1);
+	}
+}
+
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_unplug(request_queue_t *q)
+{
+	blk_mq_run_queues(q, 0);
+}
+
+static int blk_mq_make_request(request_queue_t *q, struct bio *bio)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+
+	blk_queue_bounce(q, &bio);
+
+	/*
+	 * there is no ordering between hardware queues to build
+	 * barriers from
+	 */
+	if (bio_barrier(bio)) {
+		bio_endio(bio, bio->bi_size, -EOPNOTSUPP);
+		return 0;
+	}
+
+	ctx = per_cpu_ptr(q->queue_ctx, get_cpu());
+	put_cpu();
+	hctx = blk_mq_map_queue(q, ctx->cpu);
+
+	spin_lock(&ctx->lock);
+	if (blk_mq_attempt_merge(q, ctx, bio)) {
+		spin_unlock(&ctx->lock);
+		return 0;
+	}
+	spin_unlock(&ctx->lock);
+
+	rq = blk_mq_alloc_request(hctx, !bio_rw_ahead(bio));
+	if (!rq) {
+		bio_endio(bio, bio->bi_size, -EWOULDBLOCK);
+		return 0;
+	}
+
+	blk_mq_rq_init(ctx, rq, bio);
+	blk_mq_account_sectors(rq, rq->nr_sectors, 0);
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&rq->queuelist, &ctx->rq_list);
+	set_bit(ctx->index_hw, hctx->ctx_map);
+	spin_unlock(&ctx->lock);
+	hctx->queued++;
+
+	blk_mq_run_hw_queue(hctx, 0);
+	return 0;
+}
+
+/**
+ * blk_mq_end_io - end all I/O of a request and release its tag
+ * @rq:		The request
+ * @error:	0, or a negative errno
+ **/
+void blk_mq_end_io(struct request *rq, int error)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+	struct completion *waiting = rq->waiting;
+
+	end_that_request_first(rq, error ? error : 1, rq->hard_nr_sectors);
+	blk_mq_account_done(rq);
+	blk_mq_free_request(hctx, rq);
+
+	if (waiting)
+		complete(waiting);
+}
+
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void blk_mq_done_work(void *data)
+{
+	struct blk_mq_done *done = data;
+	struct request *rq;
+	LIST_HEAD(list);
+
+	spin_lock_irq(&done->lock);
+	list_splice_init(&done->list, &list);
+	spin_unlock_irq(&done->lock);
+
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+		blk_mq_end_io(rq, rq->errors);
+	}
+}
+
+/**
+ * blk_mq_complete_request - complete a request from the driver
+ * @rq:		The request
+ * @error:	0, or a negative errno
+ *
+ * Description:
+ *   Hardware queues registered with %BLK_MQ_F_SAME_CPU have requests
+ *   finished on the CPU that submitted them, where the data and the
+ *   waiting task most likely are: requests completing elsewhere are
+ *   handed to kblockd on that CPU. May be called from interrupt context.
+ **/
+void blk_mq_complete_request(struct request *rq, int error)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, ctx->cpu);
+	struct blk_mq_done *done;
+	unsigned long flags;
+	int cpu;
+
+	cpu = get_cpu();
+	if (!(hctx->flags & BLK_MQ_F_SAME_CPU) || cpu == ctx->cpu ||
+	    !cpu_online(ctx->cpu)) {
+		put_cpu();
+		blk_mq_end_io(rq, error);
+		return;
+	}
+
+	rq->errors = error;
+	done = &per_cpu(blk_mq_done, ctx->cpu);
+	spin_lock_irqsave(&done->lock, flags);
+	list_add_tail(&rq->queuelist, &done->list);
+	spin_unlock_irqrestore(&done->lock, flags);
+	kblockd_schedule_work_on(ctx->cpu, &done->work);
+	put_cpu();
+}
+
+EXPORT_SYMBOL(blk_mq_complete_request);
+
+/*
+ * Spread the possible CPUs over the hardware queues in contiguous runs,
+ * so neighbouring CPUs share a queue.
+ */
+static void blk_mq_map_cpus(request_queue_t *q)
+{
+	unsigned int nr_cpus = num_possible_cpus();
+	unsigned int i = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		q->mq_map[cpu] = 0;
+
+	for_each_cpu(cpu)
+		q->mq_map[cpu] = (i++ * q->nr_hw_queues) / nr_cpus;
+}
+
+static void blk_mq_free_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	kfree(hctx->tag_map);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hctx(request_queue_t *q,
+					       struct blk_mq_reg *reg,
+					       unsigned int index)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i, nr_ctx = 0, size;
+	int cpu;
+
+	hctx = kmalloc(sizeof(*hctx), GFP_KERNEL);
+	if (!hctx)
+		return NULL;
+	memset(hctx, 0, sizeof(*hctx));
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_WORK(&hctx->run_work, blk_mq_run_work_fn, hctx);
+	init_waitqueue_head(&hctx->tag_wait);
+	hctx->queue = q;
+	hctx->queue_num = index;
+	hctx->flags = reg->flags;
+	hctx->queue_depth = reg->queue_depth;
+
+	for_each_cpu(cpu)
+		if (q->mq_map[cpu] == index)
+			nr_ctx++;
+
+	hctx->ctxs = kmalloc(nr_ctx * sizeof(struct blk_mq_ctx *), GFP_KERNEL);
+	size = BITS_TO_LONGS(nr_ctx) * sizeof(unsigned long);
+	hctx->ctx_map = kmalloc(size, GFP_KERNEL);
+	if (!hctx->ctxs || !hctx->ctx_map)
+		goto fail;
+	memset(hctx->ctx_map, 0, size);
+
+	size = BITS_TO_LONGS(hctx->queue_depth) * sizeof(unsigned long);
+	hctx->tag_map = kmalloc(size, GFP_KERNEL);
+	hctx->rqs = kmalloc(hctx->queue_depth * sizeof(struct request *),
+			    GFP_KERNEL);
+	if (!hctx->tag_map || !hctx->rqs)
+		goto fail;
+	memset(hctx->tag_map, 0, size);
+	memset(hctx->rqs, 0, hctx->queue_depth * sizeof(struct request *));
+
+	size = sizeof(struct request) + reg->cmd_size;
+	for (i = 0; i < hctx->queue_depth; i++) {
+		hctx->rqs[i] = kmalloc(size, GFP_KERNEL);
+		if (!hctx->rqs[i])
+			goto fail;
+		memset(hctx->rqs[i], 0, size);
+		hctx->rqs[i]->tag = i;
+		hctx->rqs[i]->rq_status = RQ_INACTIVE;
+	}
+
+	return hctx;
+
+fail:
+	blk_mq_free_hctx(hctx);
+	return NULL;
+}
+
+/**
+ * blk_mq_init_queue - set up a multi-queue request queue
+ * @reg:	Number and depth of the hardware queues, and driver hooks
+ * @driver_data: Stored in q->queuedata
+ *
+ * Description:
+ *   Returns a queue whose make_request_fn feeds the driver's
+ *   ->queue_rq() through per-CPU software queues. Released with
+ *   blk_cleanup_queue() like any other queue.
+ **/
+request_queue_t *blk_mq_init_queue(struct blk_mq_reg *reg, void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	request_queue_t *q;
+	unsigned int i;
+	int cpu;
+
+	if (!reg->ops || !reg->ops->queue_rq || !reg->nr_hw_queues ||
+	    !reg->queue_depth || reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return NULL;
+
+	q = blk_alloc_queue(GFP_KERNEL);
+	if (!q)
+		return NULL;
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->queuedata = driver_data;
+	q->unplug_fn = blk_mq_unplug;
+	q->mq_ops = reg->ops;
+	q->nr_hw_queues = min_t(unsigned int, reg->nr_hw_queues,
+				num_possible_cpus());
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = kmalloc(NR_CPUS * sizeof(unsigned int), GFP_KERNEL);
+	q->queue_hw_ctx = kmalloc(q->nr_hw_queues *
+				  sizeof(struct blk_mq_hw_ctx *), GFP_KERNEL);
+	if (!q->queue_ctx || !q->mq_map || !q->queue_hw_ctx)
+		goto fail;
+	memset(q->queue_hw_ctx, 0,
+	       q->nr_hw_queues * sizeof(struct blk_mq_hw_ctx *));
+
+	blk_mq_map_cpus(q);
+
+	for (i = 0; i < q->nr_hw_queues; i++) {
+		hctx = blk_mq_alloc_hctx(q, reg, i);
+		if (!hctx)
+			goto fail;
+		q->queue_hw_ctx[i] = hctx;
+	}
+
+	for_each_cpu(cpu) {
+		ctx = per_cpu_ptr(q->queue_ctx, cpu);
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = blk_mq_map_queue(q, cpu);
+		cpu_set(cpu, hctx->cpumask);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (reg->ops->init_hctx &&
+		    reg->ops->init_hctx(hctx, driver_data, i)) {
+			/* only undo the ones that went through */
+			while (i--)
+				if (reg->ops->exit_hctx)
+					reg->ops->exit_hctx(q->queue_hw_ctx[i], i);
+			goto fail;
+		}
+	}
+
+	return q;
+
+fail:
+	/* no ->exit_hctx() for queues that were never set up */
+	q->mq_ops = NULL;
+	blk_mq_free_queue(q);
+	blk_cleanup_queue(q);
+	return NULL;
+}
+
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Called from blk_cleanup_queue() when the last reference is gone
+ */
+void blk_mq_free_queue(request_queue_t *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	kblockd_flush();
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++) {
+			hctx = q->queue_hw_ctx[i];
+			if (!hctx)
+				continue;
+			if (q->mq_ops && q->mq_ops->exit_hctx)
+				q->mq_ops->exit_hctx(hctx, i);
+			blk_mq_free_hctx(hctx);
+		}
+		kfree(q->queue_hw_ctx);
+	}
+
+	kfree(q->mq_map);
+	if (q->queue_ctx)
+		free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+	q->nr_hw_queues = 0;
+}
+
+static int __init blk_mq_init(void)
+{
+	struct blk_mq_done *done;
+	int cpu;
+
+	for_each_cpu(cpu) {
+		done = &per_cpu(blk_mq_done, cpu);
+		spin_lock_init(&done->lock);
+		INIT_LIST_HEAD(&done->list);
+		INIT_WORK(&done->work, blk_mq_done_work, done);
+	}
+
+	return 0;
+}
+
+subsys_initcall(blk_mq_init);
@@ -7,6 +7,12 @@
  *  scheduler (round robin per-process disk scheduling) and Andrea Arcangeli.
  *
  *  Copyright (C) 2003 Jens Axboe <axboe@suse.de>
+ *
+ *  Each queue is served for a time slice at a time, in an order given
+ *  by its io priority class and level (see linux/ioprio.h). A queue doing
+ *  sync io is allowed to keep the disk idle for a little while after its
+ *  last request completes, in case the process quickly issues another
+ *  request close by.
  */
 #include <linux/kernel.h>
 #include <linux/fs.h>
@@ -21,6 +27,7 @@
 #include <linux/hash.h>
 #include <linux/rbtree.h>
 #include <linux/mempool.h>
+#include <linux/ioprio.h>
 
 static unsigned long max_elapsed_crq;
 static unsigned long max_elapsed_dispatch;
@@ -30,12 +37,28 @@ static unsigned long max_elapsed_dispatch;
  */
 static int cfq_quantum = 4;		/* max queue in one round of service */
 static int cfq_queued = 8;		/* minimum rq allocate limit per-queue*/
-static int cfq_service = HZ;		/* period over which service is avg */
 static int cfq_fifo_expire_r = HZ / 2;	/* fifo timeout for sync requests */
 static int cfq_fifo_expire_w = 5 * HZ;	/* fifo timeout for async requests */
 static int cfq_fifo_rate = HZ / 8;	/* fifo expiry rate */
 static int cfq_back_max = 16 * 1024;	/* maximum backwards seek, in KiB */
 static int cfq_back_penalty = 2;	/* penalty of a backwards seek */
+static int cfq_slice_sync = HZ / 10;	/* base slice of a sync queue */
+static int cfq_slice_async = HZ / 25;	/* base slice of an async queue */
+static int cfq_slice_async_rq = 2;	/* base requests per async slice */
+static int cfq_slice_idle = HZ / 100;	/* wait for the next sync request */
+
+/*
+ * the idle class is only served once the disk has been left alone for
+ * this long
+ */
+#define CFQ_IDLE_GRACE		(HZ / 10)
+
+/*
+ * each priority level adds or takes 1/CFQ_SLICE_SCALE of the base slice
+ */
+#define CFQ_SLICE_SCALE		(5)
+
+#define CFQ_PRIO_LISTS		IOPRIO_BE_NR
 
 /*
  * for the hash of cfqq inside the cfqd
@@ -75,11 +98,6 @@ static int cfq_back_penalty = 2;	/* penalty of a backwards seek */
 #define rb_entry_crq(node)	rb_entry((node), struct cfq_rq, rb_node)
 #define rq_rb_key(rq)		(rq)->sector
 
-/*
- * threshold for switching off non-tag accounting
- */
-#define CFQ_MAX_TAG		(4)
-
 /*
  * sort key types and names
  */
@@ -98,8 +116,16 @@ static kmem_cache_t *cfq_pool;
 static kmem_cache_t *cfq_ioc_pool;
 
 struct cfq_data {
-	struct list_head rr_list;
+	/*
+	 * busy queues: rr_list holds the best-effort queues by level, and
+	 * is moved a level at a time onto cur_rr, which is served in
+	 * order. real-time queues go straight to the front of cur_rr.
+	 */
+	struct list_head rr_list[CFQ_PRIO_LISTS];
+	struct list_head cur_rr;
+	struct list_head idle_rr;
 	struct list_head empty_list;
+	int cur_prio, cur_end_prio;
 
 	struct hlist_head *cfq_hash;
 	struct hlist_head *crq_hash;
@@ -121,6 +147,18 @@ struct cfq_data {
 
 	int rq_in_driver;
 
+	/*
+	 * the queue being served, and how many requests it got this slice
+	 */
+	struct cfq_queue *active_queue;
+	unsigned int dispatch_slice;
+
+	struct timer_list idle_slice_timer;
+	struct timer_list idle_class_timer;
+	struct work_struct unplug_work;
+
+	unsigned long last_end_request;
+
 	/*
 	 * tunables, see top of file
 	 */
@@ -132,8 +170,9 @@ struct cfq_data {
 	unsigned int cfq_back_penalty;
 	unsigned int cfq_back_max;
 	unsigned int find_best_crq;
-
-	unsigned int cfq_tagged;
+	unsigned int cfq_slice[2];
+	unsigned int cfq_slice_async_rq;
+	unsigned int cfq_slice_idle;
 };
 
 struct cfq_queue {
@@ -164,15 +203,30 @@ struct cfq_queue {
 
 	int key_type;
 
-	unsigned long service_start;
-	unsigned long service_used;
+	/* slice end time, and what a preempted queue had left of it */
+	unsigned long slice_end;
+	unsigned long slice_left;
+
+	/* io priority: class and level within the class */
+	unsigned short ioprio, ioprio_class;
 
-	unsigned int max_rate;
+	/* think time between a completion and the next request */
+	unsigned long last_end_request;
+	unsigned long ttime_total;
+	unsigned long ttime_samples;
+	unsigned long ttime_mean;
 
 	/* number of requests that have been handed to the driver */
 	int in_flight;
 	/* number of currently allocated requests */
 	int alloc_limit[2];
+
+	/* idling for the next request of this (active) queue */
+	unsigned int wait_request : 1;
+	/* worth idling for, given its think time */
+	unsigned int idle_window : 1;
+	/* the current slice is a sync one */
+	unsigned int sync_slice : 1;
 };
 
 struct cfq_rq {
@@ -198,6 +252,26 @@ static void cfq_dispatch_sort(request_queue_t *, struct cfq_rq *);
 static void cfq_update_next_crq(struct cfq_rq *);
 static void cfq_put_cfqd(struct cfq_data *cfqd);
 
+static inline int cfq_class_idle(struct cfq_queue *cfqq)
+{
+	return cfqq->ioprio_class == IOPRIO_CLASS_IDLE;
+}
+
+static inline int cfq_class_rt(struct cfq_queue *cfqq)
+{
+	return cfqq->ioprio_class == IOPRIO_CLASS_RT;
+}
+
+/*
+ * run the queue from process context, for when dispatch was held back
+ * by an idle timer or a slice switch
+ */
+static inline void cfq_schedule_dispatch(struct cfq_data *cfqd)
+{
+	if (cfqd->busy_queues)
+		kblockd_schedule_work(&cfqd->unplug_work);
+}
+
 /*
  * what the fairness is based on (ie how processes are grouped and
  * differentiated)
@@ -401,75 +475,47 @@ static void cfq_update_next_crq(struct cfq_rq *crq)
 		cfqq->next_crq = cfq_find_next_crq(cfqq->cfqd, cfqq, crq);
 }
 
-static int cfq_check_sort_rr_list(struct cfq_queue *cfqq)
-{
-	struct list_head *head = &cfqq->cfqd->rr_list;
-	struct list_head *next, *prev;
-
-	/*
-	 * list might still be ordered
-	 */
-	next = cfqq->cfq_list.next;
-	if (next != head) {
-		struct cfq_queue *cnext = list_entry_cfqq(next);
-
-		if (cfqq->service_used > cnext->service_used)
-			return 1;
-	}
-
-	prev = cfqq->cfq_list.prev;
-	if (prev != head) {
-		struct cfq_queue *cprev = list_entry_cfqq(prev);
-
-		if (cfqq->service_used < cprev->service_used)
-			return 1;
-	}
-
-	return 0;
-}
-
-static void cfq_sort_rr_list(struct cfq_queue *cfqq, int new_queue)
+/*
+ * put a busy queue where it will be found for service: real-time queues
+ * at the front of cur_rr behind the other real-time ones, best-effort
+ * queues at the back of the list of their level, idle queues on their
+ * own list. a queue preempted in the middle of its slice goes first.
+ */
+static void cfq_resort_rr_list(struct cfq_queue *cfqq, int preempted)
 {
-	struct list_head *entry = &cfqq->cfqd->rr_list;
+	struct cfq_data *cfqd = cfqq->cfqd;
+	struct list_head *list, *entry;
 
 	if (!cfqq->on_rr)
 		return;
-	if (!new_queue && !cfq_check_sort_rr_list(cfqq))
-		return;
 
 	list_del(&cfqq->cfq_list);
 
-	/*
-	 * sort by our mean service_used, sub-sort by in-flight requests
-	 */
-	while ((entry = entry->prev) != &cfqq->cfqd->rr_list) {
-		struct cfq_queue *__cfqq = list_entry_cfqq(entry);
-
-		if (cfqq->service_used > __cfqq->service_used)
-			break;
-		else if (cfqq->service_used == __cfqq->service_used) {
-			struct list_head *prv;
-
-			while ((prv = entry->prev) != &cfqq->cfqd->rr_list) {
-				__cfqq = list_entry_cfqq(prv);
-
-				WARN_ON(__cfqq->service_used > cfqq->service_used);
-				if (cfqq->service_used != __cfqq->service_used)
-					break;
-				if (cfqq->in_flight > __cfqq->in_flight)
-					break;
-
-				entry = prv;
-			}
+	if (cfq_class_rt(cfqq)) {
+		list = &cfqd->cur_rr;
+		entry = list;
+		if (!preempted) {
+			while (entry->next != list &&
+			       cfq_class_rt(list_entry_cfqq(entry->next)))
+				entry = entry->next;
 		}
+		list_add(&cfqq->cfq_list, entry);
+		return;
 	}
 
-	list_add(&cfqq->cfq_list, entry);
+	if (cfq_class_idle(cfqq))
+		list = &cfqd->idle_rr;
+	else
+		list = &cfqd->rr_list[cfqq->ioprio];
+
+	if (preempted)
+		list_add(&cfqq->cfq_list, list);
+	else
+		list_add_tail(&cfqq->cfq_list, list);
 }
 
 /*
- * add to busy list of queues for service, trying to be fair in ordering
- * the pending list according to requests serviced
+ * add to busy list of queues for service
  */
 static inline void
 cfq_add_cfqq_rr(struct cfq_data *cfqd, struct cfq_queue *cfqq)
@@ -480,10 +526,7 @@ cfq_add_cfqq_rr(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 	cfqq->on_rr = 1;
 	cfqd->busy_queues++;
 
-	if (time_after(jiffies, cfqq->service_start + cfq_service))
-		cfqq->service_used >>= 3;
-
-	cfq_sort_rr_list(cfqq, 1);
+	cfq_resort_rr_list(cfqq, 0);
 }
 
 static inline void
@@ -617,11 +660,6 @@ static void cfq_requeue_request(request_queue_t *q, struct request *rq)
 	if (crq) {
 		struct cfq_queue *cfqq = crq->cfq_queue;
 
-		if (cfqq->cfqd->cfq_tagged) {
-			cfqq->service_used--;
-			cfq_sort_rr_list(cfqq, 0);
-		}
-
 		if (crq->accounted) {
 			crq->accounted = 0;
 			cfqq->cfqd->rq_in_driver--;
@@ -790,72 +828,291 @@ static inline struct cfq_rq *cfq_check_fifo(struct cfq_queue *cfqq)
 }
 
 /*
- * dispatch a single request from given queue
+ * Scale the base slice by the priority level: each level above or below
+ * the default gets 1/CFQ_SLICE_SCALE more or less
  */
+static inline int
+cfq_prio_to_slice(struct cfq_data *cfqd, struct cfq_queue *cfqq)
+{
+	const int base_slice = cfqd->cfq_slice[cfqq->sync_slice];
+
+	return base_slice + (base_slice / CFQ_SLICE_SCALE *
+			     (IOPRIO_NORM - cfqq->ioprio));
+}
+
+/*
+ * async queues are time sliced by number of requests instead, as they
+ * complete long after being dispatched
+ */
+static inline int
+cfq_prio_to_maxrq(struct cfq_data *cfqd, struct cfq_queue *cfqq)
+{
+	const int base_rq = cfqd->cfq_slice_async_rq;
+
+	return 2 * (base_rq + base_rq * (CFQ_PRIO_LISTS - 1 - cfqq->ioprio));
+}
+
 static inline void
-cfq_dispatch_request(request_queue_t *q, struct cfq_data *cfqd,
-		     struct cfq_queue *cfqq)
+cfq_set_prio_slice(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 {
-	struct cfq_rq *crq;
+	if (cfqq->slice_left) {
+		cfqq->slice_end = jiffies + cfqq->slice_left;
+		cfqq->slice_left = 0;
+	} else
+		cfqq->slice_end = jiffies + cfq_prio_to_slice(cfqd, cfqq);
+}
 
-	/*
-	 * follow expired path, else get first next available
-	 */
-	if ((crq = cfq_check_fifo(cfqq)) == NULL) {
-		if (cfqd->find_best_crq)
-			crq = cfqq->next_crq;
+static inline int cfq_slice_used(struct cfq_queue *cfqq)
+{
+	if (!cfqq->slice_end)
+		return 0;
+
+	return time_after(jiffies, cfqq->slice_end);
+}
+
+/*
+ * current queue is done with its slice: put it back in line for service,
+ * at the front if it was preempted with part of the slice left
+ */
+static void cfq_slice_expired(struct cfq_data *cfqd, int preempted)
+{
+	struct cfq_queue *cfqq = cfqd->active_queue;
+
+	if (!cfqq)
+		return;
+
+	del_timer(&cfqd->idle_slice_timer);
+	cfqq->wait_request = 0;
+
+	if (preempted && cfqq->slice_end &&
+	    time_before(jiffies, cfqq->slice_end))
+		cfqq->slice_left = cfqq->slice_end - jiffies;
+	else
+		cfqq->slice_left = 0;
+	cfqq->slice_end = 0;
+
+	cfq_resort_rr_list(cfqq, preempted);
+
+	cfqd->active_queue = NULL;
+	cfqd->dispatch_slice = 0;
+}
+
+/*
+ * move the next best-effort level onto cur_rr. the levels are scanned in
+ * rounds that each reach one level further down, so level 0 is served in
+ * every round and level 7 only in the last one.
+ */
+static int cfq_get_next_prio_level(struct cfq_data *cfqd)
+{
+	int prio, wrap;
+
+	prio = -1;
+	wrap = 0;
+	do {
+		int p;
+
+		for (p = cfqd->cur_prio; p <= cfqd->cur_end_prio; p++) {
+			if (!list_empty(&cfqd->rr_list[p])) {
+				prio = p;
+				break;
+			}
+		}
+
+		if (prio != -1)
+			break;
+		cfqd->cur_prio = 0;
+		if (++cfqd->cur_end_prio == CFQ_PRIO_LISTS) {
+			cfqd->cur_end_prio = 0;
+			if (wrap)
+				break;
+			wrap = 1;
+		}
+	} while (1);
+
+	if (prio == -1)
+		return -1;
+
+	list_splice_init(&cfqd->rr_list[prio], &cfqd->cur_rr);
+
+	cfqd->cur_prio = prio + 1;
+	if (cfqd->cur_prio > cfqd->cur_end_prio) {
+		cfqd->cur_end_prio = cfqd->cur_prio;
+		cfqd->cur_prio = 0;
+	}
+	if (cfqd->cur_end_prio == CFQ_PRIO_LISTS) {
+		cfqd->cur_prio = 0;
+		cfqd->cur_end_prio = 0;
+	}
+
+	return prio;
+}
+
+static struct cfq_queue *cfq_set_active_queue(struct cfq_data *cfqd, int force)
+{
+	struct cfq_queue *cfqq = NULL;
+	unsigned long end;
+
+	if (!list_empty(&cfqd->cur_rr) || cfq_get_next_prio_level(cfqd) != -1)
+		cfqq = list_entry_cfqq(cfqd->cur_rr.next);
+	else if (!list_empty(&cfqd->idle_rr)) {
+		/*
+		 * only serve the idle class once everybody else has been
+		 * quiet for a while
+		 */
+		end = cfqd->last_end_request + CFQ_IDLE_GRACE;
+		if (force || time_after_eq(jiffies, end))
+			cfqq = list_entry_cfqq(cfqd->idle_rr.next);
 		else
-			crq = rb_entry_crq(rb_first(&cfqq->sort_list));
+			mod_timer(&cfqd->idle_class_timer, end);
 	}
 
-	cfqd->last_sector = crq->request->sector + crq->request->nr_sectors;
+	if (cfqq) {
+		cfqq->slice_end = 0;
+		cfqq->wait_request = 0;
+		cfqq->sync_slice = 0;
+	}
 
-	/*
-	 * finally, insert request into driver list
-	 */
-	cfq_dispatch_sort(q, crq);
+	cfqd->active_queue = cfqq;
+	cfqd->dispatch_slice = 0;
+	return cfqq;
 }
 
-static int cfq_dispatch_requests(request_queue_t *q, int max_dispatch)
+/*
+ * the active queue ran dry: keep the disk idle for a little while if it
+ * looks like its process will be back soon with more sync io
+ */
+static int cfq_arm_slice_timer(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 {
-	struct cfq_data *cfqd = q->elevator->elevator_data;
-	struct cfq_queue *cfqq;
-	struct list_head *entry, *tmp;
-	int queued, busy_queues, first_round;
+	unsigned long expires;
 
-	if (list_empty(&cfqd->rr_list))
+	if (!cfqd->cfq_slice_idle || !cfqq->sync_slice || !cfqq->idle_window)
 		return 0;
 
-	queued = 0;
-	first_round = 1;
-restart:
-	busy_queues = 0;
-	list_for_each_safe(entry, tmp, &cfqd->rr_list) {
-		cfqq = list_entry_cfqq(entry);
+	if (cfqq->wait_request)
+		return 1;
 
-		BUG_ON(RB_EMPTY(&cfqq->sort_list));
+	expires = jiffies + cfqd->cfq_slice_idle;
+	if (cfqq->slice_end && time_after(expires, cfqq->slice_end))
+		return 0;
 
+	cfqq->wait_request = 1;
+	mod_timer(&cfqd->idle_slice_timer, expires);
+	return 1;
+}
+
+/*
+ * pick the queue to dispatch from: the active one while it has slice and
+ * requests left, else the next one in line. returns NULL while idling.
+ */
+static struct cfq_queue *cfq_select_queue(struct cfq_data *cfqd, int force)
+{
+	struct cfq_queue *cfqq = cfqd->active_queue;
+
+	if (!cfqq)
+		goto new_queue;
+
+	if (cfq_slice_used(cfqq))
+		goto expire;
+
+	if (!RB_EMPTY(&cfqq->sort_list))
+		goto keep_queue;
+
+	if (!force) {
 		/*
-		 * first round of queueing, only select from queues that
-		 * don't already have io in-flight
+		 * wait for what is in flight to complete before deciding
+		 * to idle, completion will get us going again
 		 */
-		if (first_round && cfqq->in_flight)
-			continue;
+		if (cfqq->in_flight && cfqq->sync_slice && cfqq->idle_window) {
+			cfqq = NULL;
+			goto keep_queue;
+		}
+		if (cfq_arm_slice_timer(cfqd, cfqq)) {
+			cfqq = NULL;
+			goto keep_queue;
+		}
+	}
 
-		cfq_dispatch_request(q, cfqd, cfqq);
+expire:
+	cfq_slice_expired(cfqd, 0);
+new_queue:
+	cfqq = cfq_set_active_queue(cfqd, force);
+keep_queue:
+	return cfqq;
+}
 
-		if (!RB_EMPTY(&cfqq->sort_list))
-			busy_queues++;
+static int
+__cfq_dispatch_requests(request_queue_t *q, struct cfq_data *cfqd,
+			struct cfq_queue *cfqq, int max_dispatch)
+{
+	int dispatched = 0;
 
-		queued++;
-	}
+	BUG_ON(RB_EMPTY(&cfqq->sort_list));
 
-	if ((queued < max_dispatch) && (busy_queues || first_round)) {
-		first_round = 0;
-		goto restart;
-	}
+	do {
+		struct cfq_rq *crq;
+
+		/*
+		 * follow expired path, else get first next available
+		 */
+		if ((crq = cfq_check_fifo(cfqq)) == NULL) {
+			if (cfqd->find_best_crq)
+				crq = cfqq->next_crq;
+			else
+				crq = rb_entry_crq(rb_first(&cfqq->sort_list));
+		}
+
+		if (crq->is_sync)
+			cfqq->sync_slice = 1;
+
+		cfqd->last_sector = crq->request->sector + crq->request->nr_sectors;
+
+		/*
+		 * finally, insert request into driver list
+		 */
+		cfq_dispatch_sort(q, crq);
+		dispatched++;
+	} while (dispatched < max_dispatch && !RB_EMPTY(&cfqq->sort_list));
+
+	cfqd->dispatch_slice += dispatched;
+
+	/*
+	 * the slice starts when the queue first gets the disk
+	 */
+	if (!cfqq->slice_end)
+		cfq_set_prio_slice(cfqd, cfqq);
+
+	/*
+	 * an async queue is done once it has sent its share of requests,
+	 * and the idle class only ever gets one at a time
+	 */
+	if ((!cfqq->sync_slice &&
+	     cfqd->dispatch_slice >= cfq_prio_to_maxrq(cfqd, cfqq)) ||
+	    cfq_class_idle(cfqq))
+		cfq_slice_expired(cfqd, 0);
+
+	return dispatched;
+}
+
+static int
+cfq_dispatch_requests(request_queue_t *q, int max_dispatch, int force)
+{
+	struct cfq_data *cfqd = q->elevator->elevator_data;
+	struct cfq_queue *cfqq;
+
+	if (!cfqd->busy_queues)
+		return 0;
 
-	return queued;
+	cfqq = cfq_select_queue(cfqd, force);
+	if (!cfqq)
+		return 0;
+
+	cfqq->wait_request = 0;
+	del_timer(&cfqd->idle_slice_timer);
+
+	if (cfq_class_idle(cfqq))
+		max_dispatch = 1;
+
+	return __cfq_dispatch_requests(q, cfqd, cfqq, max_dispatch);
 }
 
 static inline void cfq_account_dispatch(struct cfq_rq *crq)
@@ -875,42 +1132,20 @@ static inline void cfq_account_dispatch(struct cfq_rq *crq)
 		return;
 
 	now = jiffies;
-	if (cfqq->service_start == ~0UL)
-		cfqq->service_start = now;
-
-	/*
-	 * on drives with tagged command queueing, command turn-around time
-	 * doesn't necessarily reflect the time spent processing this very
-	 * command inside the drive. so do the accounting differently there,
-	 * by just sorting on the number of requests
-	 */
-	if (cfqd->cfq_tagged) {
-		if (time_after(now, cfqq->service_start + cfq_service)) {
-			cfqq->service_start = now;
-			cfqq->service_used /= 10;
-		}
-
-		cfqq->service_used++;
-		cfq_sort_rr_list(cfqq, 0);
-	}
-
 	elapsed = now - crq->queue_start;
 	if (elapsed > max_elapsed_dispatch)
 		max_elapsed_dispatch = elapsed;
 
 	crq->accounted = 1;
 	crq->service_start = now;
-
-	if (++cfqd->rq_in_driver >= CFQ_MAX_TAG && !cfqd->cfq_tagged) {
-		cfqq->cfqd->cfq_tagged = 1;
-		printk("cfq: depth %d reached, tagging now on\n", CFQ_MAX_TAG);
-	}
+	cfqd->rq_in_driver++;
 }
 
 static inline void
 cfq_account_completion(struct cfq_queue *cfqq, struct cfq_rq *crq)
 {
 	struct cfq_data *cfqd = cfqq->cfqd;
+	unsigned long now, duration;
 
 	if (!crq->accounted)
 		return;
@@ -918,21 +1153,31 @@ cfq_account_completion(struct cfq_queue *cfqq, struct cfq_rq *crq)
 	WARN_ON(!cfqd->rq_in_driver);
 	cfqd->rq_in_driver--;
 
-	if (!cfqd->cfq_tagged) {
-		unsigned long now = jiffies;
-		unsigned long duration = now - crq->service_start;
-
-		if (time_after(now, cfqq->service_start + cfq_service)) {
-			cfqq->service_start = now;
-			cfqq->service_used >>= 3;
-		}
+	now = jiffies;
+	duration = now - crq->service_start;
+	if (duration > max_elapsed_crq)
+		max_elapsed_crq = duration;
 
-		cfqq->service_used += duration;
-		cfq_sort_rr_list(cfqq, 0);
+	cfqq->last_end_request = now;
+	if (!cfq_class_idle(cfqq))
+		cfqd->last_end_request = now;
 
-		if (duration > max_elapsed_crq)
-			max_elapsed_crq = duration;
+	/*
+	 * the active queue is out of requests: idle for the next one if
+	 * it is worth it, else move on
+	 */
+	if (cfqd->active_queue == cfqq) {
+		if (cfq_slice_used(cfqq) ||
+		    (RB_EMPTY(&cfqq->sort_list) && !cfqq->in_flight &&
+		     !cfq_arm_slice_timer(cfqd, cfqq))) {
+			cfq_slice_expired(cfqd, 0);
+			cfq_schedule_dispatch(cfqd);
+			return;
+		}
 	}
+
+	if (!cfqd->rq_in_driver)
+		cfq_schedule_dispatch(cfqd);
 }
 
 static struct request *cfq_next_request(request_queue_t *q)
@@ -953,7 +1198,7 @@ dispatch:
 		return rq;
 	}
 
-	if (cfq_dispatch_requests(q, cfqd->cfq_quantum))
+	if (cfq_dispatch_requests(q, cfqd->cfq_quantum, 0))
 		goto dispatch;
 
 	return NULL;
@@ -975,6 +1220,9 @@ static void cfq_put_queue(struct cfq_queue *cfqq)
 	BUG_ON(rb_first(&cfqq->sort_list));
 	BUG_ON(cfqq->on_rr);
 
+	if (unlikely(cfqq->cfqd->active_queue == cfqq))
+		cfq_slice_expired(cfqq->cfqd, 0);
+
 	cfq_put_cfqd(cfqq->cfqd);
 
 	/*
@@ -1219,7 +1467,9 @@ retry:
 		cfqq->cfqd = cfqd;
 		atomic_inc(&cfqd->ref);
 		cfqq->key_type = cfqd->key_type;
-		cfqq->service_start = ~0UL;
+		cfqq->ioprio_class = IOPRIO_CLASS_BE;
+		cfqq->ioprio = IOPRIO_NORM;
+		cfqq->idle_window = 1;
 	}
 
 	if (new_cfqq)
@@ -1231,16 +1481,116 @@ out:
 	return cfqq;
 }
 
+/*
+ * pick up the io priority of the task allocating a request. the queue is
+ * shared by all tasks with the same hash key, the last one wins.
+ */
+static void cfq_init_prio_data(struct cfq_queue *cfqq, struct task_struct *tsk)
+{
+	unsigned short ioprio_class = task_ioprio_class(tsk);
+	unsigned short ioprio = task_ioprio(tsk);
+
+	if (ioprio_class == IOPRIO_CLASS_IDLE)
+		ioprio = CFQ_PRIO_LISTS - 1;
+	else if (ioprio >= CFQ_PRIO_LISTS)
+		ioprio = CFQ_PRIO_LISTS - 1;
+
+	if (ioprio_class == cfqq->ioprio_class && ioprio == cfqq->ioprio)
+		return;
+
+	cfqq->ioprio_class = ioprio_class;
+	cfqq->ioprio = ioprio;
+
+	/*
+	 * move it to its new list, unless it is being served right now
+	 */
+	if (cfqq->cfqd->active_queue != cfqq)
+		cfq_resort_rr_list(cfqq, 0);
+}
+
+/*
+ * keep a decaying average of the time the process takes to issue a new
+ * request after the previous one completed. only queues that are quick
+ * enough are worth idling the disk for.
+ */
+static void
+cfq_update_idle_window(struct cfq_data *cfqd, struct cfq_queue *cfqq)
+{
+	unsigned long elapsed, ttime;
+
+	if (cfqq->in_flight || !cfqq->last_end_request)
+		return;
+
+	elapsed = jiffies - cfqq->last_end_request;
+	ttime = min(elapsed, 2UL * cfqd->cfq_slice_idle);
+
+	cfqq->ttime_samples = (7*cfqq->ttime_samples + 256) / 8;
+	cfqq->ttime_total = (7*cfqq->ttime_total + 256*ttime) / 8;
+	cfqq->ttime_mean = (cfqq->ttime_total + 128) / cfqq->ttime_samples;
+
+	cfqq->idle_window = cfqq->ttime_mean <= cfqd->cfq_slice_idle;
+}
+
+/*
+ * should the newly queued request of cfqq take the disk away from the
+ * active queue right away?
+ */
+static int
+cfq_should_preempt(struct cfq_data *cfqd, struct cfq_queue *cfqq,
+		   struct cfq_rq *crq)
+{
+	struct cfq_queue *active = cfqd->active_queue;
+
+	if (!active || active == cfqq)
+		return 0;
+
+	if (cfq_class_idle(cfqq))
+		return 0;
+	if (cfq_class_idle(active))
+		return 1;
+
+	/*
+	 * real-time beats everything else, and sync io beats async
+	 */
+	if (cfq_class_rt(cfqq) && !cfq_class_rt(active))
+		return 1;
+	if (crq->is_sync && !active->sync_slice &&
+	    cfqq->ioprio_class == active->ioprio_class)
+		return 1;
+
+	return 0;
+}
+
 static void cfq_enqueue(struct cfq_data *cfqd, struct cfq_rq *crq)
 {
+	struct cfq_queue *cfqq = crq->cfq_queue;
+
 	crq->is_sync = 0;
 	if (rq_data_dir(crq->request) == READ || current->flags & PF_SYNCWRITE)
 		crq->is_sync = 1;
 
+	if (crq->is_sync)
+		cfq_update_idle_window(cfqd, cfqq);
+
 	cfq_add_crq_rb(crq);
 	crq->queue_start = jiffies;
 
-	list_add_tail(&crq->request->queuelist, &crq->cfq_queue->fifo[crq->is_sync]);
+	list_add_tail(&crq->request->queuelist, &cfqq->fifo[crq->is_sync]);
+
+	if (cfqq == cfqd->active_queue) {
+		/*
+		 * the request we were idling for, get going again
+		 */
+		if (cfqq->wait_request) {
+			del_timer(&cfqd->idle_slice_timer);
+			cfqq->wait_request = 0;
+			cfq_schedule_dispatch(cfqd);
+		}
+	} else if (cfq_should_preempt(cfqd, cfqq, crq)) {
+		cfq_slice_expired(cfqd, 1);
+		list_move(&cfqq->cfq_list, &cfqd->cur_rr);
+		cfq_schedule_dispatch(cfqd);
+	}
 }
 
 static void
@@ -1251,7 +1601,7 @@ cfq_insert_request(request_queue_t *q, struct request *rq, int where)
 
 	switch (where) {
 		case ELEVATOR_INSERT_BACK:
-			while (cfq_dispatch_requests(q, cfqd->cfq_quantum))
+			while (cfq_dispatch_requests(q, cfqd->cfq_quantum, 1))
 				;
 			list_add_tail(&rq->queuelist, &q->queue_head);
 			break;
@@ -1279,7 +1629,7 @@ static int cfq_queue_empty(request_queue_t *q)
 {
 	struct cfq_data *cfqd = q->elevator->elevator_data;
 
-	return list_empty(&q->queue_head) && list_empty(&cfqd->rr_list);
+	return list_empty(&q->queue_head) && !cfqd->busy_queues;
 }
 
 static void cfq_completed_request(request_queue_t *q, struct request *rq)
@@ -1337,6 +1687,12 @@ static int cfq_may_queue(request_queue_t *q, int rw)
 	if (cfqq) {
 		int limit = cfqd->max_queued;
 
+		/*
+		 * the disk is being kept idle for this very request
+		 */
+		if (cfqq->wait_request)
+			return ELV_MQUEUE_MUST;
+
 		if (cfqq->allocated[rw] < cfqd->cfq_queued)
 			return ELV_MQUEUE_MUST;
 
@@ -1420,6 +1776,8 @@ static int cfq_set_request(request_queue_t *q, struct request *rq, int gfp_mask)
 	if (!cfqq)
 		goto out_lock;
 
+	cfq_init_prio_data(cfqq, current);
+
 repeat:
 	if (cfqq->allocated[rw] >= cfqd->max_queued)
 		goto out_lock;
@@ -1485,9 +1843,80 @@ static void cfq_put_cfqd(struct cfq_data *cfqd)
 	kfree(cfqd);
 }
 
+static void cfq_kick_queue(void *data)
+{
+	request_queue_t *q = data;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	blk_remove_plug(q);
+	q->request_fn(q);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
+/*
+ * the process we were idling for did not come back in time
+ */
+static void cfq_idle_slice_timer(unsigned long data)
+{
+	struct cfq_data *cfqd = (struct cfq_data *) data;
+	struct cfq_queue *cfqq;
+	unsigned long flags;
+
+	spin_lock_irqsave(cfqd->queue->queue_lock, flags);
+
+	if ((cfqq = cfqd->active_queue) != NULL) {
+		/*
+		 * a request came in after all, dispatch it
+		 */
+		if (!cfq_slice_used(cfqq) && !RB_EMPTY(&cfqq->sort_list))
+			cfqq->wait_request = 0;
+		else
+			cfq_slice_expired(cfqd, 0);
+	}
+
+	cfq_schedule_dispatch(cfqd);
+	spin_unlock_irqrestore(cfqd->queue->queue_lock, flags);
+}
+
+/*
+ * the idle class grace period is over
+ */
+static void cfq_idle_class_timer(unsigned long data)
+{
+	struct cfq_data *cfqd = (struct cfq_data *) data;
+	unsigned long flags, end;
+
+	spin_lock_irqsave(cfqd->queue->queue_lock, flags);
+
+	end = cfqd->last_end_request + CFQ_IDLE_GRACE;
+	if (!time_after_eq(jiffies, end))
+		mod_timer(&cfqd->idle_class_timer, end);
+	else
+		cfq_schedule_dispatch(cfqd);
+
+	spin_unlock_irqrestore(cfqd->queue->queue_lock, flags);
+}
+
+static void cfq_shutdown_timer_wq(struct cfq_data *cfqd)
+{
+	del_timer_sync(&cfqd->idle_slice_timer);
+	del_timer_sync(&cfqd->idle_class_timer);
+	kblockd_flush();
+}
+
 static void cfq_exit_queue(elevator_t *e)
 {
-	cfq_put_cfqd(e->elevator_data);
+	struct cfq_data *cfqd = e->elevator_data;
+
+	cfq_shutdown_timer_wq(cfqd);
+
+	spin_lock_irq(cfqd->queue->queue_lock);
+	if (cfqd->active_queue)
+		cfq_slice_expired(cfqd, 0);
+	spin_unlock_irq(cfqd->queue->queue_lock);
+
+	cfq_put_cfqd(cfqd);
 }
 
 static int cfq_init_queue(request_queue_t *q, elevator_t *e)
@@ -1500,7 +1929,10 @@ static int cfq_init_queue(request_queue_t *q, elevator_t *e)
 		return -ENOMEM;
 
 	memset(cfqd, 0, sizeof(*cfqd));
-	INIT_LIST_HEAD(&cfqd->rr_list);
+	for (i = 0; i < CFQ_PRIO_LISTS; i++)
+		INIT_LIST_HEAD(&cfqd->rr_list[i]);
+	INIT_LIST_HEAD(&cfqd->cur_rr);
+	INIT_LIST_HEAD(&cfqd->idle_rr);
 	INIT_LIST_HEAD(&cfqd->empty_list);
 
 	cfqd->crq_hash = kmalloc(sizeof(struct hlist_head) * CFQ_MHASH_ENTRIES, GFP_KERNEL);
@@ -1525,6 +1957,16 @@ static int cfq_init_queue(request_queue_t *q, elevator_t *e)
 	cfqd->queue = q;
 	atomic_inc(&q->refcnt);
 
+	init_timer(&cfqd->idle_slice_timer);
+	cfqd->idle_slice_timer.function = cfq_idle_slice_timer;
+	cfqd->idle_slice_timer.data = (unsigned long) cfqd;
+
+	init_timer(&cfqd->idle_class_timer);
+	cfqd->idle_class_timer.function = cfq_idle_class_timer;
+	cfqd->idle_class_timer.data = (unsigned long) cfqd;
+
+	INIT_WORK(&cfqd->unplug_work, cfq_kick_queue, q);
+
 	/*
 	 * just set it to some high value, we want anyone to be able to queue
 	 * some requests. fairness is handled differently
@@ -1543,6 +1985,10 @@ static int cfq_init_queue(request_queue_t *q, elevator_t *e)
 	cfqd->cfq_fifo_batch_expire = cfq_fifo_rate;
 	cfqd->cfq_back_max = cfq_back_max;
 	cfqd->cfq_back_penalty = cfq_back_penalty;
+	cfqd->cfq_slice[0] = cfq_slice_async;
+	cfqd->cfq_slice[1] = cfq_slice_sync;
+	cfqd->cfq_slice_async_rq = cfq_slice_async_rq;
+	cfqd->cfq_slice_idle = cfq_slice_idle;
 
 	return 0;
 out_crqpool:
@@ -1667,6 +2113,10 @@ SHOW_FUNCTION(cfq_fifo_batch_expire_show, cfqd->cfq_fifo_batch_expire, 1);
 SHOW_FUNCTION(cfq_find_best_show, cfqd->find_best_crq, 0);
 SHOW_FUNCTION(cfq_back_max_show, cfqd->cfq_back_max, 0);
 SHOW_FUNCTION(cfq_back_penalty_show, cfqd->cfq_back_penalty, 0);
+SHOW_FUNCTION(cfq_slice_idle_show, cfqd->cfq_slice_idle, 1);
+SHOW_FUNCTION(cfq_slice_sync_show, cfqd->cfq_slice[1], 1);
+SHOW_FUNCTION(cfq_slice_async_show, cfqd->cfq_slice[0], 1);
+SHOW_FUNCTION(cfq_slice_async_rq_show, cfqd->cfq_slice_async_rq, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -1692,6 +2142,10 @@ STORE_FUNCTION(cfq_fifo_batch_expire_store, &cfqd->cfq_fifo_batch_expire, 0, UIN
 STORE_FUNCTION(cfq_find_best_store, &cfqd->find_best_crq, 0, 1, 0);
 STORE_FUNCTION(cfq_back_max_store, &cfqd->cfq_back_max, 0, UINT_MAX, 0);
 STORE_FUNCTION(cfq_back_penalty_store, &cfqd->cfq_back_penalty, 1, UINT_MAX, 0);
+STORE_FUNCTION(cfq_slice_idle_store, &cfqd->cfq_slice_idle, 0, UINT_MAX, 1);
+STORE_FUNCTION(cfq_slice_sync_store, &cfqd->cfq_slice[1], 1, UINT_MAX, 1);
+STORE_FUNCTION(cfq_slice_async_store, &cfqd->cfq_slice[0], 1, UINT_MAX, 1);
+STORE_FUNCTION(cfq_slice_async_rq_store, &cfqd->cfq_slice_async_rq, 1, UINT_MAX, 0);
 #undef STORE_FUNCTION
 
 static struct cfq_fs_entry cfq_quantum_entry = {
@@ -1734,6 +2188,26 @@ static struct cfq_fs_entry cfq_back_penalty_entry = {
 	.show = cfq_back_penalty_show,
 	.store = cfq_back_penalty_store,
 };
+static struct cfq_fs_entry cfq_slice_sync_entry = {
+	.attr = {.name = "slice_sync", .mode = S_IRUGO | S_IWUSR },
+	.show = cfq_slice_sync_show,
+	.store = cfq_slice_sync_store,
+};
+static struct cfq_fs_entry cfq_slice_async_entry = {
+	.attr = {.name = "slice_async", .mode = S_IRUGO | S_IWUSR },
+	.show = cfq_slice_async_show,
+	.store = cfq_slice_async_store,
+};
+static struct cfq_fs_entry cfq_slice_async_rq_entry = {
+	.attr = {.name = "slice_async_rq", .mode = S_IRUGO | S_IWUSR },
+	.show = cfq_slice_async_rq_show,
+	.store = cfq_slice_async_rq_store,
+};
+static struct cfq_fs_entry cfq_slice_idle_entry = {
+	.attr = {.name = "slice_idle", .mode = S_IRUGO | S_IWUSR },
+	.show = cfq_slice_idle_show,
+	.store = cfq_slice_idle_store,
+};
 static struct cfq_fs_entry cfq_clear_elapsed_entry = {
 	.attr = {.name = "clear_elapsed", .mode = S_IWUSR },
 	.store = cfq_clear_elapsed,
@@ -1754,6 +2228,10 @@ static struct attribute *default_attrs[] = {
 	&cfq_find_best_entry.attr,
 	&cfq_back_max_entry.attr,
 	&cfq_back_penalty_entry.attr,
+	&cfq_slice_sync_entry.attr,
+	&cfq_slice_async_entry.attr,
+	&cfq_slice_async_rq_entry.attr,
+	&cfq_slice_idle_entry.attr,
 	&cfq_clear_elapsed_entry.attr,
 	NULL,
 };
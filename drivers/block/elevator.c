@@ -334,6 +334,8 @@ struct request *elv_next_request(request_queue_t *q)
 		 * that has been delayed should not be passed by new incoming
 		 * requests
 		 */
+		if (!(rq->flags & REQ_STARTED))
+			rq->issue_time = sched_clock();
 		rq->flags |= REQ_STARTED;
 
 		if (rq == q->last_merge)
@@ -192,6 +192,11 @@ void add_disk(struct gendisk *disk)
 			    disk->minors, NULL, exact_match, exact_lock, disk);
 	register_disk(disk);
 	blk_register_queue(disk);
+	if (disk->queue &&
+	    bdi_register(&disk->queue->backing_dev_info, "%s",
+			 disk->disk_name))
+		printk(KERN_WARNING "%s: could not register a flusher thread\n",
+		       disk->disk_name);
 }
 
 EXPORT_SYMBOL(add_disk);
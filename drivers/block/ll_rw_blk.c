@@ -18,6 +18,7 @@
 #include <linux/backing-dev.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
 #include <linux/kernel_stat.h>
@@ -29,6 +30,8 @@
 #include <linux/swap.h>
 #include <linux/writeback.h>
 
+#include <asm/div64.h>
+
 /*
  * for max sense size
  */
@@ -36,6 +39,7 @@
 
 static void blk_unplug_work(void *data);
 static void blk_unplug_timeout(unsigned long data);
+static inline void add_request(request_queue_t * q, struct request * req);
 
 /*
  * For the allocated request tables
@@ -73,6 +77,10 @@ EXPORT_SYMBOL(blk_max_pfn);
 /* Number of requests a "batching" process may submit */
 #define BLK_BATCH_REQ	32
 
+/* Default read latency target and window for writeback throttling */
+#define BLK_WB_LAT_USEC	75000
+#define BLK_WB_WINDOW	(HZ/10)
+
 /*
  * Return the threshold (number of used requests) at which the queue is
  * considered to be congested.  It include a little hysteresis to keep the
@@ -1092,7 +1100,7 @@ static inline int ll_new_hw_segment(request_queue_t *q,
 	return 1;
 }
 
-static int ll_back_merge_fn(request_queue_t *q, struct request *req, 
+int ll_back_merge_fn(request_queue_t *q, struct request *req, 
 			    struct bio *bio)
 {
 	int len;
@@ -1124,7 +1132,7 @@ static int ll_back_merge_fn(request_queue_t *q, struct request *req,
 	return ll_new_hw_segment(q, req, bio);
 }
 
-static int ll_front_merge_fn(request_queue_t *q, struct request *req, 
+int ll_front_merge_fn(request_queue_t *q, struct request *req, 
 			     struct bio *bio)
 {
 	int len;
@@ -1310,6 +1318,107 @@ static void blk_unplug_timeout(unsigned long data)
 	kblockd_schedule_work(&q->unplug_work);
 }
 
+/**
+ * blk_start_plug - hold back the I/O the current task is about to submit
+ * @plug:	The &struct blk_plug, normally on the caller's stack
+ *
+ * Description:
+ *   Until blk_finish_plug() is called, requests built by __make_request
+ *   for this task are collected on @plug instead of being handed to the
+ *   I/O scheduler one by one. Bios that continue one of them are merged
+ *   without touching the queue lock. Plugs do not nest: an inner
+ *   blk_start_plug() leaves the outer plug in charge.
+ **/
+void blk_start_plug(struct blk_plug *plug)
+{
+	INIT_LIST_HEAD(&plug->list);
+	plug->count = 0;
+
+	/*
+	 * if this is a nested plug, don't actually assign it. it will be
+	 * flushed on its own blk_finish_plug()
+	 */
+	if (!current->plug)
+		current->plug = plug;
+}
+
+EXPORT_SYMBOL(blk_start_plug);
+
+/*
+ * Kick a queue that just got a batch from a plug list. Called with the
+ * queue lock held and interrupts disabled.
+ */
+static void blk_plug_run_queue(request_queue_t *q)
+{
+	blk_remove_plug(q);
+
+	if (test_bit(QUEUE_FLAG_STOPPED, &q->queue_flags))
+		return;
+
+	if (!elv_queue_empty(q))
+		q->request_fn(q);
+}
+
+/**
+ * blk_flush_plug_list - hand the requests held on a plug to their queues
+ * @plug:	The &struct blk_plug to empty
+ *
+ * Description:
+ *   Requests are inserted in submission order, taking each queue lock
+ *   once per run of requests for that queue, and the queue is started
+ *   right away rather than waiting for the unplug timer. Also called
+ *   from schedule() when a plugged task is about to sleep, so a task
+ *   never waits on I/O that is still sitting on its own plug.
+ **/
+void blk_flush_plug_list(struct blk_plug *plug)
+{
+	request_queue_t *q = NULL;
+	struct request *rq;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	if (list_empty(&plug->list))
+		return;
+
+	list_splice_init(&plug->list, &list);
+	plug->count = 0;
+
+	local_irq_save(flags);
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+
+		if (rq->q != q) {
+			if (q) {
+				blk_plug_run_queue(q);
+				spin_unlock(q->queue_lock);
+			}
+			q = rq->q;
+			spin_lock(q->queue_lock);
+		}
+		add_request(q, rq);
+	}
+	blk_plug_run_queue(q);
+	spin_unlock(q->queue_lock);
+	local_irq_restore(flags);
+}
+
+EXPORT_SYMBOL(blk_flush_plug_list);
+
+/**
+ * blk_finish_plug - submit the I/O held back since blk_start_plug()
+ * @plug:	The &struct blk_plug passed to blk_start_plug()
+ **/
+void blk_finish_plug(struct blk_plug *plug)
+{
+	blk_flush_plug_list(plug);
+
+	if (plug == current->plug)
+		current->plug = NULL;
+}
+
+EXPORT_SYMBOL(blk_finish_plug);
+
 /**
  * blk_start_queue - restart a previously stopped queue
  * @q:    The &request_queue_t in question
@@ -1422,12 +1531,17 @@ void blk_cleanup_queue(request_queue_t * q)
 
 	blk_sync_queue(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
 	if (q->queue_tags)
 		__blk_queue_free_tags(q);
 
+	bdi_unregister(&q->backing_dev_info);
+
 	kmem_cache_free(requestq_cachep, q);
 }
 
@@ -1530,6 +1644,10 @@ request_queue_t *blk_init_queue(request_fn_proc *rfn, spinlock_t *lock)
 	blk_queue_max_hw_segments(q, MAX_HW_SEGMENTS);
 	blk_queue_max_phys_segments(q, MAX_PHYS_SEGMENTS);
 
+	init_waitqueue_head(&q->wb.wait);
+	q->wb.lat_usec = BLK_WB_LAT_USEC;
+	q->wb.last_read = q->wb.win_start = jiffies;
+
 	/*
 	 * all done
 	 */
@@ -2168,6 +2286,145 @@ void disk_round_stats(struct gendisk *disk)
 	disk->stamp_idle = now;
 }
 
+/*
+ * Writeback throttling
+ *
+ * A big buffered write can fill the whole request pool with background
+ * writeback, and reads then queue behind it in the device for seconds.
+ * So background writes are held to a depth here, and the depth is tuned
+ * to the read completion latency: every window the fastest read is
+ * compared to the target and the depth is halved if it was too slow, or
+ * doubled again if reads were fine but writers had to wait.  While no
+ * reads are around, writeback gets the whole pool.
+ *
+ * Background writes are those nobody waits on: not sync or barrier, and
+ * not issued for fsync, O_SYNC, O_DIRECT (PF_SYNCWRITE) or by reclaim.
+ */
+static unsigned int blk_wb_max_depth(request_queue_t *q)
+{
+	return (q->nr_requests * 3) / 4;
+}
+
+static unsigned int blk_wb_depth(request_queue_t *q)
+{
+	unsigned int depth = q->nr_requests / 2;
+	int step = q->wb.scale_step;
+
+	if (step > 0)
+		depth = step < 31 ? 1 + ((depth - 1) >> step) : 1;
+	else if (step < 0)
+		depth = step > -16 ? depth << -step : blk_wb_max_depth(q);
+
+	if (depth > blk_wb_max_depth(q))
+		depth = blk_wb_max_depth(q);
+	return depth ? depth : 1;
+}
+
+static unsigned int blk_wb_limit(request_queue_t *q)
+{
+	if (time_after(jiffies, q->wb.last_read + BLK_WB_WINDOW))
+		return q->nr_requests;
+
+	return blk_wb_depth(q);
+}
+
+/*
+ * queue lock must be held
+ */
+static void blk_wb_window(request_queue_t *q)
+{
+	struct blk_wb *wb = &q->wb;
+	unsigned int depth;
+
+	if (time_before(jiffies, wb->win_start + BLK_WB_WINDOW))
+		return;
+
+	depth = blk_wb_depth(q);
+	if (!wb->win_reads) {
+		/* nothing to judge by, start over */
+		wb->scale_step = 0;
+	} else if (wb->win_min_usec > wb->lat_usec) {
+		if (depth > 1)
+			wb->scale_step++;
+	} else if (wb->throttled && depth < blk_wb_max_depth(q))
+		wb->scale_step--;
+
+	if (blk_wb_depth(q) > depth)
+		wake_up_all(&wb->wait);
+
+	wb->win_start = jiffies;
+	wb->win_reads = 0;
+	wb->throttled = 0;
+}
+
+static inline int blk_wb_should_throttle(request_queue_t *q, struct bio *bio)
+{
+	if (!q->wb.lat_usec || bio_data_dir(bio) != WRITE)
+		return 0;
+	if (bio_sync(bio) || bio_barrier(bio) || bio_rw_ahead(bio))
+		return 0;
+
+	return !(current->flags & (PF_SYNCWRITE | PF_MEMALLOC));
+}
+
+/*
+ * Wait for room for another background write request.  The caller
+ * marks the request it gets with REQ_WB_ACCT.
+ */
+static void blk_wb_wait(request_queue_t *q)
+{
+	struct blk_wb *wb = &q->wb;
+	DEFINE_WAIT(wait);
+
+	spin_lock_irq(q->queue_lock);
+	while (wb->lat_usec && wb->inflight >= blk_wb_limit(q)) {
+		wb->throttled = 1;
+		prepare_to_wait_exclusive(&wb->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		__generic_unplug_device(q);
+		spin_unlock_irq(q->queue_lock);
+		io_schedule();
+		spin_lock_irq(q->queue_lock);
+	}
+	finish_wait(&wb->wait, &wait);
+	wb->inflight++;
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * queue lock must be held
+ */
+static void blk_wb_done(request_queue_t *q)
+{
+	struct blk_wb *wb = &q->wb;
+
+	wb->inflight--;
+	blk_wb_window(q);
+
+	if (waitqueue_active(&wb->wait) && wb->inflight < blk_wb_limit(q))
+		wake_up(&wb->wait);
+}
+
+/*
+ * queue lock must be held
+ */
+static void blk_wb_read_done(request_queue_t *q, struct request *rq)
+{
+	struct blk_wb *wb = &q->wb;
+	unsigned long long usec = sched_clock() - rq->issue_time;
+
+	/* clocks of different cpus can be a little apart */
+	if ((long long) usec < 0)
+		usec = 0;
+	do_div(usec, 1000);
+
+	if (!wb->win_reads || usec < wb->win_min_usec)
+		wb->win_min_usec = usec;
+	wb->win_reads++;
+	wb->last_read = jiffies;
+	blk_wb_window(q);
+}
+
 /*
  * queue lock must be held
  */
@@ -2191,6 +2448,9 @@ void __blk_put_request(request_queue_t *q, struct request *req)
 	if (rl) {
 		int rw = rq_data_dir(req);
 
+		if (req->flags & REQ_WB_ACCT)
+			blk_wb_done(q);
+
 		elv_completed_request(q, req);
 
 		BUG_ON(!list_empty(&req->queuelist));
@@ -2349,10 +2609,55 @@ void __blk_attempt_remerge(request_queue_t *q, struct request *rq)
 
 EXPORT_SYMBOL(__blk_attempt_remerge);
 
+/*
+ * Try to merge @bio into one of the requests the current task holds on
+ * its plug. Those are private to the task, so no queue lock is needed;
+ * disk statistics are accounted in full when the request is inserted.
+ */
+static int attempt_plug_merge(request_queue_t *q, struct blk_plug *plug,
+			      struct bio *bio)
+{
+	struct request *req;
+	int nr_sectors = bio_sectors(bio);
+
+	list_for_each_entry_reverse(req, &plug->list, queuelist) {
+		if (req->q != q || !elv_rq_merge_ok(req, bio))
+			continue;
+
+		if (req->sector + req->nr_sectors == bio->bi_sector) {
+			if (!q->back_merge_fn(q, req, bio))
+				return 0;
+
+			req->biotail->bi_next = bio;
+			req->biotail = bio;
+			req->nr_sectors = req->hard_nr_sectors += nr_sectors;
+			return 1;
+		}
+
+		if (req->sector - nr_sectors == bio->bi_sector) {
+			if (!q->front_merge_fn(q, req, bio))
+				return 0;
+
+			bio->bi_next = req->bio;
+			req->bio = bio;
+			req->buffer = bio_data(bio);
+			req->current_nr_sectors = bio_cur_sectors(bio);
+			req->hard_cur_sectors = req->current_nr_sectors;
+			req->sector = req->hard_sector = bio->bi_sector;
+			req->nr_sectors = req->hard_nr_sectors += nr_sectors;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int __make_request(request_queue_t *q, struct bio *bio)
 {
 	struct request *req, *freereq = NULL;
+	struct blk_plug *plug;
 	int el_ret, rw, nr_sectors, cur_nr_sectors, barrier, err;
+	int wb_acct = 0;
 	sector_t sector;
 
 	sector = bio->bi_sector;
@@ -2376,11 +2681,25 @@ static int __make_request(request_queue_t *q, struct bio *bio)
 		goto end_io;
 	}
 
+	/*
+	 * sync and barrier bios bypass the task plug; a barrier must also
+	 * not overtake the requests still held on it
+	 */
+	plug = current->plug;
+	if (plug && (barrier || bio_sync(bio))) {
+		blk_flush_plug_list(plug);
+		plug = NULL;
+	}
+	if (plug && attempt_plug_merge(q, plug, bio))
+		return 0;
+
 again:
 	spin_lock_irq(q->queue_lock);
 
 	if (elv_queue_empty(q)) {
-		blk_plug_device(q);
+		/* a plugged task starts the queue itself when it flushes */
+		if (!plug)
+			blk_plug_device(q);
 		goto get_rq;
 	}
 	if (barrier)
@@ -2448,6 +2767,10 @@ get_rq:
 		freereq = NULL;
 	} else {
 		spin_unlock_irq(q->queue_lock);
+		if (!wb_acct && blk_wb_should_throttle(q, bio)) {
+			blk_wb_wait(q);
+			wb_acct = 1;
+		}
 		if ((freereq = get_request(q, rw, GFP_ATOMIC)) == NULL) {
 			/*
 			 * READA bit set
@@ -2458,6 +2781,9 @@ get_rq:
 	
 			freereq = get_request_wait(q, rw);
 		}
+		/* if the bio merges after all, putting freereq drops this */
+		if (wb_acct)
+			freereq->flags |= REQ_WB_ACCT;
 		goto again;
 	}
 
@@ -2487,6 +2813,18 @@ get_rq:
 	req->rq_disk = bio->bi_bdev->bd_disk;
 	req->start_time = jiffies;
 
+	if (plug) {
+		/* keep the plug short, so the device is not left idle */
+		if (plug->count >= BLK_MAX_REQUEST_COUNT) {
+			spin_unlock_irq(q->queue_lock);
+			blk_flush_plug_list(plug);
+			spin_lock_irq(q->queue_lock);
+		}
+		list_add_tail(&req->queuelist, &plug->list);
+		plug->count++;
+		goto out;
+	}
+
 	add_request(q, req);
 out:
 	if (freereq)
@@ -2998,6 +3336,9 @@ void end_that_request_last(struct request *req)
 		disk_round_stats(disk);
 		disk->in_flight--;
 	}
+	if (rq_data_dir(req) == READ && (req->flags & REQ_STARTED) &&
+	    blk_fs_request(req) && req->q && req->q->wb.lat_usec)
+		blk_wb_read_done(req->q, req);
 	__blk_put_request(req->q, req);
 	/* Do this LAST! The structure may be freed immediately afterwards */
 	if (waiting)
@@ -3041,6 +3382,13 @@ int kblockd_schedule_work(struct work_struct *work)
 
 EXPORT_SYMBOL(kblockd_schedule_work);
 
+int kblockd_schedule_work_on(int cpu, struct work_struct *work)
+{
+	return queue_work_on(cpu, kblockd_workqueue, work);
+}
+
+EXPORT_SYMBOL(kblockd_schedule_work_on);
+
 void kblockd_flush(void)
 {
 	flush_workqueue(kblockd_workqueue);
@@ -3317,6 +3665,26 @@ static ssize_t queue_max_hw_sectors_show(struct request_queue *q, char *page)
 }
 
 
+static ssize_t queue_wb_lat_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%lu\n", q->wb.lat_usec);
+}
+
+static ssize_t
+queue_wb_lat_store(struct request_queue *q, const char *page, size_t count)
+{
+	unsigned long lat_usec;
+	ssize_t ret = queue_var_store(&lat_usec, page, count);
+
+	spin_lock_irq(q->queue_lock);
+	q->wb.lat_usec = lat_usec;
+	q->wb.scale_step = 0;
+	wake_up_all(&q->wb.wait);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -3346,12 +3714,19 @@ static struct queue_sysfs_entry queue_iosched_entry = {
 	.store = elv_iosched_store,
 };
 
+static struct queue_sysfs_entry queue_wb_lat_entry = {
+	.attr = {.name = "wbt_lat_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_wb_lat_show,
+	.store = queue_wb_lat_store,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
 	&queue_max_hw_sectors_entry.attr,
 	&queue_max_sectors_entry.attr,
 	&queue_iosched_entry.attr,
+	&queue_wb_lat_entry.attr,
 	NULL,
 };
 
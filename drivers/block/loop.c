@@ -67,6 +67,8 @@
 #include <linux/writeback.h>
 #include <linux/buffer_head.h>		/* for invalidate_bdev() */
 #include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 
@@ -74,6 +76,21 @@ static int max_loop = 8;
 static struct loop_device *loop_dev;
 static struct gendisk **disks;
 
+/*
+ * Direct mode keeps track of a bio split up over several extents here
+ */
+struct loop_dio {
+	struct loop_device	*lo;
+	struct bio		*bio;
+	atomic_t		remaining;
+	int			error;
+};
+
+#define MIN_DIOS	16
+
+static kmem_cache_t *loop_dio_cache;
+static mempool_t *loop_dio_pool;
+
 /*
  * Transfer functions
  */
@@ -363,6 +380,327 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 	return ret;
 }
 
+/*
+ * Direct mode
+ *
+ * The sectors of the loop device are translated into the disk blocks of
+ * the backing file once, when the mode is switched on, and bios are then
+ * sent straight to the device holding the file from the submitter's
+ * context.  Nothing goes through the page cache of the file or waits for
+ * the loop thread, so any number of bios can be in flight, and the data
+ * is cached once, by whoever uses the loop device.
+ *
+ * This needs every block of the file to be allocated up front, which
+ * rules out sparse files, and the blocks must not move: the file is
+ * flagged S_SWAPFILE to keep it from being truncated, just like an
+ * active swap file.
+ */
+static struct loop_extent *loop_find_extent(struct loop_device *lo,
+					    sector_t sector)
+{
+	unsigned int first = 0, last = lo->lo_nr_extents;
+
+	while (first < last) {
+		unsigned int mid = (first + last) / 2;
+		struct loop_extent *ext = &lo->lo_extents[mid];
+
+		if (sector < ext->start)
+			last = mid;
+		else if (sector >= ext->start + ext->nr_sects)
+			first = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+static int loop_add_extent(struct loop_device *lo, unsigned int *max,
+			   sector_t start, sector_t nr_sects,
+			   sector_t disk_start)
+{
+	struct loop_extent *ext;
+
+	if (lo->lo_nr_extents) {
+		ext = &lo->lo_extents[lo->lo_nr_extents - 1];
+		if (ext->start + ext->nr_sects == start &&
+		    ext->disk_start + ext->nr_sects == disk_start) {
+			ext->nr_sects += nr_sects;
+			return 0;
+		}
+	}
+
+	if (lo->lo_nr_extents == *max) {
+		unsigned int new_max = *max ? *max * 2 : 16;
+
+		ext = vmalloc(new_max * sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		if (lo->lo_extents) {
+			memcpy(ext, lo->lo_extents, *max * sizeof(*ext));
+			vfree(lo->lo_extents);
+		}
+		lo->lo_extents = ext;
+		*max = new_max;
+	}
+
+	ext = &lo->lo_extents[lo->lo_nr_extents++];
+	ext->start = start;
+	ext->nr_sects = nr_sects;
+	ext->disk_start = disk_start;
+	return 0;
+}
+
+/*
+ * Build the extent list for the current offset and size.  Called with
+ * i_sem of the backing inode held.
+ */
+static int loop_map_extents(struct loop_device *lo, struct inode *inode)
+{
+	sector_t size = get_capacity(disks[lo->lo_number]);
+	unsigned blkbits = inode->i_blkbits;
+	unsigned sects_per_block = 1 << (blkbits - 9);
+	sector_t first_block, block, sector;
+	unsigned int max = 0;
+	int error;
+
+	if (S_ISBLK(inode->i_mode)) {
+		if (lo->lo_offset & 511)
+			return -EINVAL;
+		return loop_add_extent(lo, &max, 0, size, lo->lo_offset >> 9);
+	}
+
+	if (lo->lo_offset & ((1 << blkbits) - 1))
+		return -EINVAL;
+
+	first_block = lo->lo_offset >> blkbits;
+	for (sector = 0; sector < size; sector += sects_per_block) {
+		block = bmap(inode, first_block + (sector >> (blkbits - 9)));
+		if (!block) {
+			printk(KERN_ERR "loop%d: backing file has holes\n",
+			       lo->lo_number);
+			error = -EINVAL;
+			goto fail;
+		}
+		error = loop_add_extent(lo, &max, sector, sects_per_block,
+					block << (blkbits - 9));
+		if (error)
+			goto fail;
+		cond_resched();
+	}
+
+	/* the last block may run past the end of the device */
+	if (lo->lo_nr_extents)
+		lo->lo_extents[lo->lo_nr_extents - 1].nr_sects -= sector - size;
+	return 0;
+
+fail:
+	if (lo->lo_extents)
+		vfree(lo->lo_extents);
+	lo->lo_extents = NULL;
+	lo->lo_nr_extents = 0;
+	return error;
+}
+
+static int loop_direct_on(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct block_device *bdev;
+	int error;
+
+	/* transfer functions need a copy of the data to work on */
+	if (lo->lo_encryption)
+		return -EINVAL;
+
+	if (S_ISBLK(inode->i_mode))
+		bdev = I_BDEV(inode);
+	else if (!mapping->a_ops->bmap || !(bdev = inode->i_sb->s_bdev))
+		return -EINVAL;
+
+	/*
+	 * Push out what the loop device has written through the page
+	 * cache of the file, and make sure it is all on disk and allocated
+	 * before asking where it is.
+	 */
+	sync_blockdev(lo->lo_device);
+	error = filemap_write_and_wait(mapping);
+	if (error)
+		return error;
+
+	down(&inode->i_sem);
+	error = -EBUSY;
+	if (IS_SWAPFILE(inode))
+		goto out;
+	error = loop_map_extents(lo, inode);
+	if (error)
+		goto out;
+	if (S_ISREG(inode->i_mode))
+		inode->i_flags |= S_SWAPFILE;
+	invalidate_inode_pages2(mapping);
+
+	lo->lo_direct_bdev = bdev;
+	blk_queue_hardsect_size(lo->lo_queue, bdev_hardsect_size(bdev));
+	lo->lo_flags |= LO_FLAGS_DIRECT;
+out:
+	up(&inode->i_sem);
+	return error;
+}
+
+static void loop_direct_off(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT))
+		return;
+
+	sync_blockdev(lo->lo_device);
+	lo->lo_flags &= ~LO_FLAGS_DIRECT;
+
+	if (S_ISREG(inode->i_mode)) {
+		down(&inode->i_sem);
+		inode->i_flags &= ~S_SWAPFILE;
+		up(&inode->i_sem);
+	}
+	vfree(lo->lo_extents);
+	lo->lo_extents = NULL;
+	lo->lo_nr_extents = 0;
+	lo->lo_direct_bdev = NULL;
+	blk_queue_hardsect_size(lo->lo_queue, 512);
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+	struct bio *bio = dio->bio;
+	int error = dio->error;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	mempool_free(dio, loop_dio_pool);
+	bio_endio(bio, bio->bi_size, error);
+
+	if (atomic_dec_and_test(&lo->lo_pending))
+		up(&lo->lo_bh_mutex);
+}
+
+static int loop_dio_end_io(struct bio *clone, unsigned int done, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (clone->bi_size)
+		return 1;
+
+	if (!error && !bio_flagged(clone, BIO_UPTODATE))
+		error = -EIO;
+	if (error)
+		dio->error = error;
+
+	bio_put(clone);
+	loop_dio_put(dio);
+	return 0;
+}
+
+static struct bio *loop_dio_alloc(struct loop_dio *dio, struct bio *bio,
+				  struct loop_extent *ext, sector_t sector)
+{
+	struct loop_device *lo = dio->lo;
+	struct bio *clone;
+	int nr_vecs;
+
+	/* one more, as a segment may span two extents */
+	nr_vecs = min(bio->bi_vcnt - bio->bi_idx + 1, BIO_MAX_PAGES);
+	clone = bio_alloc(GFP_NOIO, nr_vecs);
+	if (!clone)
+		return NULL;
+	clone->bi_bdev = lo->lo_direct_bdev;
+	clone->bi_sector = ext->disk_start + (sector - ext->start);
+	clone->bi_rw = bio->bi_rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	return clone;
+}
+
+static void loop_dio_submit(struct loop_dio *dio, struct bio *clone)
+{
+	if (!clone)
+		return;
+	atomic_inc(&dio->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Send a bio to the backing device, as one clone per extent it covers,
+ * or more if the device cannot take that much in one go.
+ */
+static void loop_direct_request(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_extent *ext = NULL;
+	struct loop_dio *dio;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	sector_t sector = bio->bi_sector;
+	int i;
+
+	dio = mempool_alloc(loop_dio_pool, GFP_NOIO);
+	dio->lo = lo;
+	dio->bio = bio;
+	dio->error = 0;
+	atomic_set(&dio->remaining, 1);
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int offset = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			unsigned int this_len = len;
+			sector_t left;
+
+			if (!ext || sector >= ext->start + ext->nr_sects) {
+				loop_dio_submit(dio, clone);
+				clone = NULL;
+				ext = loop_find_extent(lo, sector);
+				if (!ext) {
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+			left = ext->start + ext->nr_sects - sector;
+			if (left < (this_len >> 9))
+				this_len = left << 9;
+
+			if (!clone) {
+				clone = loop_dio_alloc(dio, bio, ext, sector);
+				if (!clone) {
+					dio->error = -ENOMEM;
+					goto out;
+				}
+			}
+			if (bio_add_page(clone, bvec->bv_page, this_len, offset)
+			    < this_len) {
+				if (!clone->bi_size) {
+					bio_put(clone);
+					clone = NULL;
+					dio->error = -EIO;
+					goto out;
+				}
+				/* full, carry on in a new one */
+				loop_dio_submit(dio, clone);
+				clone = NULL;
+				continue;
+			}
+
+			offset += this_len;
+			len -= this_len;
+			sector += this_len >> 9;
+		}
+	}
+out:
+	loop_dio_submit(dio, clone);
+	loop_dio_put(dio);
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -423,7 +761,10 @@ static int loop_make_request(request_queue_t *q, struct bio *old_bio)
 		printk(KERN_ERR "loop: unknown command (%x)\n", rw);
 		goto err;
 	}
-	loop_add_bio(lo, old_bio);
+	if (lo->lo_flags & LO_FLAGS_DIRECT)
+		loop_direct_request(lo, old_bio);
+	else
+		loop_add_bio(lo, old_bio);
 	return 0;
 err:
 	if (atomic_dec_and_test(&lo->lo_pending))
@@ -793,6 +1134,9 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	if (filp == NULL)
 		return -EINVAL;
 
+	/* its flush has to get through before requests are refused */
+	loop_direct_off(lo);
+
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_state = Lo_rundown;
 	if (atomic_dec_and_test(&lo->lo_pending))
@@ -831,6 +1175,8 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 {
 	int err;
 	struct loop_func_table *xfer;
+	int direct = (info->lo_flags & LO_FLAGS_DIRECT) != 0;
+	int remap;
 
 	if (lo->lo_encrypt_key_size && lo->lo_key_owner != current->uid &&
 	    !capable(CAP_SYS_ADMIN))
@@ -840,6 +1186,20 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/*
+	 * Going in or out of direct mode, or moving the window on the file
+	 * while in it, changes where the data is cached, so nobody else may
+	 * be using the device.
+	 */
+	remap = direct != ((lo->lo_flags & LO_FLAGS_DIRECT) != 0) ||
+		(direct && (lo->lo_offset != info->lo_offset ||
+			    lo->lo_sizelimit != info->lo_sizelimit));
+	if (remap) {
+		if (lo->lo_refcnt > 1)
+			return -EBUSY;
+		loop_direct_off(lo);
+	}
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -884,8 +1244,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		memcpy(lo->lo_encrypt_key, info->lo_encrypt_key,
 		       info->lo_encrypt_key_size);
 		lo->lo_key_owner = current->uid;
-	}	
+	}
 
+	if (remap && direct)
+		return loop_direct_on(lo);
 	return 0;
 }
 
@@ -1147,8 +1509,19 @@ int __init loop_init(void)
 		max_loop = 8;
 	}
 
+	loop_dio_cache = kmem_cache_create("loop_dio", sizeof(struct loop_dio),
+					   0, 0, NULL, NULL);
+	if (!loop_dio_cache)
+		return -ENOMEM;
+	loop_dio_pool = mempool_create(MIN_DIOS, mempool_alloc_slab,
+				       mempool_free_slab, loop_dio_cache);
+	if (!loop_dio_pool) {
+		kmem_cache_destroy(loop_dio_cache);
+		return -ENOMEM;
+	}
+
 	if (register_blkdev(LOOP_MAJOR, "loop"))
-		return -EIO;
+		goto out_dio;
 
 	loop_dev = kmalloc(max_loop * sizeof(struct loop_device), GFP_KERNEL);
 	if (!loop_dev)
@@ -1209,7 +1582,14 @@ out_mem2:
 out_mem1:
 	unregister_blkdev(LOOP_MAJOR, "loop");
 	printk(KERN_ERR "loop: ran out of memory\n");
+	mempool_destroy(loop_dio_pool);
+	kmem_cache_destroy(loop_dio_cache);
 	return -ENOMEM;
+
+out_dio:
+	mempool_destroy(loop_dio_pool);
+	kmem_cache_destroy(loop_dio_cache);
+	return -EIO;
 }
 
 void loop_exit(void)
@@ -1227,6 +1607,8 @@ void loop_exit(void)
 
 	kfree(disks);
 	kfree(loop_dev);
+	mempool_destroy(loop_dio_pool);
+	kmem_cache_destroy(loop_dio_cache);
 }
 
 module_init(loop_init);
@@ -0,0 +1,591 @@
+/*
+ * Null block device
+ *
+ * Completes every request without moving any data, so the cost of the
+ * block layer itself can be measured. Requests can be taken straight
+ * from ->make_request_fn(), from a classic request_fn queue behind an
+ * elevator, or from the multi-queue block layer. See
+ * Documentation/block/null_blk.txt for the module options.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/genhd.h>
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
+#include <linux/timer.h>
+#include <linux/wait.h>
+
+struct nullb_cmd {
+	struct list_head list;
+	struct request *rq;
+	struct bio *bio;
+	unsigned int tag;
+	unsigned long deadline;		/* irqmode timer */
+	struct nullb_queue *nq;
+};
+
+struct nullb_queue {
+	unsigned long *tag_map;
+	wait_queue_head_t wait;
+	unsigned int queue_depth;
+
+	struct nullb_cmd *cmds;
+};
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	request_queue_t *q;
+	struct gendisk *disk;
+	spinlock_t lock;
+
+	struct nullb_queue *queues;
+	unsigned int nr_queues;
+};
+
+/*
+ * Per-CPU queue of commands waiting for their completion "interrupt"
+ */
+struct completion_queue {
+	struct list_head list;
+	struct tasklet_struct tasklet;
+	struct timer_list timer;
+};
+
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static DECLARE_MUTEX(nullb_sem);
+static int null_major;
+static int nullb_indexes;
+
+enum {
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+	NULL_IRQ_TIMER		= 2,
+};
+
+enum {
+	NULL_Q_BIO		= 0,
+	NULL_Q_RQ		= 1,
+	NULL_Q_MQ		= 2,
+};
+
+static int submit_queues = 1;
+module_param(submit_queues, int, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of submission queues");
+
+static int queue_mode = NULL_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface to use (0=bio,1=rq,2=multiqueue)");
+
+static int gb = 250;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size in GB");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Block size (in bytes)");
+
+static int nr_devices = 2;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "IRQ completion handler. 0-none, 1-softirq, 2-timer");
+
+static int completion_nsec = 10000;
+module_param(completion_nsec, int, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Time in ns to complete a request in hardware. Default: 10,000ns");
+
+static int hw_queue_depth = 64;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue. Default: 64");
+
+/* completion_nsec, rounded up to whole jiffies */
+static unsigned long completion_jiffies;
+
+static void put_tag(struct nullb_queue *nq, unsigned int tag)
+{
+	clear_bit(tag, nq->tag_map);
+	smp_mb__after_clear_bit();
+
+	if (waitqueue_active(&nq->wait))
+		wake_up(&nq->wait);
+}
+
+static unsigned int get_tag(struct nullb_queue *nq)
+{
+	unsigned int tag;
+
+	do {
+		tag = find_first_zero_bit(nq->tag_map, nq->queue_depth);
+		if (tag >= nq->queue_depth)
+			return -1U;
+	} while (test_and_set_bit(tag, nq->tag_map));
+
+	return tag;
+}
+
+static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
+{
+	struct nullb_cmd *cmd;
+	unsigned int tag;
+
+	tag = get_tag(nq);
+	if (tag == -1U)
+		return NULL;
+
+	cmd = &nq->cmds[tag];
+	cmd->tag = tag;
+	cmd->nq = nq;
+	return cmd;
+}
+
+static struct nullb_cmd *alloc_cmd(struct nullb_queue *nq, int can_wait)
+{
+	struct nullb_cmd *cmd;
+	DEFINE_WAIT(wait);
+
+	cmd = __alloc_cmd(nq);
+	while (!cmd && can_wait) {
+		prepare_to_wait(&nq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		cmd = __alloc_cmd(nq);
+		if (!cmd)
+			io_schedule();
+		finish_wait(&nq->wait, &wait);
+	}
+
+	return cmd;
+}
+
+static void end_cmd(struct nullb_cmd *cmd)
+{
+	request_queue_t *q;
+	unsigned long flags;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		blk_mq_complete_request(cmd->rq, 0);
+		return;
+	case NULL_Q_RQ:
+		q = cmd->rq->q;
+		spin_lock_irqsave(q->queue_lock, flags);
+		end_that_request_first(cmd->rq, 1, cmd->rq->hard_nr_sectors);
+		end_that_request_last(cmd->rq);
+		put_tag(cmd->nq, cmd->tag);
+		/* null_request_fn() stopped the queue when it ran out */
+		if (blk_queue_stopped(q))
+			blk_start_queue(q);
+		spin_unlock_irqrestore(q->queue_lock, flags);
+		return;
+	case NULL_Q_BIO:
+		bio_endio(cmd->bio, cmd->bio->bi_size, 0);
+		put_tag(cmd->nq, cmd->tag);
+		return;
+	}
+}
+
+static void null_complete_list(struct completion_queue *cq)
+{
+	struct nullb_cmd *cmd;
+	LIST_HEAD(list);
+
+	local_irq_disable();
+	list_splice_init(&cq->list, &list);
+	local_irq_enable();
+
+	while (!list_empty(&list)) {
+		cmd = list_entry(list.next, struct nullb_cmd, list);
+		list_del_init(&cmd->list);
+		end_cmd(cmd);
+	}
+}
+
+static void null_softirq_done_fn(unsigned long data)
+{
+	null_complete_list((struct completion_queue *) data);
+}
+
+/*
+ * Commands are queued with the same delay, so the list is in deadline
+ * order: complete the expired head, and come back for the rest.
+ */
+static void null_cmd_timer_expired(unsigned long data)
+{
+	struct completion_queue *cq = (struct completion_queue *) data;
+	struct nullb_cmd *cmd;
+	LIST_HEAD(list);
+
+	local_irq_disable();
+	while (!list_empty(&cq->list)) {
+		cmd = list_entry(cq->list.next, struct nullb_cmd, list);
+		if (time_before(jiffies, cmd->deadline)) {
+			mod_timer(&cq->timer, cmd->deadline);
+			break;
+		}
+		list_move_tail(&cmd->list, &list);
+	}
+	local_irq_enable();
+
+	while (!list_empty(&list)) {
+		cmd = list_entry(list.next, struct nullb_cmd, list);
+		list_del_init(&cmd->list);
+		end_cmd(cmd);
+	}
+}
+
+static void null_handle_cmd(struct nullb_cmd *cmd)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+
+	switch (irqmode) {
+	case NULL_IRQ_NONE:
+		end_cmd(cmd);
+		break;
+	case NULL_IRQ_SOFTIRQ:
+		local_irq_save(flags);
+		cq = &__get_cpu_var(completion_queues);
+		list_add_tail(&cmd->list, &cq->list);
+		tasklet_schedule(&cq->tasklet);
+		local_irq_restore(flags);
+		break;
+	case NULL_IRQ_TIMER:
+		local_irq_save(flags);
+		cq = &__get_cpu_var(completion_queues);
+		cmd->deadline = jiffies + completion_jiffies;
+		list_add_tail(&cmd->list, &cq->list);
+		if (!timer_pending(&cq->timer))
+			mod_timer(&cq->timer, cmd->deadline);
+		local_irq_restore(flags);
+		break;
+	}
+}
+
+static struct nullb_queue *nullb_to_queue(struct nullb *nullb)
+{
+	/* only a hint, it does not matter if we get moved */
+	return &nullb->queues[_smp_processor_id() % nullb->nr_queues];
+}
+
+static int null_queue_bio(request_queue_t *q, struct bio *bio)
+{
+	struct nullb *nullb = q->queuedata;
+	struct nullb_queue *nq;
+	struct nullb_cmd *cmd;
+
+	nq = nullb_to_queue(nullb);
+	cmd = alloc_cmd(nq, 1);
+	cmd->bio = bio;
+
+	null_handle_cmd(cmd);
+	return 0;
+}
+
+/*
+ * Called with the queue_lock held and interrupts off
+ */
+static void null_request_fn(request_queue_t *q)
+{
+	struct nullb *nullb = q->queuedata;
+	struct nullb_queue *nq;
+	struct nullb_cmd *cmd;
+	struct request *rq;
+
+	while ((rq = elv_next_request(q)) != NULL) {
+		nq = nullb_to_queue(nullb);
+		cmd = alloc_cmd(nq, 0);
+		if (!cmd) {
+			/* end_cmd() restarts us */
+			blk_stop_queue(q);
+			break;
+		}
+
+		blkdev_dequeue_request(rq);
+		cmd->rq = rq;
+
+		spin_unlock_irq(q->queue_lock);
+		null_handle_cmd(cmd);
+		spin_lock_irq(q->queue_lock);
+	}
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct nullb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->rq = rq;
+	cmd->nq = hctx->driver_data;
+
+	null_handle_cmd(cmd);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static int null_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int index)
+{
+	struct nullb *nullb = data;
+
+	hctx->driver_data = &nullb->queues[index];
+	return 0;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+	.init_hctx	= null_init_hctx,
+};
+
+static struct block_device_operations null_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static void cleanup_queues(struct nullb *nullb)
+{
+	struct nullb_queue *nq;
+	unsigned int i;
+
+	if (!nullb->queues)
+		return;
+
+	for (i = 0; i < nullb->nr_queues; i++) {
+		nq = &nullb->queues[i];
+		kfree(nq->tag_map);
+		kfree(nq->cmds);
+	}
+	kfree(nullb->queues);
+}
+
+/*
+ * The multi-queue layer has its own tags and command space: the queues
+ * only need the per-command storage for the other two modes.
+ */
+static int setup_queues(struct nullb *nullb)
+{
+	struct nullb_queue *nq;
+	unsigned int i, size;
+
+	size = submit_queues * sizeof(struct nullb_queue);
+	nullb->queues = kmalloc(size, GFP_KERNEL);
+	if (!nullb->queues)
+		return -ENOMEM;
+	memset(nullb->queues, 0, size);
+	nullb->nr_queues = submit_queues;
+
+	for (i = 0; i < nullb->nr_queues; i++) {
+		nq = &nullb->queues[i];
+		init_waitqueue_head(&nq->wait);
+		nq->queue_depth = hw_queue_depth;
+
+		if (queue_mode == NULL_Q_MQ)
+			continue;
+
+		size = nq->queue_depth * sizeof(struct nullb_cmd);
+		nq->cmds = kmalloc(size, GFP_KERNEL);
+		if (!nq->cmds)
+			goto fail;
+		memset(nq->cmds, 0, size);
+
+		size = BITS_TO_LONGS(nq->queue_depth) * sizeof(unsigned long);
+		nq->tag_map = kmalloc(size, GFP_KERNEL);
+		if (!nq->tag_map)
+			goto fail;
+		memset(nq->tag_map, 0, size);
+	}
+
+	return 0;
+
+fail:
+	cleanup_queues(nullb);
+	nullb->queues = NULL;
+	return -ENOMEM;
+}
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del_init(&nullb->list);
+
+	del_gendisk(nullb->disk);
+	put_disk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	cleanup_queues(nullb);
+	kfree(nullb);
+}
+
+static int null_add_dev(void)
+{
+	struct blk_mq_reg reg;
+	struct gendisk *disk;
+	struct nullb *nullb;
+
+	nullb = kmalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		return -ENOMEM;
+	memset(nullb, 0, sizeof(*nullb));
+	spin_lock_init(&nullb->lock);
+
+	if (setup_queues(nullb))
+		goto out_free;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		memset(&reg, 0, sizeof(reg));
+		reg.ops = &null_mq_ops;
+		reg.nr_hw_queues = submit_queues;
+		reg.queue_depth = hw_queue_depth;
+		reg.cmd_size = sizeof(struct nullb_cmd);
+		reg.flags = BLK_MQ_F_SAME_CPU;
+		nullb->q = blk_mq_init_queue(&reg, nullb);
+		break;
+	case NULL_Q_BIO:
+		nullb->q = blk_alloc_queue(GFP_KERNEL);
+		if (nullb->q)
+			blk_queue_make_request(nullb->q, null_queue_bio);
+		break;
+	case NULL_Q_RQ:
+		nullb->q = blk_init_queue(null_request_fn, &nullb->lock);
+		break;
+	}
+
+	if (!nullb->q)
+		goto out_cleanup_queues;
+
+	nullb->q->queuedata = nullb;
+	blk_queue_hardsect_size(nullb->q, bs);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto out_cleanup_blk_queue;
+
+	down(&nullb_sem);
+	nullb->index = nullb_indexes++;
+	list_add_tail(&nullb->list, &nullb_list);
+	up(&nullb_sem);
+
+	/* in sectors: bytes would overflow a 32-bit sector_t */
+	set_capacity(disk, (sector_t) gb * 1024 * 1024 * 2);
+
+	disk->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
+	disk->major = null_major;
+	disk->first_minor = nullb->index;
+	disk->fops = &null_fops;
+	disk->private_data = nullb;
+	disk->queue = nullb->q;
+	sprintf(disk->disk_name, "nullb%d", nullb->index);
+	sprintf(disk->devfs_name, "nullb/%d", nullb->index);
+	add_disk(disk);
+	return 0;
+
+out_cleanup_blk_queue:
+	blk_cleanup_queue(nullb->q);
+out_cleanup_queues:
+	cleanup_queues(nullb);
+out_free:
+	kfree(nullb);
+	return -ENOMEM;
+}
+
+static void null_cleanup_devs(void)
+{
+	struct nullb *nullb;
+
+	down(&nullb_sem);
+	while (!list_empty(&nullb_list)) {
+		nullb = list_entry(nullb_list.next, struct nullb, list);
+		null_del_dev(nullb);
+	}
+	up(&nullb_sem);
+}
+
+static int __init null_init(void)
+{
+	struct completion_queue *cq;
+	unsigned int i;
+
+	if (bs > PAGE_SIZE || bs < 512 || (bs & (bs - 1))) {
+		printk(KERN_WARNING "null_blk: invalid block size %d\n", bs);
+		bs = 512;
+	}
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ) {
+		printk(KERN_WARNING "null_blk: invalid queue_mode %d\n",
+		       queue_mode);
+		queue_mode = NULL_Q_MQ;
+	}
+
+	if (irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_TIMER) {
+		printk(KERN_WARNING "null_blk: invalid irqmode %d\n", irqmode);
+		irqmode = NULL_IRQ_SOFTIRQ;
+	}
+
+	if (submit_queues < 1)
+		submit_queues = 1;
+	else if (submit_queues > num_possible_cpus())
+		submit_queues = num_possible_cpus();
+
+	if (hw_queue_depth < 1)
+		hw_queue_depth = 1;
+	else if (hw_queue_depth > BLK_MQ_MAX_DEPTH)
+		hw_queue_depth = BLK_MQ_MAX_DEPTH;
+
+	/* there are no sub-jiffy timers: at least one tick */
+	if (completion_nsec < 0)
+		completion_nsec = 0;
+	completion_jiffies = (completion_nsec + (NSEC_PER_SEC / HZ) - 1) /
+			     (NSEC_PER_SEC / HZ);
+	if (!completion_jiffies)
+		completion_jiffies = 1;
+
+	for_each_cpu(i) {
+		cq = &per_cpu(completion_queues, i);
+		INIT_LIST_HEAD(&cq->list);
+		tasklet_init(&cq->tasklet, null_softirq_done_fn,
+			     (unsigned long) cq);
+		init_timer(&cq->timer);
+		cq->timer.function = null_cmd_timer_expired;
+		cq->timer.data = (unsigned long) cq;
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (null_add_dev()) {
+			null_cleanup_devs();
+			unregister_blkdev(null_major, "nullb");
+			return -EINVAL;
+		}
+	}
+
+	printk(KERN_INFO "null: module loaded\n");
+	return 0;
+}
+
+static void __exit null_exit(void)
+{
+	struct completion_queue *cq;
+	int i;
+
+	null_cleanup_devs();
+	unregister_blkdev(null_major, "nullb");
+
+	for_each_cpu(i) {
+		cq = &per_cpu(completion_queues, i);
+		del_timer_sync(&cq->timer);
+		tasklet_kill(&cq->tasklet);
+	}
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
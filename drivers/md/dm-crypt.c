@@ -14,6 +14,7 @@
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <asm/atomic.h>
 #include <asm/scatterlist.h>
 #include <asm/page.h>
@@ -23,16 +24,15 @@
 #define PFX	"crypt: "
 
 /*
- * per bio private data
+ * Conversions are split into at most MAX_JOBS jobs of at least
+ * MIN_JOB_SECTORS sectors, which run on the kcryptd threads of
+ * different cpus.
  */
-struct crypt_io {
-	struct dm_target *target;
-	struct bio *bio;
-	struct bio *first_clone;
-	struct work_struct work;
-	atomic_t pending;
-	int error;
-};
+#define MAX_JOBS	4
+#define MIN_JOB_SECTORS	64
+
+/* scatterlist entries handed to the cipher in one call */
+#define SG_BATCH	8
 
 /*
  * context holding the current state of a multi-part conversion
@@ -48,6 +48,38 @@ struct convert_context {
 	int write;
 };
 
+struct crypt_io;
+
+/*
+ * one slice of a conversion
+ */
+struct crypt_job {
+	struct work_struct work;
+	struct crypt_io *io;
+	struct convert_context ctx;
+	unsigned int sectors;
+};
+
+/*
+ * per bio private data
+ */
+struct crypt_io {
+	struct dm_target *target;
+	struct bio *bio;
+	struct bio *first_clone;
+	atomic_t pending;
+	int error;
+
+	/*
+	 * a write waits for all jobs of a buffer before submitting it,
+	 * a read drops one 'pending' reference per job instead
+	 */
+	atomic_t jobs_pending;
+	int jobs_error;
+	struct completion jobs_done;
+	struct crypt_job jobs[MAX_JOBS];
+};
+
 struct crypt_config;
 
 struct crypt_iv_operations {
@@ -274,51 +306,146 @@ crypt_convert_init(struct crypt_config *cc, struct convert_context *ctx,
 }
 
 /*
- * Encrypt / decrypt data from one bio to another one (can be the same one)
+ * Move the context on by one sector
  */
-static int crypt_convert(struct crypt_config *cc,
-                         struct convert_context *ctx)
+static inline void crypt_convert_advance(struct convert_context *ctx)
 {
-	int r = 0;
+	struct bio_vec *bv_in = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
+	struct bio_vec *bv_out = bio_iovec_idx(ctx->bio_out, ctx->idx_out);
 
-	while(ctx->idx_in < ctx->bio_in->bi_vcnt &&
-	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
-		struct bio_vec *bv_in = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
-		struct bio_vec *bv_out = bio_iovec_idx(ctx->bio_out, ctx->idx_out);
-		struct scatterlist sg_in = {
-			.page = bv_in->bv_page,
-			.offset = bv_in->bv_offset + ctx->offset_in,
-			.length = 1 << SECTOR_SHIFT
-		};
-		struct scatterlist sg_out = {
-			.page = bv_out->bv_page,
-			.offset = bv_out->bv_offset + ctx->offset_out,
-			.length = 1 << SECTOR_SHIFT
-		};
-
-		ctx->offset_in += sg_in.length;
-		if (ctx->offset_in >= bv_in->bv_len) {
-			ctx->offset_in = 0;
-			ctx->idx_in++;
-		}
+	ctx->offset_in += 1 << SECTOR_SHIFT;
+	if (ctx->offset_in >= bv_in->bv_len) {
+		ctx->offset_in = 0;
+		ctx->idx_in++;
+	}
 
-		ctx->offset_out += sg_out.length;
-		if (ctx->offset_out >= bv_out->bv_len) {
-			ctx->offset_out = 0;
-			ctx->idx_out++;
-		}
+	ctx->offset_out += 1 << SECTOR_SHIFT;
+	if (ctx->offset_out >= bv_out->bv_len) {
+		ctx->offset_out = 0;
+		ctx->idx_out++;
+	}
+
+	ctx->sector++;
+}
+
+static unsigned int bio_sectors_left(struct bio *bio, unsigned int idx,
+                                     unsigned int offset)
+{
+	unsigned int bytes = 0;
+
+	if (idx >= bio->bi_vcnt)
+		return 0;
+
+	for(; idx < bio->bi_vcnt; idx++)
+		bytes += bio_iovec_idx(bio, idx)->bv_len;
+
+	return (bytes - offset) >> SECTOR_SHIFT;
+}
 
-		r = crypt_convert_scatterlist(cc, &sg_out, &sg_in, sg_in.length,
-		                              ctx->write, ctx->sector);
+/*
+ * Number of sectors left to convert
+ */
+static unsigned int crypt_convert_count(struct convert_context *ctx)
+{
+	return min(bio_sectors_left(ctx->bio_in, ctx->idx_in, ctx->offset_in),
+	           bio_sectors_left(ctx->bio_out, ctx->idx_out,
+	                            ctx->offset_out));
+}
+
+/*
+ * Encrypt / decrypt up to @sectors sectors from one bio to another one
+ * (can be the same one).
+ *
+ * With an IV every sector is a chain of its own and needs a cipher call
+ * of its own.  Without one, runs of sectors are collected into
+ * scatterlists and converted with a single call.
+ */
+static int crypt_convert_sectors(struct crypt_config *cc,
+                                 struct convert_context *ctx,
+                                 unsigned int sectors)
+{
+	struct scatterlist sg_in[SG_BATCH], sg_out[SG_BATCH];
+	int r = 0;
+
+	while(sectors && ctx->idx_in < ctx->bio_in->bi_vcnt &&
+	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
+		sector_t sector = ctx->sector;
+		unsigned int length = 0;
+		int n = 0;
+
+		do {
+			struct bio_vec *bv_in = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
+			struct bio_vec *bv_out = bio_iovec_idx(ctx->bio_out, ctx->idx_out);
+			unsigned int offset_in = bv_in->bv_offset + ctx->offset_in;
+			unsigned int offset_out = bv_out->bv_offset + ctx->offset_out;
+
+			if (n && sg_in[n - 1].page == bv_in->bv_page &&
+			    sg_in[n - 1].offset + sg_in[n - 1].length == offset_in &&
+			    sg_out[n - 1].page == bv_out->bv_page &&
+			    sg_out[n - 1].offset + sg_out[n - 1].length == offset_out) {
+				sg_in[n - 1].length += 1 << SECTOR_SHIFT;
+				sg_out[n - 1].length += 1 << SECTOR_SHIFT;
+			} else if (n < SG_BATCH) {
+				sg_in[n].page = bv_in->bv_page;
+				sg_in[n].offset = offset_in;
+				sg_in[n].length = 1 << SECTOR_SHIFT;
+				sg_out[n].page = bv_out->bv_page;
+				sg_out[n].offset = offset_out;
+				sg_out[n].length = 1 << SECTOR_SHIFT;
+				n++;
+			} else
+				break;
+
+			length += 1 << SECTOR_SHIFT;
+			crypt_convert_advance(ctx);
+			sectors--;
+		} while (!cc->iv_gen_ops && sectors &&
+		         ctx->idx_in < ctx->bio_in->bi_vcnt &&
+		         ctx->idx_out < ctx->bio_out->bi_vcnt);
+
+		r = crypt_convert_scatterlist(cc, sg_out, sg_in, length,
+		                              ctx->write, sector);
 		if (r < 0)
 			break;
-
-		ctx->sector++;
 	}
 
 	return r;
 }
 
+/*
+ * Cut the rest of a conversion into jobs for the io, and move the
+ * context past all of it.  Returns the number of jobs.
+ */
+static int crypt_split_jobs(struct crypt_io *io, struct convert_context *ctx)
+{
+	unsigned int total = crypt_convert_count(ctx);
+	unsigned int njobs = num_online_cpus();
+	unsigned int per_job, i;
+
+	if (njobs > MAX_JOBS)
+		njobs = MAX_JOBS;
+	if (njobs > total / MIN_JOB_SECTORS)
+		njobs = total / MIN_JOB_SECTORS;
+	if (!njobs)
+		njobs = 1;
+	per_job = (total + njobs - 1) / njobs;
+
+	for(i = 0; i < njobs; i++) {
+		struct crypt_job *job = io->jobs + i;
+		unsigned int n;
+
+		job->io = io;
+		job->ctx = *ctx;
+		job->sectors = min(per_job, total);
+
+		for(n = job->sectors; n; n--)
+			crypt_convert_advance(ctx);
+		total -= job->sectors;
+	}
+
+	return njobs;
+}
+
 /*
  * Generate a new unfragmented bio with the given size
  * This should never violate the device limitations
@@ -464,28 +591,95 @@ static void dec_pending(struct crypt_io *io, int error)
  *
  * Needed because it would be very unwise to do decryption in an
  * interrupt context, so bios returning from read requests get
- * queued here.
+ * queued here.  There is one thread per cpu, and jobs are dealt out to
+ * them in turn, so that the cipher work of a busy target is not stuck
+ * on whichever cpu takes the disk interrupts.
  */
 static struct workqueue_struct *_kcryptd_workqueue;
 
+static void crypt_job_done(struct crypt_io *io, int error)
+{
+	if (bio_data_dir(io->bio) == READ) {
+		dec_pending(io, error);
+		return;
+	}
+
+	if (error < 0)
+		io->jobs_error = error;
+	if (atomic_dec_and_test(&io->jobs_pending))
+		complete(&io->jobs_done);
+}
+
 static void kcryptd_do_work(void *data)
 {
-	struct crypt_io *io = (struct crypt_io *) data;
+	struct crypt_job *job = (struct crypt_job *) data;
+	struct crypt_io *io = job->io;
+	struct crypt_config *cc = (struct crypt_config *) io->target->private;
+
+	crypt_job_done(io, crypt_convert_sectors(cc, &job->ctx, job->sectors));
+}
+
+static void kcryptd_queue_job(struct crypt_job *job)
+{
+	static int last_cpu = -1;
+	int cpu;
+
+	INIT_WORK(&job->work, kcryptd_do_work, job);
+
+	/* no cpu can go away while preemption is off */
+	preempt_disable();
+	cpu = next_cpu(last_cpu, cpu_online_map);
+	if (cpu >= NR_CPUS)
+		cpu = first_cpu(cpu_online_map);
+	last_cpu = cpu;
+	queue_work_on(cpu, _kcryptd_workqueue, &job->work);
+	preempt_enable();
+}
+
+static void kcryptd_queue_io(struct crypt_io *io)
+{
 	struct crypt_config *cc = (struct crypt_config *) io->target->private;
 	struct convert_context ctx;
-	int r;
+	int i, njobs;
 
 	crypt_convert_init(cc, &ctx, io->bio, io->bio,
 	                   io->bio->bi_sector - io->target->begin, 0);
-	r = crypt_convert(cc, &ctx);
+	njobs = crypt_split_jobs(io, &ctx);
 
-	dec_pending(io, r);
+	/* the reference of the finished clone goes to the first job */
+	atomic_add(njobs - 1, &io->pending);
+	for(i = 0; i < njobs; i++)
+		kcryptd_queue_job(io->jobs + i);
 }
 
-static void kcryptd_queue_io(struct crypt_io *io)
+/*
+ * Encrypt the next buffer of a write.  The submitter does the first job
+ * itself and waits for the rest, so the buffers of a bio are still sent
+ * down one after the other and in order.
+ */
+static int crypt_convert_write(struct crypt_config *cc, struct crypt_io *io,
+                               struct convert_context *ctx)
 {
-	INIT_WORK(&io->work, kcryptd_do_work, io);
-	queue_work(_kcryptd_workqueue, &io->work);
+	int njobs = crypt_split_jobs(io, ctx);
+	int i, r;
+
+	if (njobs > 1) {
+		io->jobs_error = 0;
+		atomic_set(&io->jobs_pending, njobs - 1);
+		init_completion(&io->jobs_done);
+		for(i = 1; i < njobs; i++)
+			kcryptd_queue_job(io->jobs + i);
+	}
+
+	r = crypt_convert_sectors(cc, &io->jobs[0].ctx, io->jobs[0].sectors);
+
+	if (njobs > 1) {
+		wait_for_completion(&io->jobs_done);
+		if (r >= 0)
+			r = io->jobs_error;
+	}
+
+	return r;
 }
 
 /*
@@ -765,7 +959,7 @@ crypt_clone(struct crypt_config *cc, struct crypt_io *io, struct bio *bio,
                                  io->first_clone, bvec_idx);
 		if (clone) {
 			ctx->bio_out = clone;
-			if (crypt_convert(cc, ctx) < 0) {
+			if (crypt_convert_write(cc, io, ctx) < 0) {
 				crypt_free_buffer_pages(cc, clone,
 				                        clone->bi_size);
 				bio_put(clone);
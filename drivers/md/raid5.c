@@ -22,13 +22,20 @@
 #include <linux/raid/raid5.h>
 #include <linux/highmem.h>
 #include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
 /*
  * Stripe cache
+ *
+ * NR_STRIPES is only the initial size, it can be changed at run time
+ * through /sys/block/mdX/raid5/stripe_cache_size.
  */
 
 #define NR_STRIPES		256
+#define MIN_NR_STRIPES		16
+#define MAX_NR_STRIPES		32768
 #define STRIPE_SIZE		PAGE_SIZE
 #define STRIPE_SHIFT		(PAGE_SHIFT - 9)
 #define STRIPE_SECTORS		(STRIPE_SIZE>>9)
@@ -67,6 +74,15 @@
 #define __inline__
 #endif
 
+#define RAID5_STAT_ADD(conf, field, n)					\
+	do {								\
+		per_cpu_ptr((conf)->percpu, get_cpu())->field += (n);	\
+		put_cpu();						\
+	} while (0)
+
+/* per-cpu threads that share the stripe handling of all arrays */
+static struct workqueue_struct *raid5_wq;
+
 static void print_raid5_conf (raid5_conf_t *conf);
 
 static inline void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
@@ -91,7 +107,7 @@ static inline void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 			list_add_tail(&sh->lru, &conf->inactive_list);
 			atomic_dec(&conf->active_stripes);
 			if (!conf->inactive_blocked ||
-			    atomic_read(&conf->active_stripes) < (NR_STRIPES*3/4))
+			    atomic_read(&conf->active_stripes) < (conf->max_nr_stripes*3/4))
 				wake_up(&conf->wait_for_stripe);
 		}
 	}
@@ -254,7 +270,7 @@ static struct stripe_head *get_active_stripe(raid5_conf_t *conf, sector_t sector
 				conf->inactive_blocked = 1;
 				wait_event_lock_irq(conf->wait_for_stripe,
 						    !list_empty(&conf->inactive_list) &&
-						    (atomic_read(&conf->active_stripes) < (NR_STRIPES *3/4)
+						    (atomic_read(&conf->active_stripes) < (conf->max_nr_stripes *3/4)
 						     || !conf->inactive_blocked),
 						    conf->device_lock,
 						    unplug_slaves(conf->mddev);
@@ -283,9 +299,33 @@ static struct stripe_head *get_active_stripe(raid5_conf_t *conf, sector_t sector
 	return sh;
 }
 
-static int grow_stripes(raid5_conf_t *conf, int num)
+static int grow_one_stripe(raid5_conf_t *conf)
 {
 	struct stripe_head *sh;
+	int devs = conf->raid_disks;
+
+	sh = kmem_cache_alloc(conf->slab_cache, GFP_KERNEL);
+	if (!sh)
+		return 0;
+	memset(sh, 0, sizeof(*sh) + (devs-1)*sizeof(struct r5dev));
+	sh->raid_conf = conf;
+	spin_lock_init(&sh->lock);
+
+	if (grow_buffers(sh, devs)) {
+		shrink_buffers(sh, devs);
+		kmem_cache_free(conf->slab_cache, sh);
+		return 0;
+	}
+	/* we just created an active stripe so... */
+	atomic_set(&sh->count, 1);
+	atomic_inc(&conf->active_stripes);
+	INIT_LIST_HEAD(&sh->lru);
+	release_stripe(sh);
+	return 1;
+}
+
+static int grow_stripes(raid5_conf_t *conf, int num)
+{
 	kmem_cache_t *sc;
 	int devs = conf->raid_disks;
 
@@ -297,48 +337,64 @@ static int grow_stripes(raid5_conf_t *conf, int num)
 	if (!sc)
 		return 1;
 	conf->slab_cache = sc;
-	while (num--) {
-		sh = kmem_cache_alloc(sc, GFP_KERNEL);
-		if (!sh)
-			return 1;
-		memset(sh, 0, sizeof(*sh) + (devs-1)*sizeof(struct r5dev));
-		sh->raid_conf = conf;
-		spin_lock_init(&sh->lock);
-
-		if (grow_buffers(sh, conf->raid_disks)) {
-			shrink_buffers(sh, conf->raid_disks);
-			kmem_cache_free(sc, sh);
+	while (num--)
+		if (!grow_one_stripe(conf))
 			return 1;
-		}
-		/* we just created an active stripe so... */
-		atomic_set(&sh->count, 1);
-		atomic_inc(&conf->active_stripes);
-		INIT_LIST_HEAD(&sh->lru);
-		release_stripe(sh);
-	}
 	return 0;
 }
 
-static void shrink_stripes(raid5_conf_t *conf)
+/*
+ * Free one inactive stripe.  Returns 0 if every stripe is in use.
+ */
+static int drop_one_stripe(raid5_conf_t *conf)
 {
 	struct stripe_head *sh;
 
-	while (1) {
-		spin_lock_irq(&conf->device_lock);
-		sh = get_free_stripe(conf);
-		spin_unlock_irq(&conf->device_lock);
-		if (!sh)
-			break;
-		if (atomic_read(&sh->count))
-			BUG();
-		shrink_buffers(sh, conf->raid_disks);
-		kmem_cache_free(conf->slab_cache, sh);
-		atomic_dec(&conf->active_stripes);
-	}
+	spin_lock_irq(&conf->device_lock);
+	sh = get_free_stripe(conf);
+	spin_unlock_irq(&conf->device_lock);
+	if (!sh)
+		return 0;
+	if (atomic_read(&sh->count))
+		BUG();
+	shrink_buffers(sh, conf->raid_disks);
+	kmem_cache_free(conf->slab_cache, sh);
+	atomic_dec(&conf->active_stripes);
+	return 1;
+}
+
+static void shrink_stripes(raid5_conf_t *conf)
+{
+	while (drop_one_stripe(conf))
+		;
+
 	kmem_cache_destroy(conf->slab_cache);
 	conf->slab_cache = NULL;
 }
 
+/*
+ * Resize the stripe cache of a running array.  Stripes in use cannot be
+ * taken away, so shrinking stops early with -EBUSY when the inactive list
+ * runs dry; max_nr_stripes always tells how many stripes there really are.
+ */
+static int raid5_set_cache_size(raid5_conf_t *conf, int size)
+{
+	if (size < MIN_NR_STRIPES || size > MAX_NR_STRIPES)
+		return -EINVAL;
+
+	while (size < conf->max_nr_stripes) {
+		if (!drop_one_stripe(conf))
+			return -EBUSY;
+		conf->max_nr_stripes--;
+	}
+	while (size > conf->max_nr_stripes) {
+		if (!grow_one_stripe(conf))
+			return -ENOMEM;
+		conf->max_nr_stripes++;
+	}
+	return 0;
+}
+
 static int raid5_end_read_request (struct bio * bi, unsigned int bytes_done,
 				   int error)
 {
@@ -888,8 +944,11 @@ static void handle_stripe(struct stripe_head *sh)
 	int locked=0, uptodate=0, to_read=0, to_write=0, failed=0, written=0;
 	int non_overwrite = 0;
 	int failed_num=0;
+	int reads=0, writes=0;
 	struct r5dev *dev;
 
+	RAID5_STAT_ADD(conf, handled, 1);
+
 	PRINTK("handling stripe %llu, cnt=%d, pd_idx=%d\n",
 		(unsigned long long)sh->sector, atomic_read(&sh->count),
 		sh->pd_idx);
@@ -1105,7 +1164,13 @@ static void handle_stripe(struct stripe_head *sh)
 	/* now to consider writing and what else, if anything should be read */
 	if (to_write) {
 		int rmw=0, rcw=0;
-		for (i=disks ; i--;) {
+		/* Every data block of the stripe is being overwritten: the
+		 * parity can be built from the new data alone, so there is
+		 * nothing to read and no reason to wait for more writes.
+		 */
+		int full_stripe = (to_write == disks-1 && !non_overwrite);
+
+		for (i=disks ; !full_stripe && i--;) {
 			/* would I have to read this buffer for read_modify_write */
 			dev = &sh->dev[i];
 			if ((dev->towrite || i == sh->pd_idx) &&
@@ -1177,6 +1242,12 @@ static void handle_stripe(struct stripe_head *sh)
 		/* now if nothing is locked, and if we have enough data, we can start a write request */
 		if (locked == 0 && (rcw == 0 ||rmw == 0)) {
 			PRINTK("Computing parity...\n");
+			if (full_stripe)
+				RAID5_STAT_ADD(conf, full_stripe_writes, 1);
+			else if (rcw == 0)
+				RAID5_STAT_ADD(conf, rcw, 1);
+			else
+				RAID5_STAT_ADD(conf, rmw, 1);
 			compute_parity(sh, rcw==0 ? RECONSTRUCT_WRITE : READ_MODIFY_WRITE);
 			/* now every locked buffer is ready to be written */
 			for (i=disks; i--;)
@@ -1255,11 +1326,13 @@ static void handle_stripe(struct stripe_head *sh)
 		int rw;
 		struct bio *bi;
 		mdk_rdev_t *rdev;
-		if (test_and_clear_bit(R5_Wantwrite, &sh->dev[i].flags))
+		if (test_and_clear_bit(R5_Wantwrite, &sh->dev[i].flags)) {
 			rw = 1;
-		else if (test_and_clear_bit(R5_Wantread, &sh->dev[i].flags))
+			writes++;
+		} else if (test_and_clear_bit(R5_Wantread, &sh->dev[i].flags)) {
 			rw = 0;
-		else
+			reads++;
+		} else
 			continue;
  
 		bi = &sh->dev[i].req;
@@ -1304,6 +1377,10 @@ static void handle_stripe(struct stripe_head *sh)
 			set_bit(STRIPE_HANDLE, &sh->state);
 		}
 	}
+	if (reads)
+		RAID5_STAT_ADD(conf, reads, reads);
+	if (writes)
+		RAID5_STAT_ADD(conf, writes, writes);
 }
 
 static inline void raid5_activate_delayed(raid5_conf_t *conf)
@@ -1400,6 +1477,24 @@ static inline void raid5_plug_device(raid5_conf_t *conf)
 	spin_unlock_irq(&conf->device_lock);
 }
 
+/*
+ * A write spanning several chunks adds its blocks to each stripe one chunk
+ * apart.  Handling the stripe before the last of them is in would find a
+ * partial stripe and start reading for read-modify-write, so it is left on
+ * the delayed list until this bio has finished filling it.
+ */
+static int stripe_write_continues(raid5_conf_t *conf, sector_t logical_sector,
+				  sector_t last_sector, unsigned int data_disks)
+{
+	int sectors_per_chunk = conf->chunk_size >> 9;
+	sector_t chunk_number = logical_sector;
+
+	if (logical_sector + sectors_per_chunk >= last_sector)
+		return 0;
+	sector_div(chunk_number, sectors_per_chunk);
+	return sector_div(chunk_number, data_disks) != data_disks - 1;
+}
+
 static int make_request (request_queue_t *q, struct bio * bi)
 {
 	mddev_t *mddev = q->queuedata;
@@ -1450,7 +1545,13 @@ static int make_request (request_queue_t *q, struct bio * bi)
 			}
 			finish_wait(&conf->wait_for_overlap, &w);
 			raid5_plug_device(conf);
-			handle_stripe(sh);
+			if (bio_data_dir(bi) == WRITE &&
+			    stripe_write_continues(conf, logical_sector,
+						   last_sector, data_disks)) {
+				set_bit(STRIPE_DELAYED, &sh->state);
+				set_bit(STRIPE_HANDLE, &sh->state);
+			} else
+				handle_stripe(sh);
 			release_stripe(sh);
 
 		} else {
@@ -1521,6 +1622,83 @@ static int sync_request (mddev_t *mddev, sector_t sector_nr, int go_faster)
 	return STRIPE_SECTORS;
 }
 
+/*
+ * Take the next stripe off the handle_list, or NULL when it is empty.
+ */
+static struct stripe_head *__get_handle_stripe(raid5_conf_t *conf)
+{
+	struct list_head *first;
+	struct stripe_head *sh;
+
+	CHECK_DEVLOCK();
+	if (list_empty(&conf->handle_list))
+		return NULL;
+
+	first = conf->handle_list.next;
+	sh = list_entry(first, struct stripe_head, lru);
+
+	list_del_init(first);
+	atomic_inc(&sh->count);
+	if (atomic_read(&sh->count)!= 1)
+		BUG();
+	return sh;
+}
+
+/*
+ * Get other cpus to help with the handle_list, one per waiting stripe
+ * beyond the one raid5d takes itself.  handle_stripe() serialises on the
+ * stripe lock, so any number of them can run against the same array.
+ */
+static void raid5_wake_workers(raid5_conf_t *conf)
+{
+	struct list_head *l;
+	int this_cpu = smp_processor_id();
+	int cpu, want = 0;
+
+	CHECK_DEVLOCK();
+	if (!conf->parity_workers)
+		return;
+
+	list_for_each(l, &conf->handle_list)
+		if (++want >= num_online_cpus())
+			break;
+
+	/* the first one is ours */
+	want--;
+	for_each_online_cpu(cpu) {
+		if (want <= 0)
+			break;
+		if (cpu == this_cpu)
+			continue;
+		queue_work_on(cpu, raid5_wq,
+			      &per_cpu_ptr(conf->percpu, cpu)->work);
+		want--;
+	}
+}
+
+static void raid5_do_work(void *data)
+{
+	struct raid5_percpu *percpu = data;
+	raid5_conf_t *conf = percpu->conf;
+	struct stripe_head *sh;
+	int handled = 0;
+
+	spin_lock_irq(&conf->device_lock);
+	while ((sh = __get_handle_stripe(conf)) != NULL) {
+		spin_unlock_irq(&conf->device_lock);
+
+		handled++;
+		handle_stripe(sh);
+		release_stripe(sh);
+
+		spin_lock_irq(&conf->device_lock);
+	}
+	spin_unlock_irq(&conf->device_lock);
+
+	if (handled)
+		unplug_slaves(conf->mddev);
+}
+
 /*
  * This is our raid5 kernel thread.
  *
@@ -1542,24 +1720,17 @@ static void raid5d (mddev_t *mddev)
 	handled = 0;
 	spin_lock_irq(&conf->device_lock);
 	while (1) {
-		struct list_head *first;
-
 		if (list_empty(&conf->handle_list) &&
 		    atomic_read(&conf->preread_active_stripes) < IO_THRESHOLD &&
 		    !blk_queue_plugged(mddev->queue) &&
 		    !list_empty(&conf->delayed_list))
 			raid5_activate_delayed(conf);
 
-		if (list_empty(&conf->handle_list))
-			break;
-
-		first = conf->handle_list.next;
-		sh = list_entry(first, struct stripe_head, lru);
+		raid5_wake_workers(conf);
 
-		list_del_init(first);
-		atomic_inc(&sh->count);
-		if (atomic_read(&sh->count)!= 1)
-			BUG();
+		sh = __get_handle_stripe(conf);
+		if (!sh)
+			break;
 		spin_unlock_irq(&conf->device_lock);
 		
 		handled++;
@@ -1577,6 +1748,162 @@ static void raid5d (mddev_t *mddev)
 	PRINTK("--- raid5d inactive\n");
 }
 
+/*
+ * sysfs parts below -->
+ *
+ * Each array gets a raid5 directory below its gendisk.  The directory can
+ * outlive the array while a file in it is held open, so conf itself is
+ * only freed by the kobject release, and resizing checks that the array
+ * has not been stopped under it.
+ */
+static DECLARE_MUTEX(raid5_sysfs_sem);
+
+struct raid5_fs_entry {
+	struct attribute attr;
+	ssize_t (*show)(raid5_conf_t *, char *);
+	ssize_t (*store)(raid5_conf_t *, const char *, size_t);
+};
+
+static ssize_t raid5_stripe_cache_size_show(raid5_conf_t *conf, char *page)
+{
+	return sprintf(page, "%d\n", conf->max_nr_stripes);
+}
+
+static ssize_t
+raid5_stripe_cache_size_store(raid5_conf_t *conf, const char *page, size_t count)
+{
+	char *p = (char *) page;
+	int size, ret;
+
+	size = simple_strtoul(p, &p, 10);
+	if (p == page)
+		return -EINVAL;
+
+	down(&raid5_sysfs_sem);
+	if (conf->dead)
+		ret = -ENODEV;
+	else
+		ret = raid5_set_cache_size(conf, size);
+	up(&raid5_sysfs_sem);
+
+	return ret ? ret : count;
+}
+
+static ssize_t raid5_stripe_cache_active_show(raid5_conf_t *conf, char *page)
+{
+	return sprintf(page, "%d\n", atomic_read(&conf->active_stripes));
+}
+
+static ssize_t raid5_parity_workers_show(raid5_conf_t *conf, char *page)
+{
+	return sprintf(page, "%d\n", conf->parity_workers);
+}
+
+static ssize_t
+raid5_parity_workers_store(raid5_conf_t *conf, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	conf->parity_workers = simple_strtoul(p, &p, 10) != 0;
+	return count;
+}
+
+static ssize_t raid5_stats_show(raid5_conf_t *conf, char *page)
+{
+	struct raid5_percpu total;
+	int cpu;
+
+	memset(&total, 0, sizeof(total));
+	for_each_cpu(cpu) {
+		struct raid5_percpu *percpu = per_cpu_ptr(conf->percpu, cpu);
+
+		total.handled += percpu->handled;
+		total.reads += percpu->reads;
+		total.writes += percpu->writes;
+		total.full_stripe_writes += percpu->full_stripe_writes;
+		total.rcw += percpu->rcw;
+		total.rmw += percpu->rmw;
+	}
+
+	return sprintf(page, "handled %lu\nreads %lu\nwrites %lu\n"
+		       "full_stripe_writes %lu\nrcw %lu\nrmw %lu\n",
+		       total.handled, total.reads, total.writes,
+		       total.full_stripe_writes, total.rcw, total.rmw);
+}
+
+static struct raid5_fs_entry raid5_stripe_cache_size_entry = {
+	.attr = {.name = "stripe_cache_size", .mode = S_IRUGO | S_IWUSR },
+	.show = raid5_stripe_cache_size_show,
+	.store = raid5_stripe_cache_size_store,
+};
+static struct raid5_fs_entry raid5_stripe_cache_active_entry = {
+	.attr = {.name = "stripe_cache_active", .mode = S_IRUGO },
+	.show = raid5_stripe_cache_active_show,
+};
+static struct raid5_fs_entry raid5_parity_workers_entry = {
+	.attr = {.name = "parity_workers", .mode = S_IRUGO | S_IWUSR },
+	.show = raid5_parity_workers_show,
+	.store = raid5_parity_workers_store,
+};
+static struct raid5_fs_entry raid5_stats_entry = {
+	.attr = {.name = "stats", .mode = S_IRUGO },
+	.show = raid5_stats_show,
+};
+
+static struct attribute *default_attrs[] = {
+	&raid5_stripe_cache_size_entry.attr,
+	&raid5_stripe_cache_active_entry.attr,
+	&raid5_parity_workers_entry.attr,
+	&raid5_stats_entry.attr,
+	NULL,
+};
+
+#define to_raid5(atr) container_of((atr), struct raid5_fs_entry, attr)
+
+static ssize_t
+raid5_attr_show(struct kobject *kobj, struct attribute *attr, char *page)
+{
+	raid5_conf_t *conf = container_of(kobj, raid5_conf_t, kobj);
+	struct raid5_fs_entry *entry = to_raid5(attr);
+
+	if (!entry->show)
+		return 0;
+
+	return entry->show(conf, page);
+}
+
+static ssize_t
+raid5_attr_store(struct kobject *kobj, struct attribute *attr,
+		 const char *page, size_t length)
+{
+	raid5_conf_t *conf = container_of(kobj, raid5_conf_t, kobj);
+	struct raid5_fs_entry *entry = to_raid5(attr);
+
+	if (!entry->store)
+		return -EINVAL;
+
+	return entry->store(conf, page, length);
+}
+
+static void raid5_kobj_release(struct kobject *kobj)
+{
+	raid5_conf_t *conf = container_of(kobj, raid5_conf_t, kobj);
+
+	free_percpu(conf->percpu);
+	kfree(conf);
+}
+
+static struct sysfs_ops raid5_sysfs_ops = {
+	.show	= raid5_attr_show,
+	.store	= raid5_attr_store,
+};
+
+static struct kobj_type raid5_ktype = {
+	.sysfs_ops	= &raid5_sysfs_ops,
+	.default_attrs	= default_attrs,
+	.release	= raid5_kobj_release,
+};
+
 static int run (mddev_t *mddev)
 {
 	raid5_conf_t *conf;
@@ -1584,6 +1911,7 @@ static int run (mddev_t *mddev)
 	mdk_rdev_t *rdev;
 	struct disk_info *disk;
 	struct list_head *tmp;
+	int cpu;
 
 	if (mddev->level != 5 && mddev->level != 4) {
 		printk("raid5: %s: raid level not set to 4/5 (%d)\n", mdname(mddev), mddev->level);
@@ -1611,6 +1939,17 @@ static int run (mddev_t *mddev)
 	atomic_set(&conf->active_stripes, 0);
 	atomic_set(&conf->preread_active_stripes, 0);
 
+	conf->percpu = alloc_percpu(struct raid5_percpu);
+	if (!conf->percpu)
+		goto abort;
+	for_each_cpu(cpu) {
+		struct raid5_percpu *percpu = per_cpu_ptr(conf->percpu, cpu);
+
+		percpu->conf = conf;
+		INIT_WORK(&percpu->work, raid5_do_work, percpu);
+	}
+	conf->parity_workers = num_online_cpus() > 1;
+
 	mddev->queue->unplug_fn = raid5_unplug_device;
 	mddev->queue->issue_flush_fn = raid5_issue_flush;
 
@@ -1718,6 +2057,14 @@ memory = conf->max_nr_stripes * (sizeof(struct stripe_head) +
 			mddev->queue->backing_dev_info.ra_pages = 2 * stripe;
 	}
 
+	/* the tunables are a convenience, the array runs without them */
+	conf->kobj.parent = &mddev->gendisk->kobj;
+	conf->kobj.ktype = &raid5_ktype;
+	kobject_set_name(&conf->kobj, "%s", "raid5");
+	if (kobject_register(&conf->kobj))
+		printk(KERN_WARNING "raid5: no sysfs attributes for %s\n",
+			mdname(mddev));
+
 	/* Ok, everything is just fine now */
 	mddev->array_size =  mddev->size * (mddev->raid_disks - 1);
 	return 0;
@@ -1727,6 +2074,8 @@ abort:
 		if (conf->stripe_hashtbl)
 			free_pages((unsigned long) conf->stripe_hashtbl,
 							HASH_PAGES_ORDER);
+		if (conf->percpu)
+			free_percpu(conf->percpu);
 		kfree(conf);
 	}
 	mddev->private = NULL;
@@ -1742,10 +2091,17 @@ static int stop (mddev_t *mddev)
 
 	md_unregister_thread(mddev->thread);
 	mddev->thread = NULL;
+	/* no new work can be queued now raid5d is gone */
+	flush_workqueue(raid5_wq);
+
+	down(&raid5_sysfs_sem);
+	conf->dead = 1;
+	up(&raid5_sysfs_sem);
+
 	shrink_stripes(conf);
 	free_pages((unsigned long) conf->stripe_hashtbl, HASH_PAGES_ORDER);
 	blk_sync_queue(mddev->queue); /* the unplug fn references 'conf'*/
-	kfree(conf);
+	kobject_unregister(&conf->kobj);	/* frees conf */
 	mddev->private = NULL;
 	return 0;
 }
@@ -1938,12 +2294,22 @@ static mdk_personality_t raid5_personality=
 
 static int __init raid5_init (void)
 {
-	return register_md_personality (RAID5, &raid5_personality);
+	int ret;
+
+	raid5_wq = create_workqueue("raid5");
+	if (!raid5_wq)
+		return -ENOMEM;
+
+	ret = register_md_personality (RAID5, &raid5_personality);
+	if (ret)
+		destroy_workqueue(raid5_wq);
+	return ret;
 }
 
 static void raid5_exit (void)
 {
 	unregister_md_personality (RAID5);
+	destroy_workqueue(raid5_wq);
 }
 
 module_init(raid5_init);
@@ -432,6 +432,7 @@ do_more:
 			*pdquot_freed_blocks);
 	spin_unlock(sb_bgl_lock(sbi, block_group));
 	percpu_counter_mod(&sbi->s_freeblocks_counter, count);
+	ext3_mb_freed(handle, sb, block_group);
 
 	/* We dirtied the bitmap block */
 	BUFFER_TRACE(bitmap_bh, "dirtied bitmap block");
@@ -1096,13 +1097,20 @@ out:
 	return ret;
 }
 
-static int ext3_has_free_blocks(struct ext3_sb_info *sbi)
+/*
+ * Blocks reserved for delayed allocation are as good as allocated
+ */
+int ext3_has_free_blocks(struct ext3_sb_info *sbi)
 {
-	int free_blocks, root_blocks;
+	long free_blocks, root_blocks;
 
-	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+		percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
 	root_blocks = le32_to_cpu(sbi->s_es->s_r_blocks_count);
-	if (free_blocks < root_blocks + 1 && !capable(CAP_SYS_RESOURCE) &&
+	if (free_blocks < 1)
+		return 0;
+	if (free_blocks < root_blocks + 1 &&
+		!capable(CAP_SYS_RESOURCE) &&
 		sbi->s_resuid != current->fsuid &&
 		(sbi->s_resgid == 0 || !in_group_p (sbi->s_resgid))) {
 		return 0;
@@ -1110,6 +1118,27 @@ static int ext3_has_free_blocks(struct ext3_sb_info *sbi)
 	return 1;
 }
 
+/*
+ * Set aside `nr' blocks for data whose allocation has been put off until
+ * writeback, and for the extent tree blocks it may need
+ */
+int ext3_reserve_blocks(struct super_block *sb, unsigned long nr)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+
+	percpu_counter_mod(&sbi->s_dirtyblocks_counter, nr);
+	if (!ext3_has_free_blocks(sbi)) {
+		percpu_counter_mod(&sbi->s_dirtyblocks_counter, -(long)nr);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+void ext3_release_blocks(struct super_block *sb, unsigned long nr)
+{
+	percpu_counter_mod(&EXT3_SB(sb)->s_dirtyblocks_counter, -(long)nr);
+}
+
 /*
  * ext3_should_retry_alloc() is called when ENOSPC is returned, and if
  * it is profitable to retry the operation, this function will wait
@@ -1133,9 +1162,14 @@ int ext3_should_retry_alloc(struct super_block *sb, int *retries)
  * each block group the search first looks for an entire free byte in the block
  * bitmap, and then for any free bit if that fails.
  * This function also updates quota and i_blocks field.
+ *
+ * With EXT3_GET_BLOCKS_RESERVED in `flags' the block was reserved and
+ * charged to quota when it was written, so neither is checked again: the
+ * free block count less the reservations would include the block itself.
+ * EXT3_GET_BLOCKS_NOQUOTA leaves out just the quota charge.
  */
-int ext3_new_block(handle_t *handle, struct inode *inode,
-			unsigned long goal, int *errp)
+int __ext3_new_block(handle_t *handle, struct inode *inode,
+			unsigned long goal, int flags, int *errp)
 {
 	struct buffer_head *bitmap_bh = NULL;
 	struct buffer_head *gdp_bh;
@@ -1158,6 +1192,8 @@ int ext3_new_block(handle_t *handle, struct inode *inode,
 	static int goal_hits, goal_attempts;
 #endif
 	unsigned long ngroups;
+	int charge = !(flags & (EXT3_GET_BLOCKS_RESERVED |
+				EXT3_GET_BLOCKS_NOQUOTA));
 
 	*errp = -ENOSPC;
 	sb = inode->i_sb;
@@ -1169,7 +1205,7 @@ int ext3_new_block(handle_t *handle, struct inode *inode,
 	/*
 	 * Check quota for allocation of this block.
 	 */
-	if (DQUOT_ALLOC_BLOCK(inode, 1)) {
+	if (charge && DQUOT_ALLOC_BLOCK(inode, 1)) {
 		*errp = -EDQUOT;
 		return 0;
 	}
@@ -1189,7 +1225,7 @@ int ext3_new_block(handle_t *handle, struct inode *inode,
 	if (test_opt(sb, RESERVATION) &&
 		S_ISREG(inode->i_mode) && (windowsz > 0))
 		my_rsv = rsv;
-	if (!ext3_has_free_blocks(sbi)) {
+	if (!(flags & EXT3_GET_BLOCKS_RESERVED) && !ext3_has_free_blocks(sbi)) {
 		*errp = -ENOSPC;
 		goto out;
 	}
@@ -1297,6 +1333,7 @@ allocated:
 			    "block = %u", target_block);
 
 	performed_allocation = 1;
+	ext3_mb_claimed(sb, group_no, ret_block, 1);
 
 #ifdef CONFIG_JBD_DEBUG
 	{
@@ -1372,12 +1409,18 @@ out:
 	/*
 	 * Undo the block allocation
 	 */
-	if (!performed_allocation)
+	if (!performed_allocation && charge)
 		DQUOT_FREE_BLOCK(inode, 1);
 	brelse(bitmap_bh);
 	return 0;
 }
 
+int ext3_new_block(handle_t *handle, struct inode *inode,
+			unsigned long goal, int *errp)
+{
+	return __ext3_new_block(handle, inode, goal, 0, errp);
+}
+
 unsigned long ext3_count_free_blocks(struct super_block *sb)
 {
 	unsigned long desc_count;
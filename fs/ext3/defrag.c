@@ -0,0 +1,274 @@
+/*
+ *  linux/fs/ext3/defrag.c
+ *
+ * Online defragmentation of extent-mapped files, for EXT3_IOC_DEFRAG.
+ *
+ * A run of blocks following each other in the file, but spread over
+ * several extents, is moved in one step: its pages are read in and
+ * locked, a free run as long as it is allocated, the tree is changed to
+ * map the new run and free the old blocks, and the page buffers are
+ * pointed at the new blocks and dirtied, all in one transaction.
+ * Writeback then puts the data in place.  In data=ordered mode that is
+ * before the transaction commits, so after a crash the file has either
+ * its old blocks or its new ones with the data in them.  Other modes have
+ * nothing to hold the commit back for the data and are refused.
+ *
+ * i_sem keeps write() and truncate away while the file is worked on.
+ * Files with shared writable mappings are refused, as their pages can
+ * be changed without the page lock.  mmap() does not take i_sem, so that
+ * is checked again for each run with its pages locked.
+ */
+
+#include <linux/config.h>
+#include <linux/time.h>
+#include <linux/fs.h>
+#include <linux/jbd.h>
+#include <linux/ext3_fs.h>
+#include <linux/ext3_jbd.h>
+#include <linux/ext3_extents.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+
+/*
+ * Most blocks, and extents, moved in one transaction.  A run of blocks
+ * spans at most one page more than it has blocks.
+ */
+#define EXT3_DEFRAG_MAX_BLOCKS	256
+#define EXT3_DEFRAG_MAX_EXTENTS	16
+#define EXT3_DEFRAG_MAX_PAGES	(EXT3_DEFRAG_MAX_BLOCKS + 1)
+
+/*
+ * Credits for one step: the tree changes for the extents going and the
+ * one coming, and the bitmaps and group descriptors of both
+ */
+static inline int ext3_defrag_credits(struct inode *inode)
+{
+	return ext3_ext_index_trans_blocks(inode, EXT3_DEFRAG_MAX_EXTENTS + 1) +
+	       2 * (EXT3_DEFRAG_MAX_EXTENTS + 1) + 2 +
+	       2 * EXT3_QUOTA_TRANS_BLOCKS;
+}
+
+/*
+ * The run to move from `block': whole extents following on from each
+ * other in the file, up to a hole, `end' or the limits above.  Its
+ * length goes in *len and the number of physically separate pieces in
+ * *nr; for a hole at `block', *nr is 0 and *len the hole's length.
+ * *pstart is where the run is now.
+ */
+static int ext3_defrag_run(struct inode *inode, u32 block, u32 end,
+			   u32 *len, int *nr, u32 *pstart)
+{
+	u32 pblock, n, next = 0;
+	int extents = 0;
+	int err;
+
+	*len = 0;
+	*nr = 0;
+	while (block + *len < end && extents < EXT3_DEFRAG_MAX_EXTENTS) {
+		err = ext3_ext_map_run(inode, block + *len, &pblock, &n);
+		if (err)
+			return err;
+		if (!pblock) {
+			if (!extents)
+				*len = n;
+			break;
+		}
+		if (extents && (*len + n > EXT3_DEFRAG_MAX_BLOCKS ||
+				block + *len + n > end))
+			break;
+		if (!extents)
+			*pstart = pblock;
+		if (pblock != next)
+			(*nr)++;
+		next = pblock + n;
+		*len += n;
+		extents++;
+	}
+	return 0;
+}
+
+/*
+ * Move the `len' blocks from `block' on into one free run near *goal,
+ * and leave *goal just after it.  Returns the number of blocks moved, 0
+ * if there is no free run long enough, or an error.
+ */
+static int ext3_defrag_move(struct file *filp, u32 block, u32 len,
+			    unsigned long *goal, struct page **pages)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	unsigned int bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t first = block >> bits;
+	int nr_pages = ((block + len - 1) >> bits) - first + 1;
+	unsigned long pblock, count = len;
+	struct buffer_head *bh, *head;
+	struct page *page;
+	handle_t *handle;
+	sector_t iblock;
+	int locked, i, freed, moved = 0, err = 0, ret;
+
+	for (locked = 0; locked < nr_pages; locked++) {
+		page = read_cache_page(mapping, first + locked,
+				(filler_t *)mapping->a_ops->readpage, filp);
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			goto out_pages;
+		}
+		lock_page(page);
+		wait_on_page_writeback(page);
+		if (page->mapping != mapping || !PageUptodate(page)) {
+			err = page->mapping != mapping ? -EAGAIN : -EIO;
+			unlock_page(page);
+			page_cache_release(page);
+			goto out_pages;
+		}
+		pages[locked] = page;
+	}
+	if (mapping_writably_mapped(mapping)) {
+		err = -EBUSY;
+		goto out_pages;
+	}
+
+	handle = ext3_journal_start(inode, ext3_defrag_credits(inode));
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out_pages;
+	}
+
+	/* the file keeps its quota: the old blocks pass theirs on */
+	pblock = ext3_new_blocks(handle, inode, *goal, &count,
+				 EXT3_GET_BLOCKS_NOQUOTA, &err);
+	if (pblock && count < len) {
+		/* no better than what the file has */
+		ext3_free_blocks_sb(handle, sb, pblock, count, &freed);
+		pblock = 0;
+		err = -ENOSPC;
+	}
+	if (!pblock) {
+		if (err == -ENOSPC)
+			err = 0;
+		goto out_stop;
+	}
+
+	err = ext3_ext_move_run(handle, inode, block, len, pblock);
+	if (err) {
+		ext3_free_blocks_sb(handle, sb, pblock, len, &freed);
+		goto out_stop;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		page = pages[i];
+		if (!page_has_buffers(page))
+			create_empty_buffers(page, sb->s_blocksize, 0);
+		iblock = (sector_t)page->index << bits;
+		head = bh = page_buffers(page);
+		do {
+			if (iblock >= block && iblock < block + len) {
+				map_bh(bh, sb, pblock + iblock - block);
+				unmap_underlying_metadata(bh->b_bdev,
+							  bh->b_blocknr);
+				set_buffer_uptodate(bh);
+				mark_buffer_dirty(bh);
+				ret = ext3_journal_dirty_data(handle, bh);
+				if (!err)
+					err = ret;
+			}
+			iblock++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	*goal = pblock + len;
+	moved = len;
+
+out_stop:
+	ret = ext3_journal_stop(handle);
+	if (!err)
+		err = ret;
+out_pages:
+	while (locked-- > 0) {
+		unlock_page(pages[locked]);
+		page_cache_release(pages[locked]);
+	}
+	return err ? err : moved;
+}
+
+/**
+ * ext3_defrag - make the blocks of a file contiguous
+ * @filp: the file, open for writing
+ * @dr: the range to work on; dr_moved and dr_next are filled in
+ *
+ * Runs which are in one piece already are left where they are, as are
+ * runs for which there is no free space long enough.  Returns early, with
+ * dr_next where to continue, on a signal.
+ */
+int ext3_defrag(struct file *filp, struct ext3_defrag_range *dr)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	struct page **pages;
+	unsigned long goal;
+	u32 block, end, last, len, pstart;
+	int nr, err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (IS_IMMUTABLE(inode) || IS_APPEND(inode))
+		return -EPERM;
+	if (IS_SWAPFILE(inode))
+		return -ETXTBSY;
+	if (!ext3_inode_has_extents(inode) || !ext3_should_order_data(inode))
+		return -EOPNOTSUPP;
+
+	dr->dr_moved = 0;
+	dr->dr_next = dr->dr_start;
+	pages = kmalloc(EXT3_DEFRAG_MAX_PAGES * sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	down(&inode->i_sem);
+	err = -EBUSY;
+	if (mapping_writably_mapped(mapping))
+		goto out;
+	/* delayed allocations get their blocks, and the rest settles */
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		goto out;
+
+	last = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >>
+		inode->i_sb->s_blocksize_bits;
+	end = last;
+	if (dr->dr_start < last && dr->dr_len < last - dr->dr_start)
+		end = dr->dr_start + dr->dr_len;
+	goal = dr->dr_goal;
+
+	for (block = dr->dr_start; block < end; block += len) {
+		if (signal_pending(current)) {
+			if (!dr->dr_moved)
+				err = -EINTR;
+			break;
+		}
+		cond_resched();
+		err = ext3_defrag_run(inode, block, end, &len, &nr, &pstart);
+		if (err)
+			break;
+		if (nr < 2)
+			continue;
+		if (!dr->dr_goal && !dr->dr_moved)
+			goal = pstart;
+		err = ext3_defrag_move(filp, block, len, &goal, pages);
+		if (err < 0)
+			break;
+		dr->dr_moved += err;
+		err = 0;
+	}
+	dr->dr_next = min(block, end);
+out:
+	up(&inode->i_sem);
+	kfree(pages);
+	return err;
+}
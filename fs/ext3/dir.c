@@ -390,6 +390,74 @@ int ext3_htree_store_dirent(struct file *dir_file, __u32 hash,
 
 
 
+/*
+ * Inode table blocks queued for readahead, per batch
+ */
+#define EXT3_DIR_PREFETCH	64
+
+static void ext3_dir_prefetch_batch(struct super_block *sb,
+				    unsigned long *blocks, int n)
+{
+	unsigned long tmp;
+	int i, j;
+
+	/* insertion sort, so the reads go out in disk order */
+	for (i = 1; i < n; i++) {
+		tmp = blocks[i];
+		for (j = i; j > 0 && blocks[j - 1] > tmp; j--)
+			blocks[j] = blocks[j - 1];
+		blocks[j] = tmp;
+	}
+	for (i = 0; i < n; i++)
+		if (!i || blocks[i] != blocks[i - 1])
+			sb_breadahead(sb, blocks[i]);
+}
+
+/*
+ * htree readdir hands names back in hash order, which bears no relation
+ * to where their inodes live, so a readdir+stat pass over a big
+ * directory reads the inode tables at random.  With the dirprefetch
+ * mount option, start reading every inode table block a freshly
+ * filled chunk refers to, in disk order, before handing any of it out.
+ */
+static void ext3_dir_prefetch(struct super_block *sb, struct rb_root *root)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	unsigned long blocks[EXT3_DIR_PREFETCH];
+	unsigned long ino, group, offset, block;
+	struct ext3_group_desc *gdp;
+	struct rb_node *node;
+	struct fname *fname;
+	int n = 0;
+
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		fname = rb_entry(node, struct fname, rb_hash);
+		for (; fname; fname = fname->next) {
+			ino = fname->inode;
+			if (ino < EXT3_FIRST_INO(sb) ||
+			    ino > le32_to_cpu(sbi->s_es->s_inodes_count))
+				continue;
+			group = (ino - 1) / EXT3_INODES_PER_GROUP(sb);
+			gdp = ext3_get_group_desc(sb, group, NULL);
+			if (!gdp)
+				continue;
+			offset = ((ino - 1) % EXT3_INODES_PER_GROUP(sb)) *
+				 EXT3_INODE_SIZE(sb);
+			block = le32_to_cpu(gdp->bg_inode_table) +
+				(offset >> EXT3_BLOCK_SIZE_BITS(sb));
+			if (n && blocks[n - 1] == block)
+				continue;
+			blocks[n++] = block;
+			if (n == EXT3_DIR_PREFETCH) {
+				ext3_dir_prefetch_batch(sb, blocks, n);
+				n = 0;
+			}
+		}
+	}
+	if (n)
+		ext3_dir_prefetch_batch(sb, blocks, n);
+}
+
 /*
  * This is a helper function for ext3_dx_readdir.  It calls filldir
  * for all entres on the fname linked list.  (Normally there is only
@@ -484,6 +552,8 @@ static int ext3_dx_readdir(struct file * filp,
 				filp->f_pos = EXT3_HTREE_EOF;
 				break;
 			}
+			if (test_opt(inode->i_sb, DIR_PREFETCH))
+				ext3_dir_prefetch(inode->i_sb, &info->root);
 			info->curr_node = rb_first(&info->root);
 		}
 
@@ -0,0 +1,1077 @@
+/*
+ *  linux/fs/ext3/extents.c
+ *
+ * Extent-mapped files.
+ *
+ * The block map of a file with EXT3_EXTENTS_FL set is a B-tree of extents,
+ * runs of physically contiguous blocks, rooted in i_data instead of the
+ * direct and indirect block pointers.  Every node starts with an
+ * ext3_extent_header; leaves hold ext3_extent entries, index nodes
+ * ext3_extent_idx entries pointing one level down, both sorted by logical
+ * block.  The root has room for four entries.  Once every level on the
+ * way to a full leaf is full too, the tree grows a level by pushing the
+ * root's entries down into a block of their own.
+ *
+ * The tree is only changed under truncate_sem, and is journaled like any
+ * other metadata.  Each step leaves a consistent tree behind, so that a
+ * truncate can be restarted in a new transaction, or after a crash.
+ */
+
+#include <linux/config.h>
+#include <linux/time.h>
+#include <linux/fs.h>
+#include <linux/jbd.h>
+#include <linux/ext3_fs.h>
+#include <linux/ext3_jbd.h>
+#include <linux/ext3_extents.h>
+#include <linux/quotaops.h>
+#include <linux/buffer_head.h>
+#include <linux/string.h>
+
+/*
+ * Entries in the root, and in a node block.  Index and leaf entries are
+ * the same size.
+ */
+#define EXT3_EXT_ROOT_MAX						\
+	((sizeof(((struct ext3_inode_info *)0)->i_data) -		\
+	  sizeof(struct ext3_extent_header)) / sizeof(struct ext3_extent))
+
+static inline int ext3_ext_node_max(struct super_block *sb)
+{
+	return (sb->s_blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+}
+
+static inline u32 ext_block(struct ext3_extent *ex)
+{
+	return le32_to_cpu(ex->ee_block);
+}
+
+static inline u32 ext_len(struct ext3_extent *ex)
+{
+	return le16_to_cpu(ex->ee_len);
+}
+
+static inline u32 ext_start(struct ext3_extent *ex)
+{
+	return le32_to_cpu(ex->ee_start);
+}
+
+static inline void ext_add_entries(struct ext3_extent_header *eh, int n)
+{
+	eh->eh_entries = cpu_to_le16(le16_to_cpu(eh->eh_entries) + n);
+}
+
+/*
+ * The extent last looked up is remembered in the inode, so that mapping
+ * a file block by block does not walk the tree for every block
+ */
+static void ext3_ext_cache_set(struct inode *inode, u32 block, u32 len,
+			       u32 start)
+{
+	struct ext3_ext_cache *ec = &EXT3_I(inode)->i_cached_extent;
+
+	ec->ec_block = block;
+	ec->ec_len = len;
+	ec->ec_start = start;
+}
+
+static int ext3_ext_cache_find(struct inode *inode, u32 block, u32 *pblock,
+			       u32 *len)
+{
+	struct ext3_ext_cache *ec = &EXT3_I(inode)->i_cached_extent;
+
+	if (block < ec->ec_block || block - ec->ec_block >= ec->ec_len)
+		return 0;
+	*pblock = ec->ec_start + block - ec->ec_block;
+	if (len)
+		*len = ec->ec_len - (block - ec->ec_block);
+	return 1;
+}
+
+static int ext3_ext_check(struct inode *inode, struct ext3_extent_header *eh,
+			  int depth, int max)
+{
+	if (eh->eh_magic != cpu_to_le16(EXT3_EXT_MAGIC) ||
+	    le16_to_cpu(eh->eh_depth) != depth ||
+	    le16_to_cpu(eh->eh_max) > max ||
+	    le16_to_cpu(eh->eh_entries) > le16_to_cpu(eh->eh_max) ||
+	    (depth && !eh->eh_entries)) {
+		ext3_error(inode->i_sb, "ext3_ext_check",
+			   "bad extent tree node, inode=%lu, depth=%d",
+			   inode->i_ino, depth);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void ext3_ext_drop_path(struct ext3_ext_path *path, int depth)
+{
+	int i;
+
+	for (i = 0; i <= depth; i++) {
+		brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+/*
+ * The last index starting at or before `block', or the first one
+ */
+static struct ext3_extent_idx *
+ext3_ext_search_idx(struct ext3_extent_header *eh, u32 block)
+{
+	struct ext3_extent_idx *l = EXT_FIRST_INDEX(eh) + 1;
+	struct ext3_extent_idx *r = EXT_LAST_INDEX(eh);
+
+	while (l <= r) {
+		struct ext3_extent_idx *m = l + (r - l) / 2;
+
+		if (block < le32_to_cpu(m->ei_block))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return l - 1;
+}
+
+/*
+ * Same for extents; NULL in an empty leaf
+ */
+static struct ext3_extent *
+ext3_ext_search_ext(struct ext3_extent_header *eh, u32 block)
+{
+	struct ext3_extent *l = EXT_FIRST_EXTENT(eh) + 1;
+	struct ext3_extent *r = EXT_LAST_EXTENT(eh);
+
+	if (!eh->eh_entries)
+		return NULL;
+
+	while (l <= r) {
+		struct ext3_extent *m = l + (r - l) / 2;
+
+		if (block < ext_block(m))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return l - 1;
+}
+
+/*
+ * Fill in path[0..depth] on the way to `block'.  The caller drops the
+ * references with ext3_ext_drop_path().
+ */
+static int ext3_ext_find_extent(struct inode *inode, u32 block,
+				struct ext3_ext_path *path)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext3_extent_header *eh = ext_inode_hdr(inode);
+	int depth = ext_depth(inode);
+	int i, err;
+
+	if (depth > EXT3_EXT_MAX_DEPTH) {
+		ext3_error(sb, "ext3_ext_find_extent",
+			   "extent tree too deep, inode=%lu", inode->i_ino);
+		return -EIO;
+	}
+	memset(path, 0, sizeof(*path) * (depth + 1));
+
+	err = ext3_ext_check(inode, eh, depth, EXT3_EXT_ROOT_MAX);
+	if (err)
+		return err;
+
+	for (i = 0; i < depth; i++) {
+		struct buffer_head *bh;
+
+		path[i].p_hdr = eh;
+		path[i].p_idx = ext3_ext_search_idx(eh, block);
+
+		bh = sb_bread(sb, le32_to_cpu(path[i].p_idx->ei_leaf));
+		if (!bh) {
+			err = -EIO;
+			goto fail;
+		}
+		path[i + 1].p_bh = bh;
+		eh = (struct ext3_extent_header *) bh->b_data;
+		err = ext3_ext_check(inode, eh, depth - i - 1,
+				     ext3_ext_node_max(sb));
+		if (err)
+			goto fail;
+	}
+	path[depth].p_hdr = eh;
+	path[depth].p_ext = ext3_ext_search_ext(eh, block);
+	return 0;
+
+fail:
+	ext3_ext_drop_path(path, depth);
+	return err;
+}
+
+/*
+ * The first block mapped by the leaf after the one on `path', or
+ * EXT3_EXT_MAX_BLOCK if this is the last leaf
+ */
+static u32 ext3_ext_next_leaf_block(struct ext3_ext_path *path, int depth)
+{
+	int i;
+
+	for (i = depth - 1; i >= 0; i--)
+		if (path[i].p_idx != EXT_LAST_INDEX(path[i].p_hdr))
+			return le32_to_cpu(path[i].p_idx[1].ei_block);
+	return EXT3_EXT_MAX_BLOCK;
+}
+
+static int ext3_ext_get_access(handle_t *handle, struct ext3_ext_path *p)
+{
+	if (p->p_bh)
+		return ext3_journal_get_write_access(handle, p->p_bh);
+	return 0;		/* the root: the inode is dirtied afterwards */
+}
+
+static int ext3_ext_dirty(handle_t *handle, struct inode *inode,
+			  struct ext3_ext_path *p)
+{
+	if (p->p_bh)
+		return ext3_journal_dirty_metadata(handle, p->p_bh);
+	return ext3_mark_inode_dirty(handle, inode);
+}
+
+/*
+ * A fresh, empty node `depth' levels above the leaves.  Blocks set aside
+ * for the tree by delayed allocation are used up first.
+ */
+static struct buffer_head *ext3_ext_new_node(handle_t *handle,
+		struct inode *inode, unsigned long goal, int depth, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct ext3_extent_header *eh;
+	struct buffer_head *bh;
+	unsigned long block;
+	int flags = 0;
+
+	spin_lock(&ei->i_da_lock);
+	if (ei->i_da_meta) {
+		ei->i_da_meta--;
+		flags = EXT3_GET_BLOCKS_RESERVED;
+	}
+	spin_unlock(&ei->i_da_lock);
+
+	block = __ext3_new_block(handle, inode, goal, flags, err);
+	if (!block) {
+		if (flags) {
+			spin_lock(&ei->i_da_lock);
+			ei->i_da_meta++;
+			spin_unlock(&ei->i_da_lock);
+		}
+		return NULL;
+	}
+	/* the block is allocated now; its quota stays charged */
+	if (flags)
+		ext3_release_blocks(sb, 1);
+
+	bh = sb_getblk(sb, block);
+	lock_buffer(bh);
+	BUFFER_TRACE(bh, "call get_create_access");
+	*err = ext3_journal_get_create_access(handle, bh);
+	if (*err) {
+		unlock_buffer(bh);
+		brelse(bh);
+		ext3_free_blocks(handle, inode, block, 1);
+		return NULL;
+	}
+	memset(bh->b_data, 0, sb->s_blocksize);
+	eh = (struct ext3_extent_header *) bh->b_data;
+	eh->eh_magic = cpu_to_le16(EXT3_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(ext3_ext_node_max(sb));
+	eh->eh_depth = cpu_to_le16(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+/*
+ * Every level is full: move the root's entries into a new block and make
+ * the root a single index entry pointing to it
+ */
+static int ext3_ext_grow(handle_t *handle, struct inode *inode,
+			 unsigned long goal)
+{
+	struct ext3_extent_header *root = ext_inode_hdr(inode);
+	int depth = ext_depth(inode);
+	struct ext3_extent_header *eh;
+	struct ext3_extent_idx *ix;
+	struct buffer_head *bh;
+	int err;
+
+	if (depth >= EXT3_EXT_MAX_DEPTH) {
+		ext3_error(inode->i_sb, "ext3_ext_grow",
+			   "extent tree too deep, inode=%lu", inode->i_ino);
+		return -EIO;
+	}
+
+	bh = ext3_ext_new_node(handle, inode, goal, depth, &err);
+	if (!bh)
+		return err;
+	eh = (struct ext3_extent_header *) bh->b_data;
+	memcpy(eh + 1, root + 1,
+	       le16_to_cpu(root->eh_entries) * sizeof(struct ext3_extent));
+	eh->eh_entries = root->eh_entries;
+	BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
+	err = ext3_journal_dirty_metadata(handle, bh);
+	if (err)
+		goto out;
+
+	/* ei_block and ee_block are both the first field */
+	ix = EXT_FIRST_INDEX(root);
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	ix->ei_leaf_hi = 0;
+	ix->ei_unused = 0;
+	root->eh_entries = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	err = ext3_mark_inode_dirty(handle, inode);
+out:
+	brelse(bh);
+	return err;
+}
+
+/*
+ * path[at] has room and the levels below it are full.  Give each of those
+ * a new node holding the entries to the right of the path, and link the
+ * new nodes in after path[at].p_idx; `block' then goes into one of the
+ * two halves of the leaf.  Nothing is changed until all the new nodes
+ * are set up and write access to the path is had, so an error up to
+ * there frees the new nodes and leaves the tree as it was.  After that
+ * only a journal abort can fail, and the new nodes are kept.
+ */
+static int ext3_ext_split(handle_t *handle, struct inode *inode,
+			  struct ext3_ext_path *path, int at, u32 block,
+			  unsigned long goal)
+{
+	struct buffer_head *bh[EXT3_EXT_MAX_DEPTH + 1];
+	int depth = ext_depth(inode);
+	struct ext3_extent_header *eh;
+	struct ext3_extent *ex = path[depth].p_ext;
+	struct ext3_extent_idx *ix;
+	u32 border;
+	int i, n, err = 0;
+
+	if (ex != EXT_LAST_EXTENT(path[depth].p_hdr))
+		border = ext_block(ex + 1);
+	else
+		border = block;
+
+	memset(bh, 0, sizeof(bh));
+	for (i = depth; i > at; i--) {
+		bh[i] = ext3_ext_new_node(handle, inode, goal, depth - i, &err);
+		if (!bh[i])
+			goto fail;
+		eh = (struct ext3_extent_header *) bh[i]->b_data;
+		if (i == depth) {
+			n = EXT_LAST_EXTENT(path[i].p_hdr) - ex;
+			memcpy(EXT_FIRST_EXTENT(eh), ex + 1, n * sizeof(*ex));
+		} else {
+			ix = EXT_FIRST_INDEX(eh);
+			ix->ei_block = cpu_to_le32(border);
+			ix->ei_leaf = cpu_to_le32(bh[i + 1]->b_blocknr);
+			n = EXT_LAST_INDEX(path[i].p_hdr) - path[i].p_idx;
+			memcpy(ix + 1, path[i].p_idx + 1, n * sizeof(*ix));
+			n++;
+		}
+		eh->eh_entries = cpu_to_le16(n);
+		BUFFER_TRACE(bh[i], "call ext3_journal_dirty_metadata");
+		err = ext3_journal_dirty_metadata(handle, bh[i]);
+		if (err)
+			goto fail;
+	}
+
+	for (i = depth; i >= at; i--) {
+		err = ext3_ext_get_access(handle, path + i);
+		if (err)
+			goto fail;
+	}
+
+	for (i = depth; i > at; i--) {
+		eh = path[i].p_hdr;
+		if (i == depth)
+			n = ex - EXT_FIRST_EXTENT(eh) + 1;
+		else
+			n = path[i].p_idx - EXT_FIRST_INDEX(eh) + 1;
+		eh->eh_entries = cpu_to_le16(n);
+		err = ext3_ext_dirty(handle, inode, path + i);
+		if (err)
+			goto out;
+	}
+
+	eh = path[at].p_hdr;
+	ix = path[at].p_idx + 1;
+	memmove(ix + 1, ix, (EXT_LAST_INDEX(eh) - path[at].p_idx) * sizeof(*ix));
+	ix->ei_block = cpu_to_le32(border);
+	ix->ei_leaf = cpu_to_le32(bh[at + 1]->b_blocknr);
+	ix->ei_leaf_hi = 0;
+	ix->ei_unused = 0;
+	ext_add_entries(eh, 1);
+	err = ext3_ext_dirty(handle, inode, path + at);
+out:
+	for (i = depth; i > at; i--)
+		brelse(bh[i]);
+	return err;
+
+fail:
+	for (i = depth; i > at; i--) {
+		unsigned long nr;
+
+		if (!bh[i])
+			continue;
+		nr = bh[i]->b_blocknr;
+		BUFFER_TRACE(bh[i], "call journal_forget");
+		ext3_journal_forget(handle, bh[i]);
+		ext3_free_blocks(handle, inode, nr, 1);
+	}
+	return err;
+}
+
+/*
+ * The first entry of the leaf on `path' changed: the index entries above
+ * it have to start there as well
+ */
+static int ext3_ext_correct_indexes(handle_t *handle, struct inode *inode,
+				    struct ext3_ext_path *path)
+{
+	int depth = ext_depth(inode);
+	__le32 border = EXT_FIRST_EXTENT(path[depth].p_hdr)->ee_block;
+	int k, err = 0;
+
+	for (k = depth - 1; k >= 0; k--) {
+		if (path[k].p_idx->ei_block == border)
+			break;
+		err = ext3_ext_get_access(handle, path + k);
+		if (err)
+			break;
+		path[k].p_idx->ei_block = border;
+		err = ext3_ext_dirty(handle, inode, path + k);
+		if (err)
+			break;
+		if (path[k].p_idx != EXT_FIRST_INDEX(path[k].p_hdr))
+			break;
+	}
+	return err;
+}
+
+static inline int ext3_ext_can_append(struct ext3_extent *ex,
+				      struct ext3_extent *newex)
+{
+	return ext_block(ex) + ext_len(ex) == ext_block(newex) &&
+	       ext_start(ex) + ext_len(ex) == ext_start(newex) &&
+	       ext_len(ex) + ext_len(newex) <= EXT3_EXT_MAX_LEN;
+}
+
+/*
+ * Add `newex' to the tree, whose lookup for it is `path'.  The path is
+ * dropped before returning.
+ */
+static int ext3_ext_insert_extent(handle_t *handle, struct inode *inode,
+				  struct ext3_ext_path *path,
+				  struct ext3_extent *newex)
+{
+	u32 block = ext_block(newex);
+	struct ext3_extent_header *eh;
+	struct ext3_extent *ex, *nearex;
+	int depth, at, err;
+
+repeat:
+	depth = ext_depth(inode);
+	eh = path[depth].p_hdr;
+	ex = path[depth].p_ext;
+
+	if (ex && ext3_ext_can_append(ex, newex)) {
+		err = ext3_ext_get_access(handle, path + depth);
+		if (err)
+			goto out;
+		ex->ee_len = cpu_to_le16(ext_len(ex) + ext_len(newex));
+		err = ext3_ext_dirty(handle, inode, path + depth);
+		if (!err)
+			ext3_ext_cache_set(inode, ext_block(ex), ext_len(ex),
+					   ext_start(ex));
+		goto out;
+	}
+
+	if (le16_to_cpu(eh->eh_entries) >= le16_to_cpu(eh->eh_max)) {
+		unsigned long goal = ext_start(newex);
+
+		for (at = depth - 1; at >= 0; at--)
+			if (le16_to_cpu(path[at].p_hdr->eh_entries) <
+			    le16_to_cpu(path[at].p_hdr->eh_max))
+				break;
+		if (at < 0)
+			err = ext3_ext_grow(handle, inode, goal);
+		else
+			err = ext3_ext_split(handle, inode, path, at, block,
+					     goal);
+		ext3_ext_drop_path(path, depth);
+		if (err)
+			return err;
+		err = ext3_ext_find_extent(inode, block, path);
+		if (err)
+			return err;
+		goto repeat;
+	}
+
+	err = ext3_ext_get_access(handle, path + depth);
+	if (err)
+		goto out;
+	if (!ex)
+		nearex = EXT_FIRST_EXTENT(eh);
+	else if (block > ext_block(ex))
+		nearex = ex + 1;
+	else
+		nearex = ex;
+	memmove(nearex + 1, nearex,
+		(EXT_LAST_EXTENT(eh) - nearex + 1) * sizeof(*nearex));
+	*nearex = *newex;
+	ext_add_entries(eh, 1);
+	err = ext3_ext_dirty(handle, inode, path + depth);
+	if (err)
+		goto out;
+	ext3_ext_cache_set(inode, block, ext_len(newex), ext_start(newex));
+
+	if (depth && nearex == EXT_FIRST_EXTENT(eh))
+		err = ext3_ext_correct_indexes(handle, inode, path);
+out:
+	ext3_ext_drop_path(path, depth);
+	return err;
+}
+
+/*
+ * Where to allocate `block': following on from the extent next to it,
+ * else near the leaf, else near the inode
+ */
+static unsigned long ext3_ext_find_goal(struct inode *inode,
+					struct ext3_ext_path *path, u32 block)
+{
+	struct super_block *sb = inode->i_sb;
+	int depth = ext_depth(inode);
+	struct ext3_extent *ex = path[depth].p_ext;
+	unsigned long bg_start, colour;
+
+	if (ex) {
+		if (block >= ext_block(ex))
+			return ext_start(ex) + block - ext_block(ex);
+		if (ext_start(ex) > ext_block(ex) - block)
+			return ext_start(ex) - (ext_block(ex) - block);
+		return ext_start(ex);
+	}
+	if (path[depth].p_bh)
+		return path[depth].p_bh->b_blocknr;
+
+	bg_start = EXT3_I(inode)->i_block_group * EXT3_BLOCKS_PER_GROUP(sb) +
+		le32_to_cpu(EXT3_SB(sb)->s_es->s_first_data_block);
+	colour = (current->pid % 16) * (EXT3_BLOCKS_PER_GROUP(sb) / 16);
+	return bg_start + colour;
+}
+
+/*
+ * Map up to `max' blocks from `iblock' on, allocating a run into a hole if
+ * EXT3_GET_BLOCKS_CREATE is set.  bh_result gets the first block.  Returns
+ * the number of blocks mapped the same way from `iblock', 0 for a hole
+ * left alone, or a negative error.
+ */
+int ext3_ext_get_blocks(handle_t *handle, struct inode *inode,
+			sector_t iblock, unsigned long max,
+			struct buffer_head *bh_result, int flags)
+{
+	struct ext3_ext_path path[EXT3_EXT_MAX_DEPTH + 1];
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct ext3_extent newex, *ex;
+	unsigned long count;
+	u32 block = iblock;
+	u32 pblock, len, next;
+	int depth, err;
+
+	if (iblock >= EXT3_EXT_MAX_BLOCK)
+		return -EIO;
+	if (max > EXT3_EXT_MAX_BLOCK - block)
+		max = EXT3_EXT_MAX_BLOCK - block;
+
+	down(&ei->truncate_sem);
+	if (ext3_ext_cache_find(inode, block, &pblock, &len)) {
+		clear_buffer_new(bh_result);
+		goto found;
+	}
+
+	err = ext3_ext_find_extent(inode, block, path);
+	if (err)
+		goto out;
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+
+	if (ex && block >= ext_block(ex) &&
+	    block - ext_block(ex) < ext_len(ex)) {
+		pblock = ext_start(ex) + block - ext_block(ex);
+		len = ext_len(ex) - (block - ext_block(ex));
+		ext3_ext_cache_set(inode, ext_block(ex), ext_len(ex),
+				   ext_start(ex));
+		ext3_ext_drop_path(path, depth);
+		clear_buffer_new(bh_result);
+		goto found;
+	}
+
+	if (!(flags & EXT3_GET_BLOCKS_CREATE)) {
+		ext3_ext_drop_path(path, depth);
+		err = 0;
+		goto out;		/* a hole */
+	}
+
+	/* The run may not reach into the next extent */
+	if (ex && block < ext_block(ex))
+		next = ext_block(ex);
+	else if (ex && ex != EXT_LAST_EXTENT(path[depth].p_hdr))
+		next = ext_block(ex + 1);
+	else
+		next = ext3_ext_next_leaf_block(path, depth);
+	count = min_t(unsigned long, max, next - block);
+	if (count > EXT3_EXT_MAX_LEN)
+		count = EXT3_EXT_MAX_LEN;
+
+	pblock = ext3_new_blocks(handle, inode,
+				 ext3_ext_find_goal(inode, path, block),
+				 &count, flags, &err);
+	if (!pblock) {
+		ext3_ext_drop_path(path, depth);
+		goto out;
+	}
+
+	newex.ee_block = cpu_to_le32(block);
+	newex.ee_len = cpu_to_le16(count);
+	newex.ee_start = cpu_to_le32(pblock);
+	newex.ee_start_hi = 0;
+	err = ext3_ext_insert_extent(handle, inode, path, &newex);
+	if (err) {
+		int freed;
+
+		/* reserved blocks keep their quota until the write is undone */
+		if (flags & EXT3_GET_BLOCKS_RESERVED)
+			ext3_free_blocks_sb(handle, inode->i_sb, pblock, count,
+					    &freed);
+		else
+			ext3_free_blocks(handle, inode, pblock, count);
+		goto out;
+	}
+
+	/*
+	 * i_disksize growing is protected by truncate_sem.  It may not
+	 * reach past the run: delayed blocks after it have no disk space yet.
+	 * Nothing after writeback dirties the inode, so it is done here.
+	 */
+	if (flags & EXT3_GET_BLOCKS_EXTEND) {
+		loff_t size = (loff_t)(block + count) << inode->i_blkbits;
+
+		if (size > inode->i_size)
+			size = inode->i_size;
+		if (size > ei->i_disksize) {
+			ei->i_disksize = size;
+			err = ext3_mark_inode_dirty(handle, inode);
+			if (err)
+				goto out;
+		}
+	}
+	len = count;
+	set_buffer_new(bh_result);
+found:
+	map_bh(bh_result, inode->i_sb, pblock);
+	err = min_t(unsigned long, len, max);
+out:
+	up(&ei->truncate_sem);
+	return err;
+}
+
+/*
+ * ext3_get_block_handle() for extent-mapped files
+ */
+int ext3_ext_get_block(handle_t *handle, struct inode *inode, sector_t iblock,
+		       struct buffer_head *bh_result, int create,
+		       int extend_disksize)
+{
+	int flags = 0;
+	int ret;
+
+	if (create)
+		flags |= EXT3_GET_BLOCKS_CREATE;
+	if (extend_disksize)
+		flags |= EXT3_GET_BLOCKS_EXTEND;
+	ret = ext3_ext_get_blocks(handle, inode, iblock, 1, bh_result, flags);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * ext3_ext_map_run - map a run of blocks without allocating
+ * @inode: an extent-mapped file
+ * @block: first logical block
+ * @pblock: where it is on disk, 0 for a hole
+ * @len: how many blocks from @block on are mapped (or not) the same way
+ */
+int ext3_ext_map_run(struct inode *inode, u32 block, u32 *pblock, u32 *len)
+{
+	struct ext3_ext_path path[EXT3_EXT_MAX_DEPTH + 1];
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct ext3_extent *ex;
+	u32 next;
+	int depth, err;
+
+	down(&ei->truncate_sem);
+	if (ext3_ext_cache_find(inode, block, pblock, len)) {
+		err = 0;
+		goto out;
+	}
+
+	err = ext3_ext_find_extent(inode, block, path);
+	if (err)
+		goto out;
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+
+	if (ex && block >= ext_block(ex) &&
+	    block - ext_block(ex) < ext_len(ex)) {
+		*pblock = ext_start(ex) + block - ext_block(ex);
+		*len = ext_len(ex) - (block - ext_block(ex));
+	} else {
+		if (ex && block < ext_block(ex))
+			next = ext_block(ex);
+		else if (ex && ex != EXT_LAST_EXTENT(path[depth].p_hdr))
+			next = ext_block(ex + 1);
+		else
+			next = ext3_ext_next_leaf_block(path, depth);
+		*pblock = 0;
+		*len = next - block;
+	}
+	ext3_ext_drop_path(path, depth);
+out:
+	up(&ei->truncate_sem);
+	return err;
+}
+
+/*
+ * Journal credits for mapping `nrblocks' blocks, on top of the bitmaps
+ * and group descriptors of the data blocks themselves: the nodes on the
+ * path, and a split of every level plus growing the tree
+ */
+int ext3_ext_index_trans_blocks(struct inode *inode, int nrblocks)
+{
+	int depth = ext_depth(inode);
+
+	return nrblocks * (depth + 1) + 2 * (depth + 2);
+}
+
+/**
+ * ext3_ext_meta_blocks - tree blocks to set aside for delayed blocks
+ * @inode: an extent-mapped file
+ * @nr: number of delayed blocks
+ *
+ * A leaf for each node's worth of them, were every one a separate
+ * extent, the index blocks above those, and a split of every level of
+ * the tree as it is plus a new root level.
+ */
+unsigned long ext3_ext_meta_blocks(struct inode *inode, unsigned long nr)
+{
+	unsigned long per = ext3_ext_node_max(inode->i_sb);
+	unsigned long level = nr, blocks = 0;
+
+	if (!nr)
+		return 0;
+	while (level > 1) {
+		level = (level + per - 1) / per;
+		blocks += level;
+	}
+	return blocks + ext_depth(inode) + 1;
+}
+
+/*
+ * Make sure there is room for one more step of a truncate
+ */
+static int ext3_ext_truncate_extend(handle_t *handle, struct inode *inode)
+{
+	int needed = ext_depth(inode) + 8 + 2 * EXT3_QUOTA_TRANS_BLOCKS;
+
+	if (handle->h_buffer_credits >= needed)
+		return 0;
+	if (!ext3_journal_extend(handle, 4 * needed))
+		return 0;
+	ext3_mark_inode_dirty(handle, inode);
+	return ext3_journal_restart(handle, 4 * needed);
+}
+
+/*
+ * Release blocks no longer mapped by the file, and their quota unless it
+ * goes to the blocks replacing them
+ */
+static void ext3_ext_free_data(handle_t *handle, struct inode *inode,
+			       unsigned long start, unsigned long count,
+			       int quota)
+{
+	unsigned long i;
+	int freed;
+
+	for (i = 0; i < count; i++) {
+		struct buffer_head *bh;
+
+		bh = sb_find_get_block(inode->i_sb, start + i);
+		ext3_forget(handle, 0, inode, bh, start + i);
+	}
+	if (quota)
+		ext3_free_blocks(handle, inode, start, count);
+	else
+		ext3_free_blocks_sb(handle, inode->i_sb, start, count, &freed);
+}
+
+/*
+ * path[level] is an empty node: drop it from its parent, and so on up as
+ * long as that leaves the parent empty.  An empty root index turns back
+ * into an empty leaf.
+ */
+static int ext3_ext_rm_node(handle_t *handle, struct inode *inode,
+			    struct ext3_ext_path *path, int level)
+{
+	struct ext3_extent_header *root = ext_inode_hdr(inode);
+	int i, err = 0;
+
+	for (i = level; i > 0; i--) {
+		struct ext3_extent_header *eh = path[i - 1].p_hdr;
+		struct ext3_extent_idx *ix = path[i - 1].p_idx;
+		unsigned long block = path[i].p_bh->b_blocknr;
+
+		err = ext3_ext_get_access(handle, path + i - 1);
+		if (err)
+			break;
+		memmove(ix, ix + 1, (EXT_LAST_INDEX(eh) - ix) * sizeof(*ix));
+		ext_add_entries(eh, -1);
+		err = ext3_ext_dirty(handle, inode, path + i - 1);
+		if (err)
+			break;
+
+		ext3_forget(handle, 1, inode, path[i].p_bh, block);
+		path[i].p_bh = NULL;
+		ext3_free_blocks(handle, inode, block, 1);
+		if (eh->eh_entries)
+			break;
+	}
+
+	if (!root->eh_entries && root->eh_depth) {
+		root->eh_depth = 0;
+		root->eh_max = cpu_to_le16(EXT3_EXT_ROOT_MAX);
+		err = ext3_mark_inode_dirty(handle, inode);
+	}
+	return err;
+}
+
+/**
+ * ext3_ext_truncate - free the blocks from @start on
+ * @handle: the truncate transaction, which may be restarted
+ * @inode: an extent-mapped file
+ * @start: first logical block to go
+ *
+ * Extents are removed from the end of the file backwards, one at a time,
+ * so the tree is consistent whenever the transaction has to be restarted.
+ * Called under truncate_sem.
+ */
+void ext3_ext_truncate(handle_t *handle, struct inode *inode, u32 start)
+{
+	struct ext3_ext_path path[EXT3_EXT_MAX_DEPTH + 1];
+	struct ext3_extent *ex;
+	int depth, err = 0;
+
+	ext3_ext_cache_set(inode, 0, 0, 0);
+
+	while (!err && !is_handle_aborted(handle)) {
+		u32 eblock, elen, num;
+
+		if (ext3_ext_truncate_extend(handle, inode))
+			break;
+		if (ext3_ext_find_extent(inode, EXT3_EXT_MAX_BLOCK, path))
+			break;
+		depth = ext_depth(inode);
+		ex = path[depth].p_ext;
+
+		if (!ex) {
+			/* an empty leaf, left behind by a failed insert */
+			if (depth)
+				err = ext3_ext_rm_node(handle, inode, path,
+						       depth);
+			ext3_ext_drop_path(path, depth);
+			if (!depth)
+				break;
+			continue;
+		}
+
+		eblock = ext_block(ex);
+		elen = ext_len(ex);
+		if (eblock + elen <= start) {
+			ext3_ext_drop_path(path, depth);
+			break;
+		}
+		num = eblock >= start ? elen : eblock + elen - start;
+
+		err = ext3_ext_get_access(handle, path + depth);
+		if (!err) {
+			if (num == elen)
+				ext_add_entries(path[depth].p_hdr, -1);
+			else
+				ex->ee_len = cpu_to_le16(elen - num);
+			err = ext3_ext_dirty(handle, inode, path + depth);
+		}
+		if (!err) {
+			ext3_ext_free_data(handle, inode,
+					   ext_start(ex) + elen - num, num, 1);
+			if (depth && !path[depth].p_hdr->eh_entries)
+				err = ext3_ext_rm_node(handle, inode, path,
+						       depth);
+		}
+		ext3_ext_drop_path(path, depth);
+	}
+}
+
+/**
+ * ext3_ext_move_run - map a run of blocks somewhere else
+ * @handle: a transaction with ext3_ext_index_trans_blocks() credits for
+ *	one more extent than the run covers, plus the bitmaps freed
+ * @inode: an extent-mapped file
+ * @block: first logical block
+ * @len: number of blocks, all mapped, the last one ending an extent and
+ *	at least one extent lying wholly inside the run
+ * @pblock: start of the @len free blocks, already allocated with
+ *	EXT3_GET_BLOCKS_NOQUOTA, to map there
+ *
+ * The first extent whose start is inside the run is rewritten to map the
+ * whole run at @pblock, the extents after it are cut out, and the tail of
+ * one reaching into the run from before is cut off.  The old blocks are
+ * freed, their quota passing to the new ones.  Nothing is added to the
+ * tree, so no tree block has to be allocated.  All of it goes into the
+ * one transaction, so the file is never seen with a part of the run
+ * unmapped; an error once the tree has been changed aborts the journal.
+ * The caller has moved the data.
+ */
+int ext3_ext_move_run(handle_t *handle, struct inode *inode, u32 block,
+		      u32 len, u32 pblock)
+{
+	struct ext3_ext_path path[EXT3_EXT_MAX_DEPTH + 1];
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	struct ext3_extent *ex;
+	u32 end = block + len;
+	u32 eblock, elen, keep, old;
+	int depth, changed = 0, err;
+
+	down(&ei->truncate_sem);
+	ext3_ext_cache_set(inode, 0, 0, 0);
+
+	err = ext3_ext_find_extent(inode, block, path);
+	if (err)
+		goto out;
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+	if (!ex || ext_block(ex) > block ||
+	    ext_block(ex) + ext_len(ex) <= block)
+		goto changed;
+	eblock = ext_block(ex);
+	elen = ext_len(ex);
+	keep = eblock < block ? eblock + elen : block;
+	if (keep >= end) {
+		ext3_ext_drop_path(path, depth);
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* an extent from before the run loses its tail */
+	if (eblock < block) {
+		err = ext3_ext_get_access(handle, path + depth);
+		if (err) {
+			ext3_ext_drop_path(path, depth);
+			goto out;
+		}
+		changed = 1;
+		ex->ee_len = cpu_to_le16(block - eblock);
+		err = ext3_ext_dirty(handle, inode, path + depth);
+		if (!err)
+			ext3_ext_free_data(handle, inode,
+					   ext_start(ex) + block - eblock,
+					   keep - block, 0);
+	}
+	ext3_ext_drop_path(path, depth);
+	if (err)
+		goto out;
+
+	while (end > keep) {
+		err = ext3_ext_find_extent(inode, end - 1, path);
+		if (err)
+			goto out;
+		depth = ext_depth(inode);
+		ex = path[depth].p_ext;
+		if (!ex || ext_block(ex) < keep ||
+		    ext_block(ex) + ext_len(ex) != end)
+			goto changed;
+
+		eblock = ext_block(ex);
+		elen = ext_len(ex);
+		old = ext_start(ex);
+
+		err = ext3_ext_get_access(handle, path + depth);
+		if (err) {
+			ext3_ext_drop_path(path, depth);
+			goto out;
+		}
+		changed = 1;
+		if (eblock == keep) {
+			ex->ee_block = cpu_to_le32(block);
+			ex->ee_len = cpu_to_le16(len);
+			ex->ee_start = cpu_to_le32(pblock);
+			ex->ee_start_hi = 0;
+		} else {
+			memmove(ex, ex + 1, (EXT_LAST_EXTENT(path[depth].p_hdr) -
+					     ex) * sizeof(*ex));
+			ext_add_entries(path[depth].p_hdr, -1);
+		}
+		err = ext3_ext_dirty(handle, inode, path + depth);
+		if (!err && eblock == keep && depth &&
+		    ex == EXT_FIRST_EXTENT(path[depth].p_hdr))
+			err = ext3_ext_correct_indexes(handle, inode, path);
+		if (!err) {
+			ext3_ext_free_data(handle, inode, old, elen, 0);
+			if (depth && !path[depth].p_hdr->eh_entries)
+				err = ext3_ext_rm_node(handle, inode, path,
+						       depth);
+		}
+		ext3_ext_drop_path(path, depth);
+		if (err)
+			goto out;
+		end = eblock;
+	}
+	ext3_ext_cache_set(inode, block, len, pblock);
+	goto out;
+
+changed:
+	ext3_ext_drop_path(path, depth);
+	ext3_error(inode->i_sb, "ext3_ext_move_run",
+		   "run changed under us, inode=%lu, block=%u",
+		   inode->i_ino, end - 1);
+	err = -EIO;
+out:
+	if (err && changed)
+		ext3_abort(inode->i_sb, "ext3_ext_move_run",
+			   "error %d with the tree half changed, inode=%lu",
+			   err, inode->i_ino);
+	up(&ei->truncate_sem);
+	return err;
+}
+
+/*
+ * Set up an empty tree in a new inode
+ */
+void ext3_ext_tree_init(struct inode *inode)
+{
+	struct ext3_extent_header *eh = ext_inode_hdr(inode);
+
+	memset(EXT3_I(inode)->i_data, 0, sizeof(EXT3_I(inode)->i_data));
+	eh->eh_magic = cpu_to_le16(EXT3_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(EXT3_EXT_ROOT_MAX);
+	EXT3_I(inode)->i_flags |= EXT3_EXTENTS_FL;
+	ext3_ext_cache_set(inode, 0, 0, 0);
+}
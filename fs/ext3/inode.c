@@ -26,6 +26,7 @@
 #include <linux/fs.h>
 #include <linux/time.h>
 #include <linux/ext3_jbd.h>
+#include <linux/ext3_extents.h>
 #include <linux/jbd.h>
 #include <linux/smp_lock.h>
 #include <linux/highuid.h>
@@ -36,6 +37,7 @@
 #include <linux/writeback.h>
 #include <linux/mpage.h>
 #include <linux/uio.h>
+#include <linux/slab.h>
 #include "xattr.h"
 #include "acl.h"
 
@@ -706,11 +708,16 @@ ext3_get_block_handle(handle_t *handle, struct inode *inode, sector_t iblock,
 	unsigned long goal;
 	int left;
 	int boundary = 0;
-	int depth = ext3_block_to_path(inode, iblock, offsets, &boundary);
+	int depth;
 	struct ext3_inode_info *ei = EXT3_I(inode);
 
 	J_ASSERT(handle != NULL || create == 0);
 
+	if (ext3_inode_has_extents(inode))
+		return ext3_ext_get_block(handle, inode, iblock, bh_result,
+					  create, extend_disksize);
+
+	depth = ext3_block_to_path(inode, iblock, offsets, &boundary);
 	if (depth == 0)
 		goto out;
 
@@ -812,6 +819,27 @@ static int ext3_get_block(struct inode *inode, sector_t iblock,
 	return ret;
 }
 
+/*
+ * Where block `block' of the file is on disk (0 for a hole), and how many
+ * blocks on from it are known to be mapped the same way.  For the
+ * fragmentation report.
+ */
+int ext3_map_run(struct inode *inode, u32 block, u32 *pblock, u32 *len)
+{
+	struct buffer_head dummy;
+	int err;
+
+	if (ext3_inode_has_extents(inode))
+		return ext3_ext_map_run(inode, block, pblock, len);
+
+	dummy.b_state = 0;
+	dummy.b_blocknr = -1000;
+	err = ext3_get_block_handle(NULL, inode, block, &dummy, 0, 0);
+	*pblock = buffer_mapped(&dummy) ? dummy.b_blocknr : 0;
+	*len = 1;
+	return err;
+}
+
 #define DIO_CREDITS (EXT3_RESERVE_TRANS_BLOCKS + 32)
 
 static int
@@ -1134,6 +1162,128 @@ static int ext3_journalled_commit_write(struct file *file,
 	return ret;
 }
 
+/*
+ * Delayed allocation.  A write into a hole of an extent-mapped file only
+ * reserves a block, in ext3_reserve_blocks() and in quota, and leaves the
+ * buffer BH_Delay and unmapped.  Enough extent tree blocks for all the
+ * file's delayed blocks are reserved along with them, in i_da_meta, and
+ * what the tree has not used is given back as the delayed blocks go.  Writeback then allocates a run for the
+ * delayed buffer it meets and as many delayed buffers as follow it in the
+ * page cache, and maps them all.  Without a transaction to open, write()
+ * no longer touches the journal unless it has to grow i_disksize over
+ * blocks which are on disk already.
+ */
+static int ext3_bh_delay(handle_t *handle, struct buffer_head *bh)
+{
+	return buffer_delay(bh);
+}
+
+/*
+ * i_sem keeps other writers out between working out the tree blocks
+ * needed and reserving them.  Writeback only lowers i_da_meta meanwhile,
+ * so at worst a little too much is reserved.
+ */
+static int ext3_da_reserve(struct inode *inode)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	unsigned long meta, nr;
+
+	spin_lock(&ei->i_da_lock);
+	meta = ext3_ext_meta_blocks(inode, ei->i_da_blocks + 1);
+	meta = meta > ei->i_da_meta ? meta - ei->i_da_meta : 0;
+	spin_unlock(&ei->i_da_lock);
+
+	nr = 1 + meta;
+	if (DQUOT_ALLOC_BLOCK(inode, nr))
+		return -EDQUOT;
+	if (ext3_reserve_blocks(inode->i_sb, nr)) {
+		DQUOT_FREE_BLOCK(inode, nr);
+		return -ENOSPC;
+	}
+
+	spin_lock(&ei->i_da_lock);
+	ei->i_da_blocks++;
+	ei->i_da_meta += meta;
+	spin_unlock(&ei->i_da_lock);
+	return 0;
+}
+
+/*
+ * `used' delayed blocks have been allocated and `dropped' ones thrown
+ * away.  Their reservations go, and the quota of the dropped ones, along
+ * with the tree blocks the remaining delayed blocks no longer need.
+ */
+static void ext3_da_release(struct inode *inode, unsigned long used,
+			    unsigned long dropped)
+{
+	struct ext3_inode_info *ei = EXT3_I(inode);
+	unsigned long meta, need;
+
+	spin_lock(&ei->i_da_lock);
+	ei->i_da_blocks -= used + dropped;
+	need = ext3_ext_meta_blocks(inode, ei->i_da_blocks);
+	meta = ei->i_da_meta > need ? ei->i_da_meta - need : 0;
+	ei->i_da_meta -= meta;
+	spin_unlock(&ei->i_da_lock);
+
+	DQUOT_FREE_BLOCK(inode, dropped + meta);
+	ext3_release_blocks(inode->i_sb, used + dropped + meta);
+}
+
+/*
+ * get_block for prepare_write(): map what is on disk, reserve the rest.
+ * The reserved buffer is BH_New so that block_prepare_write() zeroes
+ * around the write.
+ */
+static int ext3_da_get_block_prep(struct inode *inode, sector_t iblock,
+				  struct buffer_head *bh_result, int create)
+{
+	int ret;
+
+	if (buffer_delay(bh_result))
+		return 0;
+	ret = ext3_get_block_handle(NULL, inode, iblock, bh_result, 0, 0);
+	if (ret || buffer_mapped(bh_result) || !create)
+		return ret;
+	ret = ext3_da_reserve(inode);
+	if (ret)
+		return ret;
+	set_buffer_delay(bh_result);
+	set_buffer_new(bh_result);
+	return 0;
+}
+
+static int ext3_da_prepare_write(struct file *file, struct page *page,
+				 unsigned from, unsigned to)
+{
+	struct inode *inode = page->mapping->host;
+	int ret, retries = 0;
+
+retry:
+	ret = block_prepare_write(page, from, to, ext3_da_get_block_prep);
+	if (ret == -ENOSPC && ext3_should_retry_alloc(inode->i_sb, &retries))
+		goto retry;
+	return ret;
+}
+
+/*
+ * i_disksize may only grow over blocks which are on disk.  Delayed ones
+ * grow it when writeback allocates them.
+ */
+static int ext3_da_commit_write(struct file *file, struct page *page,
+				unsigned from, unsigned to)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t new_i_size;
+
+	new_i_size = ((loff_t)page->index << PAGE_CACHE_SHIFT) + to;
+	if (new_i_size > EXT3_I(inode)->i_disksize &&
+	    !walk_page_buffers(NULL, page_buffers(page), from, to, NULL,
+			       ext3_bh_delay))
+		EXT3_I(inode)->i_disksize = new_i_size;
+	return generic_commit_write(file, page, from, to);
+}
+
 /* 
  * bmap() is special.  It gets used by applications such as lilo and by
  * the swapper to find the on-disk block of a specific piece of data.
@@ -1257,8 +1407,8 @@ static int journal_dirty_data_fn(handle_t *handle, struct buffer_head *bh)
  * AKPM2: if all the page's buffers are mapped to disk and !data=journal,
  * we don't need to open a transaction here.
  */
-static int ext3_ordered_writepage(struct page *page,
-			struct writeback_control *wbc)
+static int __ext3_ordered_writepage(struct page *page,
+			struct writeback_control *wbc, get_block_t *get_block)
 {
 	struct inode *inode = page->mapping->host;
 	struct buffer_head *page_bufs;
@@ -1290,7 +1440,7 @@ static int ext3_ordered_writepage(struct page *page,
 	walk_page_buffers(handle, page_bufs, 0,
 			PAGE_CACHE_SIZE, NULL, bget_one);
 
-	ret = block_write_full_page(page, ext3_get_block, wbc);
+	ret = block_write_full_page(page, get_block, wbc);
 
 	/*
 	 * The page can become unlocked at any point now, and
@@ -1323,8 +1473,14 @@ out_fail:
 	return ret;
 }
 
-static int ext3_writeback_writepage(struct page *page,
-				struct writeback_control *wbc)
+static int ext3_ordered_writepage(struct page *page,
+			struct writeback_control *wbc)
+{
+	return __ext3_ordered_writepage(page, wbc, ext3_get_block);
+}
+
+static int __ext3_writeback_writepage(struct page *page,
+			struct writeback_control *wbc, get_block_t *get_block)
 {
 	struct inode *inode = page->mapping->host;
 	handle_t *handle = NULL;
@@ -1340,7 +1496,7 @@ static int ext3_writeback_writepage(struct page *page,
 		goto out_fail;
 	}
 
-	ret = block_write_full_page(page, ext3_get_block, wbc);
+	ret = block_write_full_page(page, get_block, wbc);
 	err = ext3_journal_stop(handle);
 	if (!ret)
 		ret = err;
@@ -1352,6 +1508,182 @@ out_fail:
 	return ret;
 }
 
+static int ext3_writeback_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	return __ext3_writeback_writepage(page, wbc, ext3_get_block);
+}
+
+/*
+ * Most pages a delayed allocation locks to map in one run
+ */
+#define EXT3_DA_MAX_PAGES	256
+
+static inline int ext3_da_pending(struct buffer_head *bh)
+{
+	return buffer_delay(bh) && buffer_dirty(bh) && buffer_uptodate(bh);
+}
+
+/*
+ * Count the delayed buffers from `bh' on: the rest of its page, then
+ * following pages for as long as they are delayed from their start and
+ * can be locked without waiting.  The pages are returned locked in
+ * `pages'.
+ */
+static unsigned long ext3_da_collect(struct inode *inode, sector_t iblock,
+				     struct buffer_head *bh,
+				     struct page **pages, int max_pages,
+				     int *nr_pages)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct buffer_head *head = page_buffers(bh->b_page);
+	unsigned long count = 0, limit, n;
+	pgoff_t index = bh->b_page->index + 1;
+	struct page *page;
+	sector_t last;
+
+	last = (i_size_read(inode) - 1) >> inode->i_blkbits;
+	limit = EXT3_EXT_MAX_LEN;
+	if (last >= iblock && last - iblock + 1 < limit)
+		limit = last - iblock + 1;
+
+	do {
+		if (count >= limit || !ext3_da_pending(bh))
+			return count ? count : 1;
+		count++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	while (*nr_pages < max_pages && count < limit) {
+		page = find_get_page(mapping, index);
+		if (!page)
+			break;
+		if (TestSetPageLocked(page)) {
+			page_cache_release(page);
+			break;
+		}
+		if (page->mapping != mapping || !page_has_buffers(page)) {
+			unlock_page(page);
+			page_cache_release(page);
+			break;
+		}
+		n = 0;
+		head = bh = page_buffers(page);
+		do {
+			if (count + n >= limit || !ext3_da_pending(bh))
+				break;
+			n++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		if (!n) {
+			unlock_page(page);
+			page_cache_release(page);
+			break;
+		}
+		pages[(*nr_pages)++] = page;
+		count += n;
+		if (n != (PAGE_CACHE_SIZE >> inode->i_blkbits))
+			break;
+		index++;
+	}
+	return count;
+}
+
+/*
+ * Map the `count' blocks from bh_result's on to the delayed buffers
+ * ext3_da_collect() counted.  In data=ordered mode the buffers on other
+ * pages go on the transaction's data list now, as bh_result's page will
+ * once it has been written, so that none of the run can be committed
+ * ahead of its data.
+ */
+static int ext3_da_map(handle_t *handle, struct inode *inode,
+		       struct buffer_head *bh_result, unsigned long count,
+		       struct page **pages, int nr_pages)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long pblock = bh_result->b_blocknr;
+	struct buffer_head *bh = bh_result, *head;
+	int order = ext3_should_order_data(inode);
+	unsigned long i = 0;
+	int p, err, ret = 0;
+
+	head = page_buffers(bh_result->b_page);
+	do {
+		if (bh != bh_result) {
+			map_bh(bh, sb, pblock + i);
+			unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+		}
+		clear_buffer_delay(bh);
+		i++;
+		bh = bh->b_this_page;
+	} while (i < count && bh != head);
+
+	for (p = 0; p < nr_pages && i < count; p++) {
+		head = bh = page_buffers(pages[p]);
+		do {
+			map_bh(bh, sb, pblock + i);
+			unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+			clear_buffer_delay(bh);
+			if (order) {
+				err = ext3_journal_dirty_data(handle, bh);
+				if (!ret)
+					ret = err;
+			}
+			i++;
+			bh = bh->b_this_page;
+		} while (i < count && bh != head);
+	}
+	ext3_da_release(inode, count, 0);
+	return ret;
+}
+
+/*
+ * get_block for writepage() under delayed allocation: one allocation for
+ * the delayed buffer writeback has reached and those after it.
+ */
+static int ext3_da_get_block_write(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create)
+{
+	handle_t *handle = ext3_journal_current_handle();
+	struct page **pages;
+	unsigned long count;
+	int nr_pages = 0;
+	int i, ret;
+
+	if (!buffer_delay(bh_result))
+		return ext3_get_block(inode, iblock, bh_result, create);
+	J_ASSERT(handle != NULL);
+
+	pages = kmalloc(EXT3_DA_MAX_PAGES * sizeof(struct page *), GFP_NOFS);
+	count = ext3_da_collect(inode, iblock, bh_result, pages,
+				pages ? EXT3_DA_MAX_PAGES : 0, &nr_pages);
+	ret = ext3_ext_get_blocks(handle, inode, iblock, count, bh_result,
+				  EXT3_GET_BLOCKS_CREATE |
+				  EXT3_GET_BLOCKS_EXTEND |
+				  EXT3_GET_BLOCKS_RESERVED);
+	if (ret > 0)
+		ret = ext3_da_map(handle, inode, bh_result, ret, pages,
+				  nr_pages);
+	for (i = 0; i < nr_pages; i++) {
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+	kfree(pages);
+	return ret;
+}
+
+static int ext3_da_ordered_writepage(struct page *page,
+				     struct writeback_control *wbc)
+{
+	return __ext3_ordered_writepage(page, wbc, ext3_da_get_block_write);
+}
+
+static int ext3_da_writeback_writepage(struct page *page,
+				       struct writeback_control *wbc)
+{
+	return __ext3_writeback_writepage(page, wbc, ext3_da_get_block_write);
+}
+
 static int ext3_journalled_writepage(struct page *page,
 				struct writeback_control *wbc)
 {
@@ -1442,6 +1774,50 @@ static int ext3_releasepage(struct page *page, int wait)
 	return journal_try_to_free_buffers(journal, page, wait);
 }
 
+/*
+ * Delayed buffers being thrown away give back their reservations
+ */
+static int ext3_da_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct buffer_head *head, *bh;
+	unsigned int curr_off = 0;
+	int nr = 0;
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			if (curr_off >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				nr++;
+			}
+			curr_off += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	if (nr)
+		ext3_da_release(page->mapping->host, 0, nr);
+	return ext3_invalidatepage(page, offset);
+}
+
+/*
+ * A clean page can still hold delayed buffers, beyond i_size while a
+ * truncate is on its way.  They go in ext3_da_invalidatepage().
+ */
+static int ext3_da_releasepage(struct page *page, int wait)
+{
+	if (walk_page_buffers(NULL, page_buffers(page), 0, PAGE_CACHE_SIZE,
+			      NULL, ext3_bh_delay))
+		return 0;
+	return ext3_releasepage(page, wait);
+}
+
+static sector_t ext3_da_bmap(struct address_space *mapping, sector_t block)
+{
+	/* delayed blocks are not anywhere yet */
+	filemap_write_and_wait(mapping);
+	return ext3_bmap(mapping, block);
+}
+
 /*
  * If the O_DIRECT write will extend the file then add this inode to the
  * orphan list.  So recovery will truncate it back to the original size
@@ -1576,9 +1952,39 @@ static struct address_space_operations ext3_journalled_aops = {
 	.releasepage	= ext3_releasepage,
 };
 
+static struct address_space_operations ext3_da_ordered_aops = {
+	.readpage	= ext3_readpage,
+	.readpages	= ext3_readpages,
+	.writepage	= ext3_da_ordered_writepage,
+	.sync_page	= block_sync_page,
+	.prepare_write	= ext3_da_prepare_write,
+	.commit_write	= ext3_da_commit_write,
+	.bmap		= ext3_da_bmap,
+	.invalidatepage	= ext3_da_invalidatepage,
+	.releasepage	= ext3_da_releasepage,
+	.direct_IO	= ext3_direct_IO,
+};
+
+static struct address_space_operations ext3_da_writeback_aops = {
+	.readpage	= ext3_readpage,
+	.readpages	= ext3_readpages,
+	.writepage	= ext3_da_writeback_writepage,
+	.sync_page	= block_sync_page,
+	.prepare_write	= ext3_da_prepare_write,
+	.commit_write	= ext3_da_commit_write,
+	.bmap		= ext3_da_bmap,
+	.invalidatepage	= ext3_da_invalidatepage,
+	.releasepage	= ext3_da_releasepage,
+	.direct_IO	= ext3_direct_IO,
+};
+
 void ext3_set_aops(struct inode *inode)
 {
-	if (ext3_should_order_data(inode))
+	if (ext3_should_delay_alloc(inode) && ext3_should_order_data(inode))
+		inode->i_mapping->a_ops = &ext3_da_ordered_aops;
+	else if (ext3_should_delay_alloc(inode))
+		inode->i_mapping->a_ops = &ext3_da_writeback_aops;
+	else if (ext3_should_order_data(inode))
 		inode->i_mapping->a_ops = &ext3_ordered_aops;
 	else if (ext3_should_writeback_data(inode))
 		inode->i_mapping->a_ops = &ext3_writeback_aops;
@@ -2075,6 +2481,7 @@ void ext3_truncate(struct inode * inode)
 		return;
 
 	ext3_discard_reservation(inode);
+	ext3_dx_unpin(inode);
 
 	/*
 	 * We have to lock the EOF page here, because lock_page() nests
@@ -2107,9 +2514,12 @@ void ext3_truncate(struct inode * inode)
 	if (page)
 		ext3_block_truncate_page(handle, page, mapping, inode->i_size);
 
-	n = ext3_block_to_path(inode, last_block, offsets, NULL);
-	if (n == 0)
-		goto out_stop;	/* error */
+	n = 0;
+	if (!ext3_inode_has_extents(inode)) {
+		n = ext3_block_to_path(inode, last_block, offsets, NULL);
+		if (n == 0)
+			goto out_stop;	/* error */
+	}
 
 	/*
 	 * OK.  This truncate is going to happen.  We add the inode to the
@@ -2138,6 +2548,11 @@ void ext3_truncate(struct inode * inode)
 	 */
 	down(&ei->truncate_sem);
 
+	if (ext3_inode_has_extents(inode)) {
+		ext3_ext_truncate(handle, inode, last_block);
+		goto out_unlock;
+	}
+
 	if (n == 1) {		/* direct blocks */
 		ext3_free_data(handle, inode, NULL, i_data+offsets[0],
 			       i_data + EXT3_NDIR_BLOCKS);
@@ -2200,6 +2615,7 @@ do_indirects:
 		case EXT3_TIND_BLOCK:
 			;
 	}
+out_unlock:
 	up(&ei->truncate_sem);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 	ext3_mark_inode_dirty(handle, inode);
@@ -2443,6 +2859,7 @@ void ext3_read_inode(struct inode * inode)
 	ei->i_next_alloc_block = 0;
 	ei->i_next_alloc_goal = 0;
 	ei->i_dir_start_lookup = 0;
+	ei->i_cached_extent.ec_len = 0;
 	ei->i_dtime = le32_to_cpu(raw_inode->i_dtime);
 	/* We now have enough fields to check if the inode was active or not.
 	 * This is needed because nfsd might try to access dead inodes
@@ -2843,6 +3260,9 @@ static int ext3_writepage_trans_blocks(struct inode *inode)
 	int indirects = (EXT3_NDIR_BLOCKS % bpp) ? 5 : 3;
 	int ret;
 
+	if (ext3_inode_has_extents(inode))
+		indirects = ext3_ext_index_trans_blocks(inode, bpp);
+
 	if (ext3_should_journal_data(inode))
 		ret = 3 * (bpp + indirects) + 2;
 	else
@@ -3020,6 +3440,9 @@ int ext3_change_inode_journal_flag(struct inode *inode, int val)
 	if (is_journal_aborted(journal) || IS_RDONLY(inode))
 		return -EROFS;
 
+	/* Delayed blocks must be allocated before the aops can change */
+	filemap_write_and_wait(inode->i_mapping);
+
 	journal_lock_updates(journal);
 	journal_flush(journal);
 
@@ -11,9 +11,81 @@
 #include <linux/jbd.h>
 #include <linux/ext3_fs.h>
 #include <linux/ext3_jbd.h>
+#include <linux/ext3_extents.h>
 #include <linux/time.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
 #include <asm/uaccess.h>
 
+/*
+ * Most runs of blocks reported per EXT3_IOC_GETFRAG call
+ */
+#define EXT3_FRAG_MAX	(PAGE_SIZE / sizeof(struct ext3_frag_extent))
+
+static int ext3_ioctl_getfrag(struct inode *inode,
+			      struct ext3_frag_report __user *arg)
+{
+	struct ext3_frag_report fr;
+	struct ext3_frag_extent *fe;
+	u32 block, last, pblock, len;
+	int count, n = 0, err = 0;
+
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+		return -EINVAL;
+	if (copy_from_user(&fr, arg, sizeof(fr)))
+		return -EFAULT;
+	/* no room would report nothing, and no progress either */
+	if (!fr.fr_count)
+		return -EINVAL;
+
+	count = min_t(u32, fr.fr_count, EXT3_FRAG_MAX);
+	fe = kmalloc(EXT3_FRAG_MAX * sizeof(*fe), GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+
+	last = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >>
+		inode->i_sb->s_blocksize_bits;
+	for (block = fr.fr_start; block < last; block += len) {
+		cond_resched();
+		err = ext3_map_run(inode, block, &pblock, &len);
+		if (err)
+			break;
+		if (len > last - block)
+			len = last - block;
+		if (!pblock)
+			continue;
+		if (n && fe[n - 1].fe_logical + fe[n - 1].fe_length == block &&
+		    fe[n - 1].fe_physical + fe[n - 1].fe_length == pblock) {
+			fe[n - 1].fe_length += len;
+			continue;
+		}
+		if (n == count)
+			break;
+		fe[n].fe_logical = block;
+		fe[n].fe_physical = pblock;
+		fe[n].fe_length = len;
+		fe[n].fe_reserved = 0;
+		n++;
+	}
+	if (err)
+		goto out;
+
+	fr.fr_count = n;
+	fr.fr_next = block;
+	fr.fr_flags = block >= last ? EXT3_FRAG_LAST : 0;
+	fr.fr_depth = 0;
+	if (ext3_inode_has_extents(inode)) {
+		fr.fr_flags |= EXT3_FRAG_EXTENTS;
+		fr.fr_depth = ext_depth(inode);
+	}
+	if (copy_to_user(arg, &fr, sizeof(fr)) ||
+	    copy_to_user(arg->fr_extents, fe, n * sizeof(*fe)))
+		err = -EFAULT;
+out:
+	kfree(fe);
+	return err;
+}
+
 
 int ext3_ioctl (struct inode * inode, struct file * filp, unsigned int cmd,
 		unsigned long arg)
@@ -218,6 +290,27 @@ flags_err:
 
 		return err;
 	}
+	case EXT3_IOC_GETFRAG:
+		return ext3_ioctl_getfrag(inode,
+				(struct ext3_frag_report __user *) arg);
+	case EXT3_IOC_DEFRAG: {
+		struct ext3_defrag_range dr;
+		int err;
+
+		if (IS_RDONLY(inode))
+			return -EROFS;
+
+		if (copy_from_user(&dr, (struct ext3_defrag_range __user *)arg,
+				sizeof(dr)))
+			return -EFAULT;
+
+		err = ext3_defrag(filp, &dr);
+		if (copy_to_user((struct ext3_defrag_range __user *)arg, &dr,
+				sizeof(dr)))
+			return -EFAULT;
+
+		return err;
+	}
 
 
 	default:
@@ -0,0 +1,682 @@
+/*
+ *  linux/fs/ext3/mballoc.c
+ *
+ * Multi-block allocation.
+ *
+ * ext3_new_block() hands out one block per call.  ext3_new_blocks() hands
+ * out a physically contiguous run, found through a summary of each group's
+ * free space kept in memory, buddy fashion: order 0 has a bit per block,
+ * set if the block is free in both the bitmap and its last-committed copy,
+ * and order k a bit per aligned chunk of 2^k blocks, set if all of the
+ * chunk is free.  Each order also counts its set bits, so a group which
+ * cannot satisfy a request is passed over without searching it.
+ *
+ * A summary is only a hint.  Blocks are claimed in the bitmap itself, the
+ * way ext3_new_block() claims them, and a claim that fails just sends the
+ * summary to be rebuilt.  Blocks ext3_new_block() claims are cleared from
+ * the summary as it goes.  Freed blocks only become allocatable once the
+ * transaction freeing them has committed, so a free leaves the summary as
+ * it is and has it rebuilt from the bitmap after that commit.
+ *
+ * Summaries are built the first time a group is searched, and are
+ * protected by the group's sb_bgl_lock().  Building one reads the
+ * last-committed bitmap too, under jbd_lock_bh_state(), which is taken
+ * first.
+ *
+ * Statistics are in /proc/fs/ext3/<device>/mb_stats.
+ */
+
+#include <linux/config.h>
+#include <linux/time.h>
+#include <linux/fs.h>
+#include <linux/jbd.h>
+#include <linux/ext3_fs.h>
+#include <linux/ext3_jbd.h>
+#include <linux/quotaops.h>
+#include <linux/buffer_head.h>
+#include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define in_range(b, first, len)	((b) >= (first) && (b) <= (first) + (len) - 1)
+
+/* Enough orders for a group of 8 * 64k blocks */
+#define EXT3_MB_ORDERS		20
+
+struct ext3_buddy {
+	unsigned long	*bb_map;	/* all orders, see mb_offset */
+	int		bb_valid;	/* bb_map matches the bitmap */
+	int		bb_freed;	/* blocks were freed in bb_tid */
+	tid_t		bb_tid;
+	int		bb_blocks;	/* blocks in the group */
+	unsigned int	bb_free[EXT3_MB_ORDERS];	/* set bits per order */
+};
+
+struct ext3_mb_info {
+	struct ext3_buddy	**mb_groups;
+	unsigned long		mb_ngroups;	/* room in mb_groups */
+	int			mb_order;	/* largest order */
+	unsigned int		mb_offset[EXT3_MB_ORDERS];	/* in longs */
+	unsigned int		mb_size;	/* bytes in a bb_map */
+	struct proc_dir_entry	*mb_proc;
+
+	atomic_t		mb_reqs;	/* runs asked for */
+	atomic_t		mb_wanted;	/* blocks asked for */
+	atomic_t		mb_allocs;	/* runs handed out */
+	atomic_t		mb_blocks;	/* blocks handed out */
+	atomic_t		mb_full;	/* runs as long as asked */
+	atomic_t		mb_goal_hits;	/* runs starting at the goal */
+	atomic_t		mb_scanned;	/* groups searched */
+	atomic_t		mb_builds;	/* summaries built */
+	atomic_t		mb_lost;	/* claims lost to a race */
+	atomic_t		mb_fallbacks;	/* left to ext3_new_block() */
+};
+
+static struct proc_dir_entry *ext3_proc_root;
+
+static inline unsigned long *mb_map(struct ext3_mb_info *mb,
+				    struct ext3_buddy *bb, int order)
+{
+	return bb->bb_map + mb->mb_offset[order];
+}
+
+static int ext3_mb_group_blocks(struct super_block *sb, int group)
+{
+	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
+
+	if (group == EXT3_SB(sb)->s_groups_count - 1)
+		return le32_to_cpu(es->s_blocks_count) -
+			le32_to_cpu(es->s_first_data_block) -
+			group * EXT3_BLOCKS_PER_GROUP(sb);
+	return EXT3_BLOCKS_PER_GROUP(sb);
+}
+
+/*
+ * Rebuild the summary from the bitmap.  Called with the bitmap's
+ * jbd_lock_bh_state() and the group lock held.
+ */
+static void ext3_mb_build(struct super_block *sb, int group,
+			  struct ext3_buddy *bb, struct buffer_head *bitmap_bh)
+{
+	struct ext3_mb_info *mb = EXT3_SB(sb)->s_mb;
+	char *committed = NULL;
+	unsigned long *map, *prev;
+	int i, k, n;
+
+	if (buffer_jbd(bitmap_bh))
+		committed = bh2jh(bitmap_bh)->b_committed_data;
+
+	memset(bb->bb_map, 0, mb->mb_size);
+	memset(bb->bb_free, 0, sizeof(bb->bb_free));
+	bb->bb_blocks = ext3_mb_group_blocks(sb, group);
+
+	map = mb_map(mb, bb, 0);
+	for (i = 0; i < bb->bb_blocks; i++) {
+		if (ext3_test_bit(i, bitmap_bh->b_data))
+			continue;
+		if (committed && ext3_test_bit(i, committed))
+			continue;
+		__set_bit(i, map);
+		bb->bb_free[0]++;
+	}
+	for (k = 1; k <= mb->mb_order; k++) {
+		prev = map;
+		map = mb_map(mb, bb, k);
+		n = bb->bb_blocks >> k;
+		for (i = 0; i < n; i++) {
+			if (test_bit(2 * i, prev) && test_bit(2 * i + 1, prev)) {
+				__set_bit(i, map);
+				bb->bb_free[k]++;
+			}
+		}
+	}
+	bb->bb_valid = 1;
+	bb->bb_freed = 0;
+	atomic_inc(&mb->mb_builds);
+}
+
+static inline int ext3_mb_stale(struct super_block *sb, struct ext3_buddy *bb)
+{
+	if (!bb->bb_valid)
+		return 1;
+	return bb->bb_freed &&
+		tid_geq(EXT3_SB(sb)->s_journal->j_commit_sequence, bb->bb_tid);
+}
+
+/* Clear `len' blocks from `start' at every order.  Group lock held. */
+static void ext3_mb_mark_used(struct ext3_mb_info *mb, struct ext3_buddy *bb,
+			      int start, int len)
+{
+	int k, i, last;
+
+	for (k = 0; k <= mb->mb_order; k++) {
+		unsigned long *map = mb_map(mb, bb, k);
+
+		last = (start + len - 1) >> k;
+		for (i = start >> k; i <= last; i++)
+			if (__test_and_clear_bit(i, map))
+				bb->bb_free[k]--;
+	}
+}
+
+/* Free blocks from `start' on, up to `want' of them */
+static inline int ext3_mb_extend(unsigned long *map, int start, int want,
+				 int blocks)
+{
+	int end = start + want;
+
+	if (end > blocks)
+		end = blocks;
+	return find_next_zero_bit(map, end, start) - start;
+}
+
+/* First free chunk of order `k' at or after `goal', wrapping around */
+static int ext3_mb_first(struct ext3_mb_info *mb, struct ext3_buddy *bb,
+			 int k, int goal)
+{
+	unsigned long *map = mb_map(mb, bb, k);
+	int n = bb->bb_blocks >> k;
+	int i, from = goal > 0 ? goal >> k : 0;
+
+	if (from >= n)
+		from = 0;
+	i = find_next_bit(map, n, from);
+	if (i >= n && from)
+		i = find_next_bit(map, from, 0);
+	if (i >= n)
+		return -1;
+	return i << k;
+}
+
+/*
+ * Find a run of up to `want' free blocks: at `goal' if that run is long
+ * enough, else in the smallest order of chunk which holds the lot, else
+ * in the largest chunk there is.  Returns its first block, with its length
+ * in *lenp, or -1.  Group lock held.
+ */
+static int ext3_mb_find(struct ext3_mb_info *mb, struct ext3_buddy *bb,
+			int goal, int want, int *lenp)
+{
+	unsigned long *map0 = mb_map(mb, bb, 0);
+	int best = -1, bestlen = 0;
+	int k, o, start = -1, len;
+
+	if (goal >= 0 && goal < bb->bb_blocks && test_bit(goal, map0)) {
+		best = goal;
+		bestlen = ext3_mb_extend(map0, goal, want, bb->bb_blocks);
+		if (bestlen >= want)
+			goto out;
+	}
+
+	k = fls(want - 1);
+	if (k > mb->mb_order)
+		k = mb->mb_order;
+	for (o = k; o <= mb->mb_order && start < 0; o++)
+		if (bb->bb_free[o])
+			start = ext3_mb_first(mb, bb, o, goal);
+	for (o = k - 1; o >= 0 && start < 0; o--)
+		if (bb->bb_free[o])
+			start = ext3_mb_first(mb, bb, o, goal);
+	if (start >= 0) {
+		len = ext3_mb_extend(map0, start, want, bb->bb_blocks);
+		if (len > bestlen) {
+			best = start;
+			bestlen = len;
+		}
+	}
+out:
+	*lenp = bestlen;
+	return best;
+}
+
+/*
+ * Set the bits of the run in the bitmap, stopping at the first one which
+ * is not free after all.  Returns how many were claimed.
+ */
+static int ext3_mb_claim(spinlock_t *lock, int start, int len,
+			 struct buffer_head *bh)
+{
+	struct journal_head *jh = bh2jh(bh);
+	int i;
+
+	jbd_lock_bh_state(bh);
+	for (i = 0; i < len; i++) {
+		if (jh->b_committed_data &&
+		    ext3_test_bit(start + i, jh->b_committed_data))
+			break;
+		if (ext3_set_bit_atomic(lock, start + i, bh->b_data))
+			break;
+	}
+	jbd_unlock_bh_state(bh);
+	return i;
+}
+
+static struct ext3_buddy *ext3_mb_alloc_buddy(struct ext3_mb_info *mb)
+{
+	struct ext3_buddy *bb;
+
+	bb = kmalloc(sizeof(*bb), GFP_NOFS);
+	if (!bb)
+		return NULL;
+	memset(bb, 0, sizeof(*bb));
+	bb->bb_map = kmalloc(mb->mb_size, GFP_NOFS);
+	if (!bb->bb_map) {
+		kfree(bb);
+		return NULL;
+	}
+	return bb;
+}
+
+/*
+ * Look for a run in one group, of at least `min' blocks unless it starts
+ * at the goal.  Returns its group-relative start with the summary updated
+ * to match, or -1.
+ */
+static int ext3_mb_search_group(struct super_block *sb, int group,
+				struct buffer_head *bitmap_bh, int goal,
+				int want, int min, int *lenp)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_mb_info *mb = sbi->s_mb;
+	struct ext3_buddy *bb, *new = NULL;
+	int start = -1;
+
+	if (group >= mb->mb_ngroups)
+		return -1;
+	if (!mb->mb_groups[group]) {
+		new = ext3_mb_alloc_buddy(mb);
+		if (!new)
+			return -1;
+	}
+
+	jbd_lock_bh_state(bitmap_bh);
+	spin_lock(sb_bgl_lock(sbi, group));
+	bb = mb->mb_groups[group];
+	if (!bb) {
+		bb = mb->mb_groups[group] = new;
+		new = NULL;
+	}
+	if (ext3_mb_stale(sb, bb))
+		ext3_mb_build(sb, group, bb, bitmap_bh);
+	atomic_inc(&mb->mb_scanned);
+	start = ext3_mb_find(mb, bb, goal, want, lenp);
+	if (start >= 0 && *lenp < min && start != goal)
+		start = -1;
+	if (start >= 0)
+		ext3_mb_mark_used(mb, bb, start, *lenp);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	jbd_unlock_bh_state(bitmap_bh);
+
+	if (new) {
+		kfree(new->bb_map);
+		kfree(new);
+	}
+	return start;
+}
+
+static void ext3_mb_invalidate(struct super_block *sb, int group)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_buddy *bb;
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	bb = sbi->s_mb->mb_groups[group];
+	if (bb)
+		bb->bb_valid = 0;
+	spin_unlock(sb_bgl_lock(sbi, group));
+}
+
+/*
+ * Run the single block allocator instead, passing on that reserved
+ * blocks have their space and quota already, or moved ones their quota.
+ */
+static unsigned long ext3_mb_fallback(handle_t *handle, struct inode *inode,
+				      unsigned long goal, unsigned long *count,
+				      int flags, int *errp)
+{
+	unsigned long block;
+
+	block = __ext3_new_block(handle, inode, goal, flags, errp);
+	*count = block ? 1 : 0;
+	return block;
+}
+
+/**
+ * ext3_new_blocks - allocate a run of blocks
+ * @handle: the running transaction
+ * @inode: the file they are for
+ * @goal: where the run should start
+ * @count: blocks wanted in, blocks allocated out
+ * @flags: EXT3_GET_BLOCKS_RESERVED if ext3_reserve_blocks() and quota
+ *	have accounted for the blocks already, EXT3_GET_BLOCKS_NOQUOTA if
+ *	only quota has
+ * @errp: error out
+ *
+ * Returns the first block of a physically contiguous run, within one
+ * group, of at most *count blocks, or 0 with *errp set.  The goal group is
+ * tried first; then every group for a run of the full length; then every
+ * group for any run at all.  Without the summaries, or if they find
+ * nothing, this is ext3_new_block().
+ */
+unsigned long ext3_new_blocks(handle_t *handle, struct inode *inode,
+			      unsigned long goal, unsigned long *count,
+			      int flags, int *errp)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_super_block *es = sbi->s_es;
+	struct ext3_mb_info *mb = sbi->s_mb;
+	struct buffer_head *bitmap_bh = NULL, *gdp_bh;
+	struct ext3_group_desc *gdp;
+	unsigned long ngroups, block, want = *count;
+	int goal_group, group, goal_bit, start, len, claimed;
+	int pass, i, credits, fatal = 0;
+	int charge = !(flags & (EXT3_GET_BLOCKS_RESERVED |
+				EXT3_GET_BLOCKS_NOQUOTA));
+
+	if (!mb || !test_opt(sb, MBALLOC))
+		return ext3_mb_fallback(handle, inode, goal, count, flags, errp);
+
+	if (want > EXT3_BLOCKS_PER_GROUP(sb))
+		want = EXT3_BLOCKS_PER_GROUP(sb);
+	if (charge && DQUOT_ALLOC_BLOCK(inode, want)) {
+		*errp = -EDQUOT;
+		return 0;
+	}
+	if (!(flags & EXT3_GET_BLOCKS_RESERVED) && !ext3_has_free_blocks(sbi)) {
+		if (charge)
+			DQUOT_FREE_BLOCK(inode, want);
+		*errp = -ENOSPC;
+		return 0;
+	}
+	atomic_inc(&mb->mb_reqs);
+	atomic_add(want, &mb->mb_wanted);
+
+	if (goal < le32_to_cpu(es->s_first_data_block) ||
+	    goal >= le32_to_cpu(es->s_blocks_count))
+		goal = le32_to_cpu(es->s_first_data_block);
+	goal_group = (goal - le32_to_cpu(es->s_first_data_block)) /
+			EXT3_BLOCKS_PER_GROUP(sb);
+	ngroups = sbi->s_groups_count;
+	smp_rmb();
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ngroups; i++) {
+			group = (goal_group + i) % ngroups;
+			goal_bit = -1;
+			if (!i)
+				goal_bit = (goal -
+					le32_to_cpu(es->s_first_data_block)) %
+					EXT3_BLOCKS_PER_GROUP(sb);
+			gdp = ext3_get_group_desc(sb, group, &gdp_bh);
+			if (!gdp) {
+				*errp = -EIO;
+				goto out;
+			}
+			if (!le16_to_cpu(gdp->bg_free_blocks_count))
+				continue;
+			if (!pass && i &&
+			    le16_to_cpu(gdp->bg_free_blocks_count) < want)
+				continue;
+
+			brelse(bitmap_bh);
+			bitmap_bh = sb_bread(sb,
+					le32_to_cpu(gdp->bg_block_bitmap));
+			if (!bitmap_bh) {
+				*errp = -EIO;
+				goto out;
+			}
+			start = ext3_mb_search_group(sb, group, bitmap_bh,
+						     goal_bit, want,
+						     pass ? 1 : want, &len);
+			if (start < 0)
+				continue;
+
+			credits = 0;
+			fatal = ext3_journal_get_undo_access(handle, bitmap_bh,
+							     &credits);
+			if (fatal) {
+				ext3_mb_invalidate(sb, group);
+				goto out;
+			}
+			claimed = ext3_mb_claim(sb_bgl_lock(sbi, group), start,
+						len, bitmap_bh);
+			if (claimed < len) {
+				atomic_inc(&mb->mb_lost);
+				ext3_mb_invalidate(sb, group);
+			}
+			if (!claimed) {
+				ext3_journal_release_buffer(handle, bitmap_bh,
+							    credits);
+				continue;
+			}
+			if (start == goal_bit)
+				atomic_inc(&mb->mb_goal_hits);
+			goto allocated;
+		}
+	}
+
+	/*
+	 * Nothing in the summaries.  Blocks freed by the committing
+	 * transaction are not there yet, nor are groups whose summary
+	 * could not be allocated: ext3_new_block() still finds those.
+	 */
+	atomic_inc(&mb->mb_fallbacks);
+	if (charge)
+		DQUOT_FREE_BLOCK(inode, want);
+	brelse(bitmap_bh);
+	return ext3_mb_fallback(handle, inode, goal, count, flags, errp);
+
+allocated:
+	block = start + group * EXT3_BLOCKS_PER_GROUP(sb) +
+		le32_to_cpu(es->s_first_data_block);
+	if (in_range(le32_to_cpu(gdp->bg_block_bitmap), block, claimed) ||
+	    in_range(le32_to_cpu(gdp->bg_inode_bitmap), block, claimed) ||
+	    in_range(block, le32_to_cpu(gdp->bg_inode_table),
+		     sbi->s_itb_per_group) ||
+	    in_range(block + claimed - 1, le32_to_cpu(gdp->bg_inode_table),
+		     sbi->s_itb_per_group))
+		ext3_error(sb, "ext3_new_blocks",
+			   "Allocating blocks in system zones - "
+			   "block = %lu, count = %d", block, claimed);
+
+	BUFFER_TRACE(bitmap_bh, "journal_dirty_metadata for bitmap block");
+	fatal = ext3_journal_dirty_metadata(handle, bitmap_bh);
+	if (fatal)
+		goto out;
+	BUFFER_TRACE(gdp_bh, "get_write_access");
+	fatal = ext3_journal_get_write_access(handle, gdp_bh);
+	if (fatal)
+		goto out;
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	gdp->bg_free_blocks_count =
+		cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) - claimed);
+	spin_unlock(sb_bgl_lock(sbi, group));
+	percpu_counter_mod(&sbi->s_freeblocks_counter, -claimed);
+
+	BUFFER_TRACE(gdp_bh, "journal_dirty_metadata for group descriptor");
+	fatal = ext3_journal_dirty_metadata(handle, gdp_bh);
+	sb->s_dirt = 1;
+	if (fatal)
+		goto out;
+
+	if (charge && claimed < want)
+		DQUOT_FREE_BLOCK(inode, want - claimed);
+	atomic_inc(&mb->mb_allocs);
+	atomic_add(claimed, &mb->mb_blocks);
+	if (claimed == want)
+		atomic_inc(&mb->mb_full);
+	brelse(bitmap_bh);
+	*count = claimed;
+	*errp = 0;
+	return block;
+
+out:
+	if (fatal) {
+		*errp = fatal;
+		ext3_std_error(sb, fatal);
+	}
+	if (charge)
+		DQUOT_FREE_BLOCK(inode, want);
+	brelse(bitmap_bh);
+	return 0;
+}
+
+/*
+ * ext3_new_block() claimed `len' blocks from `start' in `group'
+ */
+void ext3_mb_claimed(struct super_block *sb, int group, int start, int len)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_mb_info *mb = sbi->s_mb;
+	struct ext3_buddy *bb;
+
+	if (!mb || group >= mb->mb_ngroups)
+		return;
+	spin_lock(sb_bgl_lock(sbi, group));
+	bb = mb->mb_groups[group];
+	if (bb && bb->bb_valid)
+		ext3_mb_mark_used(mb, bb, start, len);
+	spin_unlock(sb_bgl_lock(sbi, group));
+}
+
+/*
+ * Blocks in `group' were freed; they can be handed out once the
+ * transaction freeing them has committed.
+ */
+void ext3_mb_freed(handle_t *handle, struct super_block *sb, int group)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_mb_info *mb = sbi->s_mb;
+	struct ext3_buddy *bb;
+
+	if (!mb || group >= mb->mb_ngroups)
+		return;
+	spin_lock(sb_bgl_lock(sbi, group));
+	bb = mb->mb_groups[group];
+	if (bb) {
+		bb->bb_freed = 1;
+		bb->bb_tid = handle->h_transaction->t_tid;
+	}
+	spin_unlock(sb_bgl_lock(sbi, group));
+}
+
+static int ext3_mb_read_stats(char *page, char **start, off_t off,
+			      int count, int *eof, void *data)
+{
+	struct ext3_mb_info *mb = EXT3_SB((struct super_block *)data)->s_mb;
+	unsigned long i, groups = 0;
+	int len;
+
+	for (i = 0; i < mb->mb_ngroups; i++)
+		if (mb->mb_groups[i])
+			groups++;
+
+	len = sprintf(page,
+		"requests:    %u\n"
+		"wanted:      %u\n"
+		"allocated:   %u\n"
+		"blocks:      %u\n"
+		"full:        %u\n"
+		"goal hits:   %u\n"
+		"scanned:     %u\n"
+		"builds:      %u\n"
+		"lost races:  %u\n"
+		"fallbacks:   %u\n"
+		"summaries:   %lu\n",
+		atomic_read(&mb->mb_reqs), atomic_read(&mb->mb_wanted),
+		atomic_read(&mb->mb_allocs), atomic_read(&mb->mb_blocks),
+		atomic_read(&mb->mb_full), atomic_read(&mb->mb_goal_hits),
+		atomic_read(&mb->mb_scanned), atomic_read(&mb->mb_builds),
+		atomic_read(&mb->mb_lost), atomic_read(&mb->mb_fallbacks),
+		groups);
+
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+/*
+ * Set up the summaries at mount.  There is room for as many groups as
+ * online resize can add.
+ */
+int ext3_mb_init(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_mb_info *mb;
+	unsigned long bits, longs = 0;
+	int k;
+
+	mb = kmalloc(sizeof(*mb), GFP_KERNEL);
+	if (!mb)
+		return -ENOMEM;
+	memset(mb, 0, sizeof(*mb));
+
+	bits = EXT3_BLOCKS_PER_GROUP(sb);
+	for (k = 0; k < EXT3_MB_ORDERS && (1UL << k) <= bits; k++) {
+		mb->mb_offset[k] = longs;
+		longs += BITS_TO_LONGS(bits >> k);
+	}
+	mb->mb_order = k - 1;
+	mb->mb_size = longs * sizeof(unsigned long);
+
+	mb->mb_ngroups = (sbi->s_gdb_count +
+			  le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks)) *
+			 EXT3_DESC_PER_BLOCK(sb);
+	mb->mb_groups = vmalloc(mb->mb_ngroups * sizeof(struct ext3_buddy *));
+	if (!mb->mb_groups) {
+		kfree(mb);
+		return -ENOMEM;
+	}
+	memset(mb->mb_groups, 0, mb->mb_ngroups * sizeof(struct ext3_buddy *));
+
+	if (ext3_proc_root)
+		mb->mb_proc = proc_mkdir(sb->s_id, ext3_proc_root);
+	if (mb->mb_proc)
+		create_proc_read_entry("mb_stats", 0, mb->mb_proc,
+				       ext3_mb_read_stats, sb);
+	sbi->s_mb = mb;
+	return 0;
+}
+
+void ext3_mb_release(struct super_block *sb)
+{
+	struct ext3_sb_info *sbi = EXT3_SB(sb);
+	struct ext3_mb_info *mb = sbi->s_mb;
+	unsigned long i;
+
+	if (!mb)
+		return;
+	if (mb->mb_proc) {
+		remove_proc_entry("mb_stats", mb->mb_proc);
+		remove_proc_entry(sb->s_id, ext3_proc_root);
+	}
+	for (i = 0; i < mb->mb_ngroups; i++) {
+		if (!mb->mb_groups[i])
+			continue;
+		kfree(mb->mb_groups[i]->bb_map);
+		kfree(mb->mb_groups[i]);
+	}
+	vfree(mb->mb_groups);
+	kfree(mb);
+	sbi->s_mb = NULL;
+}
+
+int __init init_ext3_mballoc(void)
+{
+	ext3_proc_root = proc_mkdir("fs/ext3", NULL);
+	return 0;
+}
+
+void exit_ext3_mballoc(void)
+{
+	if (ext3_proc_root)
+		remove_proc_entry("fs/ext3", NULL);
+}
@@ -141,6 +141,113 @@ struct dx_map_entry
 	u32 offs;
 };
 
+/*
+ * The index blocks of a busy htree directory are kept pinned, so that a
+ * lookup finds them without going through the block map and the buffer
+ * hash, and memory pressure cannot push them out between lookups.  A
+ * directory counts as busy once EXT3_DX_HOT index blocks have been read
+ * for it within EXT3_DX_WINDOW.  Slot 0 holds the root, the others are
+ * recycled in turn.  The pins go when the inode leaves the cache or the
+ * directory is truncated, the only time its blocks can move, and under
+ * memory pressure once the directory has gone a window without a
+ * lookup.  [i_sem]
+ */
+#define EXT3_DX_HOT		64
+#define EXT3_DX_WINDOW		(10 * HZ)
+#define EXT3_DX_PIN_BLOCKS	16
+
+struct ext3_dx_pin
+{
+	struct list_head list;		/* on ext3_dx_pinned [ext3_dx_lock] */
+	struct inode *dir;
+	unsigned long used;		/* jiffies at the last lookup */
+	unsigned int next;
+	u32 block[EXT3_DX_PIN_BLOCKS];
+	struct buffer_head *bh[EXT3_DX_PIN_BLOCKS];
+};
+
+static LIST_HEAD(ext3_dx_pinned);
+static DEFINE_SPINLOCK(ext3_dx_lock);
+static int ext3_dx_nr_pinned;
+static struct shrinker *ext3_dx_shrinker;
+
+static void ext3_dx_free_pin(struct ext3_dx_pin *pin)
+{
+	int i;
+
+	for (i = 0; i < EXT3_DX_PIN_BLOCKS; i++)
+		brelse(pin->bh[i]);
+	kfree(pin);
+}
+
+void ext3_dx_unpin(struct inode *dir)
+{
+	struct ext3_inode_info *ei = EXT3_I(dir);
+	struct ext3_dx_pin *pin;
+
+	ei->i_dx_reads = 0;
+	if (!ei->i_dx_pin)
+		return;
+	spin_lock(&ext3_dx_lock);
+	pin = ei->i_dx_pin;
+	if (pin) {
+		list_del(&pin->list);
+		ext3_dx_nr_pinned--;
+		ei->i_dx_pin = NULL;
+	}
+	spin_unlock(&ext3_dx_lock);
+	if (pin)
+		ext3_dx_free_pin(pin);
+}
+
+/*
+ * Memory is short: unpin directories idle for a window.  Those in use,
+ * or with a lookup under way, go to the back of the list.
+ */
+static int ext3_dx_shrink(int nr, unsigned int gfp_mask)
+{
+	struct ext3_dx_pin *pin;
+	LIST_HEAD(idle);
+	int count;
+
+	spin_lock(&ext3_dx_lock);
+	while (nr-- > 0 && !list_empty(&ext3_dx_pinned)) {
+		pin = list_entry(ext3_dx_pinned.next, struct ext3_dx_pin, list);
+		if (time_before(jiffies, pin->used + EXT3_DX_WINDOW) ||
+		    down_trylock(&pin->dir->i_sem)) {
+			list_move_tail(&pin->list, &ext3_dx_pinned);
+			continue;
+		}
+		EXT3_I(pin->dir)->i_dx_pin = NULL;
+		EXT3_I(pin->dir)->i_dx_reads = 0;
+		up(&pin->dir->i_sem);
+		list_move(&pin->list, &idle);
+		ext3_dx_nr_pinned--;
+	}
+	count = ext3_dx_nr_pinned;
+	spin_unlock(&ext3_dx_lock);
+
+	while (!list_empty(&idle)) {
+		pin = list_entry(idle.next, struct ext3_dx_pin, list);
+		list_del(&pin->list);
+		ext3_dx_free_pin(pin);
+	}
+	return count;
+}
+
+int __init init_ext3_dx_pins(void)
+{
+	ext3_dx_shrinker = set_shrinker(DEFAULT_SEEKS, ext3_dx_shrink);
+	if (!ext3_dx_shrinker)
+		return -ENOMEM;
+	return 0;
+}
+
+void exit_ext3_dx_pins(void)
+{
+	remove_shrinker(ext3_dx_shrinker);
+}
+
 #ifdef CONFIG_EXT3_INDEX
 static inline unsigned dx_get_block (struct dx_entry *entry);
 static void dx_set_block (struct dx_entry *entry, unsigned value);
@@ -315,6 +422,68 @@ struct stats dx_show_entries(struct dx_hash_info *hinfo, struct inode *dir,
 }
 #endif /* DX_DEBUG */
 
+/*
+ * Read an index block, from the pins if the directory has them
+ */
+static struct buffer_head *dx_bread(struct inode *dir, u32 block, int *err)
+{
+	struct ext3_inode_info *ei = EXT3_I(dir);
+	struct ext3_dx_pin *pin = ei->i_dx_pin;
+	struct buffer_head *bh;
+	int i;
+
+	if (pin) {
+		for (i = 0; i < EXT3_DX_PIN_BLOCKS; i++) {
+			bh = pin->bh[i];
+			if (!bh || pin->block[i] != block)
+				continue;
+			if (buffer_uptodate(bh)) {
+				pin->used = jiffies;
+				get_bh(bh);
+				return bh;
+			}
+			/* lost to an I/O error: read it again */
+			pin->bh[i] = NULL;
+			brelse(bh);
+			break;
+		}
+	}
+
+	bh = ext3_bread(NULL, dir, block, 0, err);
+	if (!bh)
+		return NULL;
+
+	if (!pin) {
+		if (time_after(jiffies, ei->i_dx_window + EXT3_DX_WINDOW)) {
+			ei->i_dx_window = jiffies;
+			ei->i_dx_reads = 0;
+		}
+		if (++ei->i_dx_reads < EXT3_DX_HOT)
+			return bh;
+		pin = kmalloc(sizeof(*pin), GFP_NOFS);
+		if (!pin)
+			return bh;
+		memset(pin, 0, sizeof(*pin));
+		pin->dir = dir;
+		spin_lock(&ext3_dx_lock);
+		list_add_tail(&pin->list, &ext3_dx_pinned);
+		ext3_dx_nr_pinned++;
+		ei->i_dx_pin = pin;
+		spin_unlock(&ext3_dx_lock);
+	}
+	pin->used = jiffies;
+
+	if (block)
+		i = 1 + pin->next++ % (EXT3_DX_PIN_BLOCKS - 1);
+	else
+		i = 0;
+	brelse(pin->bh[i]);
+	get_bh(bh);
+	pin->bh[i] = bh;
+	pin->block[i] = block;
+	return bh;
+}
+
 /*
  * Probe for a directory leaf block to search.
  *
@@ -338,7 +507,7 @@ dx_probe(struct dentry *dentry, struct inode *dir,
 	frame->bh = NULL;
 	if (dentry)
 		dir = dentry->d_parent->d_inode;
-	if (!(bh = ext3_bread (NULL,dir, 0, 0, err)))
+	if (!(bh = dx_bread(dir, 0, err)))
 		goto fail;
 	root = (struct dx_root *) bh->b_data;
 	if (root->info.hash_version != DX_HASH_TEA &&
@@ -418,7 +587,7 @@ dx_probe(struct dentry *dentry, struct inode *dir,
 		frame->entries = entries;
 		frame->at = at;
 		if (!indirect--) return frame;
-		if (!(bh = ext3_bread (NULL,dir, dx_get_block(at), 0, err)))
+		if (!(bh = dx_bread(dir, dx_get_block(at), err)))
 			goto fail2;
 		at = entries = ((struct dx_node *) bh->b_data)->entries;
 		assert (dx_get_limit(entries) == dx_node_limit (dir));
@@ -506,8 +675,7 @@ static int ext3_htree_next_block(struct inode *dir, __u32 hash,
 	 * block so no check is necessary
 	 */
 	while (num_frames--) {
-		if (!(bh = ext3_bread(NULL, dir, dx_get_block(p->at),
-				      0, &err)))
+		if (!(bh = dx_bread(dir, dx_get_block(p->at), &err)))
 			return err; /* Failure */
 		p++;
 		brelse (p->bh);
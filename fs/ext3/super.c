@@ -390,9 +390,11 @@ static void ext3_put_super (struct super_block * sb)
 	for (i = 0; i < sbi->s_gdb_count; i++)
 		brelse(sbi->s_group_desc[i]);
 	kfree(sbi->s_group_desc);
+	ext3_mb_release(sb);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
 	brelse(sbi->s_sbh);
 #ifdef CONFIG_QUOTA
 	for (i = 0; i < MAXQUOTAS; i++) {
@@ -442,6 +444,11 @@ static struct inode *ext3_alloc_inode(struct super_block *sb)
 	ei->i_default_acl = EXT3_ACL_NOT_CACHED;
 #endif
 	ei->i_rsv_window.rsv_end = EXT3_RESERVE_WINDOW_NOT_ALLOCATED;
+	ei->i_dx_pin = NULL;
+	ei->i_dx_reads = 0;
+	ei->i_dx_window = jiffies;
+	ei->i_da_blocks = 0;
+	ei->i_da_meta = 0;
 	ei->vfs_inode.i_version = 1;
 	return &ei->vfs_inode;
 }
@@ -462,6 +469,7 @@ static void init_once(void * foo, kmem_cache_t * cachep, unsigned long flags)
 		init_rwsem(&ei->xattr_sem);
 #endif
 		init_MUTEX(&ei->truncate_sem);
+		spin_lock_init(&ei->i_da_lock);
 		inode_init_once(&ei->vfs_inode);
 	}
 }
@@ -498,6 +506,7 @@ static void ext3_clear_inode(struct inode *inode)
        }
 #endif
 	ext3_discard_reservation(inode);
+	ext3_dx_unpin(inode);
 }
 
 #ifdef CONFIG_QUOTA
@@ -582,6 +591,9 @@ enum {
 	Opt_usrjquota, Opt_grpjquota, Opt_offusrjquota, Opt_offgrpjquota,
 	Opt_jqfmt_vfsold, Opt_jqfmt_vfsv0,
 	Opt_ignore, Opt_barrier, Opt_err, Opt_resize,
+	Opt_delalloc, Opt_nodelalloc, Opt_mballoc, Opt_nomballoc,
+	Opt_journal_checksum, Opt_journal_async_commit,
+	Opt_dirprefetch, Opt_nodirprefetch,
 };
 
 static match_table_t tokens = {
@@ -629,6 +641,14 @@ static match_table_t tokens = {
 	{Opt_ignore, "quota"},
 	{Opt_ignore, "usrquota"},
 	{Opt_barrier, "barrier=%u"},
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_mballoc, "mballoc"},
+	{Opt_nomballoc, "nomballoc"},
+	{Opt_journal_checksum, "journal_checksum"},
+	{Opt_journal_async_commit, "journal_async_commit"},
+	{Opt_dirprefetch, "dirprefetch"},
+	{Opt_nodirprefetch, "nodirprefetch"},
 	{Opt_err, NULL},
 	{Opt_resize, "resize"},
 };
@@ -913,6 +933,34 @@ clear_qf_name:
 			else
 				clear_opt(sbi->s_mount_opt, BARRIER);
 			break;
+		case Opt_delalloc:
+			/* runs for a whole batch need the multi-block allocator */
+			set_opt(sbi->s_mount_opt, DELALLOC);
+			set_opt(sbi->s_mount_opt, MBALLOC);
+			break;
+		case Opt_nodelalloc:
+			clear_opt(sbi->s_mount_opt, DELALLOC);
+			break;
+		case Opt_mballoc:
+			set_opt(sbi->s_mount_opt, MBALLOC);
+			break;
+		case Opt_nomballoc:
+			clear_opt(sbi->s_mount_opt, MBALLOC);
+			break;
+		case Opt_journal_checksum:
+			set_opt(sbi->s_mount_opt, JOURNAL_CHECKSUM);
+			break;
+		case Opt_journal_async_commit:
+			/* only the checksum can catch a torn commit */
+			set_opt(sbi->s_mount_opt, JOURNAL_ASYNC_COMMIT);
+			set_opt(sbi->s_mount_opt, JOURNAL_CHECKSUM);
+			break;
+		case Opt_dirprefetch:
+			set_opt(sbi->s_mount_opt, DIR_PREFETCH);
+			break;
+		case Opt_nodirprefetch:
+			clear_opt(sbi->s_mount_opt, DIR_PREFETCH);
+			break;
 		case Opt_ignore:
 			break;
 		case Opt_resize:
@@ -1468,6 +1516,7 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	percpu_counter_init(&sbi->s_freeblocks_counter);
 	percpu_counter_init(&sbi->s_freeinodes_counter);
 	percpu_counter_init(&sbi->s_dirs_counter);
+	percpu_counter_init(&sbi->s_dirtyblocks_counter);
 	bgl_lock_init(&sbi->s_blockgroup_lock);
 
 	for (i = 0; i < db_count; i++) {
@@ -1563,6 +1612,32 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 		break;
 	}
 
+	/*
+	 * Recovery has already run under whatever features the log was
+	 * written with, so the ones for this mount can be set now.
+	 */
+	if (test_opt(sb, JOURNAL_ASYNC_COMMIT)) {
+		if (!journal_set_features(sbi->s_journal,
+				JFS_FEATURE_COMPAT_CHECKSUM, 0,
+				JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+			printk(KERN_ERR "EXT3-fs: Journal does not support "
+			       "asynchronous commit\n");
+			goto failed_mount3;
+		}
+	} else if (test_opt(sb, JOURNAL_CHECKSUM)) {
+		if (!journal_set_features(sbi->s_journal,
+				JFS_FEATURE_COMPAT_CHECKSUM, 0, 0)) {
+			printk(KERN_ERR "EXT3-fs: Journal does not support "
+			       "checksums\n");
+			goto failed_mount3;
+		}
+		journal_clear_features(sbi->s_journal, 0, 0,
+				       JFS_FEATURE_INCOMPAT_ASYNC_COMMIT);
+	} else
+		journal_clear_features(sbi->s_journal,
+				       JFS_FEATURE_COMPAT_CHECKSUM, 0,
+				       JFS_FEATURE_INCOMPAT_ASYNC_COMMIT);
+
 	/*
 	 * The journal_load will have done any necessary log recovery,
 	 * so we can safely mount the rest of the filesystem now.
@@ -1609,6 +1684,12 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	percpu_counter_mod(&sbi->s_dirs_counter,
 		ext3_count_dirs(sb));
 
+	if (test_opt(sb, MBALLOC) && ext3_mb_init(sb)) {
+		printk(KERN_WARNING "EXT3-fs: %s: not enough memory for the "
+		       "multi-block allocator\n", sb->s_id);
+		clear_opt(sbi->s_mount_opt, MBALLOC);
+	}
+
 	lock_kernel();
 	return 0;
 
@@ -1653,12 +1734,12 @@ static void ext3_init_journal_params(struct super_block *sb, journal_t *journal)
 	 * interval here, but for now we'll just fall back to the jbd
 	 * default. */
 
-	spin_lock(&journal->j_state_lock);
+	write_lock(&journal->j_state_lock);
 	if (test_opt(sb, BARRIER))
 		journal->j_flags |= JFS_BARRIER;
 	else
 		journal->j_flags &= ~JFS_BARRIER;
-	spin_unlock(&journal->j_state_lock);
+	write_unlock(&journal->j_state_lock);
 }
 
 static journal_t *ext3_get_journal(struct super_block *sb, int journal_inum)
@@ -2128,13 +2209,18 @@ static int ext3_remount (struct super_block * sb, int * flags, char * data)
 				sb->s_flags &= ~MS_RDONLY;
 		}
 	}
+	if (test_opt(sb, MBALLOC) && !sbi->s_mb && ext3_mb_init(sb)) {
+		printk(KERN_WARNING "EXT3-fs: %s: not enough memory for the "
+		       "multi-block allocator\n", sb->s_id);
+		clear_opt(sbi->s_mount_opt, MBALLOC);
+	}
 	return 0;
 }
 
 static int ext3_statfs (struct super_block * sb, struct kstatfs * buf)
 {
 	struct ext3_super_block *es = EXT3_SB(sb)->s_es;
-	unsigned long overhead;
+	unsigned long overhead, dirty;
 	int i;
 
 	if (test_opt (sb, MINIX_DF))
@@ -2176,6 +2262,9 @@ static int ext3_statfs (struct super_block * sb, struct kstatfs * buf)
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = le32_to_cpu(es->s_blocks_count) - overhead;
 	buf->f_bfree = ext3_count_free_blocks (sb);
+	/* blocks set aside for delayed allocation are as good as used */
+	dirty = percpu_counter_read_positive(&EXT3_SB(sb)->s_dirtyblocks_counter);
+	buf->f_bfree = buf->f_bfree > dirty ? buf->f_bfree - dirty : 0;
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(es->s_r_blocks_count))
 		buf->f_bavail = 0;
@@ -2492,11 +2581,21 @@ static int __init init_ext3_fs(void)
 	err = init_inodecache();
 	if (err)
 		goto out1;
+	err = init_ext3_mballoc();
+	if (err)
+		goto out2;
+	err = init_ext3_dx_pins();
+	if (err)
+		goto out3;
         err = register_filesystem(&ext3_fs_type);
 	if (err)
 		goto out;
 	return 0;
 out:
+	exit_ext3_dx_pins();
+out3:
+	exit_ext3_mballoc();
+out2:
 	destroy_inodecache();
 out1:
  	exit_ext3_xattr();
@@ -2506,6 +2605,8 @@ out1:
 static void __exit exit_ext3_fs(void)
 {
 	unregister_filesystem(&ext3_fs_type);
+	exit_ext3_dx_pins();
+	exit_ext3_mballoc();
 	destroy_inodecache();
 	exit_ext3_xattr();
 }
@@ -443,6 +443,63 @@ restart:
 	spin_unlock(&sb_lock);
 }
 
+static int mark_inode_bdi(struct inode *inode)
+{
+	struct backing_dev_info *bdi = inode->i_mapping->backing_dev_info;
+
+	if (bdi->memory_backed)
+		return 0;
+	set_bit(BDI_dirty, &bdi->state);
+	return bdi->wb == NULL;
+}
+
+/*
+ * Set BDI_dirty on every device which has dirty inodes against it, so that
+ * its flusher thread gets work.  As in sync_sb_inodes(), all inodes of a
+ * superblock other than the blockdev one are taken to share a queue.
+ *
+ * Returns 1 if a device without a flusher thread of its own has dirty
+ * inodes.
+ */
+int mark_dirty_bdis(void)
+{
+	struct super_block *sb;
+	struct inode *inode;
+	int orphans = 0;
+
+	spin_lock(&sb_lock);
+restart:
+	sb = sb_entry(super_blocks.prev);
+	for (; sb != sb_entry(&super_blocks); sb = sb_entry(sb->s_list.prev)) {
+		if (list_empty(&sb->s_dirty) && list_empty(&sb->s_io))
+			continue;
+		sb->s_count++;
+		spin_unlock(&sb_lock);
+
+		spin_lock(&inode_lock);
+		if (sb == blockdev_superblock) {
+			list_for_each_entry(inode, &sb->s_dirty, i_list)
+				orphans |= mark_inode_bdi(inode);
+			list_for_each_entry(inode, &sb->s_io, i_list)
+				orphans |= mark_inode_bdi(inode);
+		} else if (!list_empty(&sb->s_io)) {
+			inode = list_entry(sb->s_io.prev, struct inode, i_list);
+			orphans |= mark_inode_bdi(inode);
+		} else if (!list_empty(&sb->s_dirty)) {
+			inode = list_entry(sb->s_dirty.prev, struct inode,
+					   i_list);
+			orphans |= mark_inode_bdi(inode);
+		}
+		spin_unlock(&inode_lock);
+
+		spin_lock(&sb_lock);
+		if (__put_super_and_need_restart(sb))
+			goto restart;
+	}
+	spin_unlock(&sb_lock);
+	return orphans;
+}
+
 /*
  * writeback and wait upon the filesystem's dirty inodes.  The caller will
  * do this in two passes - one to write, and one to wait.  WB_SYNC_HOLD is
@@ -0,0 +1,189 @@
+/*
+ * fs/ioprio.c
+ *
+ * Helper functions for setting/querying io priorities of processes. The
+ * system calls closely mimic getpriority/setpriority, see the man page for
+ * those. The prio argument is a composite of prio class and prio data, where
+ * the data argument has meaning within that class. The standard scheduling
+ * classes have 8 distinct prio levels, with 0 being the highest prio and 7
+ * being the lowest.
+ *
+ * IOW, setting BE scheduling class with prio 2 is done ala:
+ *
+ * unsigned int prio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 2;
+ *
+ * ioprio_set(IOPRIO_WHO_PROCESS, pid, prio);
+ *
+ * See also Documentation/block/ioprio.txt
+ */
+#include <linux/kernel.h>
+#include <linux/ioprio.h>
+#include <linux/blkdev.h>
+#include <linux/syscalls.h>
+
+static int set_task_ioprio(struct task_struct *task, int ioprio)
+{
+	if (task->uid != current->euid &&
+	    task->uid != current->uid && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	/*
+	 * picked up by the io scheduler on the next request the task
+	 * allocates
+	 */
+	task->ioprio = ioprio;
+	return 0;
+}
+
+asmlinkage long sys_ioprio_set(int which, int who, int ioprio)
+{
+	int class = IOPRIO_PRIO_CLASS(ioprio);
+	int data = IOPRIO_PRIO_DATA(ioprio);
+	struct task_struct *p, *g;
+	struct user_struct *user;
+	int ret;
+
+	switch (class) {
+		case IOPRIO_CLASS_RT:
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			/* fall through, rt has prio field too */
+		case IOPRIO_CLASS_BE:
+			if (data >= IOPRIO_BE_NR || data < 0)
+				return -EINVAL;
+			break;
+		case IOPRIO_CLASS_IDLE:
+			/* no levels, and only ever lowers the priority */
+			break;
+		case IOPRIO_CLASS_NONE:
+			if (data)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	ret = -ESRCH;
+	read_lock_irq(&tasklist_lock);
+	switch (which) {
+		case IOPRIO_WHO_PROCESS:
+			if (!who)
+				p = current;
+			else
+				p = find_task_by_pid(who);
+			if (p)
+				ret = set_task_ioprio(p, ioprio);
+			break;
+		case IOPRIO_WHO_PGRP:
+			if (!who)
+				who = process_group(current);
+			do_each_task_pid(who, PIDTYPE_PGID, p) {
+				ret = set_task_ioprio(p, ioprio);
+				if (ret)
+					break;
+			} while_each_task_pid(who, PIDTYPE_PGID, p);
+			break;
+		case IOPRIO_WHO_USER:
+			user = current->user;
+			if (!who)
+				who = current->uid;
+			else
+				if ((who != current->uid) && !(user = find_user(who)))
+					break;
+
+			do_each_thread(g, p) {
+				if (p->uid != who)
+					continue;
+				ret = set_task_ioprio(p, ioprio);
+				if (ret)
+					goto free_uid;
+			} while_each_thread(g, p);
+free_uid:
+			if (who != current->uid)
+				free_uid(user);
+			break;
+		default:
+			ret = -EINVAL;
+	}
+
+	read_unlock_irq(&tasklist_lock);
+	return ret;
+}
+
+/*
+ * A process without an explicit setting reports the best-effort level
+ * its nice value maps to.
+ */
+static int get_task_ioprio(struct task_struct *p)
+{
+	return IOPRIO_PRIO_VALUE(task_ioprio_class(p), task_ioprio(p));
+}
+
+/*
+ * When several processes match, the highest priority one is reported:
+ * the lowest class, then the lowest level within it.
+ */
+static int ioprio_best(int aprio, int bprio)
+{
+	int aclass = IOPRIO_PRIO_CLASS(aprio);
+	int bclass = IOPRIO_PRIO_CLASS(bprio);
+
+	if (aclass != bclass)
+		return aclass < bclass ? aprio : bprio;
+
+	return IOPRIO_PRIO_DATA(aprio) < IOPRIO_PRIO_DATA(bprio) ? aprio : bprio;
+}
+
+asmlinkage long sys_ioprio_get(int which, int who)
+{
+	struct task_struct *g, *p;
+	struct user_struct *user;
+	int ret = -ESRCH;
+
+	read_lock_irq(&tasklist_lock);
+	switch (which) {
+		case IOPRIO_WHO_PROCESS:
+			if (!who)
+				p = current;
+			else
+				p = find_task_by_pid(who);
+			if (p)
+				ret = get_task_ioprio(p);
+			break;
+		case IOPRIO_WHO_PGRP:
+			if (!who)
+				who = process_group(current);
+			do_each_task_pid(who, PIDTYPE_PGID, p) {
+				if (ret == -ESRCH)
+					ret = get_task_ioprio(p);
+				else
+					ret = ioprio_best(ret, get_task_ioprio(p));
+			} while_each_task_pid(who, PIDTYPE_PGID, p);
+			break;
+		case IOPRIO_WHO_USER:
+			user = current->user;
+			if (!who)
+				who = current->uid;
+			else
+				if ((who != current->uid) && !(user = find_user(who)))
+					break;
+
+			do_each_thread(g, p) {
+				if (p->uid != who)
+					continue;
+				if (ret == -ESRCH)
+					ret = get_task_ioprio(p);
+				else
+					ret = ioprio_best(ret, get_task_ioprio(p));
+			} while_each_thread(g, p);
+
+			if (who != current->uid)
+				free_uid(user);
+			break;
+		default:
+			ret = -EINVAL;
+	}
+
+	read_unlock_irq(&tasklist_lock);
+	return ret;
+}
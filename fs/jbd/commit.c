@@ -21,6 +21,8 @@
 #include <linux/mm.h>
 #include <linux/pagemap.h>
 #include <linux/smp_lock.h>
+#include <linux/crc32.h>
+#include <linux/highmem.h>
 
 /*
  * Default IO end handler for temporary BJ_IO buffer_heads.
@@ -93,6 +95,149 @@ static int inverted_lock(journal_t *journal, struct buffer_head *bh)
 	return 1;
 }
 
+/*
+ * Histogram slot for a value: slot n holds [2^(n-1), 2^n)
+ */
+static inline int jbd_hist_slot(unsigned long value)
+{
+	int slot = value ? fls(value) : 0;
+
+	return min(slot, JBD_HIST_SLOTS - 1);
+}
+
+/*
+ * Account a finished commit.  The average commit time is what a
+ * synchronous handle is prepared to wait for others to join its
+ * transaction, see journal_stop().
+ *
+ * Called under j_state_lock
+ */
+static void journal_account_commit(journal_t *journal,
+				   transaction_t *commit_transaction,
+				   struct timeval *start)
+{
+	struct journal_stats_s *stats = &journal->j_stats;
+	struct timeval now;
+	long commit_time;
+
+	do_gettimeofday(&now);
+	commit_time = (now.tv_sec - start->tv_sec) * USEC_PER_SEC +
+		      now.tv_usec - start->tv_usec;
+	if (commit_time < 0)
+		commit_time = 0;
+
+	if (journal->j_average_commit_time)
+		journal->j_average_commit_time =
+			(commit_time + journal->j_average_commit_time * 3) / 4;
+	else
+		journal->j_average_commit_time = commit_time;
+
+	stats->js_commits++;
+	stats->js_handles += atomic_read(&commit_transaction->t_handle_count);
+	stats->js_commit_time[jbd_hist_slot(commit_time / 1000)]++;
+	stats->js_batch[jbd_hist_slot(
+		atomic_read(&commit_transaction->t_handle_count))]++;
+}
+
+/*
+ * Fold a block going to the log into the transaction's checksum.  The
+ * buffer may be a frozen copy of a data=journal page, which can live in
+ * highmem.
+ */
+static void journal_chksum_buffer(transaction_t *transaction,
+				  struct buffer_head *bh)
+{
+	struct page *page = bh->b_page;
+	char *addr;
+
+	addr = kmap_atomic(page, KM_USER0);
+	transaction->t_chksum = crc32_be(transaction->t_chksum,
+				(unsigned char *)addr + bh_offset(bh),
+				bh->b_size);
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/*
+ * Build the commit record for a transaction and send it to the log
+ * without waiting for it.  On a journal with the checksum feature it
+ * carries the crc32 of every block the transaction wrote to the log,
+ * so that recovery can tell a complete transaction from a torn one.
+ */
+static int journal_submit_commit_record(journal_t *journal,
+					transaction_t *commit_transaction,
+					struct buffer_head **cbh)
+{
+	struct journal_head *descriptor;
+	struct buffer_head *bh;
+	commit_header_t *tmp;
+
+	descriptor = journal_get_descriptor_buffer(journal);
+	if (!descriptor)
+		return -EIO;
+
+	bh = jh2bh(descriptor);
+	tmp = (commit_header_t *)bh->b_data;
+	tmp->h_header.h_magic = cpu_to_be32(JFS_MAGIC_NUMBER);
+	tmp->h_header.h_blocktype = cpu_to_be32(JFS_COMMIT_BLOCK);
+	tmp->h_header.h_sequence = cpu_to_be32(commit_transaction->t_tid);
+
+	if (JFS_HAS_COMPAT_FEATURE(journal, JFS_FEATURE_COMPAT_CHECKSUM)) {
+		tmp->h_chksum_type = JFS_CRC32_CHKSUM;
+		tmp->h_chksum_size = JFS_CRC32_CHKSUM_SIZE;
+		tmp->h_chksum[0] = cpu_to_be32(commit_transaction->t_chksum);
+	}
+
+	JBUFFER_TRACE(descriptor, "submit commit block");
+	if (journal->j_flags & JFS_BARRIER)
+		set_buffer_ordered(bh);
+	lock_buffer(bh);
+	clear_buffer_dirty(bh);
+	set_buffer_uptodate(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(WRITE, bh);
+	*cbh = bh;
+	return 0;
+}
+
+/*
+ * Wait for the commit record to reach the disk, and release it.  If
+ * the device turned out not to support barriers, switch them off and
+ * write the record again without one.
+ */
+static int journal_wait_on_commit_record(journal_t *journal,
+					 struct buffer_head *bh)
+{
+	int ret = 0;
+
+	wait_on_buffer(bh);
+	if (buffer_eopnotsupp(bh) && buffer_ordered(bh)) {
+		char b[BDEVNAME_SIZE];
+
+		printk(KERN_WARNING
+			"JBD: barrier-based sync failed on %s - "
+			"disabling barriers\n",
+			bdevname(journal->j_dev, b));
+		write_lock(&journal->j_state_lock);
+		journal->j_flags &= ~JFS_BARRIER;
+		write_unlock(&journal->j_state_lock);
+
+		/* And try again, without the barrier */
+		clear_buffer_eopnotsupp(bh);
+		clear_buffer_ordered(bh);
+		set_buffer_uptodate(bh);
+		set_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+	} else {
+		clear_buffer_ordered(bh);
+		if (unlikely(!buffer_uptodate(bh)))
+			ret = -EIO;
+	}
+	put_bh(bh);		/* One for getblk() */
+	journal_put_journal_head(bh2jh(bh));
+	return ret;
+}
+
 /*
  * journal_commit_transaction
  *
@@ -104,6 +249,8 @@ void journal_commit_transaction(journal_t *journal)
 	transaction_t *commit_transaction;
 	struct journal_head *jh, *new_jh, *descriptor;
 	struct buffer_head *wbuf[64];
+	struct buffer_head *cbh = NULL;
+	struct timeval start;
 	int bufs;
 	int flags;
 	int err;
@@ -116,6 +263,8 @@ void journal_commit_transaction(journal_t *journal)
 	int tag_flag;
 	int i;
 
+	do_gettimeofday(&start);
+
 	/*
 	 * First job: lock down the current transaction and wait for
 	 * all outstanding updates to complete.
@@ -144,27 +293,23 @@ void journal_commit_transaction(journal_t *journal)
 	jbd_debug(1, "JBD: starting commit of transaction %d\n",
 			commit_transaction->t_tid);
 
-	spin_lock(&journal->j_state_lock);
+	write_lock(&journal->j_state_lock);
 	commit_transaction->t_state = T_LOCKED;
 
-	spin_lock(&commit_transaction->t_handle_lock);
-	while (commit_transaction->t_updates) {
+	while (atomic_read(&commit_transaction->t_updates)) {
 		DEFINE_WAIT(wait);
 
 		prepare_to_wait(&journal->j_wait_updates, &wait,
 					TASK_UNINTERRUPTIBLE);
-		if (commit_transaction->t_updates) {
-			spin_unlock(&commit_transaction->t_handle_lock);
-			spin_unlock(&journal->j_state_lock);
+		if (atomic_read(&commit_transaction->t_updates)) {
+			write_unlock(&journal->j_state_lock);
 			schedule();
-			spin_lock(&journal->j_state_lock);
-			spin_lock(&commit_transaction->t_handle_lock);
+			write_lock(&journal->j_state_lock);
 		}
 		finish_wait(&journal->j_wait_updates, &wait);
 	}
-	spin_unlock(&commit_transaction->t_handle_lock);
 
-	J_ASSERT (commit_transaction->t_outstanding_credits <=
+	J_ASSERT (atomic_read(&commit_transaction->t_outstanding_credits) <=
 			journal->j_max_transaction_buffers);
 
 	/*
@@ -223,8 +368,9 @@ void journal_commit_transaction(journal_t *journal)
 	journal->j_committing_transaction = commit_transaction;
 	journal->j_running_transaction = NULL;
 	commit_transaction->t_log_start = journal->j_head;
+	commit_transaction->t_chksum = ~0U;
 	wake_up(&journal->j_wait_transaction_locked);
-	spin_unlock(&journal->j_state_lock);
+	write_unlock(&journal->j_state_lock);
 
 	jbd_debug (3, "JBD: commit phase 2\n");
 
@@ -438,7 +584,7 @@ write_out_data:
 		 * the free space in the log, but this counter is changed
 		 * by journal_next_log_block() also.
 		 */
-		commit_transaction->t_outstanding_credits--;
+		atomic_dec(&commit_transaction->t_outstanding_credits);
 
 		/* Bump b_count to prevent truncate from stumbling over
                    the shadowed buffer!  @@@ This can go if we ever get
@@ -502,6 +648,11 @@ write_out_data:
 start_journal_io:
 			for (i = 0; i < bufs; i++) {
 				struct buffer_head *bh = wbuf[i];
+
+				if (JFS_HAS_COMPAT_FEATURE(journal,
+						JFS_FEATURE_COMPAT_CHECKSUM))
+					journal_chksum_buffer(commit_transaction,
+							      bh);
 				lock_buffer(bh);
 				clear_buffer_dirty(bh);
 				set_buffer_uptodate(bh);
@@ -517,6 +668,21 @@ start_journal_io:
 		}
 	}
 
+	/*
+	 * With an asynchronous commit the commit record goes out right
+	 * behind the blocks it covers, instead of one round trip later.
+	 * If it reaches the disk ahead of them, the checksum it carries
+	 * no longer matches what recovery finds and the transaction is
+	 * discarded as incomplete.
+	 */
+	if (JFS_HAS_INCOMPAT_FEATURE(journal,
+				     JFS_FEATURE_INCOMPAT_ASYNC_COMMIT) &&
+	    !is_journal_aborted(journal)) {
+		if (journal_submit_commit_record(journal, commit_transaction,
+						 &cbh))
+			__journal_abort_hard(journal);
+	}
+
 	/* Lo and behold: we have just managed to send a transaction to
            the log.  Before we can commit it, wait for the IO so far to
            complete.  Control buffers being written are on the
@@ -616,69 +782,24 @@ wait_for_iobuf:
 
 	jbd_debug(3, "JBD: commit phase 6\n");
 
-	if (is_journal_aborted(journal))
-		goto skip_commit;
-
-	/* Done it all: now write the commit record.  We should have
-	 * cleaned up our previous buffers by now, so if we are in abort
-	 * mode we can now just skip the rest of the journal write
-	 * entirely. */
+	/* Done it all: now write the commit record, unless it already
+	 * went out asynchronously.  We should have cleaned up our
+	 * previous buffers by now, so if we are in abort mode we can now
+	 * just skip the rest of the journal write entirely. */
 
-	descriptor = journal_get_descriptor_buffer(journal);
-	if (!descriptor) {
-		__journal_abort_hard(journal);
-		goto skip_commit;
-	}
-
-	/* AKPM: buglet - add `i' to tmp! */
-	for (i = 0; i < jh2bh(descriptor)->b_size; i += 512) {
-		journal_header_t *tmp =
-			(journal_header_t*)jh2bh(descriptor)->b_data;
-		tmp->h_magic = cpu_to_be32(JFS_MAGIC_NUMBER);
-		tmp->h_blocktype = cpu_to_be32(JFS_COMMIT_BLOCK);
-		tmp->h_sequence = cpu_to_be32(commit_transaction->t_tid);
-	}
-
-	JBUFFER_TRACE(descriptor, "write commit block");
-	{
-		struct buffer_head *bh = jh2bh(descriptor);
-		int ret;
-		int barrier_done = 0;
-
-		set_buffer_dirty(bh);
-		if (journal->j_flags & JFS_BARRIER) {
-			set_buffer_ordered(bh);
-			barrier_done = 1;
-		}
-		ret = sync_dirty_buffer(bh);
-		/* is it possible for another commit to fail at roughly
-		 * the same time as this one?  If so, we don't want to
-		 * trust the barrier flag in the super, but instead want
-		 * to remember if we sent a barrier request
-		 */
-		if (ret == -EOPNOTSUPP && barrier_done) {
-			char b[BDEVNAME_SIZE];
-
-			printk(KERN_WARNING
-				"JBD: barrier-based sync failed on %s - "
-				"disabling barriers\n",
-				bdevname(journal->j_dev, b));
-			spin_lock(&journal->j_state_lock);
-			journal->j_flags &= ~JFS_BARRIER;
-			spin_unlock(&journal->j_state_lock);
-
-			/* And try again, without the barrier */
-			clear_buffer_ordered(bh);
-			set_buffer_uptodate(bh);
-			set_buffer_dirty(bh);
-			ret = sync_dirty_buffer(bh);
+	if (!cbh) {
+		if (is_journal_aborted(journal))
+			goto skip_commit;
+		if (journal_submit_commit_record(journal, commit_transaction,
+						 &cbh)) {
+			__journal_abort_hard(journal);
+			goto skip_commit;
 		}
-		if (unlikely(ret == -EIO))
-			err = -EIO;
-		put_bh(bh);		/* One for getblk() */
-		journal_put_journal_head(descriptor);
 	}
 
+	if (journal_wait_on_commit_record(journal, cbh))
+		err = -EIO;
+
 	/* End of a transaction!  Finally, we can do checkpoint
            processing: any buffers committed as a result of this
            transaction can be removed from any checkpoint list it was on
@@ -788,13 +909,14 @@ restart_loop:
 	 * Really, __jornal_remove_checkpoint should be using j_state_lock but
 	 * it's a bit hassle to hold that across __journal_remove_checkpoint
 	 */
-	spin_lock(&journal->j_state_lock);
+	write_lock(&journal->j_state_lock);
 	spin_lock(&journal->j_list_lock);
 	commit_transaction->t_state = T_FINISHED;
 	J_ASSERT(commit_transaction == journal->j_committing_transaction);
 	journal->j_commit_sequence = commit_transaction->t_tid;
 	journal->j_committing_transaction = NULL;
-	spin_unlock(&journal->j_state_lock);
+	journal_account_commit(journal, commit_transaction, &start);
+	write_unlock(&journal->j_state_lock);
 
 	if (commit_transaction->t_checkpoint_list == NULL) {
 		__journal_drop_transaction(journal, commit_transaction);
@@ -21,6 +21,7 @@
 #include <linux/jbd.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/crc32.h>
 #endif
 
 /*
@@ -209,6 +210,40 @@ do {									\
 		var -= ((journal)->j_last - (journal)->j_first);	\
 } while (0)
 
+
+/*
+ * Fold a descriptor block and the log blocks it describes into the
+ * running checksum of a transaction, leaving *next_log_block past them.
+ */
+
+static int calc_chksums(journal_t *journal, struct buffer_head *bh,
+			unsigned long *next_log_block, __u32 *crc32_sum)
+{
+	int i, num_blks, err;
+	unsigned long io_block;
+	struct buffer_head *obh;
+
+	num_blks = count_tags(bh, journal->j_blocksize);
+	*crc32_sum = crc32_be(*crc32_sum, (unsigned char *)bh->b_data,
+			      bh->b_size);
+
+	for (i = 0; i < num_blks; i++) {
+		io_block = (*next_log_block)++;
+		wrap(journal, *next_log_block);
+		err = jread(&obh, journal, io_block);
+		if (err) {
+			printk(KERN_ERR "JBD: IO error %d recovering block "
+				"%lu in log\n", err, io_block);
+			return err;
+		}
+		*crc32_sum = crc32_be(*crc32_sum, (unsigned char *)obh->b_data,
+				      obh->b_size);
+		brelse(obh);
+	}
+	return 0;
+}
+
+
 /**
  * int journal_recover(journal_t *journal) - recovers a on-disk journal
  * @journal: the journal to recover
@@ -318,6 +353,7 @@ static int do_one_pass(journal_t *journal,
 	struct buffer_head *	bh;
 	unsigned int		sequence;
 	int			blocktype;
+	__u32			crc32_sum = ~0U;
 
 	/* Precompute the maximum metadata descriptors in a descriptor block */
 	int			MAX_BLOCKS_PER_DESC;
@@ -412,6 +448,17 @@ static int do_one_pass(journal_t *journal,
 			 * in pass REPLAY; otherwise, just skip over the
 			 * blocks it describes. */
 			if (pass != PASS_REPLAY) {
+				if (pass == PASS_SCAN &&
+				    JFS_HAS_COMPAT_FEATURE(journal,
+					    JFS_FEATURE_COMPAT_CHECKSUM)) {
+					err = calc_chksums(journal, bh,
+							   &next_log_block,
+							   &crc32_sum);
+					brelse(bh);
+					if (err)
+						goto failed;
+					continue;
+				}
 				next_log_block +=
 					count_tags(bh, journal->j_blocksize);
 				wrap(journal, next_log_block);
@@ -508,12 +555,42 @@ static int do_one_pass(journal_t *journal,
 		case JFS_COMMIT_BLOCK:
 			/* Found an expected commit block: not much to
 			 * do other than move on to the next sequence
-			 * number. */
+			 * number.  If it carries a checksum, the scan
+			 * pass first makes sure that every block of the
+			 * transaction reached the log: a commit record
+			 * written asynchronously can land ahead of them,
+			 * and such a torn transaction ends the log. */
+			if (pass == PASS_SCAN &&
+			    JFS_HAS_COMPAT_FEATURE(journal,
+					JFS_FEATURE_COMPAT_CHECKSUM)) {
+				commit_header_t *cbh =
+					(commit_header_t *)bh->b_data;
+
+				if (cbh->h_chksum_type == JFS_CRC32_CHKSUM &&
+				    cbh->h_chksum_size ==
+						JFS_CRC32_CHKSUM_SIZE &&
+				    be32_to_cpu(cbh->h_chksum[0]) !=
+						crc32_sum) {
+					printk(KERN_NOTICE "JBD: checksum "
+						"mismatch in transaction %u, "
+						"discarding it\n",
+						next_commit_ID);
+					brelse(bh);
+					goto done;
+				}
+				crc32_sum = ~0U;
+			}
 			brelse(bh);
 			next_commit_ID++;
 			continue;
 
 		case JFS_REVOKE_BLOCK:
+			if (pass == PASS_SCAN &&
+			    JFS_HAS_COMPAT_FEATURE(journal,
+					JFS_FEATURE_COMPAT_CHECKSUM))
+				crc32_sum = crc32_be(crc32_sum,
+					(unsigned char *)bh->b_data,
+					bh->b_size);
 			/* If we aren't in the REVOKE pass, then we can
 			 * just skip over this block. */
 			if (pass != PASS_REVOKE) {
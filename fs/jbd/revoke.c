@@ -68,6 +68,7 @@
 #include <linux/list.h>
 #include <linux/smp_lock.h>
 #include <linux/init.h>
+#include <linux/crc32.h>
 #endif
 
 static kmem_cache_t *revoke_record_cache;
@@ -100,7 +101,8 @@ struct jbd_revoke_table_s
 static void write_one_revoke_record(journal_t *, transaction_t *,
 				    struct journal_head **, int *,
 				    struct jbd_revoke_record_s *);
-static void flush_descriptor(journal_t *, struct journal_head *, int);
+static void flush_descriptor(journal_t *, transaction_t *,
+			     struct journal_head *, int);
 #endif
 
 /* Utility functions to maintain the revoke table */
@@ -529,7 +531,7 @@ void journal_write_revoke_records(journal_t *journal,
 		}
 	}
 	if (descriptor)
-		flush_descriptor(journal, descriptor, offset);
+		flush_descriptor(journal, transaction, descriptor, offset);
 	jbd_debug(1, "Wrote %d revoke records\n", count);
 }
 
@@ -561,7 +563,8 @@ static void write_one_revoke_record(journal_t *journal,
 	/* Make sure we have a descriptor with space left for the record */
 	if (descriptor) {
 		if (offset == journal->j_blocksize) {
-			flush_descriptor(journal, descriptor, offset);
+			flush_descriptor(journal, transaction,
+					 descriptor, offset);
 			descriptor = NULL;
 		}
 	}
@@ -593,10 +596,12 @@ static void write_one_revoke_record(journal_t *journal,
  * Flush a revoke descriptor out to the journal.  If we are aborting,
  * this is a noop; otherwise we are generating a buffer which needs to
  * be waited for during commit, so it has to go onto the appropriate
- * journal buffer list.
+ * journal buffer list.  Revoke blocks precede the transaction's
+ * metadata in the log, so they are the first thing its checksum covers.
  */
 
 static void flush_descriptor(journal_t *journal, 
+			     transaction_t *transaction,
 			     struct journal_head *descriptor, 
 			     int offset)
 {
@@ -610,6 +615,10 @@ static void flush_descriptor(journal_t *journal,
 
 	header = (journal_revoke_header_t *) jh2bh(descriptor)->b_data;
 	header->r_count = cpu_to_be32(offset);
+	if (JFS_HAS_COMPAT_FEATURE(journal, JFS_FEATURE_COMPAT_CHECKSUM))
+		transaction->t_chksum = crc32_be(transaction->t_chksum,
+					(unsigned char *)bh->b_data,
+					bh->b_size);
 	set_buffer_jwrite(bh);
 	BUFFER_TRACE(bh, "write");
 	set_buffer_dirty(bh);
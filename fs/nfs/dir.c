@@ -31,6 +31,8 @@
 #include <linux/pagemap.h>
 #include <linux/smp_lock.h>
 #include <linux/namei.h>
+#include <linux/workqueue.h>
+#include <linux/file.h>
 
 #include "delegation.h"
 
@@ -121,6 +123,7 @@ typedef struct {
 	decode_dirent_t	decode;
 	int		plus;
 	int		error;
+	unsigned long	timestamp;	/* when the page was read */
 } nfs_readdir_descriptor_t;
 
 /* Now we cache directories properly, by stuffing the dirent
@@ -161,6 +164,8 @@ int nfs_readdir_filler(nfs_readdir_descriptor_t *desc, struct page *page)
 		goto error;
 	}
 	SetPageUptodate(page);
+	/* The age of the READDIRPLUS attributes: see nfs_fs.h */
+	page->private = timestamp;
 	NFS_FLAGS(inode) |= NFS_INO_INVALID_ATIME;
 	/* Ensure consistent page alignment of the data.
 	 * Note: assumes we have exclusive access to this mapping either
@@ -200,6 +205,169 @@ void dir_page_release(nfs_readdir_descriptor_t *desc)
 	desc->ptr = NULL;
 }
 
+/*
+ * The pages of a large directory are read ahead of nfs_readdir in the
+ * background, so that the READDIR calls overlap with the work done on
+ * the entries already returned.  A page is read from the last cookie
+ * on the page before, so the pages can only be read one after another,
+ * by one worker for each directory.
+ *
+ * The worker never waits for i_sem: while nfs_readdir has it, the work
+ * is put off for a tick, and dropped once the directory is closed or
+ * after NFS_DIR_PREFILL_TRIES.  The queue has a thread for each cpu, so
+ * a server which does not answer holds up little besides its own work.
+ */
+#define NFS_DIR_PREFILL		8	/* pages to read ahead */
+#define NFS_DIR_PREFILL_TRIES	32	/* ticks to wait for i_sem */
+
+struct nfs_dir_prefill {
+	struct work_struct	work;
+	struct file		*file;
+	unsigned long		index;	/* next page to read */
+	unsigned long		end;	/* and where to stop */
+	int			plus;
+	int			tries;
+};
+
+static struct workqueue_struct *nfs_dir_wq;
+
+/*
+ * Decode a cached page up to its last entry, which leaves in
+ * desc->entry the cookie to read the next page from.  Returns
+ * -EBADCOOKIE if the page ends the directory.
+ */
+static int nfs_dir_last_cookie(nfs_readdir_descriptor_t *desc,
+			       unsigned long index)
+{
+	struct inode	*inode = desc->file->f_dentry->d_inode;
+	struct page	*page;
+	int		n = 0;
+
+	page = find_get_page(inode->i_mapping, index);
+	if (page == NULL)
+		return -EAGAIN;
+	if (!PageUptodate(page)) {
+		page_cache_release(page);
+		return -EAGAIN;
+	}
+	desc->page = page;
+	desc->ptr = kmap(page);
+	desc->entry->eof = 0;
+	while (dir_decode(desc) == 0)
+		n++;
+	dir_page_release(desc);
+	if (desc->entry->eof)
+		return -EBADCOOKIE;
+	return n ? 0 : -EIO;
+}
+
+static void nfs_dir_prefill(void *data)
+{
+	struct nfs_dir_prefill *p = data;
+	struct inode	*inode = p->file->f_dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	nfs_readdir_descriptor_t desc;
+	struct nfs_entry entry;
+	struct nfs_fh	fh;
+	struct nfs_fattr fattr;
+	struct page	*page;
+	unsigned long	index;
+	int		status;
+
+	memset(&desc, 0, sizeof(desc));
+	memset(&entry, 0, sizeof(entry));
+	desc.file = p->file;
+	desc.decode = NFS_PROTO(inode)->decode_dirent;
+	desc.plus = p->plus;
+	entry.fh = &fh;
+	entry.fattr = &fattr;
+	desc.entry = &entry;
+
+	for (index = p->index; index < p->end; index++) {
+		page = find_get_page(mapping, index);
+		if (page != NULL) {
+			page_cache_release(page);
+			continue;
+		}
+		/* nfs_readdir_filler wants the mapping to itself */
+		if (down_trylock(&inode->i_sem)) {
+			if (file_count(p->file) == 1 ||
+			    ++p->tries > NFS_DIR_PREFILL_TRIES)
+				break;
+			p->index = index;
+			queue_delayed_work(nfs_dir_wq, &p->work, 1);
+			return;
+		}
+		lock_kernel();
+		status = -EAGAIN;
+		if (desc.plus == NFS_USE_READDIRPLUS(inode))
+			status = nfs_dir_last_cookie(&desc, index - 1);
+		if (status == 0)
+			page = read_cache_page(mapping, index,
+					(filler_t *)nfs_readdir_filler, &desc);
+		unlock_kernel();
+		up(&inode->i_sem);
+		if (status != 0 || IS_ERR(page))
+			break;
+		status = PageUptodate(page);
+		page_cache_release(page);
+		if (!status)
+			break;
+		NFS_SERVER(inode)->dir_prefill++;
+	}
+
+	lock_kernel();
+	NFS_FLAGS(inode) &= ~NFS_INO_DIR_PREFILL;
+	unlock_kernel();
+	fput(p->file);
+	kfree(p);
+}
+
+/*
+ * Called by nfs_readdir on getting a page past the first: start
+ * reading ahead unless that is being done, or is far enough ahead.
+ */
+static void nfs_dir_start_prefill(nfs_readdir_descriptor_t *desc)
+{
+	struct inode	*inode = desc->file->f_dentry->d_inode;
+	struct nfs_dir_prefill *p;
+	struct page	*page;
+
+	if (NFS_FLAGS(inode) & NFS_INO_DIR_PREFILL)
+		return;
+	page = find_get_page(inode->i_mapping,
+			     desc->page_index + NFS_DIR_PREFILL / 2);
+	if (page != NULL) {
+		page_cache_release(page);
+		return;
+	}
+	p = kmalloc(sizeof(*p), GFP_KERNEL);
+	if (p == NULL)
+		return;
+	INIT_WORK(&p->work, nfs_dir_prefill, p);
+	get_file(desc->file);
+	p->file = desc->file;
+	p->index = desc->page_index + 1;
+	p->end = p->index + NFS_DIR_PREFILL;
+	p->plus = desc->plus;
+	p->tries = 0;
+	NFS_FLAGS(inode) |= NFS_INO_DIR_PREFILL;
+	queue_work(nfs_dir_wq, &p->work);
+}
+
+int nfs_init_dirprefill(void)
+{
+	nfs_dir_wq = create_workqueue("nfs_dir");
+	if (nfs_dir_wq == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void nfs_destroy_dirprefill(void)
+{
+	destroy_workqueue(nfs_dir_wq);
+}
+
 /*
  * Given a pointer to a buffer that has already been filled by a call
  * to readdir, find the next entry.
@@ -253,9 +421,12 @@ int find_dirent_page(nfs_readdir_descriptor_t *desc)
 	/* NOTE: Someone else may have changed the READDIRPLUS flag */
 	desc->page = page;
 	desc->ptr = kmap(page);		/* matching kunmap in nfs_do_filldir */
+	desc->timestamp = page->private;
 	status = find_dirent(desc, page);
 	if (status < 0)
 		dir_page_release(desc);
+	else if (desc->page_index > 0 && !desc->entry->eof)
+		nfs_dir_start_prefill(desc);
  out:
 	dfprintk(VFS, "NFS: find_dirent_page() returns %d\n", status);
 	return status;
@@ -382,6 +553,7 @@ int uncached_readdir(nfs_readdir_descriptor_t *desc, void *dirent,
 		status = -ENOMEM;
 		goto out;
 	}
+	desc->timestamp = jiffies;
 	desc->error = NFS_PROTO(inode)->readdir(file->f_dentry, cred, desc->target,
 						page,
 						NFS_SERVER(inode)->dtsize,
@@ -911,10 +1083,24 @@ static struct dentry *nfs_readdir_lookup(nfs_readdir_descriptor_t *desc)
 	}
 	name.hash = full_name_hash(name.name, name.len);
 	dentry = d_lookup(parent, &name);
-	if (dentry != NULL)
+	if (!desc->plus || !(entry->fattr->valid & NFS_ATTR_FATTR)
+			|| entry->fh->size == 0)
 		return dentry;
-	if (!desc->plus || !(entry->fattr->valid & NFS_ATTR_FATTR))
-		return NULL;
+	/* The attributes are as old as the page they came in */
+	entry->fattr->timestamp = desc->timestamp;
+	if (dentry != NULL) {
+		inode = dentry->d_inode;
+		if (inode == NULL || NFS_FILEID(inode) != entry->fattr->fileid
+				|| nfs_compare_fh(NFS_FH(inode), entry->fh))
+			return dentry;
+		/* Let lookups and stat() use what the server sent */
+		if (nfs_readdirplus_update_inode(inode, entry->fattr) == 0) {
+			NFS_SERVER(dir)->rdplus_attrs++;
+			nfs_renew_times(dentry);
+			nfs_set_verifier(dentry, nfs_save_change_attribute(dir));
+		}
+		return dentry;
+	}
 	/* Note: caller is already holding the dir->i_sem! */
 	dentry = d_alloc(parent, &name);
 	if (dentry == NULL)
@@ -925,6 +1111,9 @@ static struct dentry *nfs_readdir_lookup(nfs_readdir_descriptor_t *desc)
 		dput(dentry);
 		return NULL;
 	}
+	/* nfs_fhget only checks the attributes of a cached inode */
+	nfs_readdirplus_update_inode(inode, entry->fattr);
+	NFS_SERVER(dir)->rdplus_attrs++;
 	alias = d_add_unique(dentry, inode);
 	if (alias != NULL) {
 		dput(dentry);
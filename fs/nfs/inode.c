@@ -63,6 +63,7 @@ static void nfs_clear_inode(struct inode *);
 static void nfs_umount_begin(struct super_block *);
 static int  nfs_statfs(struct super_block *, struct kstatfs *);
 static int  nfs_show_options(struct seq_file *, struct vfsmount *);
+static int  nfs_show_stats(struct seq_file *, struct vfsmount *);
 
 static struct super_operations nfs_sops = { 
 	.alloc_inode	= nfs_alloc_inode,
@@ -73,6 +74,7 @@ static struct super_operations nfs_sops = {
 	.clear_inode	= nfs_clear_inode,
 	.umount_begin	= nfs_umount_begin,
 	.show_options	= nfs_show_options,
+	.show_stats	= nfs_show_stats,
 };
 
 /*
@@ -252,6 +254,7 @@ nfs_sb_init(struct super_block *sb, rpc_authflavor_t authflavor)
 	snprintf(sb->s_id, sizeof(sb->s_id), "%x:%x", MAJOR(sb->s_dev), MINOR(sb->s_dev));
 
 	server = NFS_SB(sb);
+	bdi_register(&server->backing_dev_info, "nfs-%s", sb->s_id);
 
 	sb->s_magic      = NFS_SUPER_MAGIC;
 
@@ -369,6 +372,12 @@ nfs_create_client(struct nfs_server *server, const struct nfs_mount_data *data)
 	clnt->cl_droppriv = (server->flags & NFS_MOUNT_BROKEN_SUID) ? 1 : 0;
 	clnt->cl_chatty   = 1;
 
+	/* Spread the RPCs over several TCP connections */
+	if (tcp && data->nconnect > 1 &&
+	    rpc_add_xprts(clnt, data->nconnect) < 0)
+		printk(KERN_WARNING "NFS: using %u of %d connections.\n",
+				clnt->cl_nxprt, data->nconnect);
+
 	return clnt;
 
 out_fail:
@@ -547,6 +556,8 @@ static int nfs_show_options(struct seq_file *m, struct vfsmount *mnt)
 	seq_printf(m, ",v%d", nfss->rpc_ops->version);
 	seq_printf(m, ",rsize=%d", nfss->rsize);
 	seq_printf(m, ",wsize=%d", nfss->wsize);
+	if (nfss->client->cl_nxprt > 1)
+		seq_printf(m, ",nconnect=%u", nfss->client->cl_nxprt);
 	if (nfss->acregmin != 3*HZ)
 		seq_printf(m, ",acregmin=%d", nfss->acregmin/HZ);
 	if (nfss->acregmax != 60*HZ)
@@ -566,6 +577,18 @@ static int nfs_show_options(struct seq_file *m, struct vfsmount *mnt)
 	return 0;
 }
 
+static int nfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
+{
+	struct nfs_server *nfss = NFS_SB(mnt->mnt_sb);
+
+	seq_printf(m, "statvers=1.0");
+	seq_printf(m, "\n\tattrcache:\thits %lu misses %lu",
+			nfss->attr_hits, nfss->attr_misses);
+	seq_printf(m, "\n\treaddir:\trdplus_attrs %lu prefill %lu",
+			nfss->rdplus_attrs, nfss->dir_prefill);
+	return 0;
+}
+
 /*
  * Invalidate the local caches
  */
@@ -636,9 +659,6 @@ nfs_init_locked(struct inode *inode, void *opaque)
 	return 0;
 }
 
-/* Don't use READDIRPLUS on directories that we believe are too large */
-#define NFS_LIMIT_READDIRPLUS (8*PAGE_SIZE)
-
 /*
  * This is our front-end to iget that looks up inodes by file handle
  * instead of inode number.
@@ -687,8 +707,7 @@ nfs_fhget(struct super_block *sb, struct nfs_fh *fh, struct nfs_fattr *fattr)
 		} else if (S_ISDIR(inode->i_mode)) {
 			inode->i_op = NFS_SB(sb)->rpc_ops->dir_inode_ops;
 			inode->i_fop = &nfs_dir_operations;
-			if (nfs_server_capable(inode, NFS_CAP_READDIRPLUS)
-			    && fattr->size <= NFS_LIMIT_READDIRPLUS)
+			if (nfs_server_capable(inode, NFS_CAP_READDIRPLUS))
 				NFS_FLAGS(inode) |= NFS_INO_ADVISE_RDPLUS;
 		} else if (S_ISLNK(inode->i_mode))
 			inode->i_op = &nfs_symlink_inode_operations;
@@ -1051,8 +1070,11 @@ int nfs_attribute_timeout(struct inode *inode)
 int nfs_revalidate_inode(struct nfs_server *server, struct inode *inode)
 {
 	if (!(NFS_FLAGS(inode) & (NFS_INO_INVALID_ATTR|NFS_INO_INVALID_DATA))
-			&& !nfs_attribute_timeout(inode))
+			&& !nfs_attribute_timeout(inode)) {
+		server->attr_hits++;
 		return NFS_STALE(inode) ? -ESTALE : 0;
+	}
+	server->attr_misses++;
 	return __nfs_revalidate_inode(server, inode);
 }
 
@@ -1183,6 +1205,37 @@ int nfs_refresh_inode(struct inode *inode, struct nfs_fattr *fattr)
 	return 0;
 }
 
+/**
+ * nfs_readdirplus_update_inode - take over attributes from READDIRPLUS
+ * @inode - pointer to inode
+ * @fattr - attributes of a directory entry
+ *
+ * Unlike nfs_refresh_inode, which only checks the attribute cache
+ * against fattr, this updates it as a GETATTR would, so that a stat()
+ * after readdir() need not go to the server.  Attributes older than
+ * the cached ones, or arriving while the inode is being revalidated or
+ * written to, are only checked.
+ */
+int nfs_readdirplus_update_inode(struct inode *inode, struct nfs_fattr *fattr)
+{
+	struct nfs_inode *nfsi = NFS_I(inode);
+	int status;
+
+	if (nfs_have_delegation(inode, FMODE_READ) || NFS_REVALIDATING(inode)
+			|| nfs_caches_unstable(inode)
+			|| time_before(fattr->timestamp, nfsi->read_cache_jiffies))
+		return nfs_refresh_inode(inode, fattr);
+
+	status = nfs_update_inode(inode, fattr, nfs_save_change_attribute(inode));
+	if (status)
+		return status;
+	nfsi->flags &= ~(NFS_INO_INVALID_ATTR|NFS_INO_INVALID_ATIME);
+	/* Nothing cached to throw away: no need for a GETATTR to do it */
+	if (!S_ISDIR(inode->i_mode) && inode->i_mapping->nrpages == 0)
+		nfsi->flags &= ~NFS_INO_INVALID_DATA;
+	return 0;
+}
+
 /*
  * Many nfs protocol calls return the new file attributes after
  * an operation.  Here we update the inode to reflect the state
@@ -1399,6 +1452,8 @@ static struct super_block *nfs_get_sb(struct file_system_type *fs_type,
 		}
 		if (data->version < 5)
 			data->flags &= ~NFS_MOUNT_SECFLAVOUR;
+		if (data->version < 7)
+			data->nconnect = 1;
 	}
 
 	root = &server->fh;
@@ -1452,6 +1507,7 @@ static void nfs_kill_super(struct super_block *s)
 	struct nfs_server *server = NFS_SB(s);
 
 	kill_anon_super(s);
+	bdi_unregister(&server->backing_dev_info);
 
 	if (server->client != NULL && !IS_ERR(server->client))
 		rpc_shutdown_client(server->client);
@@ -1490,6 +1546,7 @@ static struct super_operations nfs4_sops = {
 	.clear_inode	= nfs4_clear_inode,
 	.umount_begin	= nfs_umount_begin,
 	.show_options	= nfs_show_options,
+	.show_stats	= nfs_show_stats,
 };
 
 /*
@@ -1793,6 +1850,7 @@ static void nfs4_kill_super(struct super_block *sb)
 
 	nfs_return_all_delegations(sb);
 	kill_anon_super(sb);
+	bdi_unregister(&server->backing_dev_info);
 
 	nfs4_renewd_prepare_shutdown(server);
 
@@ -1905,6 +1963,10 @@ static int __init init_nfs_fs(void)
 {
 	int err;
 
+	err = nfs_init_dirprefill();
+	if (err)
+		goto out5;
+
 	err = nfs_init_nfspagecache();
 	if (err)
 		goto out4;
@@ -1952,6 +2014,8 @@ out2:
 out3:
 	nfs_destroy_nfspagecache();
 out4:
+	nfs_destroy_dirprefill();
+out5:
 	return err;
 }
 
@@ -1969,6 +2033,7 @@ static void __exit exit_nfs_fs(void)
 #endif
 	unregister_filesystem(&nfs_fs_type);
 	unregister_nfs4fs();
+	nfs_destroy_dirprefill();
 }
 
 /* Not quite true; I just maintain it */
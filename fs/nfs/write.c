@@ -433,6 +433,7 @@ nfs_mark_request_dirty(struct nfs_page *req)
 	nfsi->ndirty++;
 	spin_unlock(&nfsi->req_lock);
 	inc_page_state(nr_dirty);
+	atomic_inc(&inode->i_mapping->backing_dev_info->nr_reclaimable);
 	mark_inode_dirty(inode);
 }
 
@@ -461,6 +462,7 @@ nfs_mark_request_commit(struct nfs_page *req)
 	nfsi->ncommit++;
 	spin_unlock(&nfsi->req_lock);
 	inc_page_state(nr_unstable);
+	atomic_inc(&inode->i_mapping->backing_dev_info->nr_reclaimable);
 	mark_inode_dirty(inode);
 }
 #endif
@@ -525,6 +527,7 @@ nfs_scan_dirty(struct inode *inode, struct list_head *dst, unsigned long idx_sta
 	res = nfs_scan_list(&nfsi->dirty, dst, idx_start, npages);
 	nfsi->ndirty -= res;
 	sub_page_state(nr_dirty,res);
+	atomic_sub(res, &inode->i_mapping->backing_dev_info->nr_reclaimable);
 	if ((nfsi->ndirty == 0) != list_empty(&nfsi->dirty))
 		printk(KERN_ERR "NFS: desynchronized value of nfs_i.ndirty.\n");
 	return res;
@@ -905,7 +908,7 @@ static int nfs_flush_multi(struct list_head *head, struct inode *inode, int how)
 	atomic_set(&req->wb_complete, requests);
 
 	ClearPageError(page);
-	SetPageWriteback(page);
+	set_page_writeback(page);
 	offset = 0;
 	nbytes = req->wb_bytes;
 	do {
@@ -968,7 +971,7 @@ static int nfs_flush_one(struct list_head *head, struct inode *inode, int how)
 		nfs_list_remove_request(req);
 		nfs_list_add_request(req, &data->pages);
 		ClearPageError(req->wb_page);
-		SetPageWriteback(req->wb_page);
+		set_page_writeback(req->wb_page);
 		*pages++ = req->wb_page;
 		count += req->wb_bytes;
 	}
@@ -1311,6 +1314,8 @@ nfs_commit_done(struct rpc_task *task)
 		res++;
 	}
 	sub_page_state(nr_unstable,res);
+	atomic_sub(res,
+		&data->inode->i_mapping->backing_dev_info->nr_reclaimable);
 }
 #endif
 
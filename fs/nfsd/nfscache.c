@@ -2,7 +2,8 @@
  * linux/fs/nfsd/nfscache.c
  *
  * Request reply cache. This is currently a global cache, but this may
- * change in the future and be a per-client cache.
+ * change in the future and be a per-client cache.  It is sized from the
+ * amount of memory, and each hash chain has its own lock.
  *
  * This code is heavily inspired by the 44BSD implementation, although
  * it does things a bit differently.
@@ -15,30 +16,41 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
 
 #include <linux/sunrpc/svc.h>
 #include <linux/nfsd/nfsd.h>
 #include <linux/nfsd/cache.h>
+#include <net/checksum.h>
 
 /* Size of reply cache. Common values are:
  * 4.3BSD:	128
  * 4.4BSD:	256
  * Solaris2:	1024
  * DEC Unix:	512-4096
+ *
+ * We allow one entry for every 16 pages of memory, within these
+ * bounds, and aim for RC_BUCKET_TARGET entries per hash chain.
  */
-#define CACHESIZE		1024
-#define HASHSIZE		64
-#define REQHASH(xid)		((((xid) >> 24) ^ (xid)) & (HASHSIZE-1))
+#define RC_MIN_ENTRIES		1024
+#define RC_MAX_ENTRIES		65536
+#define RC_BUCKET_TARGET	16
 
-struct nfscache_head {
-	struct svc_cacherep *	next;
-	struct svc_cacherep *	prev;
+/*
+ * A hash chain, kept in LRU order, with its own lock.
+ */
+struct nfscache_bucket {
+	struct list_head	lru_head;
+	spinlock_t		cache_lock;
 };
 
-static struct nfscache_head *	hash_list;
-static struct svc_cacherep *	lru_head;
-static struct svc_cacherep *	lru_tail;
-static struct svc_cacherep *	nfscache;
+static struct nfscache_bucket *	drc_hashtbl;
+static unsigned int		drc_hashbits;
+static kmem_cache_t *		drc_slab;
+static unsigned int		max_drc_entries;
+static atomic_t			num_drc_entries = ATOMIC_INIT(0);
 static int			cache_disabled = 1;
 
 static int	nfsd_cache_append(struct svc_rqst *rqstp, struct kvec *vec);
@@ -46,138 +58,148 @@ static int	nfsd_cache_append(struct svc_rqst *rqstp, struct kvec *vec);
 /* 
  * locking for the reply cache:
  * A cache entry is "single use" if c_state == RC_INPROG
- * Otherwise, it when accessing _prev or _next, the lock must be held.
+ * Otherwise, when accessing c_lru or freeing the entry, the lock of
+ * the bucket it hashes to must be held.
  */
-static DEFINE_SPINLOCK(cache_lock);
+
+static inline struct nfscache_bucket *
+nfsd_cache_bucket(u32 xid)
+{
+	return drc_hashtbl + hash_long(xid, drc_hashbits);
+}
 
 void
 nfsd_cache_init(void)
 {
-	struct svc_cacherep	*rp;
-	struct nfscache_head	*rh;
-	size_t			i;
-	unsigned long		order;
-
-
-	i = CACHESIZE * sizeof (struct svc_cacherep);
-	for (order = 0; (PAGE_SIZE << order) < i; order++)
+	unsigned int		i;
+
+	max_drc_entries = num_physpages / 16;
+	if (max_drc_entries < RC_MIN_ENTRIES)
+		max_drc_entries = RC_MIN_ENTRIES;
+	if (max_drc_entries > RC_MAX_ENTRIES)
+		max_drc_entries = RC_MAX_ENTRIES;
+	for (drc_hashbits = 0;
+	     (RC_BUCKET_TARGET << drc_hashbits) < max_drc_entries;
+	     drc_hashbits++)
 		;
-	nfscache = (struct svc_cacherep *)
-		__get_free_pages(GFP_KERNEL, order);
-	if (!nfscache) {
-		printk (KERN_ERR "nfsd: cannot allocate %Zd bytes for reply cache\n", i);
+
+	drc_slab = kmem_cache_create("nfsd_drc", sizeof(struct svc_cacherep),
+				     0, 0, NULL, NULL);
+	if (!drc_slab) {
+		printk (KERN_ERR "nfsd: cannot create reply cache slab\n");
 		return;
 	}
-	memset(nfscache, 0, i);
-
-	i = HASHSIZE * sizeof (struct nfscache_head);
-	hash_list = kmalloc (i, GFP_KERNEL);
-	if (!hash_list) {
-		free_pages ((unsigned long)nfscache, order);
-		nfscache = NULL;
-		printk (KERN_ERR "nfsd: cannot allocate %Zd bytes for hash list\n", i);
+
+	i = (1 << drc_hashbits) * sizeof (struct nfscache_bucket);
+	drc_hashtbl = kmalloc (i, GFP_KERNEL);
+	if (!drc_hashtbl) {
+		kmem_cache_destroy(drc_slab);
+		drc_slab = NULL;
+		printk (KERN_ERR "nfsd: cannot allocate %u bytes for hash list\n", i);
 		return;
 	}
 
-	for (i = 0, rh = hash_list; i < HASHSIZE; i++, rh++)
-		rh->next = rh->prev = (struct svc_cacherep *) rh;
-
-	for (i = 0, rp = nfscache; i < CACHESIZE; i++, rp++) {
-		rp->c_state = RC_UNUSED;
-		rp->c_type = RC_NOCACHE;
-		rp->c_hash_next =
-		rp->c_hash_prev = rp;
-		rp->c_lru_next = rp + 1;
-		rp->c_lru_prev = rp - 1;
+	for (i = 0; i < (1 << drc_hashbits); i++) {
+		INIT_LIST_HEAD(&drc_hashtbl[i].lru_head);
+		spin_lock_init(&drc_hashtbl[i].cache_lock);
 	}
-	lru_head = nfscache;
-	lru_tail = nfscache + CACHESIZE - 1;
-	lru_head->c_lru_prev = NULL;
-	lru_tail->c_lru_next = NULL;
 
 	cache_disabled = 0;
 }
 
+/*
+ * Unhash a cache entry and free it along with any buffer it holds.
+ * The bucket lock must be held.
+ */
+static void
+nfsd_cache_free(struct svc_cacherep *rp)
+{
+	if (rp->c_type == RC_REPLBUFF)
+		kfree(rp->c_replvec.iov_base);
+	list_del(&rp->c_lru);
+	kmem_cache_free(drc_slab, rp);
+	atomic_dec(&num_drc_entries);
+}
+
 void
 nfsd_cache_shutdown(void)
 {
-	struct svc_cacherep	*rp;
-	size_t			i;
-	unsigned long		order;
+	struct nfscache_bucket	*b;
+	unsigned int		i;
 
-	for (rp = lru_head; rp; rp = rp->c_lru_next) {
-		if (rp->c_state == RC_DONE && rp->c_type == RC_REPLBUFF)
-			kfree(rp->c_replvec.iov_base);
-	}
+	if (!drc_hashtbl)
+		return;
 
 	cache_disabled = 1;
 
-	i = CACHESIZE * sizeof (struct svc_cacherep);
-	for (order = 0; (PAGE_SIZE << order) < i; order++)
-		;
-	free_pages ((unsigned long)nfscache, order);
-	nfscache = NULL;
-	kfree (hash_list);
-	hash_list = NULL;
+	for (i = 0; i < (1 << drc_hashbits); i++) {
+		b = drc_hashtbl + i;
+		while (!list_empty(&b->lru_head))
+			nfsd_cache_free(list_entry(b->lru_head.next,
+						   struct svc_cacherep, c_lru));
+	}
+
+	kfree (drc_hashtbl);
+	drc_hashtbl = NULL;
+	if (kmem_cache_destroy(drc_slab))
+		printk(KERN_WARNING "nfsd: reply cache slab not empty\n");
+	drc_slab = NULL;
 }
 
 /*
- * Move cache entry to front of LRU list
+ * Checksum the start of the call arguments, which follow the RPC header
+ * in the head of rq_arg.  Calls whose arguments all fit there, which is
+ * nearly all of the cacheable ones, are told apart completely.
  */
-static void
-lru_put_front(struct svc_cacherep *rp)
+static u32
+nfsd_cache_csum(struct svc_rqst *rqstp)
 {
-	struct svc_cacherep	*prev = rp->c_lru_prev,
-				*next = rp->c_lru_next;
-
-	if (prev)
-		prev->c_lru_next = next;
-	else
-		lru_head = next;
-	if (next)
-		next->c_lru_prev = prev;
-	else
-		lru_tail = prev;
-
-	rp->c_lru_next = lru_head;
-	rp->c_lru_prev = NULL;
-	if (lru_head)
-		lru_head->c_lru_prev = rp;
-	lru_head = rp;
+	struct kvec	*head = &rqstp->rq_arg.head[0];
+	size_t		len = min_t(size_t, head->iov_len, RC_CSUMLEN);
+
+	return csum_partial(head->iov_base, len, 0);
 }
 
 /*
- * Move a cache entry from one hash list to another
+ * Free the entries of a bucket which are expired or were given up on.
+ * Returns the oldest one still in use but not in progress, for reuse if
+ * no new entry can be had.
  */
-static void
-hash_refile(struct svc_cacherep *rp)
+static struct svc_cacherep *
+nfsd_cache_prune(struct nfscache_bucket *b)
 {
-	struct svc_cacherep	*prev = rp->c_hash_prev,
-				*next = rp->c_hash_next;
-	struct nfscache_head	*head = hash_list + REQHASH(rp->c_xid);
-
-	prev->c_hash_next = next;
-	next->c_hash_prev = prev;
-
-	rp->c_hash_next = head->next;
-	rp->c_hash_prev = (struct svc_cacherep *) head;
-	head->next->c_hash_prev = rp;
-	head->next = rp;
+	struct svc_cacherep	*rp, *tmp, *oldest = NULL;
+
+	list_for_each_entry_safe(rp, tmp, &b->lru_head, c_lru) {
+		if (rp->c_state == RC_INPROG)
+			continue;
+		if (rp->c_state == RC_UNUSED ||
+		    time_after_eq(jiffies, rp->c_timestamp + RC_EXPIRE)) {
+			nfsd_cache_free(rp);
+			continue;
+		}
+		oldest = rp;
+	}
+	return oldest;
 }
 
 /*
  * Try to find an entry matching the current call in the cache. When none
- * is found, we grab the oldest unlocked entry off the LRU list.
- * Note that no operation within the loop may sleep.
+ * is found, we set up a new one, or take the oldest unlocked entry in
+ * the bucket when the cache is full.
+ * Note that no operation within the locked section may sleep.
  */
 int
 nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 {
-	struct svc_cacherep	*rh, *rp;
+	struct nfscache_bucket	*b;
+	struct svc_cacherep	*rp, *new = NULL;
 	u32			xid = rqstp->rq_xid,
 				proto =  rqstp->rq_prot,
 				vers = rqstp->rq_vers,
-				proc = rqstp->rq_proc;
+				proc = rqstp->rq_proc,
+				csum;
+	unsigned int		len = rqstp->rq_arg.len;
 	unsigned long		age;
 	int rtn;
 
@@ -187,15 +209,23 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 		return RC_DOIT;
 	}
 
-	spin_lock(&cache_lock);
+	csum = nfsd_cache_csum(rqstp);
+	if (atomic_read(&num_drc_entries) < max_drc_entries) {
+		new = kmem_cache_alloc(drc_slab, GFP_KERNEL);
+		if (new)
+			atomic_inc(&num_drc_entries);
+	}
+
+	b = nfsd_cache_bucket(xid);
+	spin_lock(&b->cache_lock);
 	rtn = RC_DOIT;
 
-	rp = rh = (struct svc_cacherep *) &hash_list[REQHASH(xid)];
-	while ((rp = rp->c_hash_next) != rh) {
+	list_for_each_entry(rp, &b->lru_head, c_lru) {
 		if (rp->c_state != RC_UNUSED &&
 		    xid == rp->c_xid && proc == rp->c_proc &&
 		    proto == rp->c_prot && vers == rp->c_vers &&
-		    time_before(jiffies, rp->c_timestamp + 120*HZ) &&
+		    len == rp->c_len && csum == rp->c_csum &&
+		    time_before(jiffies, rp->c_timestamp + RC_EXPIRE) &&
 		    memcmp((char*)&rqstp->rq_addr, (char*)&rp->c_addr, sizeof(rp->c_addr))==0) {
 			nfsdstats.rchits++;
 			goto found_entry;
@@ -203,31 +233,17 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 	}
 	nfsdstats.rcmisses++;
 
-	/* This loop shouldn't take more than a few iterations normally */
-	{
-	int	safe = 0;
-	for (rp = lru_tail; rp; rp = rp->c_lru_prev) {
-		if (rp->c_state != RC_INPROG)
-			break;
-		if (safe++ > CACHESIZE) {
-			printk("nfsd: loop in repcache LRU list\n");
-			cache_disabled = 1;
-			goto out;
-		}
-	}
-	}
-
-	/* This should not happen */
-	if (rp == NULL) {
-		static int	complaints;
-
-		printk(KERN_WARNING "nfsd: all repcache entries locked!\n");
-		if (++complaints > 5) {
-			printk(KERN_WARNING "nfsd: disabling repcache.\n");
-			cache_disabled = 1;
-		}
+	rp = nfsd_cache_prune(b);
+	if (new) {
+		rp = new;
+		new = NULL;
+		rp->c_type = RC_NOCACHE;
+		list_add(&rp->c_lru, &b->lru_head);
+	} else if (rp == NULL) {
+		/* Cache full and every entry here in progress: go uncached */
 		goto out;
-	}
+	} else
+		list_move(&rp->c_lru, &b->lru_head);
 
 	rqstp->rq_cacherep = rp;
 	rp->c_state = RC_INPROG;
@@ -236,10 +252,10 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 	rp->c_addr = rqstp->rq_addr;
 	rp->c_prot = proto;
 	rp->c_vers = vers;
+	rp->c_len = len;
+	rp->c_csum = csum;
 	rp->c_timestamp = jiffies;
 
-	hash_refile(rp);
-
 	/* release any buffer */
 	if (rp->c_type == RC_REPLBUFF) {
 		kfree(rp->c_replvec.iov_base);
@@ -247,14 +263,18 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 	}
 	rp->c_type = RC_NOCACHE;
  out:
-	spin_unlock(&cache_lock);
+	spin_unlock(&b->cache_lock);
+	if (new) {
+		kmem_cache_free(drc_slab, new);
+		atomic_dec(&num_drc_entries);
+	}
 	return rtn;
 
 found_entry:
 	/* We found a matching entry which is either in progress or done. */
 	age = jiffies - rp->c_timestamp;
 	rp->c_timestamp = jiffies;
-	lru_put_front(rp);
+	list_move(&rp->c_lru, &b->lru_head);
 
 	rtn = RC_DROPIT;
 	/* Request being processed or excessive rexmits */
@@ -308,18 +328,22 @@ void
 nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, u32 *statp)
 {
 	struct svc_cacherep *rp;
+	struct nfscache_bucket *b;
 	struct kvec	*resv = &rqstp->rq_res.head[0], *cachv;
 	int		len;
 
 	if (!(rp = rqstp->rq_cacherep) || cache_disabled)
 		return;
+	b = nfsd_cache_bucket(rp->c_xid);
 
 	len = resv->iov_len - ((char*)statp - (char*)resv->iov_base);
 	len >>= 2;
 	
 	/* Don't cache excessive amounts of data and XDR failures */
 	if (!statp || len > (256 >> 2)) {
+		spin_lock(&b->cache_lock);
 		rp->c_state = RC_UNUSED;
+		spin_unlock(&b->cache_lock);
 		return;
 	}
 
@@ -333,22 +357,22 @@ nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, u32 *statp)
 		cachv = &rp->c_replvec;
 		cachv->iov_base = kmalloc(len << 2, GFP_KERNEL);
 		if (!cachv->iov_base) {
-			spin_lock(&cache_lock);
+			spin_lock(&b->cache_lock);
 			rp->c_state = RC_UNUSED;
-			spin_unlock(&cache_lock);
+			spin_unlock(&b->cache_lock);
 			return;
 		}
 		cachv->iov_len = len << 2;
 		memcpy(cachv->iov_base, statp, len << 2);
 		break;
 	}
-	spin_lock(&cache_lock);
-	lru_put_front(rp);
+	spin_lock(&b->cache_lock);
+	list_move(&rp->c_lru, &b->lru_head);
 	rp->c_secure = rqstp->rq_secure;
 	rp->c_type = cachetype;
 	rp->c_state = RC_DONE;
 	rp->c_timestamp = jiffies;
-	spin_unlock(&cache_lock);
+	spin_unlock(&b->cache_lock);
 	return;
 }
 
@@ -294,8 +294,12 @@
 #define __NR_add_key		286
 #define __NR_request_key	287
 #define __NR_keyctl		288
+#define __NR_recvmmsg		289
+#define __NR_sendmmsg		290
+#define __NR_ioprio_set		291
+#define __NR_ioprio_get		292
 
-#define NR_syscalls 289
+#define NR_syscalls 293
 
 /*
  * user-visible error numbers are in the range -1 - -128: see
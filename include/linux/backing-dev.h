@@ -17,11 +17,14 @@ enum bdi_state {
 	BDI_pdflush,		/* A pdflush thread is working this device */
 	BDI_write_congested,	/* The write queue is getting full */
 	BDI_read_congested,	/* The read queue is getting full */
+	BDI_dirty,		/* Has dirty inodes, see mark_dirty_bdis() */
 	BDI_unused,		/* Available bits start here */
 };
 
 typedef int (congested_fn)(void *, int);
 
+struct bdi_writeback;
+
 struct backing_dev_info {
 	unsigned long ra_pages;	/* max readahead in PAGE_CACHE_SIZE units */
 	unsigned long state;	/* Always use atomic bitops on this */
@@ -30,11 +33,39 @@ struct backing_dev_info {
 	void *congested_data;	/* Pointer to aux data for congested func */
 	void (*unplug_io_fn)(struct backing_dev_info *, struct page *);
 	void *unplug_io_data;
+	struct bdi_writeback *wb; /* Flusher thread, if registered */
+
+	/*
+	 * Dirty memory against this device, for its share of the dirty
+	 * limit; see bdi_dirty_limit()
+	 */
+	atomic_t nr_reclaimable;	/* dirty + unstable pages */
+	atomic_t nr_writeback;		/* pages under writeback */
+	atomic_t completions;		/* recent writeback completions */
+	int dirty_exceeded;		/* over its share of the limit */
 };
 
 extern struct backing_dev_info default_backing_dev_info;
 void default_unplug_io_fn(struct backing_dev_info *bdi, struct page *page);
 
+int bdi_register(struct backing_dev_info *bdi, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void bdi_unregister(struct backing_dev_info *bdi);
+void bdi_start_background(long nr_pages);
+void bdi_start_kupdate(void);
+long bdi_dirty_limit(struct backing_dev_info *bdi, long dirty);
+
+extern atomic_t bdi_completions;
+
+/*
+ * A page against `bdi' finished writeback
+ */
+static inline void bdi_writeout_inc(struct backing_dev_info *bdi)
+{
+	atomic_inc(&bdi->completions);
+	atomic_inc(&bdi_completions);
+}
+
 int writeback_acquire(struct backing_dev_info *bdi);
 int writeback_in_progress(struct backing_dev_info *bdi);
 void writeback_release(struct backing_dev_info *bdi);
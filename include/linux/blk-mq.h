@@ -0,0 +1,114 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+/*
+ * Multi-queue block layer.
+ *
+ * Instead of one request_queue with a single queue_lock, elevator and
+ * request freelist, a multi-queue device gets one software submission
+ * context per CPU, mapped onto one or more hardware dispatch queues.
+ * Each hardware queue owns a fixed set of preallocated requests, one per
+ * tag, and completions can be sent back to the CPU that submitted the
+ * request.
+ */
+
+struct blk_mq_ctx;
+
+struct blk_mq_hw_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	dispatch;	/* held back by a busy driver */
+	} ____cacheline_aligned_in_smp;
+
+	unsigned long		state;		/* BLK_MQ_S_* flags */
+	struct work_struct	run_work;
+
+	cpumask_t		cpumask;	/* CPUs submitting to us */
+
+	unsigned long		flags;		/* BLK_MQ_F_* flags */
+
+	request_queue_t		*queue;
+	void			*driver_data;
+
+	/* software contexts mapped here, and those with pending requests */
+	unsigned int		nr_ctx;
+	struct blk_mq_ctx	**ctxs;
+	unsigned long		*ctx_map;
+
+	/* tags: one preallocated request per tag */
+	unsigned int		queue_depth;
+	unsigned long		*tag_map;
+	struct request		**rqs;
+	wait_queue_head_t	tag_wait;
+
+	unsigned int		queue_num;
+
+	unsigned long		queued;
+	unsigned long		run;
+};
+
+struct blk_mq_ops {
+	/*
+	 * Hand a request to the hardware. Return BLK_MQ_RQ_QUEUE_BUSY to
+	 * have it retried later; the driver then restarts the queue with
+	 * blk_mq_start_stopped_hw_queues() once it has room again.
+	 */
+	int (*queue_rq)(struct blk_mq_hw_ctx *, struct request *);
+
+	/* optional, called for each hardware queue at setup and teardown */
+	int (*init_hctx)(struct blk_mq_hw_ctx *, void *, unsigned int);
+	void (*exit_hctx)(struct blk_mq_hw_ctx *, unsigned int);
+};
+
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;	/* tags per hardware queue */
+	unsigned int		cmd_size;	/* per-request driver data */
+	unsigned int		flags;		/* BLK_MQ_F_* */
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_F_SAME_CPU	= 1 << 0,	/* complete on submitting CPU */
+
+	BLK_MQ_S_STOPPED	= 0,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+extern request_queue_t *blk_mq_init_queue(struct blk_mq_reg *, void *);
+extern void blk_mq_free_queue(request_queue_t *);
+
+extern void blk_mq_end_io(struct request *, int);
+extern void blk_mq_complete_request(struct request *, int);
+
+extern void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *, int);
+extern void blk_mq_run_queues(request_queue_t *, int);
+extern void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *);
+extern void blk_mq_start_stopped_hw_queues(request_queue_t *);
+
+static inline struct blk_mq_hw_ctx *blk_mq_map_queue(request_queue_t *q,
+						      int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+
+/*
+ * Driver command data is laid out right after the request
+ */
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *) (rq + 1);
+}
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+#endif
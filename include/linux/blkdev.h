@@ -135,6 +135,7 @@ struct request {
 	struct gendisk *rq_disk;
 	int errors;
 	unsigned long start_time;
+	unsigned long long issue_time;	/* sched_clock() at dispatch */
 
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
@@ -154,6 +155,7 @@ struct request {
 	int ref_count;
 	request_queue_t *q;
 	struct request_list *rl;
+	struct blk_mq_ctx *mq_ctx;	/* submitting CPU, multi-queue only */
 
 	struct completion *waiting;
 	void *special;
@@ -210,6 +212,7 @@ enum rq_flag_bits {
 	__REQ_PM_SHUTDOWN,	/* shutdown request */
 	__REQ_BAR_PREFLUSH,	/* barrier pre-flush done */
 	__REQ_BAR_POSTFLUSH,	/* barrier post-flush */
+	__REQ_WB_ACCT,		/* counted as background writeback */
 	__REQ_NR_BITS,		/* stops here */
 };
 
@@ -237,6 +240,7 @@ enum rq_flag_bits {
 #define REQ_PM_SHUTDOWN	(1 << __REQ_PM_SHUTDOWN)
 #define REQ_BAR_PREFLUSH	(1 << __REQ_BAR_PREFLUSH)
 #define REQ_BAR_POSTFLUSH	(1 << __REQ_BAR_POSTFLUSH)
+#define REQ_WB_ACCT	(1 << __REQ_WB_ACCT)
 
 /*
  * State information carried for REQ_PM_SUSPEND and REQ_PM_RESUME
@@ -275,6 +279,10 @@ enum blk_queue_state {
 #define BLK_TAGS_PER_LONG	(sizeof(unsigned long) * 8)
 #define BLK_TAGS_MASK		(BLK_TAGS_PER_LONG - 1)
 
+struct blk_mq_ops;
+struct blk_mq_ctx;
+struct blk_mq_hw_ctx;
+
 struct blk_queue_tag {
 	struct request **tag_index;	/* map of busy tags */
 	unsigned long *tag_map;		/* bit map of free/busy tags */
@@ -285,6 +293,23 @@ struct blk_queue_tag {
 	atomic_t refcnt;		/* map can be shared */
 };
 
+/*
+ * Writeback throttling.  Background writes may only have a limited
+ * number of requests in flight, and that limit is adjusted every window
+ * depending on whether reads completed within lat_usec or not.
+ */
+struct blk_wb {
+	unsigned long		lat_usec;	/* read latency target, 0 = off */
+	unsigned int		inflight;	/* background write requests */
+	int			scale_step;	/* > 0 throttled harder */
+	int			throttled;	/* writers waited this window */
+	unsigned long		last_read;	/* jiffies of last read done */
+	unsigned long		win_start;
+	unsigned int		win_reads;
+	unsigned long		win_min_usec;	/* fastest read this window */
+	wait_queue_head_t	wait;
+};
+
 struct request_queue
 {
 	/*
@@ -380,6 +405,17 @@ struct request_queue
 	unsigned int		sg_reserved_size;
 
 	struct list_head	drain_list;
+
+	struct blk_wb		wb;
+
+	/*
+	 * multi-queue mode, see blk-mq.h
+	 */
+	struct blk_mq_ops	*mq_ops;
+	struct blk_mq_ctx	*queue_ctx;	/* per-cpu submission contexts */
+	unsigned int		*mq_map;	/* cpu -> hardware queue */
+	struct blk_mq_hw_ctx	**queue_hw_ctx;
+	unsigned int		nr_hw_queues;
 };
 
 #define RQ_INACTIVE		(-1)
@@ -517,7 +553,12 @@ extern void blk_insert_request(request_queue_t *, struct request *, int, void *,
 extern void blk_requeue_request(request_queue_t *, struct request *);
 extern void blk_plug_device(request_queue_t *);
 extern int blk_remove_plug(request_queue_t *);
+extern void blk_start_plug(struct blk_plug *);
+extern void blk_finish_plug(struct blk_plug *);
+extern void blk_flush_plug_list(struct blk_plug *);
 extern void blk_recount_segments(request_queue_t *, struct bio *);
+extern int ll_back_merge_fn(request_queue_t *, struct request *, struct bio *);
+extern int ll_front_merge_fn(request_queue_t *, struct request *, struct bio *);
 extern int blk_phys_contig_segment(request_queue_t *q, struct bio *, struct bio *);
 extern int blk_hw_contig_segment(request_queue_t *q, struct bio *, struct bio *);
 extern int scsi_cmd_ioctl(struct file *, struct gendisk *, unsigned int, void __user *);
@@ -531,6 +572,29 @@ extern struct request *blk_rq_map_user(request_queue_t *, int, void __user *, un
 extern int blk_rq_unmap_user(struct request *, struct bio *, unsigned int);
 extern int blk_execute_rq(request_queue_t *, struct gendisk *, struct request *);
 
+/*
+ * Per-task on-stack plugging.  Between blk_start_plug() and
+ * blk_finish_plug() the requests __make_request builds for the task are
+ * kept on plug->list, out of the elevator: bios are merged into them
+ * without taking the queue lock, and they are inserted in one locked
+ * batch per queue when the plug is finished, grows too long, or the
+ * task goes to sleep.
+ */
+#define BLK_MAX_REQUEST_COUNT	16
+
+struct blk_plug {
+	struct list_head list;		/* requests, in submission order */
+	unsigned int count;		/* number of requests on the list */
+};
+
+static inline void blk_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	if (plug && !list_empty(&plug->list))
+		blk_flush_plug_list(plug);
+}
+
 static inline request_queue_t *bdev_get_queue(struct block_device *bdev)
 {
 	return bdev->bd_disk->queue;
@@ -703,6 +767,7 @@ static inline void put_dev_sector(Sector p)
 
 struct work_struct;
 int kblockd_schedule_work(struct work_struct *work);
+int kblockd_schedule_work_on(int cpu, struct work_struct *work);
 void kblockd_flush(void);
 
 #ifdef CONFIG_LBD
@@ -0,0 +1,89 @@
+/*
+ * linux/include/linux/ext3_extents.h
+ *
+ * On-disk format of extent-mapped ext3 files, see fs/ext3/extents.c
+ */
+
+#ifndef _LINUX_EXT3_EXTENTS_H
+#define _LINUX_EXT3_EXTENTS_H
+
+#include <linux/ext3_fs.h>
+
+#define EXT3_EXT_MAGIC		0xf30a
+
+/*
+ * Leaf entry: a run of physically contiguous blocks
+ */
+struct ext3_extent {
+	__le32	ee_block;	/* first logical block covered */
+	__le16	ee_len;		/* number of blocks covered */
+	__le16	ee_start_hi;	/* high 16 bits of physical block, zero */
+	__le32	ee_start;	/* first physical block */
+};
+
+/*
+ * Index entry: a node one level further down
+ */
+struct ext3_extent_idx {
+	__le32	ei_block;	/* first logical block covered */
+	__le32	ei_leaf;	/* physical block of the node */
+	__le16	ei_leaf_hi;	/* high 16 bits of it, zero */
+	__u16	ei_unused;
+};
+
+/*
+ * Start of every node; the root's is at the start of i_data
+ */
+struct ext3_extent_header {
+	__le16	eh_magic;
+	__le16	eh_entries;	/* entries in use */
+	__le16	eh_max;		/* room for entries */
+	__le16	eh_depth;	/* levels below this node, 0 for a leaf */
+	__le32	eh_generation;
+};
+
+/*
+ * An extent is at most this long, leaving the top bit of ee_len spare
+ */
+#define EXT3_EXT_MAX_LEN	32768
+#define EXT3_EXT_MAX_BLOCK	0xffffffffUL
+
+/*
+ * Even with 1k blocks and single block extents, five levels below the
+ * root cover the 2^32 blocks a file may have
+ */
+#define EXT3_EXT_MAX_DEPTH	5
+
+#define EXT_FIRST_EXTENT(hdr)	((struct ext3_extent *)((hdr) + 1))
+#define EXT_FIRST_INDEX(hdr)	((struct ext3_extent_idx *)((hdr) + 1))
+#define EXT_LAST_EXTENT(hdr)	\
+	(EXT_FIRST_EXTENT(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT_LAST_INDEX(hdr)	\
+	(EXT_FIRST_INDEX(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+
+#ifdef __KERNEL__
+
+/*
+ * One level of a lookup.  path[0] is the root, in the inode, and
+ * path[depth] the leaf.
+ */
+struct ext3_ext_path {
+	struct buffer_head		*p_bh;	/* NULL for the root */
+	struct ext3_extent_header	*p_hdr;
+	struct ext3_extent_idx		*p_idx;	/* index levels */
+	struct ext3_extent		*p_ext;	/* leaf, NULL if empty */
+};
+
+static inline struct ext3_extent_header *ext_inode_hdr(struct inode *inode)
+{
+	return (struct ext3_extent_header *) EXT3_I(inode)->i_data;
+}
+
+static inline int ext_depth(struct inode *inode)
+{
+	return le16_to_cpu(ext_inode_hdr(inode)->eh_depth);
+}
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LINUX_EXT3_EXTENTS_H */
@@ -185,9 +185,10 @@ struct ext3_group_desc
 #define EXT3_NOTAIL_FL			0x00008000 /* file tail should not be merged */
 #define EXT3_DIRSYNC_FL			0x00010000 /* dirsync behaviour (directories only) */
 #define EXT3_TOPDIR_FL			0x00020000 /* Top of directory hierarchies*/
+#define EXT3_EXTENTS_FL			0x00080000 /* Inode uses extents */
 #define EXT3_RESERVED_FL		0x80000000 /* reserved for ext3 lib */
 
-#define EXT3_FL_USER_VISIBLE		0x0003DFFF /* User visible flags */
+#define EXT3_FL_USER_VISIBLE		0x000BDFFF /* User visible flags */
 #define EXT3_FL_USER_MODIFIABLE		0x000380FF /* User modifiable flags */
 
 /*
@@ -197,6 +198,14 @@ struct ext3_group_desc
 #define EXT3_STATE_NEW			0x00000002 /* inode is newly created */
 #define EXT3_STATE_XATTR		0x00000004 /* has in-inode xattrs */
 
+/*
+ * Flags for ext3_ext_get_blocks() and ext3_new_blocks()
+ */
+#define EXT3_GET_BLOCKS_CREATE		0x0001	/* Allocate into holes */
+#define EXT3_GET_BLOCKS_EXTEND		0x0002	/* and grow i_disksize */
+#define EXT3_GET_BLOCKS_RESERVED	0x0004	/* Space and quota reserved at write */
+#define EXT3_GET_BLOCKS_NOQUOTA		0x0008	/* Quota stays with blocks replaced */
+
 /* Used to pass group descriptor data when online resize is done */
 struct ext3_new_group_input {
 	__u32 group;            /* Group number for this data */
@@ -220,6 +229,46 @@ struct ext3_new_group_data {
 	__u32 free_blocks_count;
 };
 
+/* One run of blocks in a struct ext3_frag_report */
+struct ext3_frag_extent {
+	__u32 fe_logical;	/* First logical block */
+	__u32 fe_physical;	/* First physical block */
+	__u32 fe_length;	/* Number of blocks */
+	__u32 fe_reserved;
+};
+
+/*
+ * Where the blocks of a file are, for EXT3_IOC_GETFRAG.  Holes are left
+ * out.  A report stops when fr_extents is full; call again with fr_start
+ * set to fr_next until EXT3_FRAG_LAST is set.
+ */
+struct ext3_frag_report {
+	__u32 fr_start;		/* In: first logical block to report */
+	__u32 fr_count;		/* In: room in fr_extents, out: filled */
+	__u32 fr_next;		/* Out: where to continue */
+	__u32 fr_flags;		/* Out: EXT3_FRAG_* */
+	__u32 fr_depth;		/* Out: depth of the extent tree */
+	__u32 fr_reserved;
+	struct ext3_frag_extent fr_extents[0];
+};
+
+#define EXT3_FRAG_EXTENTS	0x0001	/* File is extent-mapped */
+#define EXT3_FRAG_LAST		0x0002	/* Report reaches the end of file */
+
+/*
+ * A range of a file for EXT3_IOC_DEFRAG to make contiguous.  Holes are
+ * left alone.  A call may stop early; call again from dr_next until it
+ * reaches the end of the range.
+ */
+struct ext3_defrag_range {
+	__u32 dr_start;		/* In: first logical block */
+	__u32 dr_len;		/* In: number of blocks */
+	__u32 dr_goal;		/* In: physical block to move to, 0 for any */
+	__u32 dr_moved;		/* Out: blocks moved */
+	__u32 dr_next;		/* Out: where to continue */
+	__u32 dr_reserved;
+};
+
 
 /*
  * ioctl commands
@@ -237,6 +286,8 @@ struct ext3_new_group_data {
 #endif
 #define EXT3_IOC_GETRSVSZ		_IOR('f', 5, long)
 #define EXT3_IOC_SETRSVSZ		_IOW('f', 6, long)
+#define EXT3_IOC_GETFRAG		_IOWR('f', 9, struct ext3_frag_report)
+#define EXT3_IOC_DEFRAG			_IOWR('f', 10, struct ext3_defrag_range)
 
 /*
  * Structure of an inode on the disk
@@ -357,6 +408,11 @@ struct ext3_inode {
 #define EXT3_MOUNT_POSIX_ACL		0x08000	/* POSIX Access Control Lists */
 #define EXT3_MOUNT_RESERVATION		0x10000	/* Preallocation */
 #define EXT3_MOUNT_BARRIER		0x20000 /* Use block barriers */
+#define EXT3_MOUNT_DELALLOC		0x40000	/* Allocate data at writeback */
+#define EXT3_MOUNT_MBALLOC		0x80000	/* Multi-block allocator */
+#define EXT3_MOUNT_JOURNAL_CHECKSUM	0x100000 /* Checksum transactions */
+#define EXT3_MOUNT_JOURNAL_ASYNC_COMMIT	0x200000 /* Don't wait before commit */
+#define EXT3_MOUNT_DIR_PREFETCH		0x400000 /* Read inodes ahead in readdir */
 
 /* Compatibility, for having both ext2_fs.h and ext3_fs.h included at once */
 #ifndef _LINUX_EXT2_FS_H
@@ -476,6 +532,10 @@ static inline struct ext3_inode_info *EXT3_I(struct inode *inode)
 {
 	return container_of(inode, struct ext3_inode_info, vfs_inode);
 }
+static inline int ext3_inode_has_extents(struct inode *inode)
+{
+	return EXT3_I(inode)->i_flags & EXT3_EXTENTS_FL;
+}
 #else
 /* Assume that user mode programs are passing in an ext3fs superblock, not
  * a kernel struct super_block.  This will allow us to call the feature-test
@@ -544,11 +604,13 @@ static inline struct ext3_inode_info *EXT3_I(struct inode *inode)
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004 /* Needs recovery */
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008 /* Journal device */
 #define EXT3_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT3_FEATURE_INCOMPAT_EXTENTS		0x0040 /* extents support */
 
 #define EXT3_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT3_FEATURE_INCOMPAT_SUPP	(EXT3_FEATURE_INCOMPAT_FILETYPE| \
 					 EXT3_FEATURE_INCOMPAT_RECOVER| \
-					 EXT3_FEATURE_INCOMPAT_META_BG)
+					 EXT3_FEATURE_INCOMPAT_META_BG| \
+					 EXT3_FEATURE_INCOMPAT_EXTENTS)
 #define EXT3_FEATURE_RO_COMPAT_SUPP	(EXT3_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT3_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT3_FEATURE_RO_COMPAT_BTREE_DIR)
@@ -714,6 +776,8 @@ struct dir_private_info {
 extern int ext3_bg_has_super(struct super_block *sb, int group);
 extern unsigned long ext3_bg_num_gdb(struct super_block *sb, int group);
 extern int ext3_new_block (handle_t *, struct inode *, unsigned long, int *);
+extern int __ext3_new_block (handle_t *, struct inode *, unsigned long,
+			     int, int *);
 extern void ext3_free_blocks (handle_t *, struct inode *, unsigned long,
 			      unsigned long);
 extern void ext3_free_blocks_sb (handle_t *, struct super_block *,
@@ -724,8 +788,14 @@ extern struct ext3_group_desc * ext3_get_group_desc(struct super_block * sb,
 						    unsigned int block_group,
 						    struct buffer_head ** bh);
 extern int ext3_should_retry_alloc(struct super_block *sb, int *retries);
+extern int ext3_has_free_blocks(struct ext3_sb_info *sbi);
+extern int ext3_reserve_blocks(struct super_block *sb, unsigned long nr);
+extern void ext3_release_blocks(struct super_block *sb, unsigned long nr);
 extern void ext3_rsv_window_add(struct super_block *sb, struct ext3_reserve_window_node *rsv);
 
+/* defrag.c */
+extern int ext3_defrag(struct file *, struct ext3_defrag_range *);
+
 /* dir.c */
 extern int ext3_check_dir_entry(const char *, struct inode *,
 				struct ext3_dir_entry_2 *,
@@ -751,6 +821,28 @@ extern unsigned long ext3_count_dirs (struct super_block *);
 extern void ext3_check_inodes_bitmap (struct super_block *);
 extern unsigned long ext3_count_free (struct buffer_head *, unsigned);
 
+/* extents.c */
+extern int ext3_ext_get_blocks(handle_t *, struct inode *, sector_t,
+			       unsigned long, struct buffer_head *, int);
+extern int ext3_ext_get_block(handle_t *, struct inode *, sector_t,
+			      struct buffer_head *, int, int);
+extern int ext3_ext_map_run(struct inode *, u32, u32 *, u32 *);
+extern int ext3_ext_index_trans_blocks(struct inode *, int);
+extern unsigned long ext3_ext_meta_blocks(struct inode *, unsigned long);
+extern void ext3_ext_truncate(handle_t *, struct inode *, u32);
+extern int ext3_ext_move_run(handle_t *, struct inode *, u32, u32, u32);
+extern void ext3_ext_tree_init(struct inode *);
+
+/* mballoc.c */
+extern unsigned long ext3_new_blocks(handle_t *, struct inode *,
+				     unsigned long, unsigned long *, int,
+				     int *);
+extern void ext3_mb_claimed(struct super_block *, int, int, int);
+extern void ext3_mb_freed(handle_t *, struct super_block *, int);
+extern int ext3_mb_init(struct super_block *);
+extern void ext3_mb_release(struct super_block *);
+extern int init_ext3_mballoc(void);
+extern void exit_ext3_mballoc(void);
 
 /* inode.c */
 extern int ext3_forget(handle_t *, int, struct inode *, struct buffer_head *, int);
@@ -769,6 +861,7 @@ extern int ext3_get_inode_loc(struct inode *, struct ext3_iloc *);
 extern void ext3_truncate (struct inode *);
 extern void ext3_set_inode_flags(struct inode *);
 extern void ext3_set_aops(struct inode *inode);
+extern int ext3_map_run(struct inode *, u32, u32 *, u32 *);
 
 /* ioctl.c */
 extern int ext3_ioctl (struct inode *, struct file *, unsigned int,
@@ -779,6 +872,9 @@ extern int ext3_orphan_add(handle_t *, struct inode *);
 extern int ext3_orphan_del(handle_t *, struct inode *);
 extern int ext3_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 				__u32 start_minor_hash, __u32 *next_hash);
+extern void ext3_dx_unpin(struct inode *dir);
+extern int init_ext3_dx_pins(void);
+extern void exit_ext3_dx_pins(void);
 
 /* resize.c */
 extern int ext3_group_add(struct super_block *sb,
@@ -36,6 +36,17 @@ struct ext3_reserve_window_node {
 #define rsv_start rsv_window._rsv_start
 #define rsv_end rsv_window._rsv_end
 
+/*
+ * An extent of an extent-mapped file, remembered from the last lookup
+ */
+struct ext3_ext_cache {
+	__u32	ec_block;		/* First logical block */
+	__u32	ec_len;			/* Number of blocks, 0 if none */
+	__u32	ec_start;		/* First physical block */
+};
+
+struct ext3_dx_pin;
+
 /*
  * third extended file system inode data in memory
  */
@@ -79,6 +90,22 @@ struct ext3_inode_info {
 	struct ext3_reserve_window_node i_rsv_window;
 
 	__u32	i_dir_start_lookup;
+
+	/* pinned htree index blocks, see fs/ext3/namei.c [i_sem] */
+	struct ext3_dx_pin *i_dx_pin;
+	__u32	i_dx_reads;
+	unsigned long i_dx_window;	/* jiffies when i_dx_reads started */
+
+	/* last extent looked up, protected by truncate_sem */
+	struct ext3_ext_cache i_cached_extent;
+
+	/*
+	 * Delayed blocks not yet allocated, and the extent tree blocks
+	 * reserved for them, see fs/ext3/inode.c [i_da_lock]
+	 */
+	spinlock_t i_da_lock;
+	unsigned long i_da_blocks;
+	unsigned long i_da_meta;
 #ifdef CONFIG_EXT3_FS_XATTR
 	/*
 	 * Extended attributes can be read independently of the main file
@@ -24,6 +24,8 @@
 #endif
 #include <linux/rbtree.h>
 
+struct ext3_mb_info;
+
 /*
  * third extended-fs super-block data in memory
  */
@@ -57,8 +59,12 @@ struct ext3_sb_info {
 	struct percpu_counter s_freeblocks_counter;
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
+	struct percpu_counter s_dirtyblocks_counter;	/* reserved by delalloc */
 	struct blockgroup_lock s_blockgroup_lock;
 
+	/* free space summaries of the multi-block allocator */
+	struct ext3_mb_info *s_mb;
+
 	/* root of the per fs reservation window tree */
 	spinlock_t s_rsv_window_lock;
 	struct rb_root s_rsv_window_root;
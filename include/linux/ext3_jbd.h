@@ -265,4 +265,18 @@ static inline int ext3_should_writeback_data(struct inode *inode)
 	return 0;
 }
 
+/*
+ * Only extent-mapped files can take a run of blocks in one go, and
+ * journaled data has to be in the transaction that allocates its blocks.
+ */
+static inline int ext3_should_delay_alloc(struct inode *inode)
+{
+	if (!test_opt(inode->i_sb, DELALLOC))
+		return 0;
+	if (!ext3_inode_has_extents(inode))
+		return 0;
+	return ext3_should_order_data(inode) ||
+	       ext3_should_writeback_data(inode);
+}
+
 #endif	/* _LINUX_EXT3_JBD_H */
@@ -1042,6 +1042,7 @@ struct super_operations {
 	void (*umount_begin) (struct super_block *);		 /* VFS调用该函数中断安装操作 */
 
 	int (*show_options)(struct seq_file *, struct vfsmount *);
+	int (*show_stats)(struct seq_file *, struct vfsmount *);
 
 	ssize_t (*quota_read)(struct super_block *, int, char *, size_t, loff_t);
 	ssize_t (*quota_write)(struct super_block *, int, const char *, size_t, loff_t);
@@ -39,6 +39,15 @@ struct sockaddr_ll
 #define PACKET_RX_RING			5
 #define PACKET_STATISTICS		6
 #define PACKET_COPY_THRESH		7
+#define PACKET_VERSION			10
+#define PACKET_HDRLEN			11
+#define PACKET_TX_RING			13
+#define PACKET_LOSS			14
+#define PACKET_FANOUT			18
+
+#define PACKET_FANOUT_HASH		0
+#define PACKET_FANOUT_LB		1
+#define PACKET_FANOUT_CPU		2
 
 struct tpacket_stats
 {
@@ -54,6 +63,11 @@ struct tpacket_hdr
 #define TP_STATUS_COPY		2
 #define TP_STATUS_LOSING	4
 #define TP_STATUS_CSUMNOTREADY	8
+/* Tx ring - header status */
+#define TP_STATUS_AVAILABLE	0
+#define TP_STATUS_SEND_REQUEST	1
+#define TP_STATUS_SENDING	2
+#define TP_STATUS_WRONG_FORMAT	4
 	unsigned int	tp_len;
 	unsigned int	tp_snaplen;
 	unsigned short	tp_mac;
@@ -66,17 +80,46 @@ struct tpacket_hdr
 #define TPACKET_ALIGN(x)	(((x)+TPACKET_ALIGNMENT-1)&~(TPACKET_ALIGNMENT-1))
 #define TPACKET_HDRLEN		(TPACKET_ALIGN(sizeof(struct tpacket_hdr)) + sizeof(struct sockaddr_ll))
 
+/*
+ * Version 2 header: fixed-size fields on every architecture, nanosecond
+ * timestamp and the 802.1Q tag control information of the frame.
+ */
+struct tpacket2_hdr
+{
+	unsigned int	tp_status;
+	unsigned int	tp_len;
+	unsigned int	tp_snaplen;
+	unsigned short	tp_mac;
+	unsigned short	tp_net;
+	unsigned int	tp_sec;
+	unsigned int	tp_nsec;
+	unsigned short	tp_vlan_tci;
+	unsigned short	tp_padding;
+};
+
+#define TPACKET2_HDRLEN		(TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + sizeof(struct sockaddr_ll))
+
+enum tpacket_versions
+{
+	TPACKET_V1,
+	TPACKET_V2,
+};
+
 /*
    Frame structure:
 
    - Start. Frame must be aligned to TPACKET_ALIGNMENT=16
-   - struct tpacket_hdr
+   - struct tpacket_hdr or struct tpacket2_hdr, see PACKET_VERSION
    - pad to TPACKET_ALIGNMENT=16
    - struct sockaddr_ll
    - Gap, chosen so that packet data (Start+tp_net) alignes to TPACKET_ALIGNMENT=16
    - Start+tp_mac: [ Optional MAC header ]
    - Start+tp_net: Packet data, aligned to TPACKET_ALIGNMENT=16.
    - Pad to align to TPACKET_ALIGNMENT=16
+
+   Tx ring frames use the same header; the frame to send starts right
+   after the aligned header (Start+TPACKET_ALIGN(sizeof(header))) and is
+   tp_len bytes long.
  */
 
 struct tpacket_req
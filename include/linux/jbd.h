@@ -47,6 +47,18 @@
  */
 #define JBD_DEFAULT_MAX_COMMIT_AGE 5
 
+/*
+ * The longest a synchronous handle will hold its transaction open for
+ * others to join, in microseconds.
+ */
+#define JBD_DEFAULT_MAX_BATCH_TIME 15000
+
+/*
+ * Slots in the commit time and batch size histograms: slot n counts
+ * values in [2^(n-1), 2^n), the last one everything above.
+ */
+#define JBD_HIST_SLOTS	16
+
 #ifdef CONFIG_JBD_DEBUG
 /*
  * Define JBD_EXPENSIVE_CHECKING to enable more expensive internal
@@ -163,6 +175,27 @@ typedef struct journal_revoke_header_s
 } journal_revoke_header_t;
 
 
+/*
+ * Checksum types carried in a commit block
+ */
+#define JFS_CRC32_CHKSUM	1
+#define JFS_CRC32_CHKSUM_SIZE	4
+
+#define JFS_CHECKSUM_BYTES	(32 / sizeof(__u32))
+
+/*
+ * The commit block.  Journals without the checksum feature leave
+ * everything after the header zeroed.
+ */
+typedef struct commit_header_s
+{
+	journal_header_t h_header;
+	unsigned char	h_chksum_type;	/* JFS_CRC32_CHKSUM, or zero */
+	unsigned char	h_chksum_size;	/* bytes used in h_chksum */
+	unsigned char	h_padding[2];
+	__be32		h_chksum[JFS_CHECKSUM_BYTES];
+} commit_header_t;
+
 /* Definitions for the journal tag flags word: */
 #define JFS_FLAG_ESCAPE		1	/* on-disk block is escaped */
 #define JFS_FLAG_SAME_UUID	2	/* block has same uuid as previous */
@@ -228,12 +261,16 @@ typedef struct journal_superblock_s
 	((j)->j_format_version >= 2 &&					\
 	 ((j)->j_superblock->s_feature_incompat & cpu_to_be32((mask))))
 
+#define JFS_FEATURE_COMPAT_CHECKSUM	0x00000001
+
 #define JFS_FEATURE_INCOMPAT_REVOKE	0x00000001
+#define JFS_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
 
 /* Features known to this kernel version: */
-#define JFS_KNOWN_COMPAT_FEATURES	0
+#define JFS_KNOWN_COMPAT_FEATURES	JFS_FEATURE_COMPAT_CHECKSUM
 #define JFS_KNOWN_ROCOMPAT_FEATURES	0
-#define JFS_KNOWN_INCOMPAT_FEATURES	JFS_FEATURE_INCOMPAT_REVOKE
+#define JFS_KNOWN_INCOMPAT_FEATURES	(JFS_FEATURE_INCOMPAT_REVOKE | \
+					 JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)
 
 #ifdef __KERNEL__
 
@@ -423,9 +460,6 @@ struct handle_s
  *    ->j_list_lock
  *
  *    j_state_lock
- *    ->t_handle_lock
- *
- *    j_state_lock
  *    ->j_list_lock			(journal_unmap_buffer)
  *
  */
@@ -518,21 +552,18 @@ struct transaction_s
 	struct journal_head	*t_log_list;
 
 	/*
-	 * Protects info related to handles
-	 */
-	spinlock_t		t_handle_lock;
-
-	/*
-	 * Number of outstanding updates running on this transaction
-	 * [t_handle_lock]
+	 * Number of outstanding updates running on this transaction.
+	 * Handles are attached with j_state_lock held for reading, so
+	 * taking it for writing stops the count from rising from zero.
+	 * [atomic]
 	 */
-	int			t_updates;
+	atomic_t		t_updates;
 
 	/*
 	 * Number of buffers reserved for use by all handles in this transaction
-	 * handle but not yet modified. [t_handle_lock]
+	 * handle but not yet modified. [atomic]
 	 */
-	int			t_outstanding_credits;
+	atomic_t		t_outstanding_credits;
 
 	/*
 	 * Forward and backward links for the circular list of all transactions
@@ -547,10 +578,35 @@ struct transaction_s
 	unsigned long		t_expires;
 
 	/*
-	 * How many handles used this transaction? [t_handle_lock]
+	 * How many handles used this transaction? [atomic]
 	 */
-	int t_handle_count;
+	atomic_t		t_handle_count;
 
+	/*
+	 * When the transaction was created, in jiffies.  [no locking]
+	 */
+	unsigned long		t_start_time;
+
+	/*
+	 * Running crc32 of the blocks written to the log for this
+	 * transaction, when the journal has the checksum feature.
+	 * [commit thread only]
+	 */
+	__u32			t_chksum;
+
+};
+
+/*
+ * Per-journal commit statistics.  The histograms are in log2 slots,
+ * see JBD_HIST_SLOTS.
+ */
+struct journal_stats_s
+{
+	unsigned long		js_commits;
+	unsigned long		js_handles;	/* handles committed */
+	unsigned long		js_batch_waits;	/* sync handles held open */
+	unsigned long		js_commit_time[JBD_HIST_SLOTS];	/* in ms */
+	unsigned long		js_batch[JBD_HIST_SLOTS];	/* handles */
 };
 
 /**
@@ -606,6 +662,11 @@ struct transaction_s
  * @j_commit_timer:  The timer used to wakeup the commit thread
  * @j_revoke: The revoke table - maintains the list of revoked blocks in the
  *     current transaction.
+ * @j_last_sync_writer: most recent pid which did a synchronous write
+ * @j_average_commit_time: the average time a commit takes, in microseconds
+ * @j_max_batch_time: longest a synchronous handle waits for others to join
+ * @j_stats: commit statistics, shown in /proc/fs/jbd/<device>/info
+ * @j_proc: the /proc/fs/jbd/<device> directory
  */
 
 struct journal_s
@@ -627,9 +688,11 @@ struct journal_s
 	int			j_format_version;
 
 	/*
-	 * Protect the various scalars in the journal
+	 * Protect the various scalars in the journal.  Starting and
+	 * stopping handles only reads them, so many CPUs can do that at
+	 * once; anything changing journal state takes it for writing.
 	 */
-	spinlock_t		j_state_lock;
+	rwlock_t		j_state_lock;
 
 	/*
 	 * Number of processes waiting to create a barrier lock [j_state_lock]
@@ -788,6 +851,27 @@ struct journal_s
 	struct jbd_revoke_table_s *j_revoke;
 	struct jbd_revoke_table_s *j_revoke_table[2];
 
+	/*
+	 * The pid of the last process to stop a synchronous handle.  When a
+	 * different one follows, others are probably fsyncing too, and it
+	 * is worth holding the transaction open a little for them.
+	 * [no locking - it is only a hint]
+	 */
+	pid_t			j_last_sync_writer;
+
+	/*
+	 * Decaying average of the commit time, in microseconds, and the
+	 * longest a synchronous handle waits for others to join its
+	 * transaction.  [j_state_lock]
+	 */
+	unsigned long		j_average_commit_time;
+	unsigned long		j_max_batch_time;
+
+	/* Commit statistics [j_state_lock] */
+	struct journal_stats_s	j_stats;
+
+	struct proc_dir_entry	*j_proc;
+
 	/*
 	 * An opaque pointer to fs-private information.  ext3 puts its
 	 * superblock pointer here
@@ -897,6 +981,8 @@ extern int	   journal_check_available_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
 extern int	   journal_set_features 
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
+extern void	   journal_clear_features
+		   (journal_t *, unsigned long, unsigned long, unsigned long);
 extern int	   journal_create     (journal_t *);
 extern int	   journal_load       (journal_t *journal);
 extern void	   journal_destroy    (journal_t *);
@@ -1037,8 +1123,8 @@ static inline int jbd_space_needed(journal_t *journal)
 {
 	int nblocks = journal->j_max_transaction_buffers;
 	if (journal->j_committing_transaction)
-		nblocks += journal->j_committing_transaction->
-					t_outstanding_credits;
+		nblocks += atomic_read(&journal->j_committing_transaction->
+					t_outstanding_credits);
 	return nblocks;
 }
 
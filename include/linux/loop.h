@@ -27,6 +27,15 @@ enum {
 
 struct loop_func_table;
 
+/*
+ * A run of loop sectors that sits contiguously on lo_direct_bdev
+ */
+struct loop_extent {
+	sector_t	start;			/* first loop sector */
+	sector_t	nr_sects;
+	sector_t	disk_start;		/* where it is on the device */
+};
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -63,6 +72,11 @@ struct loop_device {
 	struct semaphore	lo_bh_mutex;
 	atomic_t		lo_pending;
 
+	/* LO_FLAGS_DIRECT: the backing file's blocks, sorted by start */
+	struct block_device	*lo_direct_bdev;
+	struct loop_extent	*lo_extents;
+	unsigned int		lo_nr_extents;
+
 	request_queue_t		*lo_queue;
 };
 
@@ -72,6 +86,7 @@ struct loop_device {
  * Loop flags
  */
 #define LO_FLAGS_READ_ONLY	1
+#define LO_FLAGS_DIRECT		2	/* bypass the backing file's page cache */
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
 #include <asm/types.h>		/* for __u64 */
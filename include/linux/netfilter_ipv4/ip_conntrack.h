@@ -108,6 +108,7 @@ union ip_conntrack_help {
 
 #include <linux/types.h>
 #include <linux/skbuff.h>
+#include <linux/rcupdate.h>
 
 #ifdef CONFIG_NETFILTER_DEBUG
 #define IP_NF_ASSERT(x)							\
@@ -174,6 +175,9 @@ struct ip_conntrack
 	unsigned long mark;
 #endif
 
+	/* Drops the hash table's reference once lockless readers are done */
+	struct rcu_head rcu;
+
 	/* Traversed often, so hopefully in different cacheline to top */
 	/* These are my tuples; original and reply */
 	struct ip_conntrack_tuple_hash tuplehash[IP_CT_DIR_MAX];
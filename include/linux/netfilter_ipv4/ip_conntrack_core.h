@@ -45,7 +45,8 @@ static inline int ip_conntrack_confirm(struct sk_buff **pskb)
 	return NF_ACCEPT;
 }
 
-extern struct list_head *ip_conntrack_hash;
+extern struct hlist_head *ip_conntrack_hash;
+extern struct hlist_head *ip_conntrack_get_bucket(unsigned int bucket);
 extern struct list_head ip_conntrack_expect_list;
 DECLARE_RWLOCK_EXTERN(ip_conntrack_lock);
 #endif /* _IP_CONNTRACK_CORE_H */
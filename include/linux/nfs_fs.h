@@ -165,6 +165,13 @@ struct nfs_inode {
 	 */
 	__u32			cookieverf[2];
 
+	/*
+	 * Directory pages never have buffers and never get PG_private,
+	 * so page->private of each holds the jiffies at which it was
+	 * read: the READDIRPLUS attributes on the page are that old.
+	 * readdir_timestamp above is the same for page 0.
+	 */
+
 	/*
 	 * This is the list of dirty unwritten pages.
 	 */
@@ -203,6 +210,7 @@ struct nfs_inode {
 #define NFS_INO_INVALID_DATA	0x0010		/* cached data is invalid */
 #define NFS_INO_INVALID_ATIME	0x0020		/* cached atime is invalid */
 #define NFS_INO_INVALID_ACCESS	0x0040		/* cached access cred invalid */
+#define NFS_INO_DIR_PREFILL	0x0080		/* dir pages being read ahead */
 
 static inline struct nfs_inode *NFS_I(struct inode *inode)
 {
@@ -285,6 +293,7 @@ extern void nfs_zap_caches(struct inode *);
 extern struct inode *nfs_fhget(struct super_block *, struct nfs_fh *,
 				struct nfs_fattr *);
 extern int nfs_refresh_inode(struct inode *, struct nfs_fattr *);
+extern int nfs_readdirplus_update_inode(struct inode *, struct nfs_fattr *);
 extern int nfs_getattr(struct vfsmount *, struct dentry *, struct kstat *);
 extern int nfs_permission(struct inode *, int, struct nameidata *);
 extern int nfs_access_get_cached(struct inode *, struct rpc_cred *, struct nfs_access_entry *);
@@ -344,6 +353,8 @@ extern ssize_t nfs_file_direct_write(struct kiocb *iocb, const char __user *buf,
 extern struct inode_operations nfs_dir_inode_operations;
 extern struct file_operations nfs_dir_operations;
 extern struct dentry_operations nfs_dentry_operations;
+extern int nfs_init_dirprefill(void);
+extern void nfs_destroy_dirprefill(void);
 
 /*
  * linux/fs/nfs/symlink.c
@@ -29,6 +29,12 @@ struct nfs_server {
 	char *			hostname;	/* remote hostname */
 	struct nfs_fh		fh;
 	struct sockaddr_in	addr;
+
+	/* statistics, shown in /proc/<pid>/mountstats */
+	unsigned long		attr_hits;	/* cached attributes still valid */
+	unsigned long		attr_misses;	/* attributes had to be fetched */
+	unsigned long		rdplus_attrs;	/* inodes set from READDIRPLUS */
+	unsigned long		dir_prefill;	/* dir pages read in background */
 #ifdef CONFIG_NFS_V4
 	/* Our own IP address, as a null-terminated string.
 	 * This is used to generate the clientid, and the callback address.
@@ -13,16 +13,14 @@
 #ifdef __KERNEL__
 #include <linux/in.h>
 #include <linux/uio.h>
+#include <linux/list.h>
 
 /*
- * Representation of a reply cache entry. The first two members *must*
- * be hash_next and hash_prev.
+ * Representation of a reply cache entry. Entries live on the LRU list
+ * of the hash bucket of their xid, most recently used first.
  */
 struct svc_cacherep {
-	struct svc_cacherep *	c_hash_next;
-	struct svc_cacherep *	c_hash_prev;
-	struct svc_cacherep *	c_lru_next;
-	struct svc_cacherep *	c_lru_prev;
+	struct list_head	c_lru;
 	unsigned char		c_state,	/* unused, inprog, done */
 				c_type,		/* status, buffer */
 				c_secure : 1;	/* req came from port < 1024 */
@@ -31,6 +29,8 @@ struct svc_cacherep {
 	u32			c_prot;
 	u32			c_proc;
 	u32			c_vers;
+	unsigned int		c_len;		/* length of the call */
+	u32			c_csum;		/* checksum of its start */
 	unsigned long		c_timestamp;
 	union {
 		struct kvec	u_vec;
@@ -73,6 +73,17 @@ enum {
  */
 #define RC_DELAY		(HZ/5)
 
+/*
+ * Entries older than this are not matched, and are freed when seen.
+ */
+#define RC_EXPIRE		(120 * HZ)
+
+/*
+ * Bytes of the call arguments checksummed to tell apart calls which
+ * reuse an xid, e.g. after a client reboot.
+ */
+#define RC_CSUMLEN		256
+
 void	nfsd_cache_init(void);
 void	nfsd_cache_shutdown(void);
 int	nfsd_cache_lookup(struct svc_rqst *, int);
@@ -3,6 +3,8 @@
 
 #include <linux/raid/md.h>
 #include <linux/raid/xor.h>
+#include <linux/kobject.h>
+#include <linux/workqueue.h>
 
 /*
  *
@@ -200,6 +202,23 @@ struct disk_info {
 	mdk_rdev_t	*rdev;
 };
 
+/*
+ * Per-cpu part of an array: the work item which lets that cpu take
+ * stripes off the handle_list, and the throughput counters, which are
+ * only summed up when they are read.
+ */
+struct raid5_percpu {
+	struct work_struct	work;
+	struct raid5_private_data	*conf;
+
+	unsigned long		handled;	/* handle_stripe() calls */
+	unsigned long		reads;		/* blocks read from the members */
+	unsigned long		writes;		/* blocks written to the members */
+	unsigned long		full_stripe_writes;
+	unsigned long		rcw;		/* partial reconstruct-writes */
+	unsigned long		rmw;		/* read-modify-writes */
+};
+
 struct raid5_private_data {
 	struct stripe_head	**stripe_hashtbl;
 	mddev_t			*mddev;
@@ -225,6 +244,17 @@ struct raid5_private_data {
 							 * waiting for 25% to be free
 							 */        
 	spinlock_t		device_lock;
+
+	/*
+	 * When parity_workers is set, raid5d spreads the handle_list over
+	 * the per-cpu threads of raid5_wq rather than doing all of the xor
+	 * work itself.
+	 */
+	int			parity_workers;
+	struct raid5_percpu	*percpu;
+
+	struct kobject		kobj;	/* /sys/block/mdX/raid5 */
+	int			dead;	/* stopped, kobj only kept alive by sysfs */
 	struct disk_info	disks[0];
 };
 
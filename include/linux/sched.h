@@ -499,6 +499,7 @@ extern void cpu_attach_domain(struct sched_domain *sd, int cpu);
 
 
 struct io_context;			/* See blkdev.h */
+struct blk_plug;			/* See blkdev.h */
 void exit_io_context(void);
 
 #define NGROUPS_SMALL		32
@@ -696,6 +697,9 @@ struct task_struct {
 	struct backing_dev_info *backing_dev_info;
 
 	struct io_context *io_context;
+	unsigned short ioprio;		/* see linux/ioprio.h */
+/* requests held back while the task submits a batch of I/O */
+	struct blk_plug *plug;
 
 	unsigned long ptrace_message;
 	siginfo_t *last_siginfo; /* For ptrace use.  */
@@ -32,6 +32,11 @@ struct rpc_portmap {
 
 struct rpc_inode;
 
+/*
+ * Most connections one client may open to its server
+ */
+#define RPC_MAX_XPRTS		16
+
 /*
  * The high-level client handle
  */
@@ -39,6 +44,10 @@ struct rpc_clnt {
 	atomic_t		cl_count;	/* Number of clones */
 	atomic_t		cl_users;	/* number of references */
 	struct rpc_xprt *	cl_xprt;	/* transport */
+	struct rpc_xprt *	cl_xprts[RPC_MAX_XPRTS];
+					/* all transports, cl_xprt first */
+	unsigned int		cl_nxprt;	/* number of them */
+	atomic_t		cl_nextxprt;	/* round-robin position */
 	struct rpc_procinfo *	cl_procinfo;	/* procedure info */
 	u32			cl_maxproc;	/* max procedure number */
 
@@ -109,10 +118,25 @@ struct rpc_procinfo {
 
 #ifdef __KERNEL__
 
+/*
+ * The transport for a new task.  A client with several connections
+ * hands them out in turn.
+ */
+static inline struct rpc_xprt *rpc_choose_xprt(struct rpc_clnt *clnt)
+{
+	unsigned int n;
+
+	if (clnt->cl_nxprt <= 1)
+		return clnt->cl_xprt;
+	n = atomic_inc_return(&clnt->cl_nextxprt);
+	return clnt->cl_xprts[n % clnt->cl_nxprt];
+}
+
 struct rpc_clnt *rpc_create_client(struct rpc_xprt *xprt, char *servname,
 				struct rpc_program *info,
 				u32 version, rpc_authflavor_t authflavor);
 struct rpc_clnt *rpc_clone_client(struct rpc_clnt *);
+int		rpc_add_xprts(struct rpc_clnt *, unsigned int);
 int		rpc_shutdown_client(struct rpc_clnt *);
 int		rpc_destroy_client(struct rpc_clnt *);
 void		rpc_release_client(struct rpc_clnt *);
@@ -94,6 +94,7 @@ enum {
 	CTL_NLMDEBUG,
 	CTL_SLOTTABLE_UDP,
 	CTL_SLOTTABLE_TCP,
+	CTL_SLOTTABLE_TCP_MAX,
 };
 
 #endif /* _LINUX_SUNRPC_DEBUG_H_ */
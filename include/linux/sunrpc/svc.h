@@ -16,6 +16,23 @@
 #include <linux/sunrpc/svcauth.h>
 #include <linux/wait.h>
 #include <linux/mm.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+
+/*
+ * A pool of server threads, one for each NUMA node.  Threads of a pool
+ * run on its node, and a socket with data pending is queued on the
+ * pool of the node it became ready on, so that the request is mostly
+ * handled where its data arrived.  On machines without NUMA there is
+ * just the one pool.
+ */
+struct svc_pool {
+	unsigned int		sp_id;		/* node of the pool */
+	spinlock_t		sp_lock;	/* protects the lists */
+	struct list_head	sp_threads;	/* idle server threads */
+	struct list_head	sp_sockets;	/* pending sockets */
+	unsigned int		sp_nrthreads;	/* # of threads in pool */
+} ____cacheline_aligned_in_smp;
 
 /*
  * RPC service.
@@ -23,16 +40,14 @@
  * An RPC service is a ``daemon,'' possibly multithreaded, which
  * receives and processes incoming RPC messages.
  * It has one or more transport sockets associated with it, and maintains
- * a list of idle threads waiting for input.
+ * lists of idle threads waiting for input, in its pools.
  *
  * We currently do not support more than one RPC program per daemon.
  */
 struct svc_serv {
-	struct list_head	sv_threads;	/* idle server threads */
-	struct list_head	sv_sockets;	/* pending sockets */
 	struct svc_program *	sv_program;	/* RPC program */
 	struct svc_stat *	sv_stats;	/* RPC statistics */
-	spinlock_t		sv_lock;
+	spinlock_t		sv_lock;	/* protects the socket lists */
 	unsigned int		sv_nrthreads;	/* # of server threads */
 	unsigned int		sv_bufsz;	/* datagram buffer size */
 	unsigned int		sv_xdrsize;	/* XDR buffer size */
@@ -40,6 +55,10 @@ struct svc_serv {
 	struct list_head	sv_permsocks;	/* all permanent sockets */
 	struct list_head	sv_tempsocks;	/* all temporary sockets */
 	int			sv_tmpcnt;	/* count of temporary sockets */
+	unsigned long		sv_tempage;	/* next look for idle ones */
+
+	unsigned int		sv_nrpools;	/* # of thread pools */
+	struct svc_pool *	sv_pools;	/* one for each node */
 
 	char *			sv_name;	/* service name */
 };
@@ -111,6 +130,7 @@ static inline void svc_putu32(struct kvec *iov, u32 val)
 struct svc_rqst {
 	struct list_head	rq_list;	/* idle list */
 	struct svc_sock *	rq_sock;	/* socket */
+	struct svc_pool *	rq_pool;	/* thread pool */
 	struct sockaddr_in	rq_addr;	/* peer address */
 	int			rq_addrlen;
 
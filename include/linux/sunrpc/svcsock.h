@@ -21,7 +21,7 @@ struct svc_sock {
 	struct sock *		sk_sk;		/* INET layer */
 
 	struct svc_serv *	sk_server;	/* service for this socket */
-	unsigned int		sk_inuse;	/* use count */
+	atomic_t		sk_inuse;	/* use count */
 	unsigned long		sk_flags;
 #define	SK_BUSY		0			/* enqueued/receiving */
 #define	SK_CONN		1			/* conn pending */
@@ -32,7 +32,7 @@ struct svc_sock {
 #define	SK_CHNGBUF	7			/* need to change snd/rcv buffer sizes */
 #define	SK_DEFERRED	8			/* request on sk_deferred */
 
-	int			sk_reserved;	/* space on outq that is reserved */
+	atomic_t		sk_reserved;	/* space on outq that is reserved */
 
 	struct list_head	sk_deferred;	/* deferred requests that need to
 						 * be revisted */
@@ -61,5 +61,7 @@ int		svc_recv(struct svc_serv *, struct svc_rqst *, long);
 int		svc_send(struct svc_rqst *);
 void		svc_drop(struct svc_rqst *);
 void		svc_sock_update_bufs(struct svc_serv *serv);
+void		svc_pool_adopt(struct svc_serv *, struct svc_pool *);
+void		svc_pool_exit(struct svc_rqst *);
 
 #endif /* SUNRPC_SVCSOCK_H */
@@ -31,11 +31,21 @@
  */
 extern unsigned int xprt_udp_slot_table_entries;
 extern unsigned int xprt_tcp_slot_table_entries;
+extern unsigned int xprt_max_tcp_slot_table_entries;
 
 #define RPC_MIN_SLOT_TABLE	(2U)
 #define RPC_DEF_SLOT_TABLE	(16U)
 #define RPC_MAX_SLOT_TABLE	(128U)
 
+/*
+ * TCP transports start with tcp_slot_table_entries slots and grow one
+ * slot at a time, up to tcp_max_slot_table_entries, whenever a request
+ * finds them all busy.  Slots above the initial number are kept for
+ * reuse, and freed when the idle transport is disconnected.
+ */
+#define RPC_DEF_MAX_SLOT_TABLE	(256U)
+#define RPC_MAX_SLOT_TABLE_LIMIT (65536U)
+
 #define RPC_CWNDSHIFT		(8U)
 #define RPC_CWNDSCALE		(1U << RPC_CWNDSHIFT)
 #define RPC_INITCWND		RPC_CWNDSCALE
@@ -145,8 +155,9 @@ struct rpc_xprt {
 	struct rpc_wait_queue	pending;	/* requests in flight */
 	struct rpc_wait_queue	backlog;	/* waiting for slot */
 	struct list_head	free;		/* free slots */
-	struct rpc_rqst *	slot;		/* slot table storage */
-	unsigned int		max_reqs;	/* total slots */
+	unsigned int		max_reqs,	/* most slots allowed */
+				min_reqs,	/* slots kept allocated */
+				num_reqs;	/* slots allocated now */
 	unsigned long		sockstate;	/* Socket state */
 	unsigned char		shutdown   : 1,	/* being shut down */
 				nocong	   : 1,	/* no congestion control */
@@ -52,6 +52,12 @@ struct udp_sock {
 	 * when the socket is uncorked.
 	 */
 	__u16		 len;		/* total length of pending frames */
+	/*
+	 * Datagrams taken off sk_receive_queue in one go by a reader, so
+	 * that the queue lock shared with the softirq is not bounced for
+	 * every datagram.  Only touched from process context (IPv4 only).
+	 */
+	struct sk_buff_head reader_queue;
 };
 
 static inline struct udp_sock *udp_sk(const struct sock *sk)
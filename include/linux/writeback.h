@@ -67,6 +67,7 @@ struct writeback_control {
  * fs/fs-writeback.c
  */	
 void writeback_inodes(struct writeback_control *wbc);
+int mark_dirty_bdis(void);
 void wake_up_inode(struct inode *inode);
 int inode_wait(void *);
 void sync_inodes_sb(struct super_block *, int wait);
@@ -102,6 +103,9 @@ int dirty_writeback_centisecs_handler(struct ctl_table *, int, struct file *,
 
 void page_writeback_init(void);
 void balance_dirty_pages_ratelimited(struct address_space *mapping);
+long background_writeout(struct backing_dev_info *bdi, long min_pages);
+long kupdate_writeout(struct backing_dev_info *bdi);
+void global_dirty_limits(long *pbackground, long *pdirty);
 int pdflush_operation(void (*fn)(unsigned long), unsigned long arg0);
 int do_writepages(struct address_space *mapping, struct writeback_control *wbc);
 int sync_page_range(struct inode *inode, struct address_space *mapping,
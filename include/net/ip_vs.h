@@ -250,6 +250,9 @@ struct ip_vs_daemon_user {
 #include <linux/config.h>
 #include <linux/list.h>                 /* for struct list_head */
 #include <linux/spinlock.h>             /* for struct rwlock_t */
+#include <linux/rcupdate.h>		/* for struct rcu_head */
+#include <linux/percpu.h>		/* for ip_vs_cpu_stats */
+#include <linux/seqlock.h>		/* for seqcount_t */
 #include <linux/skbuff.h>               /* for struct sk_buff */
 #include <linux/ip.h>                   /* for struct iphdr */
 #include <asm/atomic.h>                 /* for struct atomic_t */
@@ -409,8 +412,25 @@ struct ip_vs_seq {
 };
 
 
+/*
+ *	Per-CPU part of the IPVS statistics, bumped without locking by
+ *	the packet path (softirq only) and summed by the estimator.
+ */
+struct ip_vs_cpu_stats
+{
+	__u32                   conns;          /* connections scheduled */
+	__u32                   inpkts;         /* incoming packets */
+	__u32                   outpkts;        /* outgoing packets */
+	__u64                   inbytes;        /* incoming bytes */
+	__u64                   outbytes;       /* outgoing bytes */
+	seqcount_t		seq;		/* for 64bit reads on 32bit */
+};
+
 /*
  *	IPVS statistics object
+ *
+ *	The counters below are refreshed from the per-CPU ones every
+ *	estimation period, see ip_vs_est.c.
  */
 struct ip_vs_stats
 {
@@ -427,8 +447,12 @@ struct ip_vs_stats
 	__u32			outbps;		/* current out byte rate */
 
 	spinlock_t              lock;           /* spin lock */
+
+	struct ip_vs_cpu_stats	*cpustats;	/* per-CPU counters */
+	struct ip_vs_cpu_stats	zero;		/* their sums at last zeroing */
 };
 
+
 struct ip_vs_conn;
 struct ip_vs_app;
 
@@ -498,7 +522,7 @@ extern struct ip_vs_protocol * ip_vs_proto_get(unsigned short proto);
  *	IP_VS structure allocated for each dynamically scheduled connection
  */
 struct ip_vs_conn {
-	struct list_head        c_list;         /* hashed list heads */
+	struct hlist_node       c_list;         /* hashed list heads */
 
 	/* Protocol, addresses and port numbers */
 	__u32                   caddr;          /* client address */
@@ -539,6 +563,8 @@ struct ip_vs_conn {
 	void                    *app_data;      /* Application private data */
 	struct ip_vs_seq        in_seq;         /* incoming seq. struct */
 	struct ip_vs_seq        out_seq;        /* outgoing seq. struct */
+
+	struct rcu_head		rcu_head;	/* deferred free */
 };
 
 
@@ -728,8 +754,8 @@ extern void ip_vs_init_hash_table(struct list_head *table, int rows);
 #if 8 <= CONFIG_IP_VS_TAB_BITS && CONFIG_IP_VS_TAB_BITS <= 20
 #define IP_VS_CONN_TAB_BITS	CONFIG_IP_VS_TAB_BITS
 #endif
-#define IP_VS_CONN_TAB_SIZE     (1 << IP_VS_CONN_TAB_BITS)
-#define IP_VS_CONN_TAB_MASK     (IP_VS_CONN_TAB_SIZE - 1)
+/* default only: the conn_tab_bits module parameter overrides it */
+extern int ip_vs_conn_tab_size;
 
 enum {
 	IP_VS_DIR_INPUT = 0,
@@ -916,6 +942,9 @@ extern void ip_vs_sync_conn(struct ip_vs_conn *cp);
 /*
  *      IPVS rate estimator prototypes (from ip_vs_est.c)
  */
+extern int ip_vs_new_stats(struct ip_vs_stats *stats);
+extern void ip_vs_free_stats(struct ip_vs_stats *stats);
+extern void ip_vs_read_stats(struct ip_vs_stats *stats);
 extern int ip_vs_new_estimator(struct ip_vs_stats *stats);
 extern void ip_vs_kill_estimator(struct ip_vs_stats *stats);
 extern void ip_vs_zero_estimator(struct ip_vs_stats *stats);
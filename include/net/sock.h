@@ -94,6 +94,7 @@ struct sock;
   *	@skc_family - network address family
   *	@skc_state - Connection state
   *	@skc_reuse - %SO_REUSEADDR setting
+  *	@skc_reuseport - %SO_REUSEPORT setting
   *	@skc_bound_dev_if - bound device index if != 0
   *	@skc_node - main hash linkage for various protocol lookup tables
   *	@skc_bind_node - bind hash linkage for various protocol lookup tables
@@ -105,7 +106,8 @@ struct sock;
 struct sock_common {
 	unsigned short		skc_family;
 	volatile unsigned char	skc_state;
-	unsigned char		skc_reuse;
+	unsigned char		skc_reuse:4;
+	unsigned char		skc_reuseport:4;
 	int			skc_bound_dev_if;
 	struct hlist_node	skc_node;
 	struct hlist_node	skc_bind_node;
@@ -187,6 +189,7 @@ struct sock {
 #define sk_family		__sk_common.skc_family
 #define sk_state		__sk_common.skc_state
 #define sk_reuse		__sk_common.skc_reuse
+#define sk_reuseport		__sk_common.skc_reuseport
 #define sk_bound_dev_if		__sk_common.skc_bound_dev_if
 #define sk_node			__sk_common.skc_node
 #define sk_bind_node		__sk_common.skc_bind_node
@@ -921,6 +924,20 @@ static inline void sock_graft(struct sock *sk, struct socket *parent)
 extern int sock_i_uid(struct sock *sk);
 extern unsigned long sock_i_ino(struct sock *sk);
 
+/*
+ * Choice among the sockets sharing a port with SO_REUSEPORT, made while
+ * walking the hash chain: the n-th equally good match replaces the
+ * current pick with probability 1/n.  The coin tosses come from the
+ * flow hash, so all packets of a flow go to the same socket.
+ */
+static inline int sk_reuseport_pick(u32 *hash, unsigned int matches)
+{
+	int pick = (((u64)*hash * matches) >> 32) == 0;
+
+	*hash = *hash * 1664525 + 1013904223;
+	return pick;
+}
+
 static inline struct dst_entry *
 __sk_dst_get(struct sock *sk)
 {
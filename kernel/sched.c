@@ -2709,6 +2709,14 @@ asmlinkage void __sched schedule(void)
 	}
 	profile_hit(SCHED_PROFILING, __builtin_return_address(0));
 
+	/*
+	 * A task going to sleep must not keep I/O back on its plug: it may
+	 * well be the I/O it is about to wait for.
+	 */
+	if (unlikely(current->plug) && current->state &&
+	    !(preempt_count() & PREEMPT_ACTIVE))
+		blk_flush_plug(current);
+
 need_resched:
 	preempt_disable();      // 禁用抢占
 	prev = current;
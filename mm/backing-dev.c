@@ -0,0 +1,513 @@
+/*
+ * mm/backing-dev.c - per-device flusher threads
+ *
+ * Background and kupdate writeback used to be handed to whichever pdflush
+ * thread was free, each one walking all superblocks, so one slow or
+ * congested device held up writeback against all others.  Now every
+ * registered backing device gets a thread of its own, flush-<name>, which
+ * only writes back inodes against that device.
+ *
+ * The flusher threads are started by the bdi-default thread: it takes the
+ * writeback requests (the kupdate timer, processes going over the
+ * background threshold, wakeup_bdflush()), looks for devices with dirty
+ * inodes and passes the request on to their flushers, starting them as
+ * needed.  A flusher which had nothing to do for BDI_IDLE_EXIT exits
+ * again.  Dirty inodes against a device that is not registered are
+ * written back by bdi-default itself.
+ *
+ * Each device is also held to a share of the dirty limit in proportion to
+ * how many pages it wrote back recently, so that a slow device cannot take
+ * up all the dirty memory; bdi-default ages the counts.
+ *
+ * Per-device statistics are in /sys/class/bdi/<name>/.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/writeback.h>
+#include <linux/backing-dev.h>
+#include <linux/kthread.h>
+#include <linux/device.h>
+#include <asm/div64.h>
+
+/*
+ * A flusher thread exits after having nothing to do for this long
+ */
+#define BDI_IDLE_EXIT	(300 * HZ)
+
+/*
+ * Writeback completions are halved this often
+ */
+#define BDI_AGE_INTERVAL	(3 * HZ)
+
+/*
+ * Writeback requested of a thread.  Protected by bdi_lock.
+ */
+struct bdi_work {
+	int kupdate;		/* write back old data */
+	int background;		/* write down to the background threshold */
+	long nr_pages;		/* ... and at least this much */
+};
+
+struct bdi_writeback {
+	struct backing_dev_info	*bdi;
+	struct list_head	list;		/* on bdi_list */
+	struct task_struct	*task;		/* the flusher, if running */
+	struct bdi_work		work;
+	unsigned long		last_active;	/* jiffies */
+
+	unsigned long		pages_written;
+	unsigned long		kupdate_runs;
+	unsigned long		background_runs;
+	unsigned long		threads_started;
+
+	struct class_device	class_dev;
+};
+
+#define to_bdi_writeback(cd) container_of(cd, struct bdi_writeback, class_dev)
+
+/*
+ * bdi_sem protects bdi_list and the ->task of its entries
+ */
+static LIST_HEAD(bdi_list);
+static DECLARE_MUTEX(bdi_sem);
+static DEFINE_SPINLOCK(bdi_lock);
+
+static struct bdi_work bdi_default_work;
+static struct task_struct *bdi_default_task;
+
+/*
+ * Sum of the registered devices' completions
+ */
+atomic_t bdi_completions = ATOMIC_INIT(0);
+static unsigned long bdi_last_age;
+
+static void bdi_queue_work(struct bdi_work *to, struct bdi_work *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bdi_lock, flags);
+	to->kupdate |= work->kupdate;
+	to->background |= work->background;
+	if (work->nr_pages > to->nr_pages)
+		to->nr_pages = work->nr_pages;
+	spin_unlock_irqrestore(&bdi_lock, flags);
+}
+
+static int bdi_take_work(struct bdi_work *from, struct bdi_work *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bdi_lock, flags);
+	*work = *from;
+	memset(from, 0, sizeof(*from));
+	spin_unlock_irqrestore(&bdi_lock, flags);
+
+	return work->kupdate || work->background;
+}
+
+static inline int bdi_has_work(struct bdi_work *work)
+{
+	return work->kupdate || work->background;
+}
+
+/*
+ * An idle flusher may go away, unless it has been given work or is being
+ * stopped in the meantime.  Either way it is the one clearing wb->task.
+ */
+static int bdi_flusher_exit(struct bdi_writeback *wb)
+{
+	int ret = 0;
+
+	if (down_trylock(&bdi_sem))
+		return 0;
+	if (wb->task == current && !bdi_has_work(&wb->work)) {
+		wb->task = NULL;
+		ret = 1;
+	}
+	up(&bdi_sem);
+	return ret;
+}
+
+static int bdi_flusher(void *data)
+{
+	struct bdi_writeback *wb = data;
+	struct backing_dev_info *bdi = wb->bdi;
+	struct bdi_work work;
+
+	current->flags |= PF_FLUSHER;
+	set_user_nice(current, 0);
+	wb->last_active = jiffies;
+
+	for ( ; ; ) {
+		try_to_freeze(PF_FREEZE);
+		if (kthread_should_stop())
+			break;
+
+		if (bdi_take_work(&wb->work, &work)) {
+			if (work.kupdate) {
+				wb->pages_written += kupdate_writeout(bdi);
+				wb->kupdate_runs++;
+			}
+			if (work.background) {
+				wb->pages_written +=
+					background_writeout(bdi, work.nr_pages);
+				wb->background_runs++;
+			}
+			wb->last_active = jiffies;
+			continue;
+		}
+
+		if (time_after(jiffies, wb->last_active + BDI_IDLE_EXIT) &&
+		    bdi_flusher_exit(wb))
+			break;		/* wb may be gone now */
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!bdi_has_work(&wb->work) && !kthread_should_stop())
+			schedule_timeout(BDI_IDLE_EXIT);
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+/*
+ * Hand the work on to the flushers of all devices with dirty inodes.
+ */
+static void bdi_dispatch(struct bdi_work *work)
+{
+	struct bdi_writeback *wb;
+	int orphans = mark_dirty_bdis();
+
+	down(&bdi_sem);
+	list_for_each_entry(wb, &bdi_list, list) {
+		struct task_struct *task;
+
+		if (!test_and_clear_bit(BDI_dirty, &wb->bdi->state))
+			continue;
+
+		bdi_queue_work(&wb->work, work);
+		if (wb->task) {
+			wake_up_process(wb->task);
+			continue;
+		}
+
+		task = kthread_run(bdi_flusher, wb, "flush-%s",
+				   wb->class_dev.class_id);
+		if (IS_ERR(task)) {
+			orphans = 1;
+			continue;
+		}
+		wb->task = task;
+		wb->threads_started++;
+	}
+	up(&bdi_sem);
+
+	if (orphans) {
+		if (work->kupdate)
+			kupdate_writeout(NULL);
+		if (work->background)
+			background_writeout(NULL, work->nr_pages);
+	}
+}
+
+/*
+ * Halve the completion counts once for every BDI_AGE_INTERVAL gone by,
+ * and resync the total with them.
+ */
+static void bdi_age_completions(void)
+{
+	unsigned long periods = (jiffies - bdi_last_age) / BDI_AGE_INTERVAL;
+	struct bdi_writeback *wb;
+	int shift = min(periods, 31UL);
+	int total = 0;
+
+	if (!periods)
+		return;
+
+	down(&bdi_sem);
+	list_for_each_entry(wb, &bdi_list, list) {
+		atomic_t *v = &wb->bdi->completions;
+		int count = atomic_read(v);
+
+		atomic_sub(count - (count >> shift), v);
+		total += atomic_read(v);
+	}
+	up(&bdi_sem);
+
+	atomic_set(&bdi_completions, total);
+	bdi_last_age += periods * BDI_AGE_INTERVAL;
+}
+
+static int bdi_default_thread(void *unused)
+{
+	struct bdi_work work;
+
+	current->flags |= PF_FLUSHER;
+	set_user_nice(current, 0);
+	bdi_last_age = jiffies;
+
+	for ( ; ; ) {
+		try_to_freeze(PF_FREEZE);
+		bdi_age_completions();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!bdi_has_work(&bdi_default_work)) {
+			if (atomic_read(&bdi_completions))
+				schedule_timeout(BDI_AGE_INTERVAL);
+			else
+				schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		if (!bdi_take_work(&bdi_default_work, &work))
+			continue;
+		if (work.kupdate)
+			sync_supers();
+		bdi_dispatch(&work);
+	}
+	return 0;
+}
+
+static void bdi_wakeup(struct bdi_work *work)
+{
+	bdi_queue_work(&bdi_default_work, work);
+	if (bdi_default_task)
+		wake_up_process(bdi_default_task);
+}
+
+/**
+ * bdi_start_background - start background writeback
+ * @nr_pages: minimum number of pages to write per device
+ *
+ * Has the devices with dirty inodes write back at least @nr_pages, and on
+ * until the dirty memory is below the background threshold.  May be
+ * called from any context.
+ */
+void bdi_start_background(long nr_pages)
+{
+	struct bdi_work work = {
+		.background	= 1,
+		.nr_pages	= nr_pages,
+	};
+
+	bdi_wakeup(&work);
+}
+
+/**
+ * bdi_start_kupdate - start writeback of old data
+ *
+ * May be called from any context.
+ */
+void bdi_start_kupdate(void)
+{
+	struct bdi_work work = {
+		.kupdate	= 1,
+	};
+
+	bdi_wakeup(&work);
+}
+
+/**
+ * bdi_dirty_limit - a device's share of the dirty limit
+ * @bdi: the device
+ * @dirty: the dirty limit, in pages
+ *
+ * A registered device gets the part of @dirty it has of the recent
+ * writeback completions, so processes writing to a fast device are not
+ * held up by the dirty pages of a slow one.  Other devices, and all of
+ * them when nothing was written back lately, get the whole of @dirty.
+ * The share may be next to nothing for an idle device, so it is only
+ * enforced once the totals are well up towards the global limits.
+ */
+long bdi_dirty_limit(struct backing_dev_info *bdi, long dirty)
+{
+	long total = atomic_read(&bdi_completions);
+	long count = atomic_read(&bdi->completions);
+	u64 limit;
+
+	if (!bdi->wb || total <= 0)
+		return dirty;
+	if (count > total)
+		count = total;
+
+	limit = (u64)dirty * count;
+	do_div(limit, total);
+	return limit;
+}
+
+/*
+ * sysfs parts below
+ */
+#define BDI_SHOW(name)							\
+static ssize_t name##_show(struct class_device *class_dev, char *page)	\
+{									\
+	return sprintf(page, "%lu\n", to_bdi_writeback(class_dev)->name); \
+}
+
+BDI_SHOW(pages_written)
+BDI_SHOW(kupdate_runs)
+BDI_SHOW(background_runs)
+BDI_SHOW(threads_started)
+
+#define BDI_SHOW_ATOMIC(name)						\
+static ssize_t name##_show(struct class_device *class_dev, char *page)	\
+{									\
+	struct bdi_writeback *wb = to_bdi_writeback(class_dev);		\
+									\
+	return sprintf(page, "%d\n", atomic_read(&wb->bdi->name));	\
+}
+
+BDI_SHOW_ATOMIC(nr_reclaimable)
+BDI_SHOW_ATOMIC(nr_writeback)
+BDI_SHOW_ATOMIC(completions)
+
+static ssize_t dirty_limit_show(struct class_device *class_dev, char *page)
+{
+	struct bdi_writeback *wb = to_bdi_writeback(class_dev);
+	long background, dirty;
+
+	global_dirty_limits(&background, &dirty);
+	return sprintf(page, "%ld\n", bdi_dirty_limit(wb->bdi, dirty));
+}
+
+static ssize_t flusher_pid_show(struct class_device *class_dev, char *page)
+{
+	struct bdi_writeback *wb = to_bdi_writeback(class_dev);
+	pid_t pid = 0;
+
+	down(&bdi_sem);
+	if (wb->task)
+		pid = wb->task->pid;
+	up(&bdi_sem);
+
+	return sprintf(page, "%d\n", pid);
+}
+
+static struct class_device_attribute bdi_attrs[] = {
+	__ATTR_RO(pages_written),
+	__ATTR_RO(kupdate_runs),
+	__ATTR_RO(background_runs),
+	__ATTR_RO(threads_started),
+	__ATTR_RO(flusher_pid),
+	__ATTR_RO(nr_reclaimable),
+	__ATTR_RO(nr_writeback),
+	__ATTR_RO(completions),
+	__ATTR_RO(dirty_limit),
+	__ATTR_NULL,
+};
+
+static void bdi_class_release(struct class_device *class_dev)
+{
+	kfree(to_bdi_writeback(class_dev));
+}
+
+static struct class bdi_class = {
+	.name		= "bdi",
+	.class_dev_attrs = bdi_attrs,
+	.release	= bdi_class_release,
+};
+
+/**
+ * bdi_register - give a backing device a flusher thread
+ * @bdi: the device
+ * @fmt: printf style name, for the thread and the sysfs directory
+ *
+ * The thread itself is only started once there is something to write.
+ * Registering an already registered device does nothing, so a queue
+ * shared by several disks may be registered for each.
+ */
+int bdi_register(struct backing_dev_info *bdi, const char *fmt, ...)
+{
+	struct bdi_writeback *wb;
+	va_list args;
+	char *s;
+	int err = 0;
+
+	down(&bdi_sem);
+	if (bdi->wb)
+		goto out;
+
+	err = -ENOMEM;
+	wb = kmalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		goto out;
+	memset(wb, 0, sizeof(*wb));
+	wb->bdi = bdi;
+	wb->class_dev.class = &bdi_class;
+	va_start(args, fmt);
+	vsnprintf(wb->class_dev.class_id, BUS_ID_SIZE, fmt, args);
+	va_end(args);
+	/* disk names like cciss/c0d0: '!' in sysfs, as for the disk */
+	for (s = wb->class_dev.class_id; (s = strchr(s, '/')) != NULL; )
+		*s = '!';
+
+	err = class_device_register(&wb->class_dev);
+	if (err) {
+		kfree(wb);
+		goto out;
+	}
+
+	list_add_tail(&wb->list, &bdi_list);
+	bdi->wb = wb;
+out:
+	up(&bdi_sem);
+	return err;
+}
+EXPORT_SYMBOL(bdi_register);
+
+/**
+ * bdi_unregister - stop a backing device's flusher thread
+ * @bdi: the device
+ *
+ * Must be called before @bdi is freed.  Does nothing if it was never
+ * registered.
+ */
+void bdi_unregister(struct backing_dev_info *bdi)
+{
+	struct bdi_writeback *wb;
+	struct task_struct *task;
+
+	down(&bdi_sem);
+	wb = bdi->wb;
+	if (!wb) {
+		up(&bdi_sem);
+		return;
+	}
+	list_del(&wb->list);
+	bdi->wb = NULL;
+	task = wb->task;
+	wb->task = NULL;
+	up(&bdi_sem);
+
+	if (task)
+		kthread_stop(task);
+	class_device_unregister(&wb->class_dev);
+}
+EXPORT_SYMBOL(bdi_unregister);
+
+static int __init bdi_init(void)
+{
+	struct task_struct *task;
+	int err;
+
+	err = class_register(&bdi_class);
+	if (err)
+		return err;
+	bdi_register(&default_backing_dev_info, "default");
+
+	task = kthread_run(bdi_default_thread, NULL, "bdi-default");
+	if (IS_ERR(task)) {
+		printk(KERN_ERR "bdi: could not start bdi-default\n");
+		return PTR_ERR(task);
+	}
+	bdi_default_task = task;
+	return 0;
+}
+
+subsys_initcall(bdi_init);
@@ -46,7 +46,6 @@
 static long ratelimit_pages = 32;
 
 static long total_pages;	/* The total number of pages in the machine. */
-static int dirty_exceeded;	/* Dirty mem may be over limit */
 
 /*
  * When balance_dirty_pages decides that the caller needs to perform some
@@ -62,7 +61,7 @@ static inline long sync_writeback_pages(void)
 /* The following parameters are exported via /proc/sys/vm */
 
 /*
- * Start background writeback (via pdflush) at this percentage
+ * Start background writeback (via the flusher threads) at this percentage
  */
 int dirty_background_ratio = 10;
 
@@ -97,8 +96,6 @@ EXPORT_SYMBOL(laptop_mode);
 /* End of sysctl-exported parameters */
 
 
-static void background_writeout(unsigned long _min_pages);
-
 struct writeback_state
 {
 	unsigned long nr_dirty;
@@ -180,21 +177,64 @@ get_dirty_limits(struct writeback_state *wbs, long *pbackground, long *pdirty,
 	*pdirty = dirty;
 }
 
+/*
+ * The current limits for a process dirtying memory in any zone
+ */
+void global_dirty_limits(long *pbackground, long *pdirty)
+{
+	struct writeback_state wbs;
+
+	get_dirty_limits(&wbs, pbackground, pdirty, NULL);
+}
+
+/*
+ * Dirty memory against `bdi' and its share of the dirty limit.  A device
+ * without a flusher thread takes no part in the proportions, so it is held
+ * to the global numbers.
+ */
+static long bdi_dirty_state(struct backing_dev_info *bdi,
+		struct writeback_state *wbs, long dirty_thresh,
+		long *nr_reclaimable, long *nr_writeback)
+{
+	if (!bdi->wb) {
+		*nr_reclaimable = wbs->nr_dirty + wbs->nr_unstable;
+		*nr_writeback = wbs->nr_writeback;
+		return dirty_thresh;
+	}
+	*nr_reclaimable = atomic_read(&bdi->nr_reclaimable);
+	*nr_writeback = atomic_read(&bdi->nr_writeback);
+	return bdi_dirty_limit(bdi, dirty_thresh);
+}
+
+/*
+ * A device's share of the dirty limit can be next to nothing while others
+ * take all the completions.  Nobody is held to it while the dirty and
+ * writeback pages of all devices stay halfway between the background and
+ * dirty limits.
+ */
+static inline int dirty_below_floor(struct writeback_state *wbs,
+		long background_thresh, long dirty_thresh)
+{
+	return wbs->nr_dirty + wbs->nr_unstable + wbs->nr_writeback <=
+		(background_thresh + dirty_thresh) / 2;
+}
+
 /*
  * balance_dirty_pages() must be called by processes which are generating dirty
- * data.  It looks at the number of dirty pages in the machine and will force
- * the caller to perform writeback if the system is over `vm_dirty_ratio'.
- * If we're over `background_thresh' then pdflush is woken to perform some
- * writeout.
+ * data.  It looks at the number of dirty pages against the device and will
+ * force the caller to perform writeback if the device is over its share of
+ * `vm_dirty_ratio'.  If we're over `background_thresh' then the flusher
+ * threads are woken to perform some writeout.
  */
 static void balance_dirty_pages(struct address_space *mapping)
 {
 	struct writeback_state wbs;
-	long nr_reclaimable;
+	long nr_reclaimable, bdi_nr_reclaimable, bdi_nr_writeback;
 	long background_thresh;
-	long dirty_thresh;
+	long dirty_thresh, bdi_thresh;
 	unsigned long pages_written = 0;
 	unsigned long write_chunk = sync_writeback_pages();
+	int exceeded;
 
 	struct backing_dev_info *bdi = mapping->backing_dev_info;
 
@@ -209,10 +249,15 @@ static void balance_dirty_pages(struct address_space *mapping)
 		get_dirty_limits(&wbs, &background_thresh,
 					&dirty_thresh, mapping);
 		nr_reclaimable = wbs.nr_dirty + wbs.nr_unstable;
-		if (nr_reclaimable + wbs.nr_writeback <= dirty_thresh)
+		exceeded = 0;
+		if (dirty_below_floor(&wbs, background_thresh, dirty_thresh))
+			break;
+		bdi_thresh = bdi_dirty_state(bdi, &wbs, dirty_thresh,
+				&bdi_nr_reclaimable, &bdi_nr_writeback);
+		if (bdi_nr_reclaimable + bdi_nr_writeback <= bdi_thresh)
 			break;
 
-		dirty_exceeded = 1;
+		bdi->dirty_exceeded = exceeded = 1;
 
 		/* Note: nr_reclaimable denotes nr_dirty + nr_unstable.
 		 * Unstable writes are a feature of certain networked
@@ -220,13 +265,20 @@ static void balance_dirty_pages(struct address_space *mapping)
 		 * written to the server's write cache, but has not yet
 		 * been flushed to permanent storage.
 		 */
-		if (nr_reclaimable) {
+		if (bdi_nr_reclaimable) {
 			writeback_inodes(&wbc);
 			get_dirty_limits(&wbs, &background_thresh,
 					&dirty_thresh, mapping);
 			nr_reclaimable = wbs.nr_dirty + wbs.nr_unstable;
-			if (nr_reclaimable + wbs.nr_writeback <= dirty_thresh)
+			exceeded = 0;
+			if (dirty_below_floor(&wbs, background_thresh,
+					dirty_thresh))
+				break;
+			bdi_thresh = bdi_dirty_state(bdi, &wbs, dirty_thresh,
+					&bdi_nr_reclaimable, &bdi_nr_writeback);
+			if (bdi_nr_reclaimable + bdi_nr_writeback <= bdi_thresh)
 				break;
+			exceeded = 1;
 			pages_written += write_chunk - wbc.nr_to_write;
 			if (pages_written >= write_chunk)
 				break;		/* We've done our duty */
@@ -234,11 +286,11 @@ static void balance_dirty_pages(struct address_space *mapping)
 		blk_congestion_wait(WRITE, HZ/10);
 	}
 
-	if (nr_reclaimable + wbs.nr_writeback <= dirty_thresh)
-		dirty_exceeded = 0;
+	if (!exceeded)
+		bdi->dirty_exceeded = 0;
 
 	if (writeback_in_progress(bdi))
-		return;		/* pdflush is already working this queue */
+		return;		/* a flusher is already working this queue */
 
 	/*
 	 * In laptop mode, we wait until hitting the higher threshold before
@@ -250,7 +302,7 @@ static void balance_dirty_pages(struct address_space *mapping)
 	 */
 	if ((laptop_mode && pages_written) ||
 	     (!laptop_mode && (nr_reclaimable > background_thresh)))
-		pdflush_operation(background_writeout, 0);
+		bdi_start_background(0);
 }
 
 /**
@@ -272,7 +324,7 @@ void balance_dirty_pages_ratelimited(struct address_space *mapping)
 	long ratelimit;
 
 	ratelimit = ratelimit_pages;
-	if (dirty_exceeded)
+	if (mapping->backing_dev_info->dirty_exceeded)
 		ratelimit = 8;
 
 	/*
@@ -290,14 +342,16 @@ void balance_dirty_pages_ratelimited(struct address_space *mapping)
 EXPORT_SYMBOL(balance_dirty_pages_ratelimited);
 
 /*
- * writeback at least _min_pages, and keep writing until the amount of dirty
+ * writeback at least min_pages, and keep writing until the amount of dirty
  * memory is less than the background threshold, or until we're all clean.
+ * Only inodes against `bdi' are written, unless it is NULL.  Returns the
+ * number of pages written.
  */
-static void background_writeout(unsigned long _min_pages)
+long background_writeout(struct backing_dev_info *bdi, long min_pages)
 {
-	long min_pages = _min_pages;
+	long written = 0;
 	struct writeback_control wbc = {
-		.bdi		= NULL,
+		.bdi		= bdi,
 		.sync_mode	= WB_SYNC_NONE,
 		.older_than_this = NULL,
 		.nr_to_write	= 0,
@@ -318,6 +372,7 @@ static void background_writeout(unsigned long _min_pages)
 		wbc.pages_skipped = 0;
 		writeback_inodes(&wbc);
 		min_pages -= MAX_WRITEBACK_PAGES - wbc.nr_to_write;
+		written += MAX_WRITEBACK_PAGES - wbc.nr_to_write;
 		if (wbc.nr_to_write > 0 || wbc.pages_skipped > 0) {
 			/* Wrote less than expected */
 			blk_congestion_wait(WRITE, HZ/10);
@@ -325,12 +380,13 @@ static void background_writeout(unsigned long _min_pages)
 				break;
 		}
 	}
+	return written;
 }
 
 /*
  * Start writeback of `nr_pages' pages.  If `nr_pages' is zero, write back
- * the whole world.  Returns 0 if a pdflush thread was dispatched.  Returns
- * -1 if all pdflush threads were busy.
+ * the whole world.  The work is handed to the flusher threads, so this
+ * always returns 0.
  */
 int wakeup_bdflush(long nr_pages)
 {
@@ -340,7 +396,8 @@ int wakeup_bdflush(long nr_pages)
 		get_writeback_state(&wbs);
 		nr_pages = wbs.nr_dirty + wbs.nr_unstable;
 	}
-	return pdflush_operation(background_writeout, nr_pages);
+	bdi_start_background(nr_pages);
+	return 0;
 }
 
 static void wb_timer_fn(unsigned long unused);
@@ -359,22 +416,24 @@ static struct timer_list laptop_mode_wb_timer =
  * just walks the superblock inode list, writing back any inodes which are
  * older than a specific point in time.
  *
- * Try to run once per dirty_writeback_centisecs.  But if a writeback event
- * takes longer than a dirty_writeback_centisecs interval, then leave a
- * one-second gap.
+ * The timer fires once per dirty_writeback_centisecs and has the flusher
+ * threads of all devices with dirty inodes run this.  A device whose
+ * flusher is still busy with the previous round simply picks it up when
+ * it is done.
  *
  * older_than_this takes precedence over nr_to_write.  So we'll only write back
  * all dirty pages if they are all attached to "old" mappings.
+ *
+ * Only inodes against `bdi' are written, unless it is NULL.  Returns the
+ * number of pages written.
  */
-static void wb_kupdate(unsigned long arg)
+long kupdate_writeout(struct backing_dev_info *bdi)
 {
 	unsigned long oldest_jif;
-	unsigned long start_jif;
-	unsigned long next_jif;
-	long nr_to_write;
+	long nr_to_write, written = 0;
 	struct writeback_state wbs;
 	struct writeback_control wbc = {
-		.bdi		= NULL,
+		.bdi		= bdi,
 		.sync_mode	= WB_SYNC_NONE,
 		.older_than_this = &oldest_jif,
 		.nr_to_write	= 0,
@@ -382,18 +441,15 @@ static void wb_kupdate(unsigned long arg)
 		.for_kupdate	= 1,
 	};
 
-	sync_supers();
-
 	get_writeback_state(&wbs);
 	oldest_jif = jiffies - (dirty_expire_centisecs * HZ) / 100;
-	start_jif = jiffies;
-	next_jif = start_jif + (dirty_writeback_centisecs * HZ) / 100;
 	nr_to_write = wbs.nr_dirty + wbs.nr_unstable +
 			(inodes_stat.nr_inodes - inodes_stat.nr_unused);
 	while (nr_to_write > 0) {
 		wbc.encountered_congestion = 0;
 		wbc.nr_to_write = MAX_WRITEBACK_PAGES;
 		writeback_inodes(&wbc);
+		written += MAX_WRITEBACK_PAGES - wbc.nr_to_write;
 		if (wbc.nr_to_write > 0) {
 			if (wbc.encountered_congestion)
 				blk_congestion_wait(WRITE, HZ/10);
@@ -402,10 +458,7 @@ static void wb_kupdate(unsigned long arg)
 		}
 		nr_to_write -= MAX_WRITEBACK_PAGES - wbc.nr_to_write;
 	}
-	if (time_before(next_jif, jiffies + HZ))
-		next_jif = jiffies + HZ;
-	if (dirty_writeback_centisecs)
-		mod_timer(&wb_timer, next_jif);
+	return written;
 }
 
 /*
@@ -426,8 +479,10 @@ int dirty_writeback_centisecs_handler(ctl_table *table, int write,
 
 static void wb_timer_fn(unsigned long unused)
 {
-	if (pdflush_operation(wb_kupdate, 0) < 0)
-		mod_timer(&wb_timer, jiffies + HZ); /* delay 1 second */
+	bdi_start_kupdate();
+	if (dirty_writeback_centisecs)
+		mod_timer(&wb_timer,
+			jiffies + (dirty_writeback_centisecs * HZ) / 100);
 }
 
 static void laptop_flush(unsigned long unused)
@@ -530,11 +585,18 @@ void __init page_writeback_init(void)
 
 int do_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
+	struct blk_plug plug;
+	int ret;
+
 	if (wbc->nr_to_write <= 0)
 		return 0;
+	blk_start_plug(&plug);
 	if (mapping->a_ops->writepages)
-		return mapping->a_ops->writepages(mapping, wbc);
-	return generic_writepages(mapping, wbc);
+		ret = mapping->a_ops->writepages(mapping, wbc);
+	else
+		ret = generic_writepages(mapping, wbc);
+	blk_finish_plug(&plug);
+	return ret;
 }
 
 /**
@@ -605,8 +667,11 @@ int __set_page_dirty_nobuffers(struct page *page)
 			mapping2 = page_mapping(page);
 			if (mapping2) { /* Race with truncate? */
 				BUG_ON(mapping2 != mapping);
-				if (!mapping->backing_dev_info->memory_backed)
+				if (!mapping->backing_dev_info->memory_backed) {
 					inc_page_state(nr_dirty);
+					atomic_inc(&mapping->backing_dev_info->
+							nr_reclaimable);
+				}
 				radix_tree_tag_set(&mapping->page_tree,
 					page_index(page), PAGECACHE_TAG_DIRTY);
 			}
@@ -691,8 +756,11 @@ int test_clear_page_dirty(struct page *page)
 						page_index(page),
 						PAGECACHE_TAG_DIRTY);
 			spin_unlock_irqrestore(&mapping->tree_lock, flags);
-			if (!mapping->backing_dev_info->memory_backed)
+			if (!mapping->backing_dev_info->memory_backed) {
 				dec_page_state(nr_dirty);
+				atomic_dec(&mapping->backing_dev_info->
+						nr_reclaimable);
+			}
 			return 1;
 		}
 		spin_unlock_irqrestore(&mapping->tree_lock, flags);
@@ -722,8 +790,11 @@ int clear_page_dirty_for_io(struct page *page)
 
 	if (mapping) {
 		if (TestClearPageDirty(page)) {
-			if (!mapping->backing_dev_info->memory_backed)
+			if (!mapping->backing_dev_info->memory_backed) {
 				dec_page_state(nr_dirty);
+				atomic_dec(&mapping->backing_dev_info->
+						nr_reclaimable);
+			}
 			return 1;
 		}
 		return 0;
@@ -762,6 +833,7 @@ int test_clear_page_writeback(struct page *page)
 	int ret;
 
 	if (mapping) {
+		struct backing_dev_info *bdi = mapping->backing_dev_info;
 		unsigned long flags;
 
 		spin_lock_irqsave(&mapping->tree_lock, flags);
@@ -771,6 +843,11 @@ int test_clear_page_writeback(struct page *page)
 						page_index(page),
 						PAGECACHE_TAG_WRITEBACK);
 		spin_unlock_irqrestore(&mapping->tree_lock, flags);
+		if (ret) {
+			atomic_dec(&bdi->nr_writeback);
+			if (!bdi->memory_backed)
+				bdi_writeout_inc(bdi);
+		}
 	} else {
 		ret = TestClearPageWriteback(page);
 	}
@@ -796,6 +873,8 @@ int test_set_page_writeback(struct page *page)
 						page_index(page),
 						PAGECACHE_TAG_DIRTY);
 		spin_unlock_irqrestore(&mapping->tree_lock, flags);
+		if (!ret)
+			atomic_inc(&mapping->backing_dev_info->nr_writeback);
 	} else {
 		ret = TestSetPageWriteback(page);
 	}
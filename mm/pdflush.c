@@ -32,12 +32,12 @@ static void start_one_pdflush_thread(void);
 
 
 /*
- * The pdflush threads are worker threads for writing back dirty data.
- * Ideally, we'd like one thread per active disk spindle.  But the disk
- * topology is very hard to divine at this level.   Instead, we take
- * care in various places to prevent more than one pdflush thread from
- * performing writeback against a single filesystem.  pdflush threads
- * have the PF_FLUSHER flag set in current->flags to aid in this.
+ * The pdflush threads are worker threads for one-off jobs such as the
+ * laptop mode sync and emergency sync/remount.  Background and periodic
+ * writeback of dirty data is done by the per-device flusher threads of
+ * mm/backing-dev.c instead.  Both kinds have the PF_FLUSHER flag set in
+ * current->flags, and we take care in various places to prevent more than
+ * one of them from performing writeback against a single filesystem.
  */
 
 /*
@@ -234,6 +234,9 @@ int sock_setsockopt(struct socket *sock, int level, int optname,
 		case SO_REUSEADDR:
 			sk->sk_reuse = valbool;
 			break;
+		case SO_REUSEPORT:
+			sk->sk_reuseport = valbool;
+			break;
 		case SO_TYPE:
 		case SO_ERROR:
 			ret = -ENOPROTOOPT;
@@ -486,6 +489,10 @@ int sock_getsockopt(struct socket *sock, int level, int optname,
 			v.val = sk->sk_reuse;
 			break;
 
+		case SO_REUSEPORT:
+			v.val = sk->sk_reuseport;
+			break;
+
 		case SO_KEEPALIVE:
 			v.val = !!sock_flag(sk, SOCK_KEEPOPEN);
 			break;
@@ -0,0 +1,300 @@
+/*
+ * IPVS:        Consistent Hashing scheduling module
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Changes:
+ *
+ */
+
+/*
+ * The ch algorithm places every server on a hash ring at a number of
+ * points proportional to its weight, and selects the server owning the
+ * first point at or after the hash of the packet's source IP address:
+ *
+ *       p <- first point on ring with p.hash >= hash(src_ip);
+ *       while (p.server is dead or overloaded) do
+ *                 p <- next point on ring;
+ *       return p.server;
+ *
+ * Like sh, a client keeps going to the same server, which keeps caches
+ * on the real servers warm.  Unlike sh, adding or removing a server
+ * only moves the clients of that server's points: the others stay
+ * where they are.  And if the chosen server is unavailable, the client
+ * is moved to the next one on the ring instead of being dropped.
+ *
+ * Servers with weight 0 are left off the ring.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <asm/div64.h>
+
+#include <net/ip_vs.h>
+
+
+/*
+ *      Number of points given to the server(s) with the highest weight.
+ *      More points spread the load more evenly, at the expense of a
+ *      longer binary search and a bigger ring.
+ */
+#ifndef CONFIG_IP_VS_CH_REPLICAS
+#define CONFIG_IP_VS_CH_REPLICAS        160
+#endif
+#define IP_VS_CH_REPLICAS               CONFIG_IP_VS_CH_REPLICAS
+
+
+/*
+ *      IPVS CH point on the ring
+ */
+struct ip_vs_ch_point {
+	__u32                   hash;           /* position on the ring */
+	struct ip_vs_dest       *dest;          /* real server (cache) */
+};
+
+struct ip_vs_ch_ring {
+	int                     size;           /* number of points */
+	struct ip_vs_ch_point   points[0];      /* sorted by hash */
+};
+
+
+static inline __u32 ip_vs_ch_hashkey(__u32 addr)
+{
+	return jhash_1word(addr, 0);
+}
+
+
+/*
+ *      Sort the points by hash value (heapsort, the ring can be big
+ *      and we are called with BHs disabled).
+ */
+static void ip_vs_ch_sift(struct ip_vs_ch_point *p, int root, int n)
+{
+	struct ip_vs_ch_point tmp;
+	int child;
+
+	while ((child = 2*root + 1) < n) {
+		if (child + 1 < n && p[child].hash < p[child+1].hash)
+			child++;
+		if (p[root].hash >= p[child].hash)
+			return;
+		tmp = p[root];
+		p[root] = p[child];
+		p[child] = tmp;
+		root = child;
+	}
+}
+
+static void ip_vs_ch_sort(struct ip_vs_ch_point *p, int n)
+{
+	struct ip_vs_ch_point tmp;
+	int i;
+
+	for (i = n/2 - 1; i >= 0; i--)
+		ip_vs_ch_sift(p, i, n);
+	for (i = n - 1; i > 0; i--) {
+		tmp = p[0];
+		p[0] = p[i];
+		p[i] = tmp;
+		ip_vs_ch_sift(p, 0, i);
+	}
+}
+
+
+/*
+ *      Number of points of a server: IP_VS_CH_REPLICAS for the biggest
+ *      weight, the others in proportion, but at least one.
+ */
+static inline int ip_vs_ch_replicas(int weight, int max_weight)
+{
+	u64 n;
+
+	if (weight <= 0)
+		return 0;
+	n = (u64)weight * IP_VS_CH_REPLICAS;
+	do_div(n, max_weight);
+	return n ? (int)n : 1;
+}
+
+
+/*
+ *      Build the ring for the current destinations of the service.
+ */
+static struct ip_vs_ch_ring *ip_vs_ch_build(struct ip_vs_service *svc)
+{
+	struct ip_vs_ch_ring *ring;
+	struct ip_vs_ch_point *p;
+	struct ip_vs_dest *dest;
+	int max_weight = 0, n = 0, i, r;
+
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		if (atomic_read(&dest->weight) > max_weight)
+			max_weight = atomic_read(&dest->weight);
+	}
+	list_for_each_entry(dest, &svc->destinations, n_list)
+		n += ip_vs_ch_replicas(atomic_read(&dest->weight), max_weight);
+
+	ring = kmalloc(sizeof(*ring) + n * sizeof(struct ip_vs_ch_point),
+		       GFP_ATOMIC);
+	if (ring == NULL) {
+		IP_VS_ERR("ip_vs_ch_build(): no memory\n");
+		return NULL;
+	}
+	ring->size = n;
+
+	p = ring->points;
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		r = ip_vs_ch_replicas(atomic_read(&dest->weight), max_weight);
+		for (i = 0; i < r; i++, p++) {
+			p->hash = jhash_3words(dest->addr, dest->port, i, 0);
+			p->dest = dest;
+			atomic_inc(&dest->refcnt);
+		}
+	}
+	ip_vs_ch_sort(ring->points, n);
+
+	IP_VS_DBG(6, "CH ring (%d points, memory=%Zdbytes) built for "
+		  "current service\n", n,
+		  sizeof(*ring) + n * sizeof(struct ip_vs_ch_point));
+	return ring;
+}
+
+
+/*
+ *      Drop the references of the ring and release it.
+ */
+static void ip_vs_ch_free(struct ip_vs_ch_ring *ring)
+{
+	int i;
+
+	if (ring == NULL)
+		return;
+	for (i = 0; i < ring->size; i++)
+		atomic_dec(&ring->points[i].dest->refcnt);
+	kfree(ring);
+}
+
+
+static int ip_vs_ch_init_svc(struct ip_vs_service *svc)
+{
+	svc->sched_data = ip_vs_ch_build(svc);
+	if (svc->sched_data == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+
+static int ip_vs_ch_done_svc(struct ip_vs_service *svc)
+{
+	ip_vs_ch_free(svc->sched_data);
+	svc->sched_data = NULL;
+	IP_VS_DBG(6, "CH ring released\n");
+	return 0;
+}
+
+
+static int ip_vs_ch_update_svc(struct ip_vs_service *svc)
+{
+	/* schedule() can not run now: the service users are gone */
+	ip_vs_ch_free(svc->sched_data);
+	svc->sched_data = ip_vs_ch_build(svc);
+	if (svc->sched_data == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+
+/*
+ *      If the dest flags is set with IP_VS_DEST_F_OVERLOAD,
+ *      consider that the server is overloaded here.
+ */
+static inline int is_overloaded(struct ip_vs_dest *dest)
+{
+	return dest->flags & IP_VS_DEST_F_OVERLOAD;
+}
+
+
+/*
+ *      Consistent Hashing scheduling
+ */
+static struct ip_vs_dest *
+ip_vs_ch_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
+{
+	struct ip_vs_ch_ring *ring = svc->sched_data;
+	struct ip_vs_dest *dest;
+	struct iphdr *iph = skb->nh.iph;
+	__u32 hash;
+	int lo, hi, mid, i;
+
+	IP_VS_DBG(6, "ip_vs_ch_schedule(): Scheduling...\n");
+
+	if (ring == NULL || ring->size == 0)
+		return NULL;
+
+	/* first point at or after the hash, wrapping around */
+	hash = ip_vs_ch_hashkey(iph->saddr);
+	lo = 0;
+	hi = ring->size;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ring->points[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = 0; i < ring->size; i++) {
+		dest = ring->points[(lo + i) % ring->size].dest;
+		if ((dest->flags & IP_VS_DEST_F_AVAILABLE)
+		    && atomic_read(&dest->weight) > 0
+		    && !is_overloaded(dest))
+			goto out;
+	}
+	return NULL;
+
+  out:
+	IP_VS_DBG(6, "CH: source IP address %u.%u.%u.%u "
+		  "--> server %u.%u.%u.%u:%d\n",
+		  NIPQUAD(iph->saddr),
+		  NIPQUAD(dest->addr),
+		  ntohs(dest->port));
+
+	return dest;
+}
+
+
+/*
+ *      IPVS CH Scheduler structure
+ */
+static struct ip_vs_scheduler ip_vs_ch_scheduler =
+{
+	.name =			"ch",
+	.refcnt =		ATOMIC_INIT(0),
+	.module =		THIS_MODULE,
+	.init_service =		ip_vs_ch_init_svc,
+	.done_service =		ip_vs_ch_done_svc,
+	.update_service =	ip_vs_ch_update_svc,
+	.schedule =		ip_vs_ch_schedule,
+};
+
+
+static int __init ip_vs_ch_init(void)
+{
+	INIT_LIST_HEAD(&ip_vs_ch_scheduler.n_list);
+	return register_ip_vs_scheduler(&ip_vs_ch_scheduler);
+}
+
+
+static void __exit ip_vs_ch_cleanup(void)
+{
+	unregister_ip_vs_scheduler(&ip_vs_ch_scheduler);
+}
+
+
+module_init(ip_vs_ch_init);
+module_exit(ip_vs_ch_cleanup);
+MODULE_LICENSE("GPL");
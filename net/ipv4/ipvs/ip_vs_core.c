@@ -88,25 +88,42 @@ void ip_vs_init_hash_table(struct list_head *table, int rows)
 		INIT_LIST_HEAD(&table[rows]);
 }
 
+/*
+ *	Statistics are kept per CPU, the packet path only runs in
+ *	softirq context so no locking is needed.
+ */
+static inline void
+ip_vs_count_in(struct ip_vs_stats *stats, unsigned int len)
+{
+	struct ip_vs_cpu_stats *s =
+		per_cpu_ptr(stats->cpustats, smp_processor_id());
+
+	write_seqcount_begin(&s->seq);
+	s->inpkts++;
+	s->inbytes += len;
+	write_seqcount_end(&s->seq);
+}
+
+static inline void
+ip_vs_count_out(struct ip_vs_stats *stats, unsigned int len)
+{
+	struct ip_vs_cpu_stats *s =
+		per_cpu_ptr(stats->cpustats, smp_processor_id());
+
+	write_seqcount_begin(&s->seq);
+	s->outpkts++;
+	s->outbytes += len;
+	write_seqcount_end(&s->seq);
+}
+
 static inline void
 ip_vs_in_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 {
 	struct ip_vs_dest *dest = cp->dest;
 	if (dest && (dest->flags & IP_VS_DEST_F_AVAILABLE)) {
-		spin_lock(&dest->stats.lock);
-		dest->stats.inpkts++;
-		dest->stats.inbytes += skb->len;
-		spin_unlock(&dest->stats.lock);
-
-		spin_lock(&dest->svc->stats.lock);
-		dest->svc->stats.inpkts++;
-		dest->svc->stats.inbytes += skb->len;
-		spin_unlock(&dest->svc->stats.lock);
-
-		spin_lock(&ip_vs_stats.lock);
-		ip_vs_stats.inpkts++;
-		ip_vs_stats.inbytes += skb->len;
-		spin_unlock(&ip_vs_stats.lock);
+		ip_vs_count_in(&dest->stats, skb->len);
+		ip_vs_count_in(&dest->svc->stats, skb->len);
+		ip_vs_count_in(&ip_vs_stats, skb->len);
 	}
 }
 
@@ -116,20 +133,9 @@ ip_vs_out_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 {
 	struct ip_vs_dest *dest = cp->dest;
 	if (dest && (dest->flags & IP_VS_DEST_F_AVAILABLE)) {
-		spin_lock(&dest->stats.lock);
-		dest->stats.outpkts++;
-		dest->stats.outbytes += skb->len;
-		spin_unlock(&dest->stats.lock);
-
-		spin_lock(&dest->svc->stats.lock);
-		dest->svc->stats.outpkts++;
-		dest->svc->stats.outbytes += skb->len;
-		spin_unlock(&dest->svc->stats.lock);
-
-		spin_lock(&ip_vs_stats.lock);
-		ip_vs_stats.outpkts++;
-		ip_vs_stats.outbytes += skb->len;
-		spin_unlock(&ip_vs_stats.lock);
+		ip_vs_count_out(&dest->stats, skb->len);
+		ip_vs_count_out(&dest->svc->stats, skb->len);
+		ip_vs_count_out(&ip_vs_stats, skb->len);
 	}
 }
 
@@ -137,17 +143,11 @@ ip_vs_out_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 static inline void
 ip_vs_conn_stats(struct ip_vs_conn *cp, struct ip_vs_service *svc)
 {
-	spin_lock(&cp->dest->stats.lock);
-	cp->dest->stats.conns++;
-	spin_unlock(&cp->dest->stats.lock);
-
-	spin_lock(&svc->stats.lock);
-	svc->stats.conns++;
-	spin_unlock(&svc->stats.lock);
+	int cpu = smp_processor_id();
 
-	spin_lock(&ip_vs_stats.lock);
-	ip_vs_stats.conns++;
-	spin_unlock(&ip_vs_stats.lock);
+	per_cpu_ptr(cp->dest->stats.cpustats, cpu)->conns++;
+	per_cpu_ptr(svc->stats.cpustats, cpu)->conns++;
+	per_cpu_ptr(ip_vs_stats.cpustats, cpu)->conns++;
 }
 
 
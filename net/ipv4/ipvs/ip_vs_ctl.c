@@ -464,8 +464,10 @@ __ip_vs_unbind_svc(struct ip_vs_dest *dest)
 	struct ip_vs_service *svc = dest->svc;
 
 	dest->svc = NULL;
-	if (atomic_dec_and_test(&svc->refcnt))
+	if (atomic_dec_and_test(&svc->refcnt)) {
+		ip_vs_free_stats(&svc->stats);
 		kfree(svc);
+	}
 }
 
 
@@ -618,6 +620,7 @@ ip_vs_trash_get_dest(struct ip_vs_service *svc, __u32 daddr, __u16 dport)
 			list_del(&dest->n_list);
 			ip_vs_dst_reset(dest);
 			__ip_vs_unbind_svc(dest);
+			ip_vs_free_stats(&dest->stats);
 			kfree(dest);
 		}
 	}
@@ -643,6 +646,7 @@ static void ip_vs_trash_cleanup(void)
 		list_del(&dest->n_list);
 		ip_vs_dst_reset(dest);
 		__ip_vs_unbind_svc(dest);
+		ip_vs_free_stats(&dest->stats);
 		kfree(dest);
 	}
 }
@@ -652,6 +656,13 @@ static void
 ip_vs_zero_stats(struct ip_vs_stats *stats)
 {
 	spin_lock_bh(&stats->lock);
+	/* the per-CPU counters keep running, remember where we are */
+	ip_vs_read_stats(stats);
+	stats->zero.conns += stats->conns;
+	stats->zero.inpkts += stats->inpkts;
+	stats->zero.outpkts += stats->outpkts;
+	stats->zero.inbytes += stats->inbytes;
+	stats->zero.outbytes += stats->outbytes;
 	memset(stats, 0, (char *)&stats->lock - (char *)stats);
 	spin_unlock_bh(&stats->lock);
 	ip_vs_zero_estimator(stats);
@@ -746,9 +757,13 @@ ip_vs_new_dest(struct ip_vs_service *svc, struct ip_vs_dest_user *udest,
 	atomic_set(&dest->persistconns, 0);
 	atomic_set(&dest->refcnt, 0);
 
+	if (ip_vs_new_stats(&dest->stats)) {
+		kfree(dest);
+		return -ENOMEM;
+	}
+
 	INIT_LIST_HEAD(&dest->d_list);
 	spin_lock_init(&dest->dst_lock);
-	spin_lock_init(&dest->stats.lock);
 	__ip_vs_update_dest(svc, dest, udest);
 	ip_vs_new_estimator(&dest->stats);
 
@@ -942,6 +957,7 @@ static void __ip_vs_del_dest(struct ip_vs_dest *dest)
 		   and only one user context can update virtual service at a
 		   time, so the operation here is OK */
 		atomic_dec(&dest->svc->refcnt);
+		ip_vs_free_stats(&dest->stats);
 		kfree(dest);
 	} else {
 		IP_VS_DBG(3, "Moving dest %u.%u.%u.%u:%u into trash, refcnt=%d\n",
@@ -1064,7 +1080,9 @@ ip_vs_add_service(struct ip_vs_service_user *u, struct ip_vs_service **svc_p)
 
 	INIT_LIST_HEAD(&svc->destinations);
 	rwlock_init(&svc->sched_lock);
-	spin_lock_init(&svc->stats.lock);
+	ret = ip_vs_new_stats(&svc->stats);
+	if (ret)
+		goto out_err;
 
 	/* Bind the scheduler */
 	ret = ip_vs_bind_scheduler(svc, sched);
@@ -1098,6 +1116,7 @@ ip_vs_add_service(struct ip_vs_service_user *u, struct ip_vs_service **svc_p)
 			ip_vs_app_inc_put(svc->inc);
 			local_bh_enable();
 		}
+		ip_vs_free_stats(&svc->stats);
 		kfree(svc);
 	}
 	ip_vs_scheduler_put(sched);
@@ -1228,8 +1247,10 @@ static void __ip_vs_del_service(struct ip_vs_service *svc)
 	/*
 	 *    Free the service if nobody refers to it
 	 */
-	if (atomic_read(&svc->refcnt) == 0)
+	if (atomic_read(&svc->refcnt) == 0) {
+		ip_vs_free_stats(&svc->stats);
 		kfree(svc);
+	}
 
 	/* decrease the module use count */
 	ip_vs_use_count_dec();
@@ -1739,7 +1760,7 @@ static int ip_vs_info_seq_show(struct seq_file *seq, void *v)
 	if (v == SEQ_START_TOKEN) {
 		seq_printf(seq,
 			"IP Virtual Server version %d.%d.%d (size=%d)\n",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		seq_puts(seq,
 			 "Prot LocalAddress:Port Scheduler Flags\n");
 		seq_puts(seq,
@@ -1832,6 +1853,7 @@ static int ip_vs_stats_show(struct seq_file *seq, void *v)
 		   "   Conns  Packets  Packets            Bytes            Bytes\n");
 
 	spin_lock_bh(&ip_vs_stats.lock);
+	ip_vs_read_stats(&ip_vs_stats);
 	seq_printf(seq, "%8X %8X %8X %16LX %16LX\n\n", ip_vs_stats.conns,
 		   ip_vs_stats.inpkts, ip_vs_stats.outpkts,
 		   (unsigned long long) ip_vs_stats.inbytes,
@@ -2048,6 +2070,7 @@ static void
 ip_vs_copy_stats(struct ip_vs_stats_user *dst, struct ip_vs_stats *src)
 {
 	spin_lock_bh(&src->lock);
+	ip_vs_read_stats(src);
 	memcpy(dst, src, (char*)&src->lock - (char*)src);
 	spin_unlock_bh(&src->lock);
 }
@@ -2212,7 +2235,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 		char buf[64];
 
 		sprintf(buf, "IP Virtual Server version %d.%d.%d (size=%d)",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		if (copy_to_user(user, buf, strlen(buf)+1) != 0) {
 			ret = -EFAULT;
 			goto out;
@@ -2225,7 +2248,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 	{
 		struct ip_vs_getinfo info;
 		info.version = IP_VS_VERSION_CODE;
-		info.size = IP_VS_CONN_TAB_SIZE;
+		info.size = ip_vs_conn_tab_size;
 		info.num_services = ip_vs_num_services;
 		if (copy_to_user(user, &info, sizeof(info)) != 0)
 			ret = -EFAULT;
@@ -2345,9 +2368,15 @@ int ip_vs_control_init(void)
 
 	EnterFunction(2);
 
+	memset(&ip_vs_stats, 0, sizeof(ip_vs_stats));
+	ret = ip_vs_new_stats(&ip_vs_stats);
+	if (ret)
+		return ret;
+
 	ret = nf_register_sockopt(&ip_vs_sockopts);
 	if (ret) {
 		IP_VS_ERR("cannot register sockopt.\n");
+		ip_vs_free_stats(&ip_vs_stats);
 		return ret;
 	}
 
@@ -2365,8 +2394,6 @@ int ip_vs_control_init(void)
 		INIT_LIST_HEAD(&ip_vs_rtable[idx]);
 	}
 
-	memset(&ip_vs_stats, 0, sizeof(ip_vs_stats));
-	spin_lock_init(&ip_vs_stats.lock);
 	ip_vs_new_estimator(&ip_vs_stats);
 
 	/* Hook the defense timer */
@@ -2390,5 +2417,6 @@ void ip_vs_control_cleanup(void)
 	proc_net_remove("ip_vs_stats");
 	proc_net_remove("ip_vs");
 	nf_unregister_sockopt(&ip_vs_sockopts);
+	ip_vs_free_stats(&ip_vs_stats);
 	LeaveFunction(2);
 }
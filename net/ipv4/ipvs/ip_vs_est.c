@@ -15,6 +15,7 @@
  */
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/percpu.h>
 
 #include <net/ip_vs.h>
 
@@ -38,10 +39,64 @@
   * The stored value for average bps is scaled by 2^5, so that maximal
     rate is ~2.15Gbits/s, average pps and cps are scaled by 2^10.
 
+  * The packet path counts into per-CPU counters; the timer folds
+    them into the shared ones before measuring.
+
   * A lot code is taken from net/sched/estimator.c
  */
 
 
+int ip_vs_new_stats(struct ip_vs_stats *stats)
+{
+	stats->cpustats = alloc_percpu(struct ip_vs_cpu_stats);
+	if (stats->cpustats == NULL)
+		return -ENOMEM;
+	memset(&stats->zero, 0, sizeof(stats->zero));
+	spin_lock_init(&stats->lock);
+	return 0;
+}
+
+void ip_vs_free_stats(struct ip_vs_stats *stats)
+{
+	if (stats->cpustats)
+		free_percpu(stats->cpustats);
+	stats->cpustats = NULL;
+}
+
+/*
+ * Sum the per-CPU counters into the shared ones, relative to the
+ * last zeroing.  Caller holds stats->lock.
+ */
+void ip_vs_read_stats(struct ip_vs_stats *stats)
+{
+	struct ip_vs_cpu_stats *s;
+	u32 conns = 0, inpkts = 0, outpkts = 0;
+	u64 inbytes = 0, outbytes = 0, in, out;
+	unsigned int seq;
+	int i;
+
+	for_each_cpu(i) {
+		s = per_cpu_ptr(stats->cpustats, i);
+		do {
+			seq = read_seqcount_begin(&s->seq);
+			in = s->inbytes;
+			out = s->outbytes;
+		} while (read_seqcount_retry(&s->seq, seq));
+		conns += s->conns;
+		inpkts += s->inpkts;
+		outpkts += s->outpkts;
+		inbytes += in;
+		outbytes += out;
+	}
+
+	stats->conns = conns - stats->zero.conns;
+	stats->inpkts = inpkts - stats->zero.inpkts;
+	stats->outpkts = outpkts - stats->zero.outpkts;
+	stats->inbytes = inbytes - stats->zero.inbytes;
+	stats->outbytes = outbytes - stats->zero.outbytes;
+}
+
+
 struct ip_vs_estimator
 {
 	struct ip_vs_estimator	*next;
@@ -79,6 +134,7 @@ static void estimation_timer(unsigned long arg)
 		s = e->stats;
 
 		spin_lock(&s->lock);
+		ip_vs_read_stats(s);
 		n_conns = s->conns;
 		n_inpkts = s->inpkts;
 		n_outpkts = s->outpkts;
@@ -37,9 +37,12 @@
 #include <linux/err.h>
 #include <linux/percpu.h>
 #include <linux/moduleparam.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 
-/* This rwlock protects the main hash table, protocol/helper/expected
-   registrations, conntrack timers*/
+/* This rwlock protects protocol/helper/expected registrations and the
+   unconfirmed list.  The hash table has its own striped locks, see
+   ip_conntrack_locks below. */
 #define ASSERT_READ_LOCK(x) MUST_BE_READ_LOCKED(&ip_conntrack_lock)
 #define ASSERT_WRITE_LOCK(x) MUST_BE_WRITE_LOCKED(&ip_conntrack_lock)
 
@@ -68,14 +71,29 @@ struct ip_conntrack_protocol *ip_ct_protos[MAX_IP_CT_PROTO];
 static LIST_HEAD(helpers);
 unsigned int ip_conntrack_htable_size = 0;
 int ip_conntrack_max;
-struct list_head *ip_conntrack_hash;
+struct hlist_head *ip_conntrack_hash;
 static kmem_cache_t *ip_conntrack_cachep;
 static kmem_cache_t *ip_conntrack_expect_cachep;
 struct ip_conntrack ip_conntrack_untracked;
 unsigned int ip_ct_log_invalid;
-static LIST_HEAD(unconfirmed);
+static HLIST_HEAD(unconfirmed);
 static int ip_conntrack_vmalloc;
 
+/* Hash chains are looked up under RCU only.  Insertion and removal
+ * take the lock(s) of the chains involved: chain n is protected by
+ * ip_conntrack_locks[n % IP_CT_LOCKS].  A resize takes every lock and
+ * bumps ip_conntrack_resize_seq, so a lockless reader that raced with
+ * it retries, and a writer that hashed against the old table relocks.
+ * Resizes are serialized, and kept away from full-table walks, by
+ * ip_conntrack_resize_sem.
+ *
+ * The number of locks is bounded because a resize holds all of them. */
+#define IP_CT_LOCKS	64
+
+static spinlock_t ip_conntrack_locks[IP_CT_LOCKS];
+static seqcount_t ip_conntrack_resize_seq;
+static DECLARE_MUTEX(ip_conntrack_resize_sem);
+
 DEFINE_PER_CPU(struct ip_conntrack_stat, ip_conntrack_stat);
 
 void 
@@ -89,7 +107,7 @@ static int ip_conntrack_hash_rnd_initted;
 static unsigned int ip_conntrack_hash_rnd;
 
 static u_int32_t
-hash_conntrack(const struct ip_conntrack_tuple *tuple)
+__hash_conntrack(const struct ip_conntrack_tuple *tuple, unsigned int size)
 {
 #if 0
 	dump_tuple(tuple);
@@ -97,7 +115,88 @@ hash_conntrack(const struct ip_conntrack_tuple *tuple)
 	return (jhash_3words(tuple->src.ip,
 	                     (tuple->dst.ip ^ tuple->dst.protonum),
 	                     (tuple->src.u.all | (tuple->dst.u.all << 16)),
-	                     ip_conntrack_hash_rnd) % ip_conntrack_htable_size);
+	                     ip_conntrack_hash_rnd) % size);
+}
+
+static inline u_int32_t
+hash_conntrack(const struct ip_conntrack_tuple *tuple)
+{
+	return __hash_conntrack(tuple, ip_conntrack_htable_size);
+}
+
+/* Snapshot of the table for a lockless reader, who must hold
+ * rcu_read_lock() and recheck the returned sequence with
+ * read_seqcount_retry() if it found nothing. */
+static inline unsigned int
+ip_ct_get_table(struct hlist_head **hash, unsigned int *size)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&ip_conntrack_resize_seq);
+		*hash = ip_conntrack_hash;
+		*size = ip_conntrack_htable_size;
+	} while (read_seqcount_retry(&ip_conntrack_resize_seq, seq));
+
+	return seq;
+}
+
+/* Used by /proc/net/ip_conntrack, under rcu_read_lock(). */
+struct hlist_head *ip_conntrack_get_bucket(unsigned int bucket)
+{
+	struct hlist_head *hash;
+	unsigned int size;
+
+	ip_ct_get_table(&hash, &size);
+	return bucket < size ? &hash[bucket] : NULL;
+}
+
+/* Lock the chains of both directions of @ct, in index order, and
+ * return their buckets in the current table.  Leaves BHs disabled. */
+static void ip_ct_lock_chains(const struct ip_conntrack *ct,
+			      unsigned int *hash, unsigned int *repl_hash)
+{
+	unsigned int seq, l1, l2;
+
+	local_bh_disable();
+	for (;;) {
+		seq = read_seqcount_begin(&ip_conntrack_resize_seq);
+		*hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+		*repl_hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+		l1 = *hash % IP_CT_LOCKS;
+		l2 = *repl_hash % IP_CT_LOCKS;
+		if (l1 > l2) {
+			unsigned int tmp = l1;
+			l1 = l2;
+			l2 = tmp;
+		}
+		spin_lock(&ip_conntrack_locks[l1]);
+		if (l2 != l1)
+			spin_lock(&ip_conntrack_locks[l2]);
+		/* Resizing holds all locks: no retry once we have ours */
+		if (!read_seqcount_retry(&ip_conntrack_resize_seq, seq))
+			return;
+		if (l2 != l1)
+			spin_unlock(&ip_conntrack_locks[l2]);
+		spin_unlock(&ip_conntrack_locks[l1]);
+	}
+}
+
+static void ip_ct_unlock_chains(unsigned int hash, unsigned int repl_hash)
+{
+	unsigned int l1 = hash % IP_CT_LOCKS, l2 = repl_hash % IP_CT_LOCKS;
+
+	if (l2 != l1)
+		spin_unlock(&ip_conntrack_locks[l2]);
+	spin_unlock(&ip_conntrack_locks[l1]);
+	local_bh_enable();
+}
+
+/* Per-conntrack lock (timer refresh, counters), stable across resizes */
+static inline spinlock_t *ip_ct_lock(const struct ip_conntrack *ct)
+{
+	return &ip_conntrack_locks[((unsigned long)ct / L1_CACHE_BYTES)
+				   % IP_CT_LOCKS];
 }
 
 int
@@ -203,21 +302,14 @@ static void remove_expectations(struct ip_conntrack *ct)
 	}
 }
 
+/* Caller holds the chain locks, see ip_ct_lock_chains() */
 static void
 clean_from_lists(struct ip_conntrack *ct)
 {
-	unsigned int ho, hr;
-	
 	DEBUGP("clean_from_lists(%p)\n", ct);
-	MUST_BE_WRITE_LOCKED(&ip_conntrack_lock);
-
-	ho = hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	hr = hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-	LIST_DELETE(&ip_conntrack_hash[ho], &ct->tuplehash[IP_CT_DIR_ORIGINAL]);
-	LIST_DELETE(&ip_conntrack_hash[hr], &ct->tuplehash[IP_CT_DIR_REPLY]);
 
-	/* Destroy all pending expectations */
-	remove_expectations(ct);
+	hlist_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode);
+	hlist_del_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnode);
 }
 
 static void
@@ -249,8 +341,8 @@ destroy_conntrack(struct nf_conntrack *nfct)
 
 	/* We overload first tuple to link into unconfirmed list. */
 	if (!is_confirmed(ct)) {
-		BUG_ON(list_empty(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list));
-		list_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list);
+		BUG_ON(hlist_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode));
+		hlist_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode);
 	}
 
 	CONNTRACK_STAT_INC(delete);
@@ -264,17 +356,34 @@ destroy_conntrack(struct nf_conntrack *nfct)
 	atomic_dec(&ip_conntrack_count);
 }
 
+static void ip_conntrack_put_rcu(struct rcu_head *head)
+{
+	ip_conntrack_put(container_of(head, struct ip_conntrack, rcu));
+}
+
 static void death_by_timeout(unsigned long ul_conntrack)
 {
 	struct ip_conntrack *ct = (void *)ul_conntrack;
+	unsigned int hash, repl_hash;
 
-	WRITE_LOCK(&ip_conntrack_lock);
+	ip_ct_lock_chains(ct, &hash, &repl_hash);
 	/* Inside lock so preempt is disabled on module removal path.
 	 * Otherwise we can get spurious warnings. */
 	CONNTRACK_STAT_INC(delete_list);
 	clean_from_lists(ct);
-	WRITE_UNLOCK(&ip_conntrack_lock);
-	ip_conntrack_put(ct);
+	ip_ct_unlock_chains(hash, repl_hash);
+
+	/* Destroy all pending expectations */
+	if (ct->expecting) {
+		WRITE_LOCK(&ip_conntrack_lock);
+		remove_expectations(ct);
+		WRITE_UNLOCK(&ip_conntrack_lock);
+	}
+
+	/* Lockless lookups may have found us just before we were unhashed
+	 * and are about to take a reference: the table's reference has to
+	 * outlive them. */
+	call_rcu(&ct->rcu, ip_conntrack_put_rcu);
 }
 
 static inline int
@@ -282,20 +391,20 @@ conntrack_tuple_cmp(const struct ip_conntrack_tuple_hash *i,
 		    const struct ip_conntrack_tuple *tuple,
 		    const struct ip_conntrack *ignored_conntrack)
 {
-	MUST_BE_READ_LOCKED(&ip_conntrack_lock);
 	return tuplehash_to_ctrack(i) != ignored_conntrack
 		&& ip_ct_tuple_equal(tuple, &i->tuple);
 }
 
+/* Caller holds rcu_read_lock() or the chain lock. */
 static struct ip_conntrack_tuple_hash *
-__ip_conntrack_find(const struct ip_conntrack_tuple *tuple,
-		    const struct ip_conntrack *ignored_conntrack)
+__ip_conntrack_find_chain(struct hlist_head *chain,
+			  const struct ip_conntrack_tuple *tuple,
+			  const struct ip_conntrack *ignored_conntrack)
 {
 	struct ip_conntrack_tuple_hash *h;
-	unsigned int hash = hash_conntrack(tuple);
+	struct hlist_node *n;
 
-	MUST_BE_READ_LOCKED(&ip_conntrack_lock);
-	list_for_each_entry(h, &ip_conntrack_hash[hash], list) {
+	hlist_for_each_entry_rcu(h, n, chain, hnode) {
 		if (conntrack_tuple_cmp(h, tuple, ignored_conntrack)) {
 			CONNTRACK_STAT_INC(found);
 			return h;
@@ -306,6 +415,27 @@ __ip_conntrack_find(const struct ip_conntrack_tuple *tuple,
 	return NULL;
 }
 
+/* Caller holds rcu_read_lock(). */
+static struct ip_conntrack_tuple_hash *
+__ip_conntrack_find(const struct ip_conntrack_tuple *tuple,
+		    const struct ip_conntrack *ignored_conntrack)
+{
+	struct ip_conntrack_tuple_hash *h;
+	struct hlist_head *hash;
+	unsigned int size, seq;
+
+	do {
+		seq = ip_ct_get_table(&hash, &size);
+		h = __ip_conntrack_find_chain(&hash[__hash_conntrack(tuple, size)],
+					      tuple, ignored_conntrack);
+		if (h)
+			return h;
+		/* Entries move between chains while the table is resized */
+	} while (read_seqcount_retry(&ip_conntrack_resize_seq, seq));
+
+	return NULL;
+}
+
 /* Find a connection corresponding to a tuple. */
 struct ip_conntrack_tuple_hash *
 ip_conntrack_find_get(const struct ip_conntrack_tuple *tuple,
@@ -313,11 +443,13 @@ ip_conntrack_find_get(const struct ip_conntrack_tuple *tuple,
 {
 	struct ip_conntrack_tuple_hash *h;
 
-	READ_LOCK(&ip_conntrack_lock);
+	rcu_read_lock();
 	h = __ip_conntrack_find(tuple, ignored_conntrack);
+	/* Safe without a lock: the table holds a reference until a grace
+	 * period after the entry was unhashed, see death_by_timeout() */
 	if (h)
 		atomic_inc(&tuplehash_to_ctrack(h)->ct_general.use);
-	READ_UNLOCK(&ip_conntrack_lock);
+	rcu_read_unlock();
 
 	return h;
 }
@@ -339,9 +471,6 @@ __ip_conntrack_confirm(struct sk_buff **pskb)
 	if (CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL)
 		return NF_ACCEPT;
 
-	hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-
 	/* We're not in hash table, and we refuse to set up related
 	   connections for unconfirmed conns.  But packet copies and
 	   REJECT will give spurious warnings here. */
@@ -352,26 +481,22 @@ __ip_conntrack_confirm(struct sk_buff **pskb)
 	IP_NF_ASSERT(!is_confirmed(ct));
 	DEBUGP("Confirming conntrack %p\n", ct);
 
-	WRITE_LOCK(&ip_conntrack_lock);
+	ip_ct_lock_chains(ct, &hash, &repl_hash);
 
 	/* See if there's one in the list already, including reverse:
            NAT could have grabbed it without realizing, since we're
            not in the hash.  If there is, we lost race. */
-	if (!LIST_FIND(&ip_conntrack_hash[hash],
-		       conntrack_tuple_cmp,
-		       struct ip_conntrack_tuple_hash *,
-		       &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple, NULL)
-	    && !LIST_FIND(&ip_conntrack_hash[repl_hash],
-			  conntrack_tuple_cmp,
-			  struct ip_conntrack_tuple_hash *,
-			  &ct->tuplehash[IP_CT_DIR_REPLY].tuple, NULL)) {
+	if (!__ip_conntrack_find_chain(&ip_conntrack_hash[hash],
+				       &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
+				       NULL)
+	    && !__ip_conntrack_find_chain(&ip_conntrack_hash[repl_hash],
+					  &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+					  NULL)) {
 		/* Remove from unconfirmed list */
-		list_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list);
+		WRITE_LOCK(&ip_conntrack_lock);
+		hlist_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode);
+		WRITE_UNLOCK(&ip_conntrack_lock);
 
-		list_prepend(&ip_conntrack_hash[hash],
-			     &ct->tuplehash[IP_CT_DIR_ORIGINAL]);
-		list_prepend(&ip_conntrack_hash[repl_hash],
-			     &ct->tuplehash[IP_CT_DIR_REPLY]);
 		/* Timer relative to confirmation time, not original
 		   setting time, otherwise we'd get timer wrap in
 		   weird delay cases. */
@@ -379,13 +504,18 @@ __ip_conntrack_confirm(struct sk_buff **pskb)
 		add_timer(&ct->timeout);
 		atomic_inc(&ct->ct_general.use);
 		set_bit(IPS_CONFIRMED_BIT, &ct->status);
+
+		hlist_add_head_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode,
+				   &ip_conntrack_hash[hash]);
+		hlist_add_head_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnode,
+				   &ip_conntrack_hash[repl_hash]);
 		CONNTRACK_STAT_INC(insert);
-		WRITE_UNLOCK(&ip_conntrack_lock);
+		ip_ct_unlock_chains(hash, repl_hash);
 		return NF_ACCEPT;
 	}
 
 	CONNTRACK_STAT_INC(insert_failed);
-	WRITE_UNLOCK(&ip_conntrack_lock);
+	ip_ct_unlock_chains(hash, repl_hash);
 
 	return NF_DROP;
 }
@@ -398,9 +528,9 @@ ip_conntrack_tuple_taken(const struct ip_conntrack_tuple *tuple,
 {
 	struct ip_conntrack_tuple_hash *h;
 
-	READ_LOCK(&ip_conntrack_lock);
+	rcu_read_lock();
 	h = __ip_conntrack_find(tuple, ignored_conntrack);
-	READ_UNLOCK(&ip_conntrack_lock);
+	rcu_read_unlock();
 
 	return h != NULL;
 }
@@ -412,20 +542,27 @@ static inline int unreplied(const struct ip_conntrack_tuple_hash *i)
 	return !(test_bit(IPS_ASSURED_BIT, &tuplehash_to_ctrack(i)->status));
 }
 
-static int early_drop(struct list_head *chain)
+static int early_drop(const struct ip_conntrack_tuple *tuple)
 {
-	/* Traverse backwards: gives us oldest, which is roughly LRU */
+	/* Entries are added at the head, so the last unreplied one is
+	   the oldest, which is roughly LRU */
 	struct ip_conntrack_tuple_hash *h;
+	struct hlist_node *n;
+	struct hlist_head *hash;
 	struct ip_conntrack *ct = NULL;
+	unsigned int size;
 	int dropped = 0;
 
-	READ_LOCK(&ip_conntrack_lock);
-	h = LIST_FIND_B(chain, unreplied, struct ip_conntrack_tuple_hash *);
-	if (h) {
-		ct = tuplehash_to_ctrack(h);
-		atomic_inc(&ct->ct_general.use);
+	rcu_read_lock();
+	ip_ct_get_table(&hash, &size);
+	hlist_for_each_entry_rcu(h, n, &hash[__hash_conntrack(tuple, size)],
+				 hnode) {
+		if (unreplied(h))
+			ct = tuplehash_to_ctrack(h);
 	}
-	READ_UNLOCK(&ip_conntrack_lock);
+	if (ct)
+		atomic_inc(&ct->ct_general.use);
+	rcu_read_unlock();
 
 	if (!ct)
 		return dropped;
@@ -461,7 +598,6 @@ init_conntrack(const struct ip_conntrack_tuple *tuple,
 {
 	struct ip_conntrack *conntrack;
 	struct ip_conntrack_tuple repl_tuple;
-	size_t hash;
 	struct ip_conntrack_expect *exp;
 
 	if (!ip_conntrack_hash_rnd_initted) {
@@ -469,12 +605,10 @@ init_conntrack(const struct ip_conntrack_tuple *tuple,
 		ip_conntrack_hash_rnd_initted = 1;
 	}
 
-	hash = hash_conntrack(tuple);
-
 	if (ip_conntrack_max
 	    && atomic_read(&ip_conntrack_count) >= ip_conntrack_max) {
 		/* Try dropping from this hash chain. */
-		if (!early_drop(&ip_conntrack_hash[hash])) {
+		if (!early_drop(tuple)) {
 			if (net_ratelimit())
 				printk(KERN_WARNING
 				       "ip_conntrack: table full, dropping"
@@ -529,7 +663,8 @@ init_conntrack(const struct ip_conntrack_tuple *tuple,
 	}
 
 	/* Overload tuple linked list to put us in unconfirmed list. */
-	list_add(&conntrack->tuplehash[IP_CT_DIR_ORIGINAL].list, &unconfirmed);
+	hlist_add_head(&conntrack->tuplehash[IP_CT_DIR_ORIGINAL].hnode,
+		       &unconfirmed);
 
 	atomic_inc(&ip_conntrack_count);
 	WRITE_UNLOCK(&ip_conntrack_lock);
@@ -872,6 +1007,16 @@ static inline int unhelp(struct ip_conntrack_tuple_hash *i,
 	return 0;
 }
 
+static void unhelp_chain(struct hlist_head *chain,
+			 const struct ip_conntrack_helper *me)
+{
+	struct ip_conntrack_tuple_hash *h;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(h, n, chain, hnode)
+		unhelp(h, me);
+}
+
 void ip_conntrack_helper_unregister(struct ip_conntrack_helper *me)
 {
 	unsigned int i;
@@ -889,12 +1034,19 @@ void ip_conntrack_helper_unregister(struct ip_conntrack_helper *me)
 		}
 	}
 	/* Get rid of expecteds, set helpers to NULL. */
-	LIST_FIND_W(&unconfirmed, unhelp, struct ip_conntrack_tuple_hash*, me);
-	for (i = 0; i < ip_conntrack_htable_size; i++)
-		LIST_FIND_W(&ip_conntrack_hash[i], unhelp,
-			    struct ip_conntrack_tuple_hash *, me);
+	unhelp_chain(&unconfirmed, me);
 	WRITE_UNLOCK(&ip_conntrack_lock);
 
+	/* Unconfirmed conntracks were done first: confirming one moves it
+	   into the hash with its helper already cleared. */
+	down(&ip_conntrack_resize_sem);
+	for (i = 0; i < ip_conntrack_htable_size; i++) {
+		spin_lock_bh(&ip_conntrack_locks[i % IP_CT_LOCKS]);
+		unhelp_chain(&ip_conntrack_hash[i], me);
+		spin_unlock_bh(&ip_conntrack_locks[i % IP_CT_LOCKS]);
+	}
+	up(&ip_conntrack_resize_sem);
+
 	/* Someone could be still looking at the helper in a bh. */
 	synchronize_net();
 }
@@ -925,14 +1077,16 @@ void ip_ct_refresh_acct(struct ip_conntrack *ct,
 		ct->timeout.expires = extra_jiffies;
 		ct_add_counters(ct, ctinfo, skb);
 	} else {
-		WRITE_LOCK(&ip_conntrack_lock);
+		spinlock_t *lock = ip_ct_lock(ct);
+
+		spin_lock_bh(lock);
 		/* Need del_timer for race avoidance (may already be dying). */
 		if (del_timer(&ct->timeout)) {
 			ct->timeout.expires = jiffies + extra_jiffies;
 			add_timer(&ct->timeout);
 		}
 		ct_add_counters(ct, ctinfo, skb);
-		WRITE_UNLOCK(&ip_conntrack_lock);
+		spin_unlock_bh(lock);
 	}
 }
 
@@ -994,31 +1148,43 @@ static void ip_conntrack_attach(struct sk_buff *nskb, struct sk_buff *skb)
 	nf_conntrack_get(nskb->nfct);
 }
 
-static inline int
-do_iter(const struct ip_conntrack_tuple_hash *i,
-	int (*iter)(struct ip_conntrack *i, void *data),
-	void *data)
+static struct ip_conntrack_tuple_hash *
+find_corpse_in_chain(struct hlist_head *chain,
+		     int (*iter)(struct ip_conntrack *i, void *data),
+		     void *data)
 {
-	return iter(tuplehash_to_ctrack(i), data);
+	struct ip_conntrack_tuple_hash *h;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(h, n, chain, hnode) {
+		if (iter(tuplehash_to_ctrack(h), data))
+			return h;
+	}
+	return NULL;
 }
 
-/* Bring out ya dead! */
+/* Bring out ya dead!  Caller holds ip_conntrack_resize_sem. */
 static struct ip_conntrack_tuple_hash *
 get_next_corpse(int (*iter)(struct ip_conntrack *i, void *data),
 		void *data, unsigned int *bucket)
 {
 	struct ip_conntrack_tuple_hash *h = NULL;
 
-	WRITE_LOCK(&ip_conntrack_lock);
 	for (; *bucket < ip_conntrack_htable_size; (*bucket)++) {
-		h = LIST_FIND_W(&ip_conntrack_hash[*bucket], do_iter,
-				struct ip_conntrack_tuple_hash *, iter, data);
+		spinlock_t *lock = &ip_conntrack_locks[*bucket % IP_CT_LOCKS];
+
+		spin_lock_bh(lock);
+		h = find_corpse_in_chain(&ip_conntrack_hash[*bucket],
+					 iter, data);
 		if (h)
-			break;
+			atomic_inc(&tuplehash_to_ctrack(h)->ct_general.use);
+		spin_unlock_bh(lock);
+		if (h)
+			return h;
 	}
-	if (!h)
-		h = LIST_FIND_W(&unconfirmed, do_iter,
-				struct ip_conntrack_tuple_hash *, iter, data);
+
+	WRITE_LOCK(&ip_conntrack_lock);
+	h = find_corpse_in_chain(&unconfirmed, iter, data);
 	if (h)
 		atomic_inc(&tuplehash_to_ctrack(h)->ct_general.use);
 	WRITE_UNLOCK(&ip_conntrack_lock);
@@ -1032,6 +1198,7 @@ ip_ct_iterate_cleanup(int (*iter)(struct ip_conntrack *i, void *), void *data)
 	struct ip_conntrack_tuple_hash *h;
 	unsigned int bucket = 0;
 
+	down(&ip_conntrack_resize_sem);
 	while ((h = get_next_corpse(iter, data, &bucket)) != NULL) {
 		struct ip_conntrack *ct = tuplehash_to_ctrack(h);
 		/* Time to push up daises... */
@@ -1041,6 +1208,7 @@ ip_ct_iterate_cleanup(int (*iter)(struct ip_conntrack *i, void *), void *data)
 
 		ip_conntrack_put(ct);
 	}
+	up(&ip_conntrack_resize_sem);
 }
 
 /* Fast function for those who don't want to parse /proc (and I don't
@@ -1110,14 +1278,85 @@ static int kill_all(struct ip_conntrack *i, void *data)
 	return 1;
 }
 
-static void free_conntrack_hash(void)
+static void free_conntrack_hash(struct hlist_head *hash, int vmalloced,
+			       unsigned int size)
 {
-	if (ip_conntrack_vmalloc)
-		vfree(ip_conntrack_hash);
+	if (vmalloced)
+		vfree(hash);
 	else
-		free_pages((unsigned long)ip_conntrack_hash, 
-			   get_order(sizeof(struct list_head)
-				     * ip_conntrack_htable_size));
+		free_pages((unsigned long)hash, 
+			   get_order(sizeof(struct hlist_head) * size));
+}
+
+static struct hlist_head *alloc_conntrack_hash(unsigned int size,
+					       int *vmalloced)
+{
+	struct hlist_head *hash;
+	unsigned int i;
+
+	*vmalloced = 0; 
+	if (size > ULONG_MAX / sizeof(struct hlist_head))
+		return NULL;
+	hash = (void*)__get_free_pages(GFP_KERNEL, 
+				       get_order(sizeof(struct hlist_head)
+						 * size));
+	if (!hash) { 
+		*vmalloced = 1;
+		printk(KERN_WARNING "ip_conntrack: falling back to vmalloc.\n");
+		hash = vmalloc(sizeof(struct hlist_head) * size);
+	}
+
+	if (hash)
+		for (i = 0; i < size; i++)
+			INIT_HLIST_HEAD(&hash[i]);
+
+	return hash;
+}
+
+/* Move every conntrack to a table of @size buckets.  Lookups keep
+ * running locklessly and retry if they raced with the move. */
+static int ip_conntrack_resize(unsigned int size)
+{
+	struct hlist_head *hash, *old_hash;
+	struct ip_conntrack_tuple_hash *h;
+	unsigned int i, old_size;
+	int vmalloced, old_vmalloced;
+
+	hash = alloc_conntrack_hash(size, &vmalloced);
+	if (!hash)
+		return -ENOMEM;
+
+	down(&ip_conntrack_resize_sem);
+	local_bh_disable();
+	for (i = 0; i < IP_CT_LOCKS; i++)
+		spin_lock(&ip_conntrack_locks[i]);
+	write_seqcount_begin(&ip_conntrack_resize_seq);
+
+	for (i = 0; i < ip_conntrack_htable_size; i++) {
+		while (!hlist_empty(&ip_conntrack_hash[i])) {
+			h = hlist_entry(ip_conntrack_hash[i].first,
+					struct ip_conntrack_tuple_hash, hnode);
+			hlist_del_rcu(&h->hnode);
+			hlist_add_head_rcu(&h->hnode,
+					   &hash[__hash_conntrack(&h->tuple, size)]);
+		}
+	}
+	old_hash = ip_conntrack_hash;
+	old_size = ip_conntrack_htable_size;
+	old_vmalloced = ip_conntrack_vmalloc;
+	ip_conntrack_hash = hash;
+	ip_conntrack_htable_size = size;
+	ip_conntrack_vmalloc = vmalloced;
+
+	write_seqcount_end(&ip_conntrack_resize_seq);
+	for (i = IP_CT_LOCKS; i-- > 0; )
+		spin_unlock(&ip_conntrack_locks[i]);
+	local_bh_enable();
+	up(&ip_conntrack_resize_sem);
+
+	synchronize_kernel();
+	free_conntrack_hash(old_hash, old_vmalloced, old_size);
+	return 0;
 }
 
 /* Mishearing the voices in his head, our hero wonders how he's
@@ -1136,15 +1375,40 @@ void ip_conntrack_cleanup(void)
 		schedule();
 		goto i_see_dead_people;
 	}
+	/* The last ip_conntrack_put_rcu() may still be returning. */
+	synchronize_kernel();
 
 	kmem_cache_destroy(ip_conntrack_cachep);
 	kmem_cache_destroy(ip_conntrack_expect_cachep);
-	free_conntrack_hash();
+	free_conntrack_hash(ip_conntrack_hash, ip_conntrack_vmalloc,
+			    ip_conntrack_htable_size);
 	nf_unregister_sockopt(&so_getorigdst);
 }
 
 static int hashsize;
-module_param(hashsize, int, 0400);
+
+/* Writable at runtime through /sys/module/ip_conntrack/parameters */
+static int set_hashsize(const char *val, struct kernel_param *kp)
+{
+	int size;
+
+	size = simple_strtol(val, NULL, 0);
+	if (size <= 0 || size > ULONG_MAX / sizeof(struct hlist_head))
+		return -EINVAL;
+
+	/* Before ip_conntrack_init(): just the initial size */
+	if (!ip_conntrack_hash) {
+		hashsize = size;
+		return 0;
+	}
+
+	printk(KERN_INFO "ip_conntrack: resizing hash table to %d buckets\n",
+	       size);
+	return ip_conntrack_resize(size);
+}
+
+module_param_call(hashsize, set_hashsize, param_get_uint,
+		  &ip_conntrack_htable_size, 0600);
 
 int __init ip_conntrack_init(void)
 {
@@ -1158,7 +1422,7 @@ int __init ip_conntrack_init(void)
  	} else {
 		ip_conntrack_htable_size
 			= (((num_physpages << PAGE_SHIFT) / 16384)
-			   / sizeof(struct list_head));
+			   / sizeof(struct hlist_head));
 		if (num_physpages > (1024 * 1024 * 1024 / PAGE_SIZE))
 			ip_conntrack_htable_size = 8192;
 		if (ip_conntrack_htable_size < 16)
@@ -1177,20 +1441,12 @@ int __init ip_conntrack_init(void)
 		return ret;
 	}
 
-	/* AK: the hash table is twice as big than needed because it
-	   uses list_head.  it would be much nicer to caches to use a
-	   single pointer list head here. */
-	ip_conntrack_vmalloc = 0; 
-	ip_conntrack_hash 
-		=(void*)__get_free_pages(GFP_KERNEL, 
-					 get_order(sizeof(struct list_head)
-						   *ip_conntrack_htable_size));
-	if (!ip_conntrack_hash) { 
-		ip_conntrack_vmalloc = 1;
-		printk(KERN_WARNING "ip_conntrack: falling back to vmalloc.\n");
-		ip_conntrack_hash = vmalloc(sizeof(struct list_head)
-					    * ip_conntrack_htable_size);
-	}
+	for (i = 0; i < IP_CT_LOCKS; i++)
+		spin_lock_init(&ip_conntrack_locks[i]);
+	seqcount_init(&ip_conntrack_resize_seq);
+
+	ip_conntrack_hash = alloc_conntrack_hash(ip_conntrack_htable_size,
+						 &ip_conntrack_vmalloc);
 	if (!ip_conntrack_hash) {
 		printk(KERN_ERR "Unable to create ip_conntrack_hash\n");
 		goto err_unreg_sockopt;
@@ -1222,9 +1478,6 @@ int __init ip_conntrack_init(void)
 	ip_ct_protos[IPPROTO_ICMP] = &ip_conntrack_protocol_icmp;
 	WRITE_UNLOCK(&ip_conntrack_lock);
 
-	for (i = 0; i < ip_conntrack_htable_size; i++)
-		INIT_LIST_HEAD(&ip_conntrack_hash[i]);
-
 	/* For use by ipt_REJECT */
 	ip_ct_attach = ip_conntrack_attach;
 
@@ -1239,7 +1492,9 @@ int __init ip_conntrack_init(void)
 err_free_conntrack_slab:
 	kmem_cache_destroy(ip_conntrack_cachep);
 err_free_hash:
-	free_conntrack_hash();
+	free_conntrack_hash(ip_conntrack_hash, ip_conntrack_vmalloc,
+			    ip_conntrack_htable_size);
+	ip_conntrack_hash = NULL;
 err_unreg_sockopt:
 	nf_unregister_sockopt(&so_getorigdst);
 
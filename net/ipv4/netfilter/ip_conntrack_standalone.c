@@ -77,11 +77,13 @@ seq_print_counters(struct seq_file *s,
 #define seq_print_counters(x, y)	0
 #endif
 
+/* The table may be resized under us: iterate over bucket numbers and
+   look the chain up afresh in ct_seq_show(). */
 static void *ct_seq_start(struct seq_file *s, loff_t *pos)
 {
 	if (*pos >= ip_conntrack_htable_size)
 		return NULL;
-	return &ip_conntrack_hash[*pos];
+	return pos;
 }
   
 static void ct_seq_stop(struct seq_file *s, void *v)
@@ -93,7 +95,7 @@ static void *ct_seq_next(struct seq_file *s, void *v, loff_t *pos)
 	(*pos)++;
 	if (*pos >= ip_conntrack_htable_size)
 		return NULL;
-	return &ip_conntrack_hash[*pos];
+	return pos;
 }
   
 /* return 0 on success, 1 in case of error */
@@ -103,8 +105,6 @@ static int ct_seq_real_show(const struct ip_conntrack_tuple_hash *hash,
 	const struct ip_conntrack *conntrack = tuplehash_to_ctrack(hash);
 	struct ip_conntrack_protocol *proto;
 
-	MUST_BE_READ_LOCKED(&ip_conntrack_lock);
-
 	IP_NF_ASSERT(conntrack);
 
 	/* we only want to print DIR_ORIGINAL */
@@ -160,15 +160,23 @@ static int ct_seq_real_show(const struct ip_conntrack_tuple_hash *hash,
 
 static int ct_seq_show(struct seq_file *s, void *v)
 {
-	struct list_head *list = v;
+	struct ip_conntrack_tuple_hash *h;
+	struct hlist_head *chain;
+	struct hlist_node *n;
 	int ret = 0;
 
 	/* FIXME: Simply truncates if hash chain too long. */
-	READ_LOCK(&ip_conntrack_lock);
-	if (LIST_FIND(list, ct_seq_real_show,
-		      struct ip_conntrack_tuple_hash *, s))
-		ret = -ENOSPC;
-	READ_UNLOCK(&ip_conntrack_lock);
+	rcu_read_lock();
+	chain = ip_conntrack_get_bucket(*(loff_t *)v);
+	if (chain) {
+		hlist_for_each_entry_rcu(h, n, chain, hnode) {
+			if (ct_seq_real_show(h, s)) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+	}
+	rcu_read_unlock();
 	return ret;
 }
 	
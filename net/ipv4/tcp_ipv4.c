@@ -185,6 +185,8 @@ static inline int tcp_bind_conflict(struct sock *sk, struct tcp_bind_bucket *tb)
 	struct sock *sk2;
 	struct hlist_node *node;
 	int reuse = sk->sk_reuse;
+	int reuseport = sk->sk_reuseport;
+	int uid = sock_i_uid(sk);
 
 	sk_for_each_bound(sk2, node, &tb->owners) {
 		if (sk != sk2 &&
@@ -192,8 +194,11 @@ static inline int tcp_bind_conflict(struct sock *sk, struct tcp_bind_bucket *tb)
 		    (!sk->sk_bound_dev_if ||
 		     !sk2->sk_bound_dev_if ||
 		     sk->sk_bound_dev_if == sk2->sk_bound_dev_if)) {
-			if (!reuse || !sk2->sk_reuse ||
-			    sk2->sk_state == TCP_LISTEN) {
+			if ((!reuse || !sk2->sk_reuse ||
+			     sk2->sk_state == TCP_LISTEN) &&
+			    (!reuseport || !sk2->sk_reuseport ||
+			     (sk2->sk_state != TCP_TIME_WAIT &&
+			      uid != sock_i_uid(sk2)))) {
 				const u32 sk2_rcv_saddr = tcp_v4_rcv_saddr(sk2);
 				if (!sk2_rcv_saddr || !sk_rcv_saddr ||
 				    sk2_rcv_saddr == sk_rcv_saddr)
@@ -410,12 +415,15 @@ void tcp_unhash(struct sock *sk)
  * connection.  So always assume those are both wildcarded
  * during the search since they can never be otherwise.
  */
-static struct sock *__tcp_v4_lookup_listener(struct hlist_head *head, u32 daddr,
+static struct sock *__tcp_v4_lookup_listener(struct hlist_head *head,
+					     u32 saddr, u16 sport, u32 daddr,
 					     unsigned short hnum, int dif)
 {
 	struct sock *result = NULL, *sk;
 	struct hlist_node *node;
 	int score, hiscore;
+	unsigned int matches = 0;
+	u32 phash = 0;
 
 	hiscore=-1;
 	sk_for_each(sk, node, head) {
@@ -435,11 +443,22 @@ static struct sock *__tcp_v4_lookup_listener(struct hlist_head *head, u32 daddr,
 					continue;
 				score+=2;
 			}
-			if (score == 5)
+			if (score == 5 && !sk->sk_reuseport)
 				return sk;
 			if (score > hiscore) {
 				hiscore = score;
 				result = sk;
+				matches = 0;
+				if (sk->sk_reuseport) {
+					/* spread flows over the sharing listeners */
+					phash = jhash_3words(saddr, daddr,
+							     ((u32)sport << 16) | hnum, 0);
+					matches = 1;
+				}
+			} else if (score == hiscore && matches &&
+				   sk->sk_reuseport) {
+				if (sk_reuseport_pick(&phash, ++matches))
+					result = sk;
 			}
 		}
 	}
@@ -447,8 +466,8 @@ static struct sock *__tcp_v4_lookup_listener(struct hlist_head *head, u32 daddr,
 }
 
 /* Optimize the common listener case. */
-static inline struct sock *tcp_v4_lookup_listener(u32 daddr,
-		unsigned short hnum, int dif)
+static inline struct sock *tcp_v4_lookup_listener(u32 saddr, u16 sport,
+		u32 daddr, unsigned short hnum, int dif)
 {
 	struct sock *sk = NULL;
 	struct hlist_head *head;
@@ -463,7 +482,8 @@ static inline struct sock *tcp_v4_lookup_listener(u32 daddr,
 		    (sk->sk_family == PF_INET || !ipv6_only_sock(sk)) &&
 		    !sk->sk_bound_dev_if)
 			goto sherry_cache;
-		sk = __tcp_v4_lookup_listener(head, daddr, hnum, dif);
+		sk = __tcp_v4_lookup_listener(head, saddr, sport, daddr, hnum,
+					      dif);
 	}
 	if (sk) {
 sherry_cache:
@@ -519,7 +539,7 @@ static inline struct sock *__tcp_v4_lookup(u32 saddr, u16 sport,
 	struct sock *sk = __tcp_v4_lookup_established(saddr, sport,
 						      daddr, hnum, dif);
 
-	return sk ? : tcp_v4_lookup_listener(daddr, hnum, dif);
+	return sk ? : tcp_v4_lookup_listener(saddr, sport, daddr, hnum, dif);
 }
 
 inline struct sock *tcp_v4_lookup(u32 saddr, u16 sport, u32 daddr,
@@ -1819,7 +1839,9 @@ do_time_wait:
 	switch (tcp_timewait_state_process((struct tcp_tw_bucket *)sk,
 					   skb, th, skb->len)) {
 	case TCP_TW_SYN: {
-		struct sock *sk2 = tcp_v4_lookup_listener(skb->nh.iph->daddr,
+		struct sock *sk2 = tcp_v4_lookup_listener(skb->nh.iph->saddr,
+							  th->source,
+							  skb->nh.iph->daddr,
 							  ntohs(th->dest),
 							  tcp_v4_iif(skb));
 		if (sk2) {
@@ -351,6 +351,7 @@ void tcp_time_wait(struct sock *sk, int state, int timeo)
 		tw->tw_dport		= inet->dport;
 		tw->tw_family		= sk->sk_family;
 		tw->tw_reuse		= sk->sk_reuse;
+		tw->tw_reuseport	= sk->sk_reuseport;
 		tw->tw_rcv_wscale	= tp->rx_opt.rcv_wscale;
 		atomic_set(&tw->tw_refcnt, 1);
 
@@ -100,6 +100,7 @@
 #include <linux/skbuff.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/jhash.h>
 #include <net/sock.h>
 #include <net/udp.h>
 #include <net/icmp.h>
@@ -169,6 +170,8 @@ static int udp_v4_get_port(struct sock *sk, unsigned short snum)
 gotit:
 		udp_port_rover = snum = result;
 	} else {
+		int uid = sock_i_uid(sk);
+
 		sk_for_each(sk2, node,
 			    &udp_hash[snum & (UDP_HTABLE_SIZE - 1)]) {
 			struct inet_sock *inet2 = inet_sk(sk2);
@@ -182,7 +185,9 @@ gotit:
 			    (!inet2->rcv_saddr ||
 			     !inet->rcv_saddr ||
 			     inet2->rcv_saddr == inet->rcv_saddr) &&
-			    (!sk2->sk_reuse || !sk->sk_reuse))
+			    (!sk2->sk_reuse || !sk->sk_reuse) &&
+			    (!sk2->sk_reuseport || !sk->sk_reuseport ||
+			     uid != sock_i_uid(sk2)))
 				goto fail;
 		}
 	}
@@ -226,6 +231,8 @@ static struct sock *udp_v4_lookup_longway(u32 saddr, u16 sport,
 	struct hlist_node *node;
 	unsigned short hnum = ntohs(dport);
 	int badness = -1;
+	unsigned int matches = 0;
+	u32 phash = 0;
 
 	sk_for_each(sk, node, &udp_hash[hnum & (UDP_HTABLE_SIZE - 1)]) {
 		struct inet_sock *inet = inet_sk(sk);
@@ -252,12 +259,23 @@ static struct sock *udp_v4_lookup_longway(u32 saddr, u16 sport,
 					continue;
 				score+=2;
 			}
-			if(score == 9) {
+			if(score == 9 && !sk->sk_reuseport) {
 				result = sk;
 				break;
 			} else if(score > badness) {
 				result = sk;
 				badness = score;
+				matches = 0;
+				if (sk->sk_reuseport) {
+					/* spread flows over the sharing sockets */
+					phash = jhash_3words(saddr, daddr,
+							     ((u32)sport << 16) | dport, 0);
+					matches = 1;
+				}
+			} else if(score == badness && matches &&
+				  sk->sk_reuseport) {
+				if (sk_reuseport_pick(&phash, ++matches))
+					result = sk;
 			}
 		}
 	}
@@ -737,6 +755,18 @@ int udp_ioctl(struct sock *sk, int cmd, unsigned long arg)
 			unsigned long amount;
 
 			amount = 0;
+			/* datagrams already moved over come first */
+			if (skb_queue_len(&udp_sk(sk)->reader_queue)) {
+				struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+
+				spin_lock_bh(&rq->lock);
+				skb = skb_peek(rq);
+				if (skb != NULL)
+					amount = skb->len - sizeof(struct udphdr);
+				spin_unlock_bh(&rq->lock);
+				if (skb != NULL)
+					return put_user(amount, (int __user *)arg);
+			}
 			spin_lock_irq(&sk->sk_receive_queue.lock);
 			skb = skb_peek(&sk->sk_receive_queue);
 			if (skb != NULL) {
@@ -768,6 +798,123 @@ static __inline__ int udp_checksum_complete(struct sk_buff *skb)
 		__udp_checksum_complete(skb);
 }
 
+/*
+ *	Take the next datagram off the reader queue, refilling it with
+ *	everything on sk_receive_queue when it is empty.  A batch of
+ *	datagrams (e.g. for recvmmsg) thus costs one irq-safe lock round
+ *	trip on the receive queue instead of one per datagram.  All readers
+ *	come through here, so datagrams are handed out in arrival order.
+ */
+static struct sk_buff *udp_reader_dequeue(struct sock *sk, int flags)
+{
+	struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+	struct sk_buff *skb;
+	unsigned long cpu_flags;
+	int more;
+
+	spin_lock_bh(&rq->lock);
+	if (skb_queue_empty(rq)) {
+		spin_lock_irqsave(&sk->sk_receive_queue.lock, cpu_flags);
+		while ((skb = __skb_dequeue(&sk->sk_receive_queue)) != NULL)
+			__skb_queue_tail(rq, skb);
+		spin_unlock_irqrestore(&sk->sk_receive_queue.lock, cpu_flags);
+	}
+	if (flags & MSG_PEEK) {
+		skb = skb_peek(rq);
+		if (skb)
+			atomic_inc(&skb->users);
+	} else
+		skb = __skb_dequeue(rq);
+	more = !skb_queue_empty(rq);
+	spin_unlock_bh(&rq->lock);
+
+	/*
+	 * The wakeup for the datagrams left behind went to this reader:
+	 * pass it on to the next one asleep.
+	 */
+	if (more && sk->sk_sleep && waitqueue_active(sk->sk_sleep))
+		wake_up_interruptible(sk->sk_sleep);
+
+	return skb;
+}
+
+/*
+ *	wait_for_packet() for both queues of a UDP socket
+ */
+static int udp_wait_for_packet(struct sock *sk, int *err, long *timeo_p)
+{
+	int error;
+	DEFINE_WAIT(wait);
+
+	prepare_to_wait_exclusive(sk->sk_sleep, &wait, TASK_INTERRUPTIBLE);
+
+	/* Socket errors? */
+	error = sock_error(sk);
+	if (error)
+		goto out_err;
+
+	if (!skb_queue_empty(&udp_sk(sk)->reader_queue) ||
+	    !skb_queue_empty(&sk->sk_receive_queue))
+		goto out;
+
+	/* Socket shut down? */
+	if (sk->sk_shutdown & RCV_SHUTDOWN)
+		goto out_noerr;
+
+	/* handle signals */
+	if (signal_pending(current))
+		goto interrupted;
+
+	error = 0;
+	*timeo_p = schedule_timeout(*timeo_p);
+out:
+	finish_wait(sk->sk_sleep, &wait);
+	return error;
+interrupted:
+	error = sock_intr_errno(*timeo_p);
+out_err:
+	*err = error;
+	goto out;
+out_noerr:
+	*err = 0;
+	error = 1;
+	goto out;
+}
+
+/*
+ *	skb_recv_datagram() taking datagrams through the reader queue
+ */
+static struct sk_buff *udp_recv_datagram(struct sock *sk, int flags,
+					 int noblock, int *err)
+{
+	struct sk_buff *skb;
+	long timeo;
+	int error = sock_error(sk);
+
+	if (error)
+		goto no_packet;
+
+	timeo = sock_rcvtimeo(sk, noblock);
+
+	do {
+		skb = udp_reader_dequeue(sk, flags);
+		if (skb)
+			return skb;
+
+		/* User doesn't want to wait */
+		error = -EAGAIN;
+		if (!timeo)
+			goto no_packet;
+
+	} while (!udp_wait_for_packet(sk, err, &timeo));
+
+	return NULL;
+
+no_packet:
+	*err = error;
+	return NULL;
+}
+
 /*
  * 	This should be easy, if there is something there we
  * 	return it, otherwise we block.
@@ -791,7 +938,7 @@ static int udp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		return ip_recv_error(sk, msg, len);
 
 try_again:
-	skb = skb_recv_datagram(sk, flags, noblock, &err);
+	skb = udp_recv_datagram(sk, flags, noblock, &err);
 	if (!skb)
 		goto out;
   
@@ -846,13 +993,22 @@ csum_copy_err:
 
 	/* Clear queue. */
 	if (flags&MSG_PEEK) {
+		struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
 		int clear = 0;
-		spin_lock_irq(&sk->sk_receive_queue.lock);
-		if (skb == skb_peek(&sk->sk_receive_queue)) {
-			__skb_unlink(skb, &sk->sk_receive_queue);
+		spin_lock_bh(&rq->lock);
+		if (skb == skb_peek(rq)) {
+			__skb_unlink(skb, rq);
 			clear = 1;
 		}
-		spin_unlock_irq(&sk->sk_receive_queue.lock);
+		spin_unlock_bh(&rq->lock);
+		if (!clear) {
+			spin_lock_irq(&sk->sk_receive_queue.lock);
+			if (skb == skb_peek(&sk->sk_receive_queue)) {
+				__skb_unlink(skb, &sk->sk_receive_queue);
+				clear = 1;
+			}
+			spin_unlock_irq(&sk->sk_receive_queue.lock);
+		}
 		if (clear)
 			kfree_skb(skb);
 	}
@@ -1209,11 +1365,18 @@ drop:
 	return(0);
 }
 
+static int udp_init_sock(struct sock *sk)
+{
+	skb_queue_head_init(&udp_sk(sk)->reader_queue);
+	return 0;
+}
+
 static int udp_destroy_sock(struct sock *sk)
 {
 	lock_sock(sk);
 	udp_flush_pending_frames(sk);
 	release_sock(sk);
+	skb_queue_purge(&udp_sk(sk)->reader_queue);
 	return 0;
 }
 
@@ -1349,6 +1512,10 @@ unsigned int udp_poll(struct file *file, struct socket *sock, poll_table *wait)
 			mask &= ~(POLLIN | POLLRDNORM);
 	}
 
+	/* datagrams a reader has already taken off the receive queue */
+	if (skb_queue_len(&udp_sk(sk)->reader_queue))
+		mask |= POLLIN | POLLRDNORM;
+
 	return mask;
 	
 }
@@ -1360,6 +1527,7 @@ struct proto udp_prot = {
 	.connect =	ip4_datagram_connect,
 	.disconnect =	udp_disconnect,
 	.ioctl =	udp_ioctl,
+	.init =		udp_init_sock,
 	.destroy =	udp_destroy_sock,
 	.setsockopt =	udp_setsockopt,
 	.getsockopt =	udp_getsockopt,
@@ -56,6 +56,9 @@
 #include <linux/if_packet.h>
 #include <linux/wireless.h>
 #include <linux/kmod.h>
+#include <linux/if_vlan.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #include <net/ip.h>
 #include <net/protocol.h>
 #include <linux/skbuff.h>
@@ -165,20 +168,32 @@ struct packet_mclist
 };
 #endif
 #ifdef CONFIG_PACKET_MMAP
-static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing);
+static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
+			   int closing, int tx_ring);
+
+struct packet_ring_buffer
+{
+	char *			*pg_vec;
+	unsigned int		head;
+	unsigned int		frames_per_block;
+	unsigned int		frame_size;
+	unsigned int		frame_max;
+	unsigned int		pg_vec_order;
+	unsigned int		pg_vec_pages;
+	unsigned int		pg_vec_len;
+};
 #endif
 
 static void packet_flush_mclist(struct sock *sk);
 
+struct packet_fanout;
+
 struct packet_opt
 {
 	struct tpacket_stats	stats;
 #ifdef CONFIG_PACKET_MMAP
-	char *			*pg_vec;
-	unsigned int		head;
-	unsigned int            frames_per_block;
-	unsigned int		frame_size;
-	unsigned int		frame_max;
+	struct packet_ring_buffer	rx_ring;
+	struct packet_ring_buffer	tx_ring;
 	int			copy_thresh;
 #endif
 	struct packet_type	prot_hook;
@@ -189,31 +204,194 @@ struct packet_opt
 #ifdef CONFIG_PACKET_MULTICAST
 	struct packet_mclist	*mclist;
 #endif
+	struct packet_fanout	*fanout;	/* fanout group or NULL	*/
 #ifdef CONFIG_PACKET_MMAP
 	atomic_t		mapped;
-	unsigned int            pg_vec_order;
-	unsigned int		pg_vec_pages;
-	unsigned int		pg_vec_len;
+	enum tpacket_versions	tp_version;
+	unsigned int		tp_hdrlen;
+	unsigned int		tp_loss:1;	/* skip bad tx frames	*/
 #endif
 };
 
+#define pkt_sk(__sk) ((struct packet_opt *)(__sk)->sk_protinfo)
+
 #ifdef CONFIG_PACKET_MMAP
 
-static inline char *packet_lookup_frame(struct packet_opt *po, unsigned int position)
+union tpacket_uhdr
+{
+	struct tpacket_hdr	*h1;
+	struct tpacket2_hdr	*h2;
+	void			*raw;
+};
+
+static inline char *packet_lookup_frame(struct packet_ring_buffer *rb, unsigned int position)
 {
 	unsigned int pg_vec_pos, frame_offset;
 	char *frame;
 
-	pg_vec_pos = position / po->frames_per_block;
-	frame_offset = position % po->frames_per_block;
+	pg_vec_pos = position / rb->frames_per_block;
+	frame_offset = position % rb->frames_per_block;
 
-	frame = po->pg_vec[pg_vec_pos] + (frame_offset * po->frame_size);
+	frame = rb->pg_vec[pg_vec_pos] + (frame_offset * rb->frame_size);
 	
 	return frame;
 }
+
+/*
+ *	The status word is shared with user space, which polls it to
+ *	find frames it owns. Its width depends on the ring version.
+ */
+
+static void __packet_set_status(struct packet_opt *po, void *frame, int status)
+{
+	union tpacket_uhdr h;
+
+	h.raw = frame;
+	switch (po->tp_version) {
+	case TPACKET_V1:
+		h.h1->tp_status = status;
+		break;
+	case TPACKET_V2:
+		h.h2->tp_status = status;
+		break;
+	}
+	mb();
+	flush_dcache_page(virt_to_page(frame));
+}
+
+static int __packet_get_status(struct packet_opt *po, void *frame)
+{
+	union tpacket_uhdr h;
+
+	flush_dcache_page(virt_to_page(frame));
+	smp_rmb();
+	h.raw = frame;
+	switch (po->tp_version) {
+	case TPACKET_V1:
+		return h.h1->tp_status;
+	case TPACKET_V2:
+		return h.h2->tp_status;
+	}
+	return 0;
+}
+
+static inline void *packet_current_frame(struct packet_opt *po,
+					 struct packet_ring_buffer *rb,
+					 int status)
+{
+	void *frame = packet_lookup_frame(rb, rb->head);
+
+	return __packet_get_status(po, frame) == status ? frame : NULL;
+}
+
+static inline void packet_increment_head(struct packet_ring_buffer *rb)
+{
+	rb->head = rb->head != rb->frame_max ? rb->head+1 : 0;
+}
 #endif
 
-#define pkt_sk(__sk) ((struct packet_opt *)(__sk)->sk_protinfo)
+/*
+ *	Fanout groups: several sockets bound to the same device and protocol
+ *	share one protocol hook, and each frame is handed to exactly one of
+ *	them. Members are linked into f->arr while their own hook would
+ *	otherwise be attached, see register_prot_hook().
+ */
+
+#define PACKET_FANOUT_MAX	256
+
+struct packet_fanout
+{
+	struct list_head	list;
+	struct sock		*arr[PACKET_FANOUT_MAX];
+	int			num_members;	/* linked sockets	*/
+	unsigned short		id;
+	unsigned char		type;
+	unsigned char		unhooked;	/* device went away	*/
+	atomic_t		rr_cur;
+	atomic_t		sk_ref;		/* sockets in the group	*/
+	spinlock_t		lock;		/* protects arr		*/
+	struct packet_type	prot_hook;
+};
+
+static LIST_HEAD(fanout_list);
+static DECLARE_MUTEX(fanout_sem);
+static u32 fanout_hashrnd;
+
+static void __fanout_link(struct sock *sk, struct packet_opt *po)
+{
+	struct packet_fanout *f = po->fanout;
+
+	spin_lock(&f->lock);
+	f->arr[f->num_members] = sk;
+	smp_wmb();
+	f->num_members++;
+	spin_unlock(&f->lock);
+}
+
+static void __fanout_unlink(struct sock *sk, struct packet_opt *po)
+{
+	struct packet_fanout *f = po->fanout;
+	int i;
+
+	spin_lock(&f->lock);
+	for (i = 0; i < f->num_members; i++) {
+		if (f->arr[i] == sk)
+			break;
+	}
+	BUG_ON(i >= f->num_members);
+	f->arr[i] = f->arr[f->num_members - 1];
+	f->num_members--;
+	spin_unlock(&f->lock);
+}
+
+/*
+ *	Take the group's hook off its device, when the device is
+ *	unregistered or the group is freed.  Only the first call does
+ *	anything; callers synchronize_net() before freeing the group.
+ */
+static void __fanout_unhook(struct packet_fanout *f)
+{
+	spin_lock(&f->lock);
+	if (!f->unhooked) {
+		__dev_remove_pack(&f->prot_hook);
+		f->prot_hook.dev = NULL;
+		f->unhooked = 1;
+	}
+	spin_unlock(&f->lock);
+}
+
+/*
+ *	Attach/detach the socket's receive hook. Caller holds po->bind_lock
+ *	or otherwise owns the socket. __unregister_prot_hook() does not wait
+ *	for receivers in flight, callers must synchronize_net() before the
+ *	hook can go away.
+ */
+
+static void register_prot_hook(struct sock *sk)
+{
+	struct packet_opt *po = pkt_sk(sk);
+
+	if (po->running)
+		return;
+	if (po->fanout)
+		__fanout_link(sk, po);
+	else
+		dev_add_pack(&po->prot_hook);
+	sock_hold(sk);
+	po->running = 1;
+}
+
+static void __unregister_prot_hook(struct sock *sk)
+{
+	struct packet_opt *po = pkt_sk(sk);
+
+	po->running = 0;
+	if (po->fanout)
+		__fanout_unlink(sk, po);
+	else
+		__dev_remove_pack(&po->prot_hook);
+	__sock_put(sk);
+}
 
 static void packet_sock_destruct(struct sock *sk)
 {
@@ -538,17 +716,31 @@ drop:
 }
 
 #ifdef CONFIG_PACKET_MMAP
+/*
+ *	802.1Q tag of a frame: either carried in the cb cookie by devices
+ *	doing VLAN transmit acceleration, or still inline in the header.
+ */
+static unsigned short packet_vlan_tci(struct sk_buff *skb)
+{
+	if (skb->pkt_type == PACKET_OUTGOING && vlan_tx_tag_present(skb))
+		return vlan_tx_tag_get(skb);
+	if (skb->protocol == __constant_htons(ETH_P_8021Q) &&
+	    skb->mac.raw + VLAN_ETH_HLEN <= skb->tail)
+		return ntohs(vlan_eth_hdr(skb)->h_vlan_TCI);
+	return 0;
+}
+
 static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct packet_type *pt)
 {
 	struct sock *sk;
 	struct packet_opt *po;
 	struct sockaddr_ll *sll;
-	struct tpacket_hdr *h;
+	union tpacket_uhdr h;
 	u8 * skb_head = skb->data;
 	int skb_len = skb->len;
 	unsigned snaplen;
 	unsigned long status = TP_STATUS_LOSING|TP_STATUS_USER;
-	unsigned short macoff, netoff;
+	unsigned short macoff, netoff, hdrlen;
 	struct sk_buff *copy_skb = NULL;
 
 	if (skb->pkt_type == PACKET_LOOPBACK)
@@ -579,14 +771,14 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct pack
 	}
 
 	if (sk->sk_type == SOCK_DGRAM) {
-		macoff = netoff = TPACKET_ALIGN(TPACKET_HDRLEN) + 16;
+		macoff = netoff = TPACKET_ALIGN(po->tp_hdrlen) + 16;
 	} else {
 		unsigned maclen = skb->nh.raw - skb->data;
-		netoff = TPACKET_ALIGN(TPACKET_HDRLEN + (maclen < 16 ? 16 : maclen));
+		netoff = TPACKET_ALIGN(po->tp_hdrlen + (maclen < 16 ? 16 : maclen));
 		macoff = netoff - maclen;
 	}
 
-	if (macoff + snaplen > po->frame_size) {
+	if (macoff + snaplen > po->rx_ring.frame_size) {
 		if (po->copy_thresh &&
 		    atomic_read(&sk->sk_rmem_alloc) + skb->truesize <
 		    (unsigned)sk->sk_rcvbuf) {
@@ -599,7 +791,7 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct pack
 			if (copy_skb)
 				skb_set_owner_r(copy_skb, sk);
 		}
-		snaplen = po->frame_size - macoff;
+		snaplen = po->rx_ring.frame_size - macoff;
 		if ((int)snaplen < 0)
 			snaplen = 0;
 	}
@@ -607,11 +799,10 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct pack
 		snaplen = skb->len-skb->data_len;
 
 	spin_lock(&sk->sk_receive_queue.lock);
-	h = (struct tpacket_hdr *)packet_lookup_frame(po, po->head);
-	
-	if (h->tp_status)
+	h.raw = packet_current_frame(po, &po->rx_ring, TP_STATUS_KERNEL);
+	if (!h.raw)
 		goto ring_is_full;
-	po->head = po->head != po->frame_max ? po->head+1 : 0;
+	packet_increment_head(&po->rx_ring);
 	po->stats.tp_packets++;
 	if (copy_skb) {
 		status |= TP_STATUS_COPY;
@@ -621,20 +812,39 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct pack
 		status &= ~TP_STATUS_LOSING;
 	spin_unlock(&sk->sk_receive_queue.lock);
 
-	memcpy((u8*)h + macoff, skb->data, snaplen);
+	memcpy((u8*)h.raw + macoff, skb->data, snaplen);
 
-	h->tp_len = skb->len;
-	h->tp_snaplen = snaplen;
-	h->tp_mac = macoff;
-	h->tp_net = netoff;
 	if (skb->stamp.tv_sec == 0) { 
 		do_gettimeofday(&skb->stamp);
 		sock_enable_timestamp(sk);
 	}
-	h->tp_sec = skb->stamp.tv_sec;
-	h->tp_usec = skb->stamp.tv_usec;
 
-	sll = (struct sockaddr_ll*)((u8*)h + TPACKET_ALIGN(sizeof(*h)));
+	switch (po->tp_version) {
+	case TPACKET_V1:
+		h.h1->tp_len = skb->len;
+		h.h1->tp_snaplen = snaplen;
+		h.h1->tp_mac = macoff;
+		h.h1->tp_net = netoff;
+		h.h1->tp_sec = skb->stamp.tv_sec;
+		h.h1->tp_usec = skb->stamp.tv_usec;
+		hdrlen = sizeof(*h.h1);
+		break;
+	case TPACKET_V2:
+		h.h2->tp_len = skb->len;
+		h.h2->tp_snaplen = snaplen;
+		h.h2->tp_mac = macoff;
+		h.h2->tp_net = netoff;
+		h.h2->tp_sec = skb->stamp.tv_sec;
+		h.h2->tp_nsec = skb->stamp.tv_usec * NSEC_PER_USEC;
+		h.h2->tp_vlan_tci = packet_vlan_tci(skb);
+		h.h2->tp_padding = 0;
+		hdrlen = sizeof(*h.h2);
+		break;
+	default:
+		BUG();
+	}
+
+	sll = (struct sockaddr_ll*)((u8*)h.raw + TPACKET_ALIGN(hdrlen));
 	sll->sll_halen = 0;
 	if (dev->hard_header_parse)
 		sll->sll_halen = dev->hard_header_parse(skb, sll->sll_addr);
@@ -644,14 +854,13 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,  struct pack
 	sll->sll_pkttype = skb->pkt_type;
 	sll->sll_ifindex = dev->ifindex;
 
-	h->tp_status = status;
-	mb();
+	__packet_set_status(po, h.raw, status);
 
 	{
 		struct page *p_start, *p_end;
-		u8 *h_end = (u8 *)h + macoff + snaplen - 1;
+		u8 *h_end = (u8 *)h.raw + macoff + snaplen - 1;
 
-		p_start = virt_to_page(h);
+		p_start = virt_to_page(h.raw);
 		p_end = virt_to_page(h_end);
 		while (p_start <= p_end) {
 			flush_dcache_page(p_start);
@@ -680,8 +889,309 @@ ring_is_full:
 	goto drop_n_restore;
 }
 
+/*
+ *	Transmit every frame user space has marked TP_STATUS_SEND_REQUEST
+ *	in the tx ring, starting at the ring head, with one system call.
+ *	Frame contents are copied into the skb, so a frame is handed back
+ *	(TP_STATUS_AVAILABLE) as soon as it is queued to the device.
+ */
+
+static int tpacket_snd(struct sock *sk, struct msghdr *msg)
+{
+	struct socket *sock = sk->sk_socket;
+	struct packet_opt *po = pkt_sk(sk);
+	struct sockaddr_ll *saddr=(struct sockaddr_ll *)msg->msg_name;
+	struct sk_buff *skb;
+	struct net_device *dev;
+	union tpacket_uhdr ph;
+	unsigned short proto;
+	unsigned char *addr;
+	unsigned int tp_len, data_off;
+	int ifindex, err, reserve = 0;
+	int len_sum = 0;
+
+	lock_sock(sk);
+
+	err = -EBUSY;
+	if (po->tx_ring.pg_vec == NULL)
+		goto out;
+
+	if (saddr == NULL) {
+		ifindex	= po->ifindex;
+		proto	= po->num;
+		addr	= NULL;
+	} else {
+		err = -EINVAL;
+		if (msg->msg_namelen < sizeof(struct sockaddr_ll))
+			goto out;
+		ifindex	= saddr->sll_ifindex;
+		proto	= saddr->sll_protocol;
+		addr	= saddr->sll_addr;
+	}
+
+	dev = dev_get_by_index(ifindex);
+	err = -ENXIO;
+	if (dev == NULL)
+		goto out;
+	if (sock->type == SOCK_RAW)
+		reserve = dev->hard_header_len;
+
+	err = -ENETDOWN;
+	if (!(dev->flags & IFF_UP))
+		goto out_put;
+
+	data_off = po->tp_hdrlen - sizeof(struct sockaddr_ll);
+
+	while ((ph.raw = packet_current_frame(po, &po->tx_ring,
+					     TP_STATUS_SEND_REQUEST)) != NULL) {
+		__packet_set_status(po, ph.raw, TP_STATUS_SENDING);
+
+		tp_len = po->tp_version == TPACKET_V2 ? ph.h2->tp_len :
+							ph.h1->tp_len;
+		if (tp_len > dev->mtu + reserve ||
+		    tp_len > po->tx_ring.frame_size - data_off) {
+			if (po->tp_loss) {
+				__packet_set_status(po, ph.raw, TP_STATUS_AVAILABLE);
+				packet_increment_head(&po->tx_ring);
+				continue;
+			}
+			__packet_set_status(po, ph.raw, TP_STATUS_WRONG_FORMAT);
+			err = -EMSGSIZE;
+			goto out_put;
+		}
+
+		skb = sock_alloc_send_skb(sk, tp_len + LL_RESERVED_SPACE(dev),
+					  msg->msg_flags & MSG_DONTWAIT, &err);
+		if (skb == NULL) {
+			/* Leave the frame to be sent by the next call */
+			__packet_set_status(po, ph.raw, TP_STATUS_SEND_REQUEST);
+			goto out_put;
+		}
+
+		skb_reserve(skb, LL_RESERVED_SPACE(dev));
+		skb->nh.raw = skb->data;
+
+		if (dev->hard_header) {
+			int res;
+			res = dev->hard_header(skb, dev, ntohs(proto), addr, NULL, tp_len);
+			if (sock->type != SOCK_DGRAM) {
+				skb->tail = skb->data;
+				skb->len = 0;
+			} else if (res < 0) {
+				kfree_skb(skb);
+				__packet_set_status(po, ph.raw, TP_STATUS_WRONG_FORMAT);
+				err = -EINVAL;
+				goto out_put;
+			}
+		}
+
+		memcpy(skb_put(skb, tp_len), (u8 *)ph.raw + data_off, tp_len);
+
+		skb->protocol = proto;
+		skb->dev = dev;
+		skb->priority = sk->sk_priority;
+
+		err = dev_queue_xmit(skb);
+		__packet_set_status(po, ph.raw, TP_STATUS_AVAILABLE);
+		packet_increment_head(&po->tx_ring);
+		if (err > 0 && (err = net_xmit_errno(err)) != 0 &&
+		    !po->tp_loss)
+			goto out_put;
+
+		len_sum += tp_len;
+		cond_resched();
+	}
+	err = len_sum;
+
+out_put:
+	dev_put(dev);
+out:
+	release_sock(sk);
+	return err;
+}
+
 #endif
 
+/*
+ *	Flow hash used to spread a fanout group: addresses and ports are
+ *	ordered so that both directions of a flow land on the same socket.
+ */
+
+static u32 fanout_flow_hash(struct sk_buff *skb)
+{
+	struct iphdr _iph, *iph;
+	u32 _ports, *ports;
+	u32 a, b, p = 0;
+	int off;
+
+	if (skb->protocol != __constant_htons(ETH_P_IP))
+		return jhash_1word(skb->protocol, fanout_hashrnd);
+
+	off = skb->nh.raw - skb->data;
+	iph = skb_header_pointer(skb, off, sizeof(_iph), &_iph);
+	if (iph == NULL)
+		return 0;
+
+	a = iph->saddr;
+	b = iph->daddr;
+	if (!(iph->frag_off & htons(IP_MF|IP_OFFSET)) &&
+	    (iph->protocol == IPPROTO_TCP ||
+	     iph->protocol == IPPROTO_UDP ||
+	     iph->protocol == IPPROTO_SCTP)) {
+		ports = skb_header_pointer(skb, off + iph->ihl * 4,
+					   sizeof(_ports), &_ports);
+		if (ports) {
+			u16 *pp = (u16 *)ports;
+			p = pp[0] < pp[1] ? (pp[0] << 16) | pp[1] :
+					    (pp[1] << 16) | pp[0];
+		}
+	}
+	if (a > b) {
+		u32 t = a;
+		a = b;
+		b = t;
+	}
+	return jhash_3words(a, b, p ^ iph->protocol, fanout_hashrnd);
+}
+
+static int packet_rcv_fanout(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt)
+{
+	struct packet_fanout *f = pt->af_packet_priv;
+	unsigned int num = f->num_members;
+	unsigned int idx;
+	struct packet_opt *po;
+
+	if (num == 0) {
+		kfree_skb(skb);
+		return 0;
+	}
+	smp_rmb();
+
+	switch (f->type) {
+	case PACKET_FANOUT_LB:
+		idx = (unsigned int)atomic_inc_return(&f->rr_cur) % num;
+		break;
+	case PACKET_FANOUT_CPU:
+		idx = smp_processor_id() % num;
+		break;
+	case PACKET_FANOUT_HASH:
+	default:
+		idx = fanout_flow_hash(skb) % num;
+		break;
+	}
+
+	po = pkt_sk(f->arr[idx]);
+	return po->prot_hook.func(skb, dev, &po->prot_hook);
+}
+
+static int fanout_add(struct sock *sk, unsigned short id, unsigned int type)
+{
+	struct packet_opt *po = pkt_sk(sk);
+	struct packet_fanout *f, *match;
+	struct net_device *dev;
+	unsigned short type_hook;
+	int err;
+
+	switch (type) {
+	case PACKET_FANOUT_HASH:
+	case PACKET_FANOUT_LB:
+	case PACKET_FANOUT_CPU:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	down(&fanout_sem);
+	spin_lock(&po->bind_lock);
+	err = -EALREADY;
+	if (po->fanout)
+		goto out_unlock;
+	err = -EINVAL;
+	if (!po->running)
+		goto out_unlock;
+	type_hook = po->prot_hook.type;
+	dev = po->prot_hook.dev;
+	spin_unlock(&po->bind_lock);
+
+	match = NULL;
+	list_for_each_entry(f, &fanout_list, list) {
+		if (f->id == id) {
+			match = f;
+			break;
+		}
+	}
+	err = -EINVAL;
+	if (match && match->type != type)
+		goto out;
+	if (!match) {
+		err = -ENOMEM;
+		match = kmalloc(sizeof(*match), GFP_KERNEL);
+		if (match == NULL)
+			goto out;
+		memset(match, 0, sizeof(*match));
+		match->id = id;
+		match->type = type;
+		atomic_set(&match->rr_cur, 0);
+		atomic_set(&match->sk_ref, 0);
+		spin_lock_init(&match->lock);
+		match->prot_hook.type = type_hook;
+		match->prot_hook.dev = dev;
+		match->prot_hook.func = packet_rcv_fanout;
+		match->prot_hook.af_packet_priv = match;
+		dev_add_pack(&match->prot_hook);
+		list_add(&match->list, &fanout_list);
+	}
+
+	err = -EINVAL;
+	spin_lock(&po->bind_lock);
+	if (po->running && !po->fanout && !match->unhooked &&
+	    match->prot_hook.type == po->prot_hook.type &&
+	    match->prot_hook.dev == po->prot_hook.dev) {
+		err = -ENOSPC;
+		if (atomic_read(&match->sk_ref) < PACKET_FANOUT_MAX) {
+			__dev_remove_pack(&po->prot_hook);
+			po->fanout = match;
+			atomic_inc(&match->sk_ref);
+			__fanout_link(sk, po);
+			err = 0;
+		}
+	}
+	spin_unlock(&po->bind_lock);
+
+	if (err && atomic_read(&match->sk_ref) == 0) {
+		list_del(&match->list);
+		dev_remove_pack(&match->prot_hook);
+		kfree(match);
+	}
+out:
+	up(&fanout_sem);
+	return err;
+
+out_unlock:
+	spin_unlock(&po->bind_lock);
+	goto out;
+}
+
+/* Called once the socket's hook is detached and receivers have drained */
+static void fanout_release(struct sock *sk)
+{
+	struct packet_opt *po = pkt_sk(sk);
+	struct packet_fanout *f;
+
+	f = po->fanout;
+	if (!f)
+		return;
+
+	down(&fanout_sem);
+	po->fanout = NULL;
+	if (atomic_dec_and_test(&f->sk_ref)) {
+		list_del(&f->list);
+		__fanout_unhook(f);
+		synchronize_net();
+		kfree(f);
+	}
+	up(&fanout_sem);
+}
 
 static int packet_sendmsg(struct kiocb *iocb, struct socket *sock,
 			  struct msghdr *msg, size_t len)
@@ -694,6 +1204,11 @@ static int packet_sendmsg(struct kiocb *iocb, struct socket *sock,
 	unsigned char *addr;
 	int ifindex, err, reserve = 0;
 
+#ifdef CONFIG_PACKET_MMAP
+	if (pkt_sk(sk)->tx_ring.pg_vec)
+		return tpacket_snd(sk, msg);
+#endif
+
 	/*
 	 *	Get and verify the address. 
 	 */
@@ -801,25 +1316,33 @@ static int packet_release(struct socket *sock)
 	 *	Unhook packet receive handler.
 	 */
 
+	spin_lock(&po->bind_lock);
 	if (po->running) {
 		/*
 		 *	Remove the protocol hook
 		 */
-		dev_remove_pack(&po->prot_hook);
-		po->running = 0;
+		__unregister_prot_hook(sk);
 		po->num = 0;
-		__sock_put(sk);
 	}
+	spin_unlock(&po->bind_lock);
+	synchronize_net();
+
+	fanout_release(sk);
 
 #ifdef CONFIG_PACKET_MULTICAST
 	packet_flush_mclist(sk);
 #endif
 
 #ifdef CONFIG_PACKET_MMAP
-	if (po->pg_vec) {
+	if (po->rx_ring.pg_vec) {
+		struct tpacket_req req;
+		memset(&req, 0, sizeof(req));
+		packet_set_ring(sk, &req, 1, 0);
+	}
+	if (po->tx_ring.pg_vec) {
 		struct tpacket_req req;
 		memset(&req, 0, sizeof(req));
-		packet_set_ring(sk, &req, 1);
+		packet_set_ring(sk, &req, 1, 1);
 	}
 #endif
 
@@ -845,6 +1368,7 @@ static int packet_release(struct socket *sock)
 static int packet_do_bind(struct sock *sk, struct net_device *dev, int protocol)
 {
 	struct packet_opt *po = pkt_sk(sk);
+
 	/*
 	 *	Detach an existing hook if present.
 	 */
@@ -852,12 +1376,17 @@ static int packet_do_bind(struct sock *sk, struct net_device *dev, int protocol)
 	lock_sock(sk);
 
 	spin_lock(&po->bind_lock);
+	/* A fanout member cannot leave the group's device and protocol */
+	if (po->fanout) {
+		spin_unlock(&po->bind_lock);
+		release_sock(sk);
+		return -EINVAL;
+	}
 	if (po->running) {
-		__sock_put(sk);
-		po->running = 0;
+		__unregister_prot_hook(sk);
 		po->num = 0;
 		spin_unlock(&po->bind_lock);
-		dev_remove_pack(&po->prot_hook);
+		synchronize_net();
 		spin_lock(&po->bind_lock);
 	}
 
@@ -872,18 +1401,14 @@ static int packet_do_bind(struct sock *sk, struct net_device *dev, int protocol)
 
 	if (dev) {
 		if (dev->flags&IFF_UP) {
-			dev_add_pack(&po->prot_hook);
-			sock_hold(sk);
-			po->running = 1;
+			register_prot_hook(sk);
 		} else {
 			sk->sk_err = ENETDOWN;
 			if (!sock_flag(sk, SOCK_DEAD))
 				sk->sk_error_report(sk);
 		}
 	} else {
-		dev_add_pack(&po->prot_hook);
-		sock_hold(sk);
-		po->running = 1;
+		register_prot_hook(sk);
 	}
 
 out_unlock:
@@ -1002,6 +1527,11 @@ static int packet_create(struct socket *sock, int protocol)
 	 *	Attach a protocol block
 	 */
 
+#ifdef CONFIG_PACKET_MMAP
+	po->tp_version = TPACKET_V1;
+	po->tp_hdrlen = TPACKET_HDRLEN;
+#endif
+
 	spin_lock_init(&po->bind_lock);
 	po->prot_hook.func = packet_rcv;
 #ifdef CONFIG_SOCK_PACKET
@@ -1012,9 +1542,7 @@ static int packet_create(struct socket *sock, int protocol)
 
 	if (protocol) {
 		po->prot_hook.type = protocol;
-		dev_add_pack(&po->prot_hook);
-		sock_hold(sk);
-		po->running = 1;
+		register_prot_hook(sk);
 	}
 
 	write_lock_bh(&packet_sklist_lock);
@@ -1323,6 +1851,7 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 #endif
 #ifdef CONFIG_PACKET_MMAP
 	case PACKET_RX_RING:
+	case PACKET_TX_RING:
 	{
 		struct tpacket_req req;
 
@@ -1330,7 +1859,7 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 			return -EINVAL;
 		if (copy_from_user(&req,optval,sizeof(req)))
 			return -EFAULT;
-		return packet_set_ring(sk, &req, 0);
+		return packet_set_ring(sk, &req, 0, optname == PACKET_TX_RING);
 	}
 	case PACKET_COPY_THRESH:
 	{
@@ -1344,7 +1873,55 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 		pkt_sk(sk)->copy_thresh = val;
 		return 0;
 	}
+	case PACKET_VERSION:
+	{
+		struct packet_opt *po = pkt_sk(sk);
+		int val;
+
+		if (optlen!=sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val,optval,sizeof(val)))
+			return -EFAULT;
+		if (po->rx_ring.pg_vec || po->tx_ring.pg_vec)
+			return -EBUSY;
+
+		switch (val) {
+		case TPACKET_V1:
+			po->tp_hdrlen = TPACKET_HDRLEN;
+			break;
+		case TPACKET_V2:
+			po->tp_hdrlen = TPACKET2_HDRLEN;
+			break;
+		default:
+			return -EINVAL;
+		}
+		po->tp_version = val;
+		return 0;
+	}
+	case PACKET_LOSS:
+	{
+		int val;
+
+		if (optlen!=sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val,optval,sizeof(val)))
+			return -EFAULT;
+
+		pkt_sk(sk)->tp_loss = !!val;
+		return 0;
+	}
 #endif
+	case PACKET_FANOUT:
+	{
+		int val;
+
+		if (optlen!=sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val,optval,sizeof(val)))
+			return -EFAULT;
+
+		return fanout_add(sk, val & 0xffff, val >> 16);
+	}
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -1353,7 +1930,7 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 static int packet_getsockopt(struct socket *sock, int level, int optname,
 			     char __user *optval, int __user *optlen)
 {
-	int len;
+	int len, val;
 	struct sock *sk = sock->sk;
 	struct packet_opt *po = pkt_sk(sk);
 
@@ -1383,8 +1960,42 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 			return -EFAULT;
 		break;
 	}
+#ifdef CONFIG_PACKET_MMAP
+	case PACKET_VERSION:
+		val = po->tp_version;
+		goto put_int;
+	case PACKET_HDRLEN:
+		if (len < sizeof(int))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+		switch (val) {
+		case TPACKET_V1:
+			val = TPACKET_HDRLEN;
+			break;
+		case TPACKET_V2:
+			val = TPACKET2_HDRLEN;
+			break;
+		default:
+			return -EINVAL;
+		}
+		goto put_int;
+	case PACKET_LOSS:
+		val = po->tp_loss;
+		goto put_int;
+#endif
+	case PACKET_FANOUT:
+		val = po->fanout ? (po->fanout->type << 16) | po->fanout->id : 0;
+		goto put_int;
 	default:
 		return -ENOPROTOOPT;
+
+	put_int:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		if (copy_to_user(optval, &val, len))
+			return -EFAULT;
+		break;
 	}
 
   	if (put_user(len, optlen))
@@ -1414,9 +2025,7 @@ static int packet_notifier(struct notifier_block *this, unsigned long msg, void
 			if (dev->ifindex == po->ifindex) {
 				spin_lock(&po->bind_lock);
 				if (po->running) {
-					__dev_remove_pack(&po->prot_hook);
-					__sock_put(sk);
-					po->running = 0;
+					__unregister_prot_hook(sk);
 					sk->sk_err = ENETDOWN;
 					if (!sock_flag(sk, SOCK_DEAD))
 						sk->sk_error_report(sk);
@@ -1424,18 +2033,17 @@ static int packet_notifier(struct notifier_block *this, unsigned long msg, void
 				if (msg == NETDEV_UNREGISTER) {
 					po->ifindex = -1;
 					po->prot_hook.dev = NULL;
+					if (po->fanout &&
+					    po->fanout->prot_hook.dev == dev)
+						__fanout_unhook(po->fanout);
 				}
 				spin_unlock(&po->bind_lock);
 			}
 			break;
 		case NETDEV_UP:
 			spin_lock(&po->bind_lock);
-			if (dev->ifindex == po->ifindex && po->num &&
-			    !po->running) {
-				dev_add_pack(&po->prot_hook);
-				sock_hold(sk);
-				po->running = 1;
-			}
+			if (dev->ifindex == po->ifindex && po->num)
+				register_prot_hook(sk);
 			spin_unlock(&po->bind_lock);
 			break;
 		}
@@ -1508,15 +2116,16 @@ static unsigned int packet_poll(struct file * file, struct socket *sock,
 	unsigned int mask = datagram_poll(file, sock, wait);
 
 	spin_lock_bh(&sk->sk_receive_queue.lock);
-	if (po->pg_vec) {
-		unsigned last = po->head ? po->head-1 : po->frame_max;
-		struct tpacket_hdr *h;
+	if (po->rx_ring.pg_vec) {
+		unsigned last = po->rx_ring.head ? po->rx_ring.head-1 : po->rx_ring.frame_max;
 
-		h = (struct tpacket_hdr *)packet_lookup_frame(po, last);
-
-		if (h->tp_status)
+		if (__packet_get_status(po, packet_lookup_frame(&po->rx_ring, last)))
 			mask |= POLLIN | POLLRDNORM;
 	}
+	if (po->tx_ring.pg_vec) {
+		if (packet_current_frame(po, &po->tx_ring, TP_STATUS_AVAILABLE))
+			mask |= POLLOUT | POLLWRNORM;
+	}
 	spin_unlock_bh(&sk->sk_receive_queue.lock);
 	return mask;
 }
@@ -1576,34 +2185,38 @@ static void free_pg_vec(char **pg_vec, unsigned order, unsigned len)
 }
 
 
-static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing)
+static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
+			   int closing, int tx_ring)
 {
 	char **pg_vec = NULL;
 	struct packet_opt *po = pkt_sk(sk);
+	struct packet_ring_buffer *rb;
 	int was_running, num, order = 0;
 	int err = 0;
+
+	rb = tx_ring ? &po->tx_ring : &po->rx_ring;
 	
 	if (req->tp_block_nr) {
-		int i, l;
+		int i;
 
 		/* Sanity tests and some calculations */
 
-		if (po->pg_vec)
+		if (rb->pg_vec)
 			return -EBUSY;
 
 		if ((int)req->tp_block_size <= 0)
 			return -EINVAL;
 		if (req->tp_block_size&(PAGE_SIZE-1))
 			return -EINVAL;
-		if (req->tp_frame_size < TPACKET_HDRLEN)
+		if (req->tp_frame_size < po->tp_hdrlen)
 			return -EINVAL;
 		if (req->tp_frame_size&(TPACKET_ALIGNMENT-1))
 			return -EINVAL;
 
-		po->frames_per_block = req->tp_block_size/req->tp_frame_size;
-		if (po->frames_per_block <= 0)
+		rb->frames_per_block = req->tp_block_size/req->tp_frame_size;
+		if (rb->frames_per_block <= 0)
 			return -EINVAL;
-		if (po->frames_per_block*req->tp_block_nr != req->tp_frame_nr)
+		if (rb->frames_per_block*req->tp_block_nr != req->tp_frame_nr)
 			return -EINVAL;
 		/* OK! */
 
@@ -1630,16 +2243,13 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing
 		}
 		/* Page vector is allocated */
 
-		l = 0;
 		for (i=0; i<req->tp_block_nr; i++) {
 			char *ptr = pg_vec[i];
-			struct tpacket_hdr *header;
 			int k;
 
-			for (k=0; k<po->frames_per_block; k++) {
-				
-				header = (struct tpacket_hdr*)ptr;
-				header->tp_status = TP_STATUS_KERNEL;
+			/* TP_STATUS_KERNEL and TP_STATUS_AVAILABLE are both 0 */
+			for (k=0; k<rb->frames_per_block; k++) {
+				__packet_set_status(po, ptr, TP_STATUS_KERNEL);
 				ptr += req->tp_frame_size;
 			}
 		}
@@ -1656,10 +2266,8 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing
 	was_running = po->running;
 	num = po->num;
 	if (was_running) {
-		__dev_remove_pack(&po->prot_hook);
+		__unregister_prot_hook(sk);
 		po->num = 0;
-		po->running = 0;
-		__sock_put(sk);
 	}
 	spin_unlock(&po->bind_lock);
 		
@@ -1670,19 +2278,21 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing
 		err = 0;
 #define XC(a, b) ({ __typeof__ ((a)) __t; __t = (a); (a) = (b); __t; })
 
+		/* Both rings are swapped under the receive queue lock */
 		spin_lock_bh(&sk->sk_receive_queue.lock);
-		pg_vec = XC(po->pg_vec, pg_vec);
-		po->frame_max = req->tp_frame_nr-1;
-		po->head = 0;
-		po->frame_size = req->tp_frame_size;
+		pg_vec = XC(rb->pg_vec, pg_vec);
+		rb->frame_max = req->tp_frame_nr-1;
+		rb->head = 0;
+		rb->frame_size = req->tp_frame_size;
 		spin_unlock_bh(&sk->sk_receive_queue.lock);
 
-		order = XC(po->pg_vec_order, order);
-		req->tp_block_nr = XC(po->pg_vec_len, req->tp_block_nr);
+		order = XC(rb->pg_vec_order, order);
+		req->tp_block_nr = XC(rb->pg_vec_len, req->tp_block_nr);
 
-		po->pg_vec_pages = req->tp_block_size/PAGE_SIZE;
-		po->prot_hook.func = po->pg_vec ? tpacket_rcv : packet_rcv;
-		skb_queue_purge(&sk->sk_receive_queue);
+		rb->pg_vec_pages = req->tp_block_size/PAGE_SIZE;
+		po->prot_hook.func = po->rx_ring.pg_vec ? tpacket_rcv : packet_rcv;
+		if (!tx_ring)
+			skb_queue_purge(&sk->sk_receive_queue);
 #undef XC
 		if (atomic_read(&po->mapped))
 			printk(KERN_DEBUG "packet_mmap: vma is busy: %d\n", atomic_read(&po->mapped));
@@ -1690,10 +2300,8 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req, int closing
 
 	spin_lock(&po->bind_lock);
 	if (was_running && !po->running) {
-		sock_hold(sk);
-		po->running = 1;
 		po->num = num;
-		dev_add_pack(&po->prot_hook);
+		register_prot_hook(sk);
 	}
 	spin_unlock(&po->bind_lock);
 
@@ -1710,7 +2318,8 @@ static int packet_mmap(struct file *file, struct socket *sock, struct vm_area_st
 {
 	struct sock *sk = sock->sk;
 	struct packet_opt *po = pkt_sk(sk);
-	unsigned long size;
+	struct packet_ring_buffer *rb;
+	unsigned long size, expected_size;
 	unsigned long start;
 	int err = -EINVAL;
 	int i;
@@ -1721,21 +2330,32 @@ static int packet_mmap(struct file *file, struct socket *sock, struct vm_area_st
 	size = vma->vm_end - vma->vm_start;
 
 	lock_sock(sk);
-	if (po->pg_vec == NULL)
+
+	/* The rx ring, if any, is mapped first, followed by the tx ring */
+	expected_size = 0;
+	for (rb = &po->rx_ring; rb <= &po->tx_ring; rb++) {
+		if (rb->pg_vec)
+			expected_size += rb->pg_vec_len*rb->pg_vec_pages*PAGE_SIZE;
+	}
+	if (expected_size == 0)
 		goto out;
-	if (size != po->pg_vec_len*po->pg_vec_pages*PAGE_SIZE)
+	if (size != expected_size)
 		goto out;
 
 	atomic_inc(&po->mapped);
 	start = vma->vm_start;
 	err = -EAGAIN;
-	for (i=0; i<po->pg_vec_len; i++) {
-		if (remap_pfn_range(vma, start,
-				     __pa(po->pg_vec[i]) >> PAGE_SHIFT,
-				     po->pg_vec_pages*PAGE_SIZE,
-				     vma->vm_page_prot))
-			goto out;
-		start += po->pg_vec_pages*PAGE_SIZE;
+	for (rb = &po->rx_ring; rb <= &po->tx_ring; rb++) {
+		if (rb->pg_vec == NULL)
+			continue;
+		for (i=0; i<rb->pg_vec_len; i++) {
+			if (remap_pfn_range(vma, start,
+					     __pa(rb->pg_vec[i]) >> PAGE_SHIFT,
+					     rb->pg_vec_pages*PAGE_SIZE,
+					     vma->vm_page_prot))
+				goto out;
+			start += rb->pg_vec_pages*PAGE_SIZE;
+		}
 	}
 	vma->vm_ops = &packet_mmap_ops;
 	err = 0;
@@ -1889,6 +2509,7 @@ static void __exit packet_exit(void)
 
 static int __init packet_init(void)
 {
+	get_random_bytes(&fanout_hashrnd, sizeof(fanout_hashrnd));
 	sock_register(&packet_family_ops);
 	register_netdevice_notifier(&packet_netdev_notifier);
 	proc_net_fops_create("packet", 0, &packet_seq_fops);
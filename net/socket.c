@@ -1685,10 +1685,10 @@ asmlinkage long sys_shutdown(int fd, int how)
  *	BSD sendmsg interface
  */
 
-asmlinkage long sys_sendmsg(int fd, struct msghdr __user *msg, unsigned flags)
+static int __sys_sendmsg(struct socket *sock, struct msghdr __user *msg,
+			 unsigned flags)
 {
 	struct compat_msghdr __user *msg_compat = (struct compat_msghdr __user *)msg;
-	struct socket *sock;
 	char address[MAX_SOCK_ADDR];
 	struct iovec iovstack[UIO_FASTIOV], *iov = iovstack;
 	unsigned char ctl[sizeof(struct cmsghdr) + 20];	/* 20 is size of ipv6_pktinfo */
@@ -1696,21 +1696,16 @@ asmlinkage long sys_sendmsg(int fd, struct msghdr __user *msg, unsigned flags)
 	struct msghdr msg_sys;
 	int err, ctl_len, iov_size, total_len;
 	
-	err = -EFAULT;
 	if (MSG_CMSG_COMPAT & flags) {
 		if (get_compat_msghdr(&msg_sys, msg_compat))
 			return -EFAULT;
 	} else if (copy_from_user(&msg_sys, msg, sizeof(struct msghdr)))
 		return -EFAULT;
 
-	sock = sockfd_lookup(fd, &err);
-	if (!sock) 
-		goto out;
-
 	/* do not move before msg_sys is valid */
 	err = -EMSGSIZE;
 	if (msg_sys.msg_iovlen > UIO_MAXIOV)
-		goto out_put;
+		goto out;
 
 	/* Check whether to allocate the iovec area*/
 	err = -ENOMEM;
@@ -1718,7 +1713,7 @@ asmlinkage long sys_sendmsg(int fd, struct msghdr __user *msg, unsigned flags)
 	if (msg_sys.msg_iovlen > UIO_FASTIOV) {
 		iov = sock_kmalloc(sock->sk, iov_size, GFP_KERNEL);
 		if (!iov)
-			goto out_put;
+			goto out;
 	}
 
 	/* This will also move the address data into kernel space */
@@ -1769,20 +1764,82 @@ out_freectl:
 out_freeiov:
 	if (iov != iovstack)
 		sock_kfree_s(sock->sk, iov, iov_size);
-out_put:
-	sockfd_put(sock);
 out:       
 	return err;
 }
 
+asmlinkage long sys_sendmsg(int fd, struct msghdr __user *msg, unsigned flags)
+{
+	struct socket *sock;
+	int err;
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock) 
+		return err;
+	err = __sys_sendmsg(sock, msg, flags);
+	sockfd_put(sock);
+	return err;
+}
+
+/*
+ *	Send a batch of messages with one file lookup.  Returns the number
+ *	of messages sent; an error is only returned if the first one fails.
+ */
+
+asmlinkage long sys_sendmmsg(int fd, struct mmsghdr __user *mmsg,
+			     unsigned int vlen, unsigned int flags)
+{
+	struct socket *sock;
+	struct mmsghdr __user *entry = mmsg;
+	struct compat_mmsghdr __user *compat_entry = (struct compat_mmsghdr __user *)mmsg;
+	unsigned int datagrams = 0;
+	int err;
+
+	if (vlen > UIO_MAXIOV)
+		vlen = UIO_MAXIOV;
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock)
+		return err;
+
+	err = 0;
+	while (datagrams < vlen) {
+		if (MSG_CMSG_COMPAT & flags) {
+			err = __sys_sendmsg(sock, (struct msghdr __user *)compat_entry,
+					    flags);
+			if (err < 0)
+				break;
+			err = put_user(err, &compat_entry->msg_len);
+			++compat_entry;
+		} else {
+			err = __sys_sendmsg(sock, (struct msghdr __user *)entry,
+					    flags);
+			if (err < 0)
+				break;
+			err = put_user(err, &entry->msg_len);
+			++entry;
+		}
+		if (err)
+			break;
+		++datagrams;
+	}
+
+	sockfd_put(sock);
+
+	/* the error of a later message is reported by the next call */
+	if (datagrams != 0)
+		return datagrams;
+	return err;
+}
+
 /*
  *	BSD recvmsg interface
  */
 
-asmlinkage long sys_recvmsg(int fd, struct msghdr __user *msg, unsigned int flags)
+static int __sys_recvmsg(struct socket *sock, struct msghdr __user *msg,
+			 unsigned int flags)
 {
 	struct compat_msghdr __user *msg_compat = (struct compat_msghdr __user *)msg;
-	struct socket *sock;
 	struct iovec iovstack[UIO_FASTIOV];
 	struct iovec *iov=iovstack;
 	struct msghdr msg_sys;
@@ -1803,13 +1860,9 @@ asmlinkage long sys_recvmsg(int fd, struct msghdr __user *msg, unsigned int flag
 		if (copy_from_user(&msg_sys,msg,sizeof(struct msghdr)))
 			return -EFAULT;
 
-	sock = sockfd_lookup(fd, &err);
-	if (!sock)
-		goto out;
-
 	err = -EMSGSIZE;
 	if (msg_sys.msg_iovlen > UIO_MAXIOV)
-		goto out_put;
+		goto out;
 	
 	/* Check whether to allocate the iovec area*/
 	err = -ENOMEM;
@@ -1817,7 +1870,7 @@ asmlinkage long sys_recvmsg(int fd, struct msghdr __user *msg, unsigned int flag
 	if (msg_sys.msg_iovlen > UIO_FASTIOV) {
 		iov = sock_kmalloc(sock->sk, iov_size, GFP_KERNEL);
 		if (!iov)
-			goto out_put;
+			goto out;
 	}
 
 	/*
@@ -1868,12 +1921,126 @@ asmlinkage long sys_recvmsg(int fd, struct msghdr __user *msg, unsigned int flag
 out_freeiov:
 	if (iov != iovstack)
 		sock_kfree_s(sock->sk, iov, iov_size);
-out_put:
-	sockfd_put(sock);
 out:
 	return err;
 }
 
+asmlinkage long sys_recvmsg(int fd, struct msghdr __user *msg, unsigned int flags)
+{
+	struct socket *sock;
+	int err;
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock)
+		return err;
+	err = __sys_recvmsg(sock, msg, flags);
+	sockfd_put(sock);
+	return err;
+}
+
+/*
+ *	Receive a batch of messages with one file lookup.  With
+ *	MSG_WAITFORONE only the first receive may block; the timeout, if
+ *	any, is checked after each message and updated with the time left.
+ */
+
+int __sys_recvmmsg(int fd, struct mmsghdr __user *mmsg, unsigned int vlen,
+		   unsigned int flags, struct timespec *timeout)
+{
+	struct socket *sock;
+	struct mmsghdr __user *entry = mmsg;
+	struct compat_mmsghdr __user *compat_entry = (struct compat_mmsghdr __user *)mmsg;
+	unsigned int datagrams = 0;
+	unsigned long expire = 0;
+	long left;
+	int err;
+
+	if (vlen > UIO_MAXIOV)
+		vlen = UIO_MAXIOV;
+
+	if (timeout) {
+		if ((unsigned long)timeout->tv_nsec >= NSEC_PER_SEC ||
+		    timeout->tv_sec < 0)
+			return -EINVAL;
+		expire = jiffies + timespec_to_jiffies(timeout);
+	}
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock)
+		return err;
+
+	err = 0;
+	while (datagrams < vlen) {
+		if (MSG_CMSG_COMPAT & flags) {
+			err = __sys_recvmsg(sock, (struct msghdr __user *)compat_entry,
+					    flags & ~MSG_WAITFORONE);
+			if (err < 0)
+				break;
+			err = put_user(err, &compat_entry->msg_len);
+			++compat_entry;
+		} else {
+			err = __sys_recvmsg(sock, (struct msghdr __user *)entry,
+					    flags & ~MSG_WAITFORONE);
+			if (err < 0)
+				break;
+			err = put_user(err, &entry->msg_len);
+			++entry;
+		}
+		if (err)
+			break;
+		++datagrams;
+
+		/* only the first datagram is waited for */
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+
+		if (timeout) {
+			left = (long)(expire - jiffies);
+			if (left <= 0) {
+				timeout->tv_sec = timeout->tv_nsec = 0;
+				break;
+			}
+			jiffies_to_timespec(left, timeout);
+		}
+	}
+
+	if (err < 0 && datagrams != 0 && err != -EAGAIN) {
+		/*
+		 * We already have datagrams for the caller: report them now
+		 * and keep the error for the next call to pick up.
+		 */
+		sock->sk->sk_err = -err;
+	}
+
+	sockfd_put(sock);
+
+	if (datagrams != 0)
+		return datagrams;
+	return err;
+}
+
+asmlinkage long sys_recvmmsg(int fd, struct mmsghdr __user *mmsg,
+			     unsigned int vlen, unsigned int flags,
+			     struct timespec __user *timeout)
+{
+	struct timespec timeout_sys;
+	int datagrams;
+
+	if (!timeout)
+		return __sys_recvmmsg(fd, mmsg, vlen, flags, NULL);
+
+	if (copy_from_user(&timeout_sys, timeout, sizeof(timeout_sys)))
+		return -EFAULT;
+
+	datagrams = __sys_recvmmsg(fd, mmsg, vlen, flags, &timeout_sys);
+
+	if (datagrams > 0 &&
+	    copy_to_user(timeout, &timeout_sys, sizeof(timeout_sys)))
+		datagrams = -EFAULT;
+
+	return datagrams;
+}
+
 #ifdef __ARCH_WANT_SYS_SOCKETCALL
 
 /* sys_socketcall 的参数列表大小
@@ -1881,9 +2048,10 @@ out:
  * 至少2个参数，最多6参数
  * */
 #define AL(x) ((x) * sizeof(unsigned long))
-static unsigned char nargs[18]={AL(0),AL(3),AL(3),AL(3),AL(2),AL(3),
+static unsigned char nargs[20]={AL(0),AL(3),AL(3),AL(3),AL(2),AL(3),
 				AL(3),AL(3),AL(4),AL(4),AL(4),AL(6),
-				AL(6),AL(2),AL(5),AL(5),AL(3),AL(3)};
+				AL(6),AL(2),AL(5),AL(5),AL(3),AL(3),
+				AL(5),AL(4)};
 #undef AL
 
 /*
@@ -1904,7 +2072,7 @@ asmlinkage long sys_socketcall(int call, unsigned long __user *args)
 	unsigned long a0,a1;
 	int err;
 
-	if(call<1||call>SYS_RECVMSG)
+	if(call<1||call>SYS_SENDMMSG)
 		return -EINVAL;
 
 	/* copy_from_user should be SMP safe. */
@@ -1969,6 +2137,13 @@ asmlinkage long sys_socketcall(int call, unsigned long __user *args)
 		case SYS_RECVMSG:
 			err = sys_recvmsg(a0, (struct msghdr __user *) a1, a[2]);
 			break;
+		case SYS_RECVMMSG:
+			err = sys_recvmmsg(a0, (struct mmsghdr __user *) a1, a[2], a[3],
+					   (struct timespec __user *) a[4]);
+			break;
+		case SYS_SENDMMSG:
+			err = sys_sendmmsg(a0, (struct mmsghdr __user *) a1, a[2], a[3]);
+			break;
 		default:
 			err = -EINVAL;
 			break;
@@ -135,6 +135,8 @@ rpc_create_client(struct rpc_xprt *xprt, char *servname,
 	strlcpy(clnt->cl_server, servname, len);
 
 	clnt->cl_xprt     = xprt;
+	clnt->cl_xprts[0] = xprt;
+	clnt->cl_nxprt    = 1;
 	clnt->cl_procinfo = version->procs;
 	clnt->cl_maxproc  = version->nrprocs;
 	clnt->cl_protname = program->name;
@@ -213,6 +215,38 @@ out_no_clnt:
 	return ERR_PTR(-ENOMEM);
 }
 
+/*
+ * Open more connections to the server, for `nconnect' in all, and spread
+ * the client's tasks over them.  Only stream transports are multiplied.
+ * Must be called before the client is used; if a connection cannot be
+ * set up, the client keeps the ones it has.
+ */
+int
+rpc_add_xprts(struct rpc_clnt *clnt, unsigned int nconnect)
+{
+	struct rpc_xprt *xprt = clnt->cl_xprt;
+	struct rpc_xprt *new;
+
+	if (!xprt->stream)
+		return -EINVAL;
+	if (nconnect > RPC_MAX_XPRTS)
+		nconnect = RPC_MAX_XPRTS;
+	while (clnt->cl_nxprt < nconnect) {
+		new = xprt_create_proto(xprt->prot, &xprt->addr,
+					&xprt->timeout);
+		if (IS_ERR(new))
+			return PTR_ERR(new);
+		new->sndsize = xprt->sndsize;
+		new->rcvsize = xprt->rcvsize;
+		clnt->cl_xprts[clnt->cl_nxprt] = new;
+		smp_wmb();
+		clnt->cl_nxprt++;
+	}
+	dprintk("RPC: %s client for %s has %u connections\n",
+			clnt->cl_protname, clnt->cl_server, clnt->cl_nxprt);
+	return 0;
+}
+
 /*
  * Properly shut down an RPC client, terminating all outstanding
  * requests. Note that we must be certain that cl_oneshot and
@@ -269,6 +303,8 @@ rpc_destroy_client(struct rpc_clnt *clnt)
 	if (clnt->cl_pathname[0])
 		rpc_rmdir(clnt->cl_pathname);
 	if (clnt->cl_xprt) {
+		while (clnt->cl_nxprt > 1)
+			xprt_destroy(clnt->cl_xprts[--clnt->cl_nxprt]);
 		xprt_destroy(clnt->cl_xprt);
 		clnt->cl_xprt = NULL;
 	}
@@ -440,16 +476,20 @@ rpc_call_setup(struct rpc_task *task, struct rpc_message *msg, int flags)
 void
 rpc_setbufsize(struct rpc_clnt *clnt, unsigned int sndsize, unsigned int rcvsize)
 {
-	struct rpc_xprt *xprt = clnt->cl_xprt;
-
-	xprt->sndsize = 0;
-	if (sndsize)
-		xprt->sndsize = sndsize + RPC_SLACK_SPACE;
-	xprt->rcvsize = 0;
-	if (rcvsize)
-		xprt->rcvsize = rcvsize + RPC_SLACK_SPACE;
-	if (xprt_connected(xprt))
-		xprt_sock_setbufsize(xprt);
+	struct rpc_xprt *xprt;
+	unsigned int i;
+
+	for (i = 0; i < clnt->cl_nxprt; i++) {
+		xprt = clnt->cl_xprts[i];
+		xprt->sndsize = 0;
+		if (sndsize)
+			xprt->sndsize = sndsize + RPC_SLACK_SPACE;
+		xprt->rcvsize = 0;
+		if (rcvsize)
+			xprt->rcvsize = rcvsize + RPC_SLACK_SPACE;
+		if (xprt_connected(xprt))
+			xprt_sock_setbufsize(xprt);
+	}
 }
 
 /*
@@ -644,7 +684,7 @@ static void
 call_bind(struct rpc_task *task)
 {
 	struct rpc_clnt	*clnt = task->tk_client;
-	struct rpc_xprt *xprt = clnt->cl_xprt;
+	struct rpc_xprt *xprt = task->tk_xprt;
 
 	dprintk("RPC: %4d call_bind xprt %p %s connected\n", task->tk_pid,
 			xprt, (xprt_connected(xprt) ? "is" : "is not"));
@@ -664,12 +704,10 @@ call_bind(struct rpc_task *task)
 static void
 call_connect(struct rpc_task *task)
 {
-	struct rpc_clnt *clnt = task->tk_client;
-
 	dprintk("RPC: %4d call_connect status %d\n",
 				task->tk_pid, task->tk_status);
 
-	if (xprt_connected(clnt->cl_xprt)) {
+	if (xprt_connected(task->tk_xprt)) {
 		task->tk_action = call_transmit;
 		return;
 	}
@@ -945,7 +983,7 @@ static u32 *
 call_header(struct rpc_task *task)
 {
 	struct rpc_clnt *clnt = task->tk_client;
-	struct rpc_xprt *xprt = clnt->cl_xprt;
+	struct rpc_xprt *xprt = task->tk_xprt;
 	struct rpc_rqst	*req = task->tk_rqstp;
 	u32		*p = req->rq_svec[0].iov_base;
 
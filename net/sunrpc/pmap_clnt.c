@@ -133,6 +133,7 @@ pmap_getport_done(struct rpc_task *task)
 {
 	struct rpc_clnt	*clnt = task->tk_client;
 	struct rpc_portmap *map = clnt->cl_pmap;
+	unsigned int i;
 
 	dprintk("RPC: %4d pmap_getport_done(status %d, port %d)\n",
 			task->tk_pid, task->tk_status, clnt->cl_port);
@@ -146,7 +147,8 @@ pmap_getport_done(struct rpc_task *task)
 	} else {
 		/* byte-swap port number first */
 		clnt->cl_port = htons(clnt->cl_port);
-		clnt->cl_xprt->addr.sin_port = clnt->cl_port;
+		for (i = 0; i < clnt->cl_nxprt; i++)
+			clnt->cl_xprts[i]->addr.sin_port = clnt->cl_port;
 	}
 	spin_lock(&pmap_lock);
 	map->pm_binding = 0;
@@ -765,6 +765,7 @@ void rpc_init_task(struct rpc_task *task, struct rpc_clnt *clnt, rpc_action call
 
 	if (clnt) {
 		atomic_inc(&clnt->cl_users);
+		task->tk_xprt = rpc_choose_xprt(clnt);
 		if (clnt->cl_softrtry)
 			task->tk_flags |= RPC_TASK_SOFT;
 		if (!clnt->cl_intr)
@@ -860,6 +861,7 @@ void rpc_release_task(struct rpc_task *task)
 	if (task->tk_client) {
 		rpc_release_client(task->tk_client);
 		task->tk_client = NULL;
+		task->tk_xprt = NULL;
 	}
 
 #ifdef RPC_DEBUG
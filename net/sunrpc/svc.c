@@ -12,6 +12,9 @@
 #include <linux/net.h>
 #include <linux/in.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
 
 #include <linux/sunrpc/types.h>
 #include <linux/sunrpc/xdr.h>
@@ -29,12 +32,19 @@ struct svc_serv *
 svc_create(struct svc_program *prog, unsigned int bufsize)
 {
 	struct svc_serv	*serv;
-	int vers;
+	struct svc_pool	*pool;
+	int vers, i;
 	unsigned int xdrsize;
 
 	if (!(serv = (struct svc_serv *) kmalloc(sizeof(*serv), GFP_KERNEL)))
 		return NULL;
 	memset(serv, 0, sizeof(*serv));
+	serv->sv_nrpools = MAX_NUMNODES;
+	serv->sv_pools = kmalloc(serv->sv_nrpools * sizeof(*pool), GFP_KERNEL);
+	if (!serv->sv_pools) {
+		kfree(serv);
+		return NULL;
+	}
 	serv->sv_program   = prog;
 	serv->sv_nrthreads = 1;
 	serv->sv_stats     = prog->pg_stats;
@@ -50,11 +60,19 @@ svc_create(struct svc_program *prog, unsigned int bufsize)
 				xdrsize = prog->pg_vers[vers]->vs_xdrsize;
 		}
 	serv->sv_xdrsize   = xdrsize;
-	INIT_LIST_HEAD(&serv->sv_threads);
-	INIT_LIST_HEAD(&serv->sv_sockets);
 	INIT_LIST_HEAD(&serv->sv_tempsocks);
 	INIT_LIST_HEAD(&serv->sv_permsocks);
 	spin_lock_init(&serv->sv_lock);
+	serv->sv_tempage = jiffies;
+
+	for (i = 0; i < serv->sv_nrpools; i++) {
+		pool = &serv->sv_pools[i];
+		memset(pool, 0, sizeof(*pool));
+		pool->sp_id = i;
+		spin_lock_init(&pool->sp_lock);
+		INIT_LIST_HEAD(&pool->sp_threads);
+		INIT_LIST_HEAD(&pool->sp_sockets);
+	}
 
 	serv->sv_name      = prog->pg_name;
 
@@ -101,6 +119,7 @@ svc_destroy(struct svc_serv *serv)
 
 	/* Unregister service with the portmapper */
 	svc_register(serv, 0, 0);
+	kfree(serv->sv_pools);
 	kfree(serv);
 }
 
@@ -149,6 +168,22 @@ svc_release_buffer(struct svc_rqst *rqstp)
 	rqstp->rq_argused = 0;
 }
 
+/*
+ * The pool of the online node with the fewest threads
+ */
+static struct svc_pool *
+svc_pool_pick(struct svc_serv *serv)
+{
+	struct svc_pool	*pool = NULL;
+	int		node;
+
+	for_each_online_node(node)
+		if (!pool ||
+		    serv->sv_pools[node].sp_nrthreads < pool->sp_nrthreads)
+			pool = &serv->sv_pools[node];
+	return pool;
+}
+
 /*
  * Create a server thread
  */
@@ -156,6 +191,9 @@ int
 svc_create_thread(svc_thread_fn func, struct svc_serv *serv)
 {
 	struct svc_rqst	*rqstp;
+	struct svc_pool	*pool;
+	cpumask_t	oldmask;
+	int		first;
 	int		error = -ENOMEM;
 
 	rqstp = kmalloc(sizeof(*rqstp), GFP_KERNEL);
@@ -172,7 +210,22 @@ svc_create_thread(svc_thread_fn func, struct svc_serv *serv)
 
 	serv->sv_nrthreads++;
 	rqstp->rq_server = serv;
+
+	pool = svc_pool_pick(serv);
+	spin_lock_bh(&pool->sp_lock);
+	first = !pool->sp_nrthreads++;
+	spin_unlock_bh(&pool->sp_lock);
+	rqstp->rq_pool = pool;
+	if (first)
+		svc_pool_adopt(serv, pool);
+
+	/* The thread inherits our cpus_allowed: start it on its node */
+	oldmask = current->cpus_allowed;
+	if (num_online_nodes() > 1)
+		set_cpus_allowed(current, node_to_cpumask(pool->sp_id));
 	error = kernel_thread((int (*)(void *)) func, rqstp, 0);
+	if (num_online_nodes() > 1)
+		set_cpus_allowed(current, oldmask);
 	if (error < 0)
 		goto out_thread;
 	svc_sock_update_bufs(serv);
@@ -193,6 +246,8 @@ svc_exit_thread(struct svc_rqst *rqstp)
 {
 	struct svc_serv	*serv = rqstp->rq_server;
 
+	if (rqstp->rq_pool)
+		svc_pool_exit(rqstp);
 	svc_release_buffer(rqstp);
 	if (rqstp->rq_resp)
 		kfree(rqstp->rq_resp);
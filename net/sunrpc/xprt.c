@@ -88,6 +88,7 @@ static struct rpc_xprt * xprt_setup(int proto, struct sockaddr_in *ap,
 						struct rpc_timeout *to);
 static struct socket *xprt_create_socket(struct rpc_xprt *, int, int);
 static void	xprt_bind_socket(struct rpc_xprt *, struct socket *);
+static void	xprt_shrink_slots(struct rpc_xprt *);
 static int      __xprt_get_cong(struct rpc_xprt *, struct rpc_task *);
 
 static int	xprt_clear_backlog(struct rpc_xprt *xprt);
@@ -442,6 +443,7 @@ xprt_socket_autoclose(void *args)
 	xprt_disconnect(xprt);
 	xprt_close(xprt);
 	xprt_release_write(xprt, NULL);
+	xprt_shrink_slots(xprt);
 }
 
 /*
@@ -1298,6 +1300,62 @@ xprt_transmit(struct rpc_task *task)
 	spin_unlock_bh(&xprt->sock_lock);
 }
 
+/*
+ * Grow the slot table by one slot, if it may grow.  We are called under
+ * xprt_lock, so we cannot wait for memory: if there is none to be had,
+ * the task waits for a slot to be released instead.
+ */
+static struct rpc_rqst *
+xprt_alloc_slot(struct rpc_xprt *xprt)
+{
+	struct rpc_rqst	*req;
+
+	if (xprt->num_reqs >= xprt->max_reqs)
+		return NULL;
+	req = kmalloc(sizeof(*req), GFP_ATOMIC);
+	if (req == NULL)
+		return NULL;
+	memset(req, 0, sizeof(*req));
+	INIT_LIST_HEAD(&req->rq_list);
+	xprt->num_reqs++;
+	dprintk("RPC:      transport %p grew to %u slots\n", xprt,
+			xprt->num_reqs);
+	return req;
+}
+
+/*
+ * Free the slots the table grew by, once the transport has gone idle.
+ * Until then they stay on the free list for the next burst.
+ */
+static void
+xprt_shrink_slots(struct rpc_xprt *xprt)
+{
+	struct rpc_rqst	*req;
+
+	spin_lock(&xprt->xprt_lock);
+	while (xprt->num_reqs > xprt->min_reqs && !list_empty(&xprt->free)) {
+		req = list_entry(xprt->free.next, struct rpc_rqst, rq_list);
+		list_del(&req->rq_list);
+		xprt->num_reqs--;
+		kfree(req);
+	}
+	spin_unlock(&xprt->xprt_lock);
+	dprintk("RPC:      transport %p shrank to %u slots\n", xprt,
+			xprt->num_reqs);
+}
+
+static void
+xprt_free_slots(struct rpc_xprt *xprt)
+{
+	struct rpc_rqst	*req;
+
+	while (!list_empty(&xprt->free)) {
+		req = list_entry(xprt->free.next, struct rpc_rqst, rq_list);
+		list_del(&req->rq_list);
+		kfree(req);
+	}
+}
+
 /*
  * Reserve an RPC call slot.
  */
@@ -1305,13 +1363,17 @@ static inline void
 do_xprt_reserve(struct rpc_task *task)
 {
 	struct rpc_xprt	*xprt = task->tk_xprt;
+	struct rpc_rqst	*req;
 
 	task->tk_status = 0;
 	if (task->tk_rqstp)
 		return;
 	if (!list_empty(&xprt->free)) {
-		struct rpc_rqst	*req = list_entry(xprt->free.next, struct rpc_rqst, rq_list);
+		req = list_entry(xprt->free.next, struct rpc_rqst, rq_list);
 		list_del_init(&req->rq_list);
+	} else
+		req = xprt_alloc_slot(xprt);
+	if (req) {
 		task->tk_rqstp = req;
 		xprt_request_init(task, xprt);
 		return;
@@ -1424,6 +1486,7 @@ xprt_set_timeout(struct rpc_timeout *to, unsigned int retr, unsigned long incr)
 
 unsigned int xprt_udp_slot_table_entries = RPC_DEF_SLOT_TABLE;
 unsigned int xprt_tcp_slot_table_entries = RPC_DEF_SLOT_TABLE;
+unsigned int xprt_max_tcp_slot_table_entries = RPC_DEF_MAX_SLOT_TABLE;
 
 /*
  * Initialize an RPC client
@@ -1432,8 +1495,7 @@ static struct rpc_xprt *
 xprt_setup(int proto, struct sockaddr_in *ap, struct rpc_timeout *to)
 {
 	struct rpc_xprt	*xprt;
-	unsigned int entries;
-	size_t slot_table_size;
+	unsigned int entries, i;
 	struct rpc_rqst	*req;
 
 	dprintk("RPC:      setting up %s transport...\n",
@@ -1445,14 +1507,24 @@ xprt_setup(int proto, struct sockaddr_in *ap, struct rpc_timeout *to)
 	if ((xprt = kmalloc(sizeof(struct rpc_xprt), GFP_KERNEL)) == NULL)
 		return ERR_PTR(-ENOMEM);
 	memset(xprt, 0, sizeof(*xprt)); /* Nnnngh! */
+	INIT_LIST_HEAD(&xprt->free);
+	xprt->min_reqs = entries;
 	xprt->max_reqs = entries;
-	slot_table_size = entries * sizeof(xprt->slot[0]);
-	xprt->slot = kmalloc(slot_table_size, GFP_KERNEL);
-	if (xprt->slot == NULL) {
-		kfree(xprt);
-		return ERR_PTR(-ENOMEM);
+	if (proto == IPPROTO_TCP && xprt_max_tcp_slot_table_entries > entries)
+		xprt->max_reqs = xprt_max_tcp_slot_table_entries;
+
+	/* initialize free list */
+	for (i = 0; i < entries; i++) {
+		req = kmalloc(sizeof(*req), GFP_KERNEL);
+		if (req == NULL) {
+			xprt_free_slots(xprt);
+			kfree(xprt);
+			return ERR_PTR(-ENOMEM);
+		}
+		memset(req, 0, sizeof(*req));
+		list_add(&req->rq_list, &xprt->free);
 	}
-	memset(xprt->slot, 0, slot_table_size);
+	xprt->num_reqs = entries;
 
 	xprt->addr = *ap;
 	xprt->prot = proto;
@@ -1466,7 +1538,6 @@ xprt_setup(int proto, struct sockaddr_in *ap, struct rpc_timeout *to)
 	spin_lock_init(&xprt->xprt_lock);
 	init_waitqueue_head(&xprt->cong_wait);
 
-	INIT_LIST_HEAD(&xprt->free);
 	INIT_LIST_HEAD(&xprt->recv);
 	INIT_WORK(&xprt->sock_connect, xprt_socket_connect, xprt);
 	INIT_WORK(&xprt->task_cleanup, xprt_socket_autoclose, xprt);
@@ -1487,17 +1558,13 @@ xprt_setup(int proto, struct sockaddr_in *ap, struct rpc_timeout *to)
 	rpc_init_wait_queue(&xprt->resend, "xprt_resend");
 	rpc_init_priority_wait_queue(&xprt->backlog, "xprt_backlog");
 
-	/* initialize free list */
-	for (req = &xprt->slot[entries-1]; req >= &xprt->slot[0]; req--)
-		list_add(&req->rq_list, &xprt->free);
-
 	xprt_init_xid(xprt);
 
 	/* Check whether we want to use a reserved port */
 	xprt->resvport = capable(CAP_NET_BIND_SERVICE) ? 1 : 0;
 
-	dprintk("RPC:      created transport %p with %u slots\n", xprt,
-			xprt->max_reqs);
+	dprintk("RPC:      created transport %p with %u slots, at most %u\n",
+			xprt, xprt->min_reqs, xprt->max_reqs);
 	
 	return xprt;
 }
@@ -1667,7 +1734,7 @@ xprt_destroy(struct rpc_xprt *xprt)
 	xprt_shutdown(xprt);
 	xprt_disconnect(xprt);
 	xprt_close(xprt);
-	kfree(xprt->slot);
+	xprt_free_slots(xprt);
 	kfree(xprt);
 
 	return 0;